@@ -25,6 +25,42 @@ struct TitanDBOptions : public DBOptions {
   // Default: 1
   int32_t max_background_gc{1};
 
+  // Max number of threads a single GC job runs on. A GC job splits its
+  // input blob files by key range into this many sub-jobs, which write
+  // their own output files and are installed together.
+  //
+  // Default: 1
+  uint32_t max_gc_subjobs{1};
+
+  // If not null, bytes read and written by GC are charged to this rate
+  // limiter, in addition to the base DB's one, e.g.
+  // NewGenericRateLimiter(bytes_per_sec, 100 * 1000, 10,
+  //                       RateLimiter::Mode::kAllIo, true /*auto_tuned*/).
+  // GC is charged for the bytes it actually reads and writes, and while
+  // the base DB is close to a write stall or behind in compaction, it
+  // additionally sleeps to run at a quarter of the limiter's rate. GC jobs
+  // are not scheduled at all while a write stall is in effect. The rate
+  // itself is never raised by GC; instead, once GC jobs of a column family
+  // keep leaving garbage behind while it keeps growing, the column family
+  // runs one more job at a time on an idle GC thread.
+  //
+  // Default: nullptr
+  std::shared_ptr<RateLimiter> gc_rate_limiter;
+
+  // GC reads its input files sequentially in chunks of this size, and
+  // reads the next chunk in the background while processing the current
+  // one. If zero, GC reads the input files record by record.
+  //
+  // Default: 2MB
+  uint64_t gc_readahead_size{2 << 20};
+
+  // If true, GC reads its input files with direct I/O, so that it doesn't
+  // evict the pages cached for foreground reads. It works best with a
+  // large "gc_readahead_size". It can't be used with "allow_mmap_reads".
+  //
+  // Default: false
+  bool use_direct_io_for_gc{false};
+
   // How often to schedule delete obsolete blob files periods.
   // If set zero, obsolete blob files won't be deleted.
   //
@@ -37,6 +73,29 @@ struct TitanDBOptions : public DBOptions {
   // Default: 600 (10 min)
   uint32_t titan_stats_dump_period_sec{600};
 
+  // If non-zero, check every column family for GC every
+  // gc_check_period_sec, besides after flushes and compactions. Column
+  // families with blob files reaching "blob_file_discardable_ratio" are
+  // queued for GC. A column family with no GC done while its number of
+  // blob files with over 80% garbage keeps growing for a few checks gets
+  // collected regardless of "min_gc_batch_size".
+  //
+  // Default: 60
+  uint32_t gc_check_period_sec{60};
+
+  // If not empty, blob records read from blob files are also cached in
+  // files under this directory, which is meant to be on a local device
+  // faster than the one holding the blob files. The cache is consulted
+  // after the in-memory blob caches miss and it survives restarts.
+  //
+  // Default: ""
+  std::string blob_persistent_cache_dir;
+
+  // The capacity in bytes of the persistent blob cache.
+  //
+  // Default: 1GB
+  uint64_t blob_persistent_cache_size{1ULL << 30};
+
   TitanDBOptions() = default;
   explicit TitanDBOptions(const DBOptions& options) : DBOptions(options) {}
 
@@ -58,6 +117,15 @@ enum class TitanBlobRunMode {
                   // and store the value in SST file.
 };
 
+enum class TitanGCPolicy {
+  kDiscardableRatio = 0,  // GC the blob files with the most discardable
+                          // data first.
+  kCostBenefit = 1,       // GC the blob files with the highest
+                          // garbage * age / (1 + live) first. Young files
+                          // are left alone for a while, since the rest of
+                          // their data is likely to be overwritten soon.
+};
+
 struct TitanOptionsHelper {
   static std::map<TitanBlobRunMode, std::string> blob_run_mode_to_string;
   static std::unordered_map<std::string, TitanBlobRunMode>
@@ -90,6 +158,43 @@ struct TitanCFOptions : public ColumnFamilyOptions {
   // compression dictionary.
   CompressionOptions blob_file_compression_options;
 
+  // The number of threads compressing the records of a blob file being
+  // built by flush, compaction or GC. Records are still written in order.
+  // The threads are taken from a pool of this size, created once for the
+  // column family and shared by the files it builds. Values less than 2
+  // compress on the thread building the file. It only takes effect when
+  // `blob_file_compression` is enabled.
+  //
+  // Default: 1
+  uint32_t blob_file_compression_parallel_threads{1};
+
+  // If non-zero, records of blob files built by flush, compaction or GC
+  // are packed into blocks of about this size, compressed as a unit, which
+  // compresses small values much better. A read then uncompresses the
+  // whole block, and `blob_cache` caches blocks instead of records. Zero
+  // stores every record on its own.
+  //
+  // Default: 0
+  uint64_t blob_file_block_size{0};
+
+  // If true, blob files built by flush, compaction or GC end with a record
+  // index, which maps the keys of the records to their locations. GC then
+  // finds the live records of a file by its keys, and reads only their
+  // values, and the records can be located without scanning the file.
+  //
+  // Default: false
+  bool blob_file_record_index{false};
+
+  // If true, records of blob files built by flush, compaction or GC are
+  // stored without their keys, which are kept only once, in the record
+  // index. This implies `blob_file_record_index`. It saves the space and
+  // the I/O of the keys duplicated from the LSM-tree, which adds up with
+  // long keys. Reads of values are not affected, while GC gets the keys
+  // from the record index.
+  //
+  // Default: false
+  bool blob_file_keys_in_index{false};
+
   // The desirable blob file size. This is not a hard limit but a wish.
   //
   // Default: 256MB
@@ -100,6 +205,25 @@ struct TitanCFOptions : public ColumnFamilyOptions {
   // Default: nullptr
   std::shared_ptr<Cache> blob_cache;
 
+  // If set false, only values are kept in the blob cache, and the keys of
+  // records read from it are empty. Reads only use the value. An entry
+  // with the key takes over the buffer an uncompressed record is read
+  // into, so that filling the cache doesn't copy the value. An entry
+  // without the key, or of a compressed record, is a copy of its own,
+  // charged for its exact size.
+  //
+  // Default: true
+  bool blob_cache_store_key{true};
+
+  // If non-NULL use the specified cache for compressed blob records. It
+  // keeps records in their on-disk form, and is looked up when a record
+  // misses `blob_cache`. Records found here are promoted to `blob_cache`.
+  // It only takes effect when `blob_file_compression` is enabled, and
+  // must not be the same cache as `blob_cache`.
+  //
+  // Default: nullptr
+  std::shared_ptr<Cache> blob_cache_compressed;
+
   // Max batch size for GC.
   //
   // Default: 1GB
@@ -120,6 +244,60 @@ struct TitanCFOptions : public ColumnFamilyOptions {
   // Default: 8MB
   uint64_t merge_small_file_threshold{8 << 20};
 
+  // The policy to order the blob files eligible for GC, i.e. the ones
+  // reaching "blob_file_discardable_ratio" or smaller than
+  // "merge_small_file_threshold". The age of a blob file is measured by
+  // the number of blob files created after it.
+  //
+  // Default: kDiscardableRatio
+  TitanGCPolicy gc_policy{TitanGCPolicy::kDiscardableRatio};
+
+  // The max number of GC jobs running on this column family at the same
+  // time. Queued column families are picked for GC by the bytes of garbage
+  // in their blob files, and this keeps a column family with lots of
+  // garbage from taking all the GC threads. Zero means only limited by
+  // "max_background_gc".
+  //
+  // Default: 0
+  int max_concurrent_gc{0};
+
+  // If set true, GC reclaims the garbage of a blob file in place by punching
+  // holes in the dead extents, instead of rewriting the live records to a new
+  // blob file. Blob indexes in the LSM-Tree are left untouched. Only works on
+  // Linux file systems supporting FALLOC_FL_PUNCH_HOLE, and is skipped while
+  // there are snapshots, which may still read the garbage. Holes are found
+  // from the allocated size of the files on recovery only when this is set,
+  // so it shouldn't be turned off once holes have been punched.
+  //
+  // Default: false
+  bool punch_hole_gc{false};
+
+  // With punch hole GC enabled, a blob file is rewritten by normal GC
+  // instead once the fraction of its size taken by holes would exceed this
+  // ratio, so that heavily fragmented files get compacted eventually.
+  //
+  // Default: 0.8
+  double punch_hole_max_fragmentation{0.8};
+
+  // If set true, values of at least "min_blob_size" are appended to an
+  // active blob file when they are written, and only their blob indexes
+  // go to the WAL and memtable. Otherwise, values are moved to blob files
+  // when memtables are flushed. An active blob file is sealed once it
+  // reaches "blob_file_target_size", or on recovery if the DB crashed
+  // before that. A sealed file is left to GC once the blob indexes
+  // referring to it are flushed. Records of active blob files are read
+  // with pread, so it doesn't work with "allow_mmap_reads".
+  //
+  // A value is written to its blob file before its blob index goes to the
+  // WAL, and synced first if the WAL is synced, by a sync write, SyncWAL()
+  // or FlushWAL(true). Active blob files are also synced before memtables
+  // are flushed. As with the WAL, values of writes not synced can be lost
+  // by a system crash, leaving their blob indexes dangling if the WAL
+  // survives them.
+  //
+  // Default: false
+  bool write_time_separation{false};
+
   // The mode used to process blob file.
   //
   // Default: kNormal
@@ -181,12 +359,24 @@ struct ImmutableTitanCFOptions {
   explicit ImmutableTitanCFOptions(const TitanCFOptions& opts)
       : min_blob_size(opts.min_blob_size),
         blob_file_compression(opts.blob_file_compression),
+        blob_file_compression_parallel_threads(
+            opts.blob_file_compression_parallel_threads),
+        blob_file_block_size(opts.blob_file_block_size),
+        blob_file_record_index(opts.blob_file_record_index),
+        blob_file_keys_in_index(opts.blob_file_keys_in_index),
         blob_file_target_size(opts.blob_file_target_size),
         blob_cache(opts.blob_cache),
+        blob_cache_store_key(opts.blob_cache_store_key),
+        blob_cache_compressed(opts.blob_cache_compressed),
         max_gc_batch_size(opts.max_gc_batch_size),
         min_gc_batch_size(opts.min_gc_batch_size),
         blob_file_discardable_ratio(opts.blob_file_discardable_ratio),
         merge_small_file_threshold(opts.merge_small_file_threshold),
+        gc_policy(opts.gc_policy),
+        max_concurrent_gc(opts.max_concurrent_gc),
+        punch_hole_gc(opts.punch_hole_gc),
+        punch_hole_max_fragmentation(opts.punch_hole_max_fragmentation),
+        write_time_separation(opts.write_time_separation),
         level_merge(opts.level_merge),
         skip_value_in_compaction_filter(opts.skip_value_in_compaction_filter) {}
 
@@ -194,10 +384,22 @@ struct ImmutableTitanCFOptions {
 
   CompressionType blob_file_compression;
 
+  uint32_t blob_file_compression_parallel_threads;
+
+  uint64_t blob_file_block_size;
+
+  bool blob_file_record_index;
+
+  bool blob_file_keys_in_index;
+
   uint64_t blob_file_target_size;
 
   std::shared_ptr<Cache> blob_cache;
 
+  bool blob_cache_store_key;
+
+  std::shared_ptr<Cache> blob_cache_compressed;
+
   uint64_t max_gc_batch_size;
 
   uint64_t min_gc_batch_size;
@@ -206,6 +408,16 @@ struct ImmutableTitanCFOptions {
 
   uint64_t merge_small_file_threshold;
 
+  TitanGCPolicy gc_policy;
+
+  int max_concurrent_gc;
+
+  bool punch_hole_gc;
+
+  double punch_hole_max_fragmentation;
+
+  bool write_time_separation;
+
   bool level_merge;
 
   bool skip_value_in_compaction_filter;
@@ -249,6 +461,15 @@ struct TitanReadOptions : public ReadOptions {
   // Default: false
   bool key_only{false};
 
+  // If non-zero, iterators scanning forward look ahead this many entries
+  // of the base iterator, and read the blob values of them together in a
+  // batch, so that the blob reads of a scan overlap rather than being
+  // issued one after another. It trades memory for the buffered entries
+  // for scan latency.
+  //
+  // Default: 0
+  size_t blob_prefetch_depth{0};
+
   TitanReadOptions() = default;
   explicit TitanReadOptions(const ReadOptions& options)
       : ReadOptions(options) {}
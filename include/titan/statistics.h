@@ -55,6 +55,21 @@ enum TickerType : uint32_t {
   // the times of triggering next round of GC actively
   TITAN_GC_TRIGGER_NEXT,
 
+  // New tickers are appended here, so that the existing ones keep their
+  // values.
+  TITAN_BLOB_CACHE_COMPRESSED_HIT,
+  TITAN_BLOB_CACHE_COMPRESSED_MISS,
+  TITAN_BLOB_CACHE_PERSISTENT_HIT,
+  TITAN_BLOB_CACHE_PERSISTENT_MISS,
+  // the count of blob records read within a prefetched range
+  TITAN_BLOB_PREFETCH_HIT,
+  TITAN_BLOB_PREFETCH_BYTES,
+  // the bytes prefetched but never read before the access turns random
+  TITAN_BLOB_PREFETCH_WASTE_BYTES,
+  // the count of blob files and bytes reclaimed in place by punching holes
+  TITAN_GC_NUM_FILES_PUNCHED,
+  TITAN_GC_BYTES_PUNCHED,
+
   TITAN_TICKER_ENUM_MAX,
 };
 
@@ -89,6 +104,15 @@ const std::vector<std::pair<TickerType, std::string>> TitanTickersNameMap = {
     {TITAN_GC_FAILURE, "titandb.gc.failure"},
     {TITAN_GC_SUCCESS, "titandb.gc.success"},
     {TITAN_GC_TRIGGER_NEXT, "titandb.gc.trigger.next"},
+    {TITAN_BLOB_CACHE_COMPRESSED_HIT, "titandb.blob.cache.compressed.hit"},
+    {TITAN_BLOB_CACHE_COMPRESSED_MISS, "titandb.blob.cache.compressed.miss"},
+    {TITAN_BLOB_CACHE_PERSISTENT_HIT, "titandb.blob.cache.persistent.hit"},
+    {TITAN_BLOB_CACHE_PERSISTENT_MISS, "titandb.blob.cache.persistent.miss"},
+    {TITAN_BLOB_PREFETCH_HIT, "titandb.blob.prefetch.hit"},
+    {TITAN_BLOB_PREFETCH_BYTES, "titandb.blob.prefetch.bytes"},
+    {TITAN_BLOB_PREFETCH_WASTE_BYTES, "titandb.blob.prefetch.waste.bytes"},
+    {TITAN_GC_NUM_FILES_PUNCHED, "titandb.gc.num.files.punched"},
+    {TITAN_GC_BYTES_PUNCHED, "titandb.gc.bytes.punched"},
 };
 
 enum HistogramType : uint32_t {
@@ -0,0 +1,199 @@
+#include "active_blob_file.h"
+
+#include <algorithm>
+
+#include "util/mutexlock.h"
+
+#include "blob_file_reader.h"
+#include "util.h"
+
+namespace rocksdb {
+namespace titandb {
+
+// Readahead size of the scan over an active blob file on recovery.
+const uint64_t kRecoveryReadaheadSize = 2 << 20;
+
+ActiveBlobFile::ActiveBlobFile(const TitanCFOptions& cf_options,
+                               std::shared_ptr<BlobFileMeta> file,
+                               std::unique_ptr<BlobFileHandle>&& handle)
+    : file_(std::move(file)),
+      handle_(std::move(handle)),
+      encoder_(cf_options.blob_file_compression,
+               cf_options.blob_file_compression_options) {}
+
+Status ActiveBlobFile::WriteHeader(WritableFileWriter* file) {
+  // Records are appended one by one, so there is no dictionary to sample.
+  BlobFileHeader header;
+  std::string buffer;
+  header.EncodeTo(&buffer);
+  return file->Append(buffer);
+}
+
+Status ActiveBlobFile::Recover(Env* env, const EnvOptions& env_options,
+                               const std::string& file_name,
+                               uint64_t* file_size, uint64_t* file_entries) {
+  uint64_t size = 0;
+  Status s = env->GetFileSize(file_name, &size);
+  if (!s.ok()) return s;
+  std::unique_ptr<RandomAccessFileReader> file;
+  s = NewBlobFileStreamReader(file_name, size, kRecoveryReadaheadSize,
+                              false /*use_direct_io*/, env_options, env,
+                              &file);
+  if (!s.ok()) return s;
+
+  FixedSlice<BlobFileHeader::kMaxEncodedLength> header_buffer;
+  s = file->Read(IOOptions(), 0, BlobFileHeader::kMaxEncodedLength,
+                 &header_buffer, header_buffer.get(), nullptr /*aligned_buf*/);
+  if (!s.ok()) return s;
+  BlobFileHeader header;
+  s = DecodeInto(header_buffer, &header, true /*ignore_extra_bytes*/);
+  if (!s.ok()) return s;
+
+  // Finds the end of the last complete record. The scan also stops at
+  // the footer, if the file was sealed but not logged yet.
+  uint64_t offset = header.size();
+  uint64_t entries = 0;
+  BlobDecoder decoder;
+  std::string buffer;
+  while (offset + kRecordHeaderSize <= size) {
+    FixedSlice<kRecordHeaderSize> record_header;
+    s = file->Read(IOOptions(), offset, kRecordHeaderSize, &record_header,
+                   record_header.get(), nullptr /*aligned_buf*/);
+    if (!s.ok()) return s;
+    if (record_header.size() < kRecordHeaderSize ||
+        !decoder.DecodeHeader(&record_header).ok()) {
+      break;
+    }
+    uint64_t record_size = decoder.GetRecordSize();
+    if (offset + kRecordHeaderSize + record_size > size) {
+      break;
+    }
+    buffer.resize(record_size);
+    Slice input;
+    s = file->Read(IOOptions(), offset + kRecordHeaderSize, record_size,
+                   &input, &buffer[0], nullptr /*aligned_buf*/);
+    if (!s.ok()) return s;
+    BlobRecord record;
+    OwnedSlice owned;
+    if (input.size() < record_size ||
+        !decoder.DecodeRecord(&input, &record, &owned).ok()) {
+      break;
+    }
+    offset += kRecordHeaderSize + record_size;
+    entries++;
+  }
+  file.reset();
+
+  std::unique_ptr<FSWritableFile> writable;
+  FileOptions file_options(env_options);
+  file_options.use_direct_writes = false;
+  s = env->GetFileSystem()->ReopenWritableFile(file_name, file_options,
+                                               &writable, nullptr /*dbg*/);
+  if (!s.ok()) return s;
+  BlobFileFooter footer;
+  std::string footer_buffer;
+  footer.EncodeTo(&footer_buffer);
+  s = writable->Truncate(offset, IOOptions(), nullptr /*dbg*/);
+  if (s.ok()) {
+    s = writable->Append(footer_buffer, IOOptions(), nullptr /*dbg*/);
+  }
+  if (s.ok()) {
+    s = writable->Sync(IOOptions(), nullptr /*dbg*/);
+  }
+  if (s.ok()) {
+    s = writable->Close(IOOptions(), nullptr /*dbg*/);
+  }
+  if (s.ok()) {
+    *file_size = offset + footer_buffer.size();
+    *file_entries = entries;
+  }
+  return s;
+}
+
+Status ActiveBlobFile::Add(const BlobRecord& record, BlobHandle* handle) {
+  WritableFileWriter* file = handle_->GetFile();
+  encoder_.EncodeRecord(record);
+  handle->offset = file->GetFileSize();
+  handle->size = encoder_.GetEncodedSize();
+  Status s = file->Append(encoder_.GetHeader());
+  if (s.ok()) {
+    s = file->Append(encoder_.GetRecord());
+  }
+  if (s.ok()) {
+    num_entries_++;
+  }
+  return s;
+}
+
+Status ActiveBlobFile::Flush(bool sync) {
+  Status s = handle_->GetFile()->Flush();
+  if (s.ok() && sync) {
+    s = handle_->GetFile()->Sync(false /*use_fsync*/);
+  }
+  return s;
+}
+
+Status ActiveBlobFile::Sync() {
+  assert(IsSyncThreadSafe());
+  MutexLock l(&sync_mutex_);
+  if (finished_) {
+    return Status::OK();
+  }
+  return handle_->GetFile()->SyncWithoutFlush(false /*use_fsync*/);
+}
+
+Status ActiveBlobFile::Finish() {
+  MutexLock l(&sync_mutex_);
+  BlobFileFooter footer;
+  std::string buffer;
+  footer.EncodeTo(&buffer);
+  WritableFileWriter* file = handle_->GetFile();
+  Status s = file->Append(buffer);
+  if (s.ok()) {
+    s = file->Sync(false /*use_fsync*/);
+  }
+  if (s.ok()) {
+    s = file->Close();
+  }
+  if (s.ok()) {
+    finished_ = true;
+  }
+  return s;
+}
+
+void ActiveBlobFile::Abandon() {
+  MutexLock l(&sync_mutex_);
+  if (finished_) {
+    return;
+  }
+  handle_->GetFile()->Close().PermitUncheckedError();
+  finished_ = true;
+}
+
+void ActiveBlobFile::BeginWrite() {
+  MutexLock l(&writes_mutex_);
+  assert(!sealed_);
+  pending_writes_++;
+}
+
+bool ActiveBlobFile::EndWrite(SequenceNumber sequence) {
+  MutexLock l(&writes_mutex_);
+  assert(pending_writes_ > 0);
+  pending_writes_--;
+  last_sequence_ = std::max(last_sequence_, sequence);
+  return sealed_ && pending_writes_ == 0;
+}
+
+bool ActiveBlobFile::MarkSealed() {
+  MutexLock l(&writes_mutex_);
+  sealed_ = true;
+  return pending_writes_ == 0;
+}
+
+SequenceNumber ActiveBlobFile::last_sequence() const {
+  MutexLock l(&writes_mutex_);
+  return last_sequence_;
+}
+
+}  // namespace titandb
+}  // namespace rocksdb
@@ -0,0 +1,107 @@
+#pragma once
+
+#include "port/port.h"
+#include "rocksdb/env.h"
+#include "rocksdb/types.h"
+
+#include "blob_file_manager.h"
+#include "blob_format.h"
+#include "titan/options.h"
+
+namespace rocksdb {
+namespace titandb {
+
+// A blob file that values are appended to as they are written, see
+// TitanCFOptions::write_time_separation. Unlike the files built by
+// BlobFileBuilder, records are kept in the order they are written, not
+// sorted by key, and the file has no key range. Records are readable
+// once Flush() returns, and the file gets its footer when it is sealed
+// by Finish().
+//
+// Add() and Flush() are not thread-safe, the owner serializes the calls.
+// Sync() may be called concurrently with them and with Finish() or
+// Abandon(). The write counting methods are thread-safe.
+class ActiveBlobFile {
+ public:
+  // Constructs an active blob file for "*handle", which must have the
+  // header written by WriteHeader() already.
+  ActiveBlobFile(const TitanCFOptions& cf_options,
+                 std::shared_ptr<BlobFileMeta> file,
+                 std::unique_ptr<BlobFileHandle>&& handle);
+
+  // Writes the header of an active blob file to "*file".
+  static Status WriteHeader(WritableFileWriter* file);
+
+  // Seals the active blob file "file_name" of a crashed DB. A torn
+  // record at the end of the file is dropped. If successful, sets
+  // "*file_size" and "*file_entries" to those of the sealed file.
+  static Status Recover(Env* env, const EnvOptions& env_options,
+                        const std::string& file_name, uint64_t* file_size,
+                        uint64_t* file_entries);
+
+  // Appends the record to the file and sets "*handle" to its location.
+  Status Add(const BlobRecord& record, BlobHandle* handle);
+
+  // Makes the records added so far readable, and durable if "sync".
+  Status Flush(bool sync);
+
+  // Whether Sync() can be called concurrently with Add() and Flush().
+  bool IsSyncThreadSafe() const {
+    return handle_->GetFile()->writable_file()->IsSyncThreadSafe();
+  }
+
+  // Makes the records flushed so far durable. Does nothing once the file
+  // is finished, which syncs all of them.
+  // REQUIRES: IsSyncThreadSafe()
+  Status Sync();
+
+  // Writes the footer, then syncs and closes the file. No more records
+  // can be added afterwards.
+  Status Finish();
+
+  // Closes the file without sealing it, after a failed write. It may end
+  // with a torn record, which Recover() truncates.
+  void Abandon();
+
+  // Counts a write with records appended to the file, until EndWrite().
+  void BeginWrite();
+
+  // Ends a write counted by BeginWrite(). "sequence" is the sequence
+  // number of its last blob index referring to the file, or 0 if the
+  // write failed. Returns true if the file was sealed already and no
+  // write to it is left.
+  bool EndWrite(SequenceNumber sequence);
+
+  // Notes that the file is sealed, no write is counted afterwards.
+  // Returns true if no write to it is left.
+  bool MarkSealed();
+
+  // The sequence number of the last blob index referring to the file of
+  // the writes ended so far.
+  SequenceNumber last_sequence() const;
+
+  uint64_t file_number() const { return file_->file_number(); }
+  // Bytes written to the file so far.
+  uint64_t file_size() const { return handle_->GetFile()->GetFileSize(); }
+  uint64_t file_entries() const { return num_entries_; }
+  const std::shared_ptr<BlobFileMeta>& file() const { return file_; }
+
+ private:
+  std::shared_ptr<BlobFileMeta> file_;
+  std::unique_ptr<BlobFileHandle> handle_;
+  BlobEncoder encoder_;
+  uint64_t num_entries_{0};
+  // Serializes Sync() with Finish() and Abandon().
+  port::Mutex sync_mutex_;
+  // REQUIRES: access with sync_mutex_ held.
+  bool finished_{false};
+  // Guards the counting of writes.
+  mutable port::Mutex writes_mutex_;
+  // REQUIRES: access with writes_mutex_ held.
+  int pending_writes_{0};
+  SequenceNumber last_sequence_{0};
+  bool sealed_{false};
+};
+
+}  // namespace titandb
+}  // namespace rocksdb
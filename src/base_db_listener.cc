@@ -11,6 +11,11 @@ BaseDbListener::BaseDbListener(TitanDBImpl* db) : db_impl_(db) {
 
 BaseDbListener::~BaseDbListener() {}
 
+void BaseDbListener::OnFlushBegin(DB* /*db*/,
+                                  const FlushJobInfo& /*flush_job_info*/) {
+  db_impl_->OnFlushBegin();
+}
+
 void BaseDbListener::OnFlushCompleted(DB* /*db*/,
                                       const FlushJobInfo& flush_job_info) {
   if (db_impl_->blob_file_set_->IsOpened()) {
@@ -25,5 +30,9 @@ void BaseDbListener::OnCompactionCompleted(
   }
 }
 
+void BaseDbListener::OnStallConditionsChanged(const WriteStallInfo& info) {
+  db_impl_->OnStallConditionsChanged(info);
+}
+
 }  // namespace titandb
 }  // namespace rocksdb
@@ -12,11 +12,15 @@ class BaseDbListener final : public EventListener {
   BaseDbListener(TitanDBImpl* db);
   ~BaseDbListener();
 
+  void OnFlushBegin(DB* db, const FlushJobInfo& flush_job_info) override;
+
   void OnFlushCompleted(DB* db, const FlushJobInfo& flush_job_info) override;
 
   void OnCompactionCompleted(
       DB* db, const CompactionJobInfo& compaction_job_info) override;
 
+  void OnStallConditionsChanged(const WriteStallInfo& info) override;
+
  private:
   rocksdb::titandb::TitanDBImpl* db_impl_;
 };
@@ -1,22 +1,178 @@
 #include "blob_file_builder.h"
 
+#include <deque>
+
+#include "db/dbformat.h"
+#include "port/port.h"
 #include "table/block_based/block_based_table_reader.h"
 #include "table/meta_blocks.h"
 #include "util/crc32c.h"
+#include "util/mutexlock.h"
 
 namespace rocksdb {
 namespace titandb {
 
+// Records queued for compression per compression job, beyond which Add()
+// waits for the head of the queue to be written.
+const uint64_t kMaxPendingRecordsPerThread = 8;
+
+// Restart interval of the record index, the same as the default of the
+// data blocks of RocksDB.
+const int kRecordIndexRestartInterval = 16;
+
+namespace {
+
+void MoveContexts(BlobFileBuilder::OutContexts* from,
+                  BlobFileBuilder::OutContexts* to) {
+  for (auto& ctx : *from) {
+    to->emplace_back(std::move(ctx));
+  }
+  from->clear();
+}
+
+}  // namespace
+
+struct BlobFileBuilder::ParallelCompression {
+  // A record or block to compress, or a small KV pair queued behind them.
+  struct Entry {
+    // The context of the record or the small KV pair, or those of a block.
+    OutContexts contexts;
+    bool has_record = false;
+    // The encoded record or block, replaced by its compressed form once
+    // done.
+    std::string record;
+    // Uncompressed size of a block.
+    uint64_t raw_size = 0;
+    char header[kRecordHeaderSize];
+    bool done = false;
+  };
+
+  ParallelCompression(const TitanCFOptions& cf_options, uint32_t num_threads,
+                      ThreadPool* _pool)
+      : compression(cf_options.blob_file_compression),
+        compression_options(cf_options.blob_file_compression_options),
+        pool(_pool),
+        max_jobs(num_threads),
+        done_cv(&mutex),
+        max_pending_records(num_threads * kMaxPendingRecordsPerThread) {}
+
+  ~ParallelCompression() {
+    MutexLock l(&mutex);
+    closing = true;
+    while (num_jobs > 0) {
+      done_cv.Wait();
+    }
+  }
+
+  // REQUIRES: no record is being compressed.
+  void SetCompressionDict(const CompressionDict* _compression_dict) {
+    MutexLock l(&mutex);
+    compression_dict = _compression_dict;
+    for (auto& encoder : encoders) {
+      encoder->SetCompressionDict(compression_dict);
+    }
+  }
+
+  // Queues the record of "entry", and submits a job to the pool to
+  // compress it unless "max_jobs" are running already.
+  void Schedule(Entry* entry) {
+    MutexLock l(&mutex);
+    work_queue.push_back(entry);
+    if (num_jobs < max_jobs) {
+      num_jobs++;
+      pool->SubmitJob([this]() { Work(); });
+    }
+  }
+
+  // Returns whether the record of "entry" is compressed, waiting for it if
+  // "wait".
+  bool Done(Entry* entry, bool wait) {
+    MutexLock l(&mutex);
+    while (wait && !entry->done) {
+      done_cv.Wait();
+    }
+    return entry->done;
+  }
+
+  // Compresses the queued records till the queue is empty.
+  void Work() {
+    MutexLock l(&mutex);
+    // Encoders are kept for the next jobs, as they hold the compression
+    // contexts.
+    std::unique_ptr<BlobEncoder> encoder;
+    if (encoders.empty()) {
+      encoder.reset(
+          new BlobEncoder(compression, compression_options, compression_dict));
+    } else {
+      encoder = std::move(encoders.back());
+      encoders.pop_back();
+    }
+    while (!closing && !work_queue.empty()) {
+      Entry* entry = work_queue.front();
+      work_queue.pop_front();
+      mutex.Unlock();
+      encoder->EncodeSlice(entry->record);
+      memcpy(entry->header, encoder->GetHeader().data(), kRecordHeaderSize);
+      Slice output = encoder->GetRecord();
+      if (output.data() != entry->record.data()) {
+        entry->record.assign(output.data(), output.size());
+      }
+      mutex.Lock();
+      entry->done = true;
+      done_cv.SignalAll();
+    }
+    encoders.push_back(std::move(encoder));
+    num_jobs--;
+    done_cv.SignalAll();
+  }
+
+  const CompressionType compression;
+  const CompressionOptions compression_options;
+  // Shared with other builders, it is not owned.
+  ThreadPool* const pool;
+  // Maximum number of jobs compressing the records of the builder.
+  const uint32_t max_jobs;
+
+  port::Mutex mutex;
+  port::CondVar done_cv;
+  // Records waiting for a job.
+  // REQUIRES: access with mutex held.
+  std::deque<Entry*> work_queue;
+  // REQUIRES: access with mutex held.
+  uint32_t num_jobs = 0;
+  // REQUIRES: access with mutex held.
+  bool closing = false;
+  // Encoders not used by a job.
+  // REQUIRES: access with mutex held.
+  std::vector<std::unique_ptr<BlobEncoder>> encoders;
+  // REQUIRES: access with mutex held.
+  const CompressionDict* compression_dict = &CompressionDict::GetEmptyDict();
+
+  // Entries not returned yet, in the order they are added. Only accessed
+  // by the builder.
+  std::deque<std::unique_ptr<Entry>> pending;
+  uint64_t pending_records = 0;
+  // Number of contexts of the pending entries.
+  uint64_t pending_contexts = 0;
+  const uint64_t max_pending_records;
+};
+
 BlobFileBuilder::BlobFileBuilder(const TitanDBOptions& db_options,
                                  const TitanCFOptions& cf_options,
                                  WritableFileWriter* file,
-                                 uint32_t blob_file_version)
+                                 uint32_t blob_file_version,
+                                 ThreadPool* compression_pool)
     : builder_state_(cf_options.blob_file_compression_options.max_dict_bytes > 0
                          ? BuilderState::kBuffered
                          : BuilderState::kUnbuffered),
       cf_options_(cf_options),
       file_(file),
-      blob_file_version_(blob_file_version),
+      blob_file_version_(cf_options.blob_file_block_size > 0 &&
+                                 blob_file_version == BlobFileHeader::kVersion2
+                             ? BlobFileHeader::kVersion3
+                             : blob_file_version),
+      blocked_(blob_file_version_ == BlobFileHeader::kVersion3),
+      keyless_(cf_options.blob_file_keys_in_index),
       encoder_(cf_options.blob_file_compression,
                cf_options.blob_file_compression_options) {
   status_ = BlobFileHeader::ValidateVersion(blob_file_version_);
@@ -24,7 +180,7 @@ BlobFileBuilder::BlobFileBuilder(const TitanDBOptions& db_options,
     return;
   }
   if (cf_options_.blob_file_compression_options.max_dict_bytes > 0) {
-    if (blob_file_version_ != BlobFileHeader::kVersion2) {
+    if (blob_file_version_ == BlobFileHeader::kVersion1) {
       status_ = Status::NotSupported(
           "dictionary comparession is not supported by blob file version 1");
     }
@@ -33,16 +189,40 @@ BlobFileBuilder::BlobFileBuilder(const TitanDBOptions& db_options,
     return;
 #endif
   }
+  if (cf_options_.blob_file_record_index ||
+      cf_options_.blob_file_keys_in_index) {
+    if (blob_file_version_ == BlobFileHeader::kVersion1) {
+      status_ = Status::NotSupported(
+          "record index is not supported by blob file version 1");
+      return;
+    }
+    record_index_.reset(new BlockBuilder(kRecordIndexRestartInterval));
+  }
+  if (cf_options_.blob_file_compression != kNoCompression &&
+      cf_options_.blob_file_compression_parallel_threads > 1 &&
+      compression_pool != nullptr) {
+    parallel_.reset(new ParallelCompression(
+        cf_options_, cf_options_.blob_file_compression_parallel_threads,
+        compression_pool));
+  }
   WriteHeader();
 }
 
+BlobFileBuilder::~BlobFileBuilder() {}
+
 void BlobFileBuilder::WriteHeader() {
   BlobFileHeader header;
   header.version = blob_file_version_;
   if (cf_options_.blob_file_compression_options.max_dict_bytes > 0) {
-    assert(blob_file_version_ == BlobFileHeader::kVersion2);
+    assert(blob_file_version_ != BlobFileHeader::kVersion1);
     header.flags |= BlobFileHeader::kHasUncompressionDictionary;
   }
+  if (record_index_) {
+    header.flags |= BlobFileHeader::kHasRecordIndex;
+  }
+  if (keyless_) {
+    header.flags |= BlobFileHeader::kHasKeylessRecords;
+  }
   std::string buffer;
   header.EncodeTo(&buffer);
   status_ = file_->Append(buffer);
@@ -53,10 +233,18 @@ void BlobFileBuilder::Add(const BlobRecord& record,
                           OutContexts* out_ctx) {
   if (!ok()) return;
   std::string key = record.key.ToString();
+  if (record_index_) {
+    record_index_keys_.push_back(std::move(key));
+  }
+  // The keys of keyless records are only in the record index.
+  BlobRecord stored_record = record;
+  if (keyless_) {
+    stored_record.key = Slice();
+  }
   if (builder_state_ == BuilderState::kBuffered) {
     std::string record_str;
     // Encode to take ownership of underlying string.
-    record.EncodeTo(&record_str);
+    stored_record.EncodeTo(&record_str);
     sample_records_.emplace_back(record_str);
     sample_str_len_ += record_str.size();
     cached_contexts_.emplace_back(std::move(ctx));
@@ -65,27 +253,102 @@ void BlobFileBuilder::Add(const BlobRecord& record,
             cf_options_.blob_file_compression_options.zstd_max_train_bytes) {
       EnterUnbuffered(out_ctx);
     }
+  } else if (blocked_) {
+    AddToBlock(stored_record, std::move(ctx), out_ctx);
+  } else if (parallel_) {
+    std::unique_ptr<ParallelCompression::Entry> entry(
+        new ParallelCompression::Entry);
+    // Encode to take ownership of underlying string.
+    stored_record.EncodeTo(&entry->record);
+    entry->contexts.emplace_back(std::move(ctx));
+    entry->has_record = true;
+    parallel_->Schedule(entry.get());
+    parallel_->pending.emplace_back(std::move(entry));
+    parallel_->pending_records++;
+    parallel_->pending_contexts++;
+    WriteCompressedRecords(false /*wait_all*/, out_ctx);
   } else {
-    encoder_.EncodeRecord(record);
+    encoder_.EncodeRecord(stored_record);
     WriteEncoderData(&ctx->new_blob_index.blob_handle);
     out_ctx->emplace_back(std::move(ctx));
   }
 
-  // The keys added into blob files are in order.
+  // Keys are mostly added in order, but the key range doesn't rely on it.
   // We do key range checks for both state
-  if (smallest_key_.empty()) {
+  const Comparator* ucmp = cf_options_.comparator;
+  if (smallest_key_.empty() || ucmp->Compare(record.key, smallest_key_) < 0) {
     smallest_key_.assign(record.key.data(), record.key.size());
   }
-  assert(cf_options_.comparator->Compare(record.key, Slice(smallest_key_)) >=
-         0);
-  assert(cf_options_.comparator->Compare(record.key, Slice(largest_key_)) >= 0);
-  largest_key_.assign(record.key.data(), record.key.size());
+  if (largest_key_.empty() || ucmp->Compare(record.key, largest_key_) > 0) {
+    largest_key_.assign(record.key.data(), record.key.size());
+  }
 }
 
 void BlobFileBuilder::AddSmall(std::unique_ptr<BlobRecordContext> ctx) {
+  if (builder_state_ == BuilderState::kUnbuffered) {
+    if (blocked_) {
+      block_contexts_.emplace_back(std::move(ctx));
+      return;
+    }
+    if (parallel_) {
+      std::unique_ptr<ParallelCompression::Entry> entry(
+          new ParallelCompression::Entry);
+      entry->contexts.emplace_back(std::move(ctx));
+      parallel_->pending.emplace_back(std::move(entry));
+      parallel_->pending_contexts++;
+      return;
+    }
+  }
   cached_contexts_.emplace_back(std::move(ctx));
 }
 
+void BlobFileBuilder::AddToBlock(const BlobRecord& record,
+                                 std::unique_ptr<BlobRecordContext> ctx,
+                                 OutContexts* out_ctx) {
+  BlobHandle& handle = ctx->new_blob_index.blob_handle;
+  handle.record_offset = block_.size();
+  record.EncodeTo(&block_);
+  handle.record_size = block_.size() - handle.record_offset;
+  block_contexts_.emplace_back(std::move(ctx));
+  if (block_.size() >= cf_options_.blob_file_block_size) {
+    FlushBlock(out_ctx);
+  }
+}
+
+void BlobFileBuilder::FlushBlock(OutContexts* out_ctx) {
+  if (block_.empty()) {
+    // Only small KV pairs are left.
+    if (parallel_ && !block_contexts_.empty()) {
+      std::unique_ptr<ParallelCompression::Entry> entry(
+          new ParallelCompression::Entry);
+      parallel_->pending_contexts += block_contexts_.size();
+      MoveContexts(&block_contexts_, &entry->contexts);
+      parallel_->pending.emplace_back(std::move(entry));
+    } else {
+      MoveContexts(&block_contexts_, out_ctx);
+    }
+    return;
+  }
+  if (parallel_) {
+    std::unique_ptr<ParallelCompression::Entry> entry(
+        new ParallelCompression::Entry);
+    entry->raw_size = block_.size();
+    entry->record.swap(block_);
+    parallel_->pending_contexts += block_contexts_.size();
+    MoveContexts(&block_contexts_, &entry->contexts);
+    entry->has_record = true;
+    parallel_->Schedule(entry.get());
+    parallel_->pending.emplace_back(std::move(entry));
+    parallel_->pending_records++;
+    WriteCompressedRecords(false /*wait_all*/, out_ctx);
+  } else {
+    encoder_.EncodeSlice(block_);
+    WriteBlock(encoder_.GetHeader(), encoder_.GetRecord(), block_.size(),
+               &block_contexts_, out_ctx);
+  }
+  block_.clear();
+}
+
 void BlobFileBuilder::EnterUnbuffered(OutContexts* out_ctx) {
   // Using collected samples to train the compression dictionary
   // Then replay those records in memory, encode them to blob file
@@ -107,6 +370,9 @@ void BlobFileBuilder::EnterUnbuffered(OutContexts* out_ctx) {
       new CompressionDict(dict, cf_options_.blob_file_compression,
                           cf_options_.blob_file_compression_options.level));
   encoder_.SetCompressionDict(compression_dict_.get());
+  if (parallel_) {
+    parallel_->SetCompressionDict(compression_dict_.get());
+  }
 
   FlushSampleRecords(out_ctx);
 
@@ -115,13 +381,22 @@ void BlobFileBuilder::EnterUnbuffered(OutContexts* out_ctx) {
 
 void BlobFileBuilder::FlushSampleRecords(OutContexts* out_ctx) {
   assert(cached_contexts_.size() >= sample_records_.size());
+  // Small KV pairs stay behind the records held in the block.
+  OutContexts* small_ctx = blocked_ ? &block_contexts_ : out_ctx;
   size_t sample_idx = 0, ctx_idx = 0;
   for (; sample_idx < sample_records_.size(); sample_idx++, ctx_idx++) {
     const std::string& record_str = sample_records_[sample_idx];
     for (; ctx_idx < cached_contexts_.size() &&
            cached_contexts_[ctx_idx]->has_value;
          ctx_idx++) {
-      out_ctx->emplace_back(std::move(cached_contexts_[ctx_idx]));
+      small_ctx->emplace_back(std::move(cached_contexts_[ctx_idx]));
+    }
+    if (blocked_) {
+      BlobRecord record;
+      status_ = DecodeInto(record_str, &record);
+      if (!ok()) return;
+      AddToBlock(record, std::move(cached_contexts_[ctx_idx]), out_ctx);
+      continue;
     }
     const std::unique_ptr<BlobRecordContext>& ctx = cached_contexts_[ctx_idx];
     encoder_.EncodeSlice(record_str);
@@ -130,7 +405,7 @@ void BlobFileBuilder::FlushSampleRecords(OutContexts* out_ctx) {
   }
   for (; ctx_idx < cached_contexts_.size(); ctx_idx++) {
     assert(cached_contexts_[ctx_idx]->has_value);
-    out_ctx->emplace_back(std::move(cached_contexts_[ctx_idx]));
+    small_ctx->emplace_back(std::move(cached_contexts_[ctx_idx]));
   }
   assert(sample_idx == sample_records_.size());
   assert(ctx_idx == cached_contexts_.size());
@@ -140,17 +415,74 @@ void BlobFileBuilder::FlushSampleRecords(OutContexts* out_ctx) {
 }
 
 void BlobFileBuilder::WriteEncoderData(BlobHandle* handle) {
+  WriteRecord(encoder_.GetHeader(), encoder_.GetRecord(), handle);
+}
+
+void BlobFileBuilder::WriteRecord(const Slice& header, const Slice& record,
+                                  BlobHandle* handle) {
   handle->offset = file_->GetFileSize();
-  handle->size = encoder_.GetEncodedSize();
+  handle->size = header.size() + record.size();
   live_data_size_ += handle->size;
+  AddToRecordIndex(*handle);
 
-  status_ = file_->Append(encoder_.GetHeader());
+  status_ = file_->Append(header);
   if (ok()) {
-    status_ = file_->Append(encoder_.GetRecord());
+    status_ = file_->Append(record);
     num_entries_++;
   }
 }
 
+void BlobFileBuilder::WriteBlock(const Slice& header, const Slice& block,
+                                 uint64_t raw_size, OutContexts* contexts,
+                                 OutContexts* out_ctx) {
+  uint64_t offset = file_->GetFileSize();
+  uint64_t size = header.size() + block.size();
+  status_ = file_->Append(header);
+  if (ok()) {
+    status_ = file_->Append(block);
+  }
+  for (auto& ctx : *contexts) {
+    if (!ctx->has_value) {
+      BlobHandle& handle = ctx->new_blob_index.blob_handle;
+      handle.offset = offset;
+      handle.size = size;
+      handle.record_size = BlockRecordSize(handle.record_size, raw_size, size);
+      live_data_size_ += handle.record_size;
+      num_entries_++;
+      AddToRecordIndex(handle);
+    }
+  }
+  MoveContexts(contexts, out_ctx);
+}
+
+void BlobFileBuilder::WriteCompressedRecords(bool wait_all,
+                                             OutContexts* out_ctx) {
+  auto& pending = parallel_->pending;
+  while (ok() && !pending.empty()) {
+    ParallelCompression::Entry* entry = pending.front().get();
+    size_t num_contexts = entry->contexts.size();
+    if (entry->has_record) {
+      bool wait = wait_all || parallel_->pending_records >
+                                  parallel_->max_pending_records;
+      if (!parallel_->Done(entry, wait)) {
+        break;
+      }
+      Slice header(entry->header, kRecordHeaderSize);
+      if (blocked_) {
+        WriteBlock(header, entry->record, entry->raw_size, &entry->contexts,
+                   out_ctx);
+      } else {
+        WriteRecord(header, entry->record,
+                    &entry->contexts[0]->new_blob_index.blob_handle);
+      }
+      parallel_->pending_records--;
+    }
+    parallel_->pending_contexts -= num_contexts;
+    MoveContexts(&entry->contexts, out_ctx);
+    pending.pop_front();
+  }
+}
+
 void BlobFileBuilder::WriteRawBlock(const Slice& block, BlockHandle* handle) {
   handle->set_offset(file_->GetFileSize());
   handle->set_size(block.size());
@@ -158,8 +490,8 @@ void BlobFileBuilder::WriteRawBlock(const Slice& block, BlockHandle* handle) {
   if (ok()) {
     // follow rocksdb's block based table format
     char trailer[BlockBasedTable::kBlockTrailerSize];
-    // only compression dictionary and meta index block are written
-    // by this method, we use `kNoCompression` as placeholder
+    // only meta blocks and meta index block are written by this method,
+    // we use `kNoCompression` as placeholder
     trailer[0] = kNoCompression;
     char* trailer_without_type = trailer + 1;
 
@@ -180,20 +512,58 @@ void BlobFileBuilder::WriteCompressionDictBlock(
   }
 }
 
+void BlobFileBuilder::WriteRecordIndexBlock(
+    MetaIndexBuilder* meta_index_builder) {
+  assert(record_index_keys_.empty());
+  BlockHandle handle;
+  WriteRawBlock(record_index_->Finish(), &handle);
+  if (ok()) {
+    meta_index_builder->Add(kRecordIndexBlockName, handle);
+  }
+}
+
+void BlobFileBuilder::AddToRecordIndex(const BlobHandle& handle) {
+  if (!record_index_) return;
+  assert(!record_index_keys_.empty());
+  record_index_key_.clear();
+  AppendInternalKey(&record_index_key_,
+                    ParsedInternalKey(record_index_keys_.front(),
+                                      0 /*sequence*/, kTypeValue));
+  record_index_keys_.pop_front();
+  record_index_value_.clear();
+  handle.EncodeTo(&record_index_value_);
+  record_index_->Add(record_index_key_, record_index_value_);
+}
+
 Status BlobFileBuilder::Finish(OutContexts* out_ctx) {
   if (!ok()) return status();
 
   if (builder_state_ == BuilderState::kBuffered) {
     EnterUnbuffered(out_ctx);
   }
+  if (blocked_) {
+    FlushBlock(out_ctx);
+  }
+  if (parallel_) {
+    WriteCompressedRecords(true /*wait_all*/, out_ctx);
+    if (!ok()) return status();
+  }
 
   BlobFileFooter footer;
-  // if has compression dictionary, encode it into meta blocks
-  if (cf_options_.blob_file_compression_options.max_dict_bytes > 0) {
-    assert(blob_file_version_ == BlobFileHeader::kVersion2);
+  // if has compression dictionary or record index, encode them into meta
+  // blocks
+  bool has_dict = cf_options_.blob_file_compression_options.max_dict_bytes > 0;
+  if (has_dict || record_index_) {
+    assert(blob_file_version_ != BlobFileHeader::kVersion1);
     BlockHandle meta_index_handle;
     MetaIndexBuilder meta_index_builder;
-    WriteCompressionDictBlock(&meta_index_builder);
+    if (record_index_) {
+      WriteRecordIndexBlock(&meta_index_builder);
+    }
+    if (has_dict && ok()) {
+      WriteCompressionDictBlock(&meta_index_builder);
+    }
+    if (!ok()) return status();
     WriteRawBlock(meta_index_builder.Finish(), &meta_index_handle);
     footer.meta_index_handle = meta_index_handle;
   }
@@ -213,5 +583,10 @@ void BlobFileBuilder::Abandon() {}
 
 uint64_t BlobFileBuilder::NumEntries() { return num_entries_; }
 
+uint64_t BlobFileBuilder::NumPendingEntries() {
+  return block_contexts_.size() +
+         (parallel_ ? parallel_->pending_contexts : 0);
+}
+
 }  // namespace titandb
 }  // namespace rocksdb
@@ -1,6 +1,10 @@
 #pragma once
 
+#include <deque>
+
 #include "file/writable_file_writer.h"
+#include "rocksdb/threadpool.h"
+#include "table/block_based/block_builder.h"
 #include "table/meta_blocks.h"
 #include "util/autovector.h"
 #include "util/compression.h"
@@ -34,6 +38,26 @@ namespace titandb {
 // meta index block with block handles pointed to the meta blocks. The
 // meta block and the meta index block are formatted the same as the
 // BlockBasedTable.
+//
+// With `blob_file_compression_parallel_threads` greater than 1, records
+// added in the `kUnbuffered` state are compressed by up to that many jobs
+// on the compression pool, which is shared by the builders, and written in
+// order as their compression completes. Their contexts are held back till
+// then, the same as in the `kBuffered` state. Without a pool, records are
+// compressed by the builder.
+//
+// With `blob_file_block_size` set, the builder writes a blocked file (see
+// BlobFileHeader::kVersion3). Records are packed into a block till it
+// reaches the block size, and the block is compressed and written as a
+// whole. The contexts of the records are held back till their block is
+// written, as the handles point into the block.
+//
+// With `blob_file_record_index` set, the builder also writes a record index
+// meta block, with the key and the handle of every record. Records are
+// written in the order they are added, so the keys of the records not
+// written yet are queued till their handles are known. With
+// `blob_file_keys_in_index` set as well, the records are written without
+// their keys.
 class BlobFileBuilder {
  public:
   // States of the builder.
@@ -66,10 +90,16 @@ class BlobFileBuilder {
 
   // Constructs a builder that will store the contents of the file it
   // is building in "*file". Does not close the file. It is up to the
-  // caller to sync and close the file after calling Finish().
+  // caller to sync and close the file after calling Finish(). Version 2
+  // becomes version 3 if `blob_file_block_size` is set. Version 1 supports
+  // neither the dictionary nor the record index. "compression_pool" must
+  // outlive the builder.
   BlobFileBuilder(const TitanDBOptions& db_options,
                   const TitanCFOptions& cf_options, WritableFileWriter* file,
-                  uint32_t blob_file_version = BlobFileHeader::kVersion2);
+                  uint32_t blob_file_version = BlobFileHeader::kVersion2,
+                  ThreadPool* compression_pool = nullptr);
+
+  ~BlobFileBuilder();
 
   // Tries to add the record to the file
   // Notice:
@@ -86,6 +116,15 @@ class BlobFileBuilder {
   // Returns builder state
   BuilderState GetBuilderState() { return builder_state_; }
 
+  // Whether the output contexts are held back by the builder, for
+  // sampling, for parallel compression or till their block is written.
+  // If so, small KV pairs must be passed in by AddSmall() to keep them in
+  // order.
+  bool HoldsContexts() const {
+    return builder_state_ == BuilderState::kBuffered || parallel_ != nullptr ||
+           blocked_;
+  }
+
   // Returns non-ok iff some error has been detected.
   Status status() const { return status_; }
 
@@ -104,6 +143,9 @@ class BlobFileBuilder {
   uint64_t NumEntries();
   // Number of sample records
   uint64_t NumSampleEntries() { return sample_records_.size(); }
+  // Number of records and small KV pairs queued for parallel compression,
+  // or held back in the block being built.
+  uint64_t NumPendingEntries();
 
   const std::string& GetSmallestKey() { return smallest_key_; }
   const std::string& GetLargestKey() { return largest_key_; }
@@ -111,6 +153,8 @@ class BlobFileBuilder {
   uint64_t live_data_size() const { return live_data_size_; }
 
  private:
+  struct ParallelCompression;
+
   BuilderState builder_state_;
 
   bool ok() const { return status().ok(); }
@@ -121,12 +165,35 @@ class BlobFileBuilder {
   void WriteHeader();
   void WriteRawBlock(const Slice& block, BlockHandle* handle);
   void WriteCompressionDictBlock(MetaIndexBuilder* meta_index_builder);
+  void WriteRecordIndexBlock(MetaIndexBuilder* meta_index_builder);
+  // Adds the handle of the next record written to the record index.
+  void AddToRecordIndex(const BlobHandle& handle);
   void FlushSampleRecords(OutContexts* out_ctx);
   void WriteEncoderData(BlobHandle* handle);
+  void WriteRecord(const Slice& header, const Slice& record,
+                   BlobHandle* handle);
+  // Appends the record to the block being built, and writes the block if
+  // it is full.
+  void AddToBlock(const BlobRecord& record,
+                  std::unique_ptr<BlobRecordContext> ctx, OutContexts* out_ctx);
+  // Writes the block being built, or queues it for parallel compression.
+  void FlushBlock(OutContexts* out_ctx);
+  // Writes the compressed block of "raw_size" bytes uncompressed, then
+  // sets the handles of the records in "*contexts" and moves all of them
+  // to "*out_ctx".
+  void WriteBlock(const Slice& header, const Slice& block, uint64_t raw_size,
+                  OutContexts* contexts, OutContexts* out_ctx);
+  // Writes the records or blocks compressed at the head of the parallel
+  // compression queue, and returns their contexts along with the small KV
+  // pairs queued in between. Waits for the compression to complete if
+  // "wait_all", or if too many records are queued.
+  void WriteCompressedRecords(bool wait_all, OutContexts* out_ctx);
 
   TitanCFOptions cf_options_;
   WritableFileWriter* file_;
   const uint32_t blob_file_version_;
+  const bool blocked_;
+  const bool keyless_;
 
   Status status_;
   BlobEncoder encoder_;
@@ -138,6 +205,21 @@ class BlobFileBuilder {
 
   OutContexts cached_contexts_;
 
+  std::unique_ptr<ParallelCompression> parallel_;
+
+  // The encoded records of the block being built, and their contexts
+  // along with the small KV pairs added in between. While a record is in
+  // the block, its handle holds its offset and size in the block.
+  std::string block_;
+  OutContexts block_contexts_;
+
+  // The record index being built, and the keys of the records added but
+  // not written yet, in the order they are added.
+  std::unique_ptr<BlockBuilder> record_index_;
+  std::deque<std::string> record_index_keys_;
+  std::string record_index_key_;
+  std::string record_index_value_;
+
   uint64_t num_entries_ = 0;
   std::string smallest_key_;
   std::string largest_key_;
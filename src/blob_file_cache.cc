@@ -15,15 +15,17 @@ Slice EncodeFileNumber(const uint64_t* number) {
 
 }  // namespace
 
-BlobFileCache::BlobFileCache(const TitanDBOptions& db_options,
-                             const TitanCFOptions& cf_options,
-                             std::shared_ptr<Cache> cache, TitanStats* stats)
+BlobFileCache::BlobFileCache(
+    const TitanDBOptions& db_options, const TitanCFOptions& cf_options,
+    std::shared_ptr<Cache> cache, TitanStats* stats,
+    std::shared_ptr<BlobPersistentCache> persistent_cache)
     : env_(db_options.env),
       env_options_(db_options),
       db_options_(db_options),
       cf_options_(cf_options),
       cache_(cache),
-      stats_(stats) {}
+      stats_(stats),
+      persistent_cache_(persistent_cache) {}
 
 Status BlobFileCache::Get(const ReadOptions& options, uint64_t file_number,
                           uint64_t file_size, const BlobHandle& handle,
@@ -38,6 +40,25 @@ Status BlobFileCache::Get(const ReadOptions& options, uint64_t file_number,
   return s;
 }
 
+void BlobFileCache::MultiGet(const ReadOptions& options, uint64_t file_number,
+                             uint64_t file_size,
+                             const std::vector<BlobHandle>& handles,
+                             BlobRecord* records, PinnableSlice* buffers,
+                             Status* statuses) {
+  Cache::Handle* cache_handle = nullptr;
+  Status s = FindFile(file_number, file_size, &cache_handle);
+  if (!s.ok()) {
+    for (size_t i = 0; i < handles.size(); i++) {
+      statuses[i] = s;
+    }
+    return;
+  }
+
+  auto reader = reinterpret_cast<BlobFileReader*>(cache_->Value(cache_handle));
+  reader->MultiGet(options, handles, records, buffers, statuses);
+  cache_->Release(cache_handle);
+}
+
 Status BlobFileCache::NewPrefetcher(
     uint64_t file_number, uint64_t file_size,
     std::unique_ptr<BlobFilePrefetcher>* result) {
@@ -56,6 +77,12 @@ void BlobFileCache::Evict(uint64_t file_number) {
   cache_->Erase(EncodeFileNumber(&file_number));
 }
 
+void BlobFileCache::EvictPersistentCache(uint64_t file_number) {
+  if (persistent_cache_) {
+    persistent_cache_->EraseFile(file_number);
+  }
+}
+
 Status BlobFileCache::FindFile(uint64_t file_number, uint64_t file_size,
                                Cache::Handle** handle) {
   Status s;
@@ -80,7 +107,7 @@ Status BlobFileCache::FindFile(uint64_t file_number, uint64_t file_size,
 
   std::unique_ptr<BlobFileReader> reader;
   s = BlobFileReader::Open(cf_options_, std::move(file), file_size, &reader,
-                           stats_);
+                           stats_, persistent_cache_.get(), file_number);
   if (!s.ok()) return s;
 
   cache_->Insert(cache_key, reader.release(), 1,
@@ -4,6 +4,7 @@
 
 #include "blob_file_reader.h"
 #include "blob_format.h"
+#include "blob_persistent_cache.h"
 #include "titan/options.h"
 #include "titan_stats.h"
 
@@ -12,10 +13,12 @@ namespace titandb {
 
 class BlobFileCache {
  public:
-  // Constructs a blob file cache to cache opened files.
-  BlobFileCache(const TitanDBOptions& db_options,
-                const TitanCFOptions& cf_options, std::shared_ptr<Cache> cache,
-                TitanStats* stats);
+  // Constructs a blob file cache to cache opened files. Files opened
+  // by it share "persistent_cache", if any.
+  BlobFileCache(
+      const TitanDBOptions& db_options, const TitanCFOptions& cf_options,
+      std::shared_ptr<Cache> cache, TitanStats* stats,
+      std::shared_ptr<BlobPersistentCache> persistent_cache = nullptr);
 
   // Gets the blob record pointed by the handle in the specified file
   // number. The corresponding file size must be exactly "file_size"
@@ -25,6 +28,12 @@ class BlobFileCache {
              uint64_t file_size, const BlobHandle& handle, BlobRecord* record,
              PinnableSlice* buffer);
 
+  // Gets the blob records pointed by the handles in the specified file
+  // number. See BlobFileReader::MultiGet for the requirements.
+  void MultiGet(const ReadOptions& options, uint64_t file_number,
+                uint64_t file_size, const std::vector<BlobHandle>& handles,
+                BlobRecord* records, PinnableSlice* buffers, Status* statuses);
+
   // Creates a prefetcher for the specified file number.
   Status NewPrefetcher(uint64_t file_number, uint64_t file_size,
                        std::unique_ptr<BlobFilePrefetcher>* result);
@@ -32,6 +41,11 @@ class BlobFileCache {
   // Evicts the file cache for the specified file number.
   void Evict(uint64_t file_number);
 
+  // Drops the records of the specified file number from the persistent
+  // blob cache. Unlike Evict(), this is only meant for files that are
+  // not going to be read anymore.
+  void EvictPersistentCache(uint64_t file_number);
+
  private:
   // Finds the file for the specified file number. Opens the file if
   // the file is not found in the cache and caches it.
@@ -45,6 +59,7 @@ class BlobFileCache {
   TitanCFOptions cf_options_;
   std::shared_ptr<Cache> cache_;
   TitanStats* stats_;
+  std::shared_ptr<BlobPersistentCache> persistent_cache_;
 };
 
 }  // namespace titandb
@@ -1,5 +1,7 @@
 #include "blob_file_iterator.h"
 
+#include <algorithm>
+
 #include "table/block_based/block_based_table_reader.h"
 #include "util/crc32c.h"
 
@@ -37,6 +39,8 @@ bool BlobFileIterator::Init() {
   }
 
   header_size_ = blob_file_header.size();
+  blocked_ = blob_file_header.blocked();
+  keyless_ = blob_file_header.flags & BlobFileHeader::kHasKeylessRecords;
 
   char footer_buf[BlobFileFooter::kEncodedLength];
   // With for_compaction=true, rate_limiter is enabled. Since BlobFileIterator
@@ -70,6 +74,15 @@ bool BlobFileIterator::Init() {
     end_of_blob_record_ -= (uncompression_dict_->GetRawDict().size() +
                             BlockBasedTable::kBlockTrailerSize);
   }
+  if (blob_file_header.flags & BlobFileHeader::kHasRecordIndex) {
+    status_ = BlobRecordIndex::Open(blob_file_header, blob_file_footer,
+                                    file_.get(), titan_cf_options_.comparator,
+                                    &record_index_);
+    if (!status_.ok()) {
+      return false;
+    }
+    end_of_blob_record_ -= record_index_->size();
+  }
 
   assert(end_of_blob_record_ > BlobFileHeader::kMinEncodedLength);
   init_ = true;
@@ -79,14 +92,41 @@ bool BlobFileIterator::Init() {
 void BlobFileIterator::SeekToFirst() {
   if (!init_ && !Init()) return;
   status_ = Status::OK();
+  block_ = Slice();
+  block_pos_ = 0;
+  if (live_records_only_) {
+    live_record_pos_ = 0;
+    GetLiveRecord();
+    return;
+  }
   iterate_offset_ = header_size_;
   PrefetchAndGet();
 }
 
+void BlobFileIterator::SetLiveRecords(std::vector<BlobHandle>&& handles,
+                                      bool ordered) {
+  live_records_only_ = true;
+  live_records_ = std::move(handles);
+  if (ordered) {
+    return;
+  }
+  // Records in a block are ordered by their offsets in the block.
+  std::sort(live_records_.begin(), live_records_.end(),
+            [](const BlobHandle& a, const BlobHandle& b) {
+              return a.offset < b.offset || (a.offset == b.offset &&
+                                             a.record_offset < b.record_offset);
+            });
+}
+
 bool BlobFileIterator::Valid() const { return valid_ && status().ok(); }
 
 void BlobFileIterator::Next() {
   assert(init_);
+  if (live_records_only_) {
+    live_record_pos_++;
+    GetLiveRecord();
+    return;
+  }
   PrefetchAndGet();
 }
 
@@ -105,6 +145,22 @@ void BlobFileIterator::IterateForPrev(uint64_t offset) {
     return;
   }
 
+  block_ = Slice();
+  block_pos_ = 0;
+  valid_ = false;
+
+  if (record_index_) {
+    // Records are indexed in the order they are in the file.
+    iterate_offset_ = header_size_;
+    auto iter = record_index_->NewIterator();
+    for (iter->SeekToFirst(); iter->Valid() && iter->handle().offset <= offset;
+         iter->Next()) {
+      iterate_offset_ = iter->handle().offset;
+    }
+    status_ = iter->status();
+    return;
+  }
+
   uint64_t total_length = 0;
   FixedSlice<kRecordHeaderSize> header_buffer;
   iterate_offset_ = header_size_;
@@ -122,7 +178,6 @@ void BlobFileIterator::IterateForPrev(uint64_t offset) {
   }
 
   if (iterate_offset_ > offset) iterate_offset_ -= total_length;
-  valid_ = false;
 }
 
 void BlobFileIterator::GetBlobRecord() {
@@ -144,19 +199,146 @@ void BlobFileIterator::GetBlobRecord() {
   status_ = file_->Read(IOOptions(), iterate_offset_ + kRecordHeaderSize,
                         record_size, &record_slice, buffer_.data(),
                         nullptr /*aligned_buf*/, true /*for_compaction*/);
-  if (status_.ok()) {
-    status_ =
-        decoder_.DecodeRecord(&record_slice, &cur_blob_record_, &uncompressed_);
+  if (!status_.ok()) return;
+  if (blocked_) {
+    status_ = decoder_.DecodeContents(&record_slice, &block_, &uncompressed_);
+    if (!status_.ok()) return;
+    block_handle_ = BlobHandle();
+    block_handle_.offset = iterate_offset_;
+    block_handle_.size = kRecordHeaderSize + record_size;
+    iterate_offset_ += block_handle_.size;
+    GetBlockRecord(0);
+    return;
   }
+  status_ =
+      decoder_.DecodeRecord(&record_slice, &cur_blob_record_, &uncompressed_);
   if (!status_.ok()) return;
 
-  cur_record_offset_ = iterate_offset_;
-  cur_record_size_ = kRecordHeaderSize + record_size;
-  iterate_offset_ += cur_record_size_;
+  cur_handle_ = BlobHandle();
+  cur_handle_.offset = iterate_offset_;
+  cur_handle_.size = kRecordHeaderSize + record_size;
+  iterate_offset_ += cur_handle_.size;
   valid_ = true;
+  if (keyless_) {
+    GetRecordKey();
+  }
+}
+
+void BlobFileIterator::GetBlockRecord(uint64_t record_offset) {
+  status_ = DecodeBlockRecord(block_, record_offset, &cur_blob_record_);
+  if (!status_.ok()) return;
+  // Records are encoded back to back, so the value ends the record.
+  uint64_t record_end = static_cast<uint64_t>(
+      cur_blob_record_.value.data() + cur_blob_record_.value.size() -
+      block_.data());
+  cur_handle_ = block_handle_;
+  cur_handle_.record_offset = record_offset;
+  cur_handle_.record_size = BlockRecordSize(
+      record_end - record_offset, block_.size(), block_handle_.size);
+  block_pos_ = record_end;
+  valid_ = true;
+  if (keyless_) {
+    GetRecordKey();
+  }
+}
+
+void BlobFileIterator::GetRecordKey() {
+  auto before = [](const BlobHandle& a, const BlobHandle& b) {
+    return a.offset < b.offset ||
+           (a.offset == b.offset && a.record_offset < b.record_offset);
+  };
+  // Records are mostly visited in the order they are indexed, so the index
+  // is read forward, and only read again from the start after a jump back.
+  if (!key_iter_) {
+    key_iter_ = record_index_->NewIterator();
+    key_iter_->SeekToFirst();
+  } else if (!key_iter_->Valid() || before(cur_handle_, key_iter_->handle())) {
+    key_iter_->SeekToFirst();
+  }
+  while (key_iter_->Valid() && before(key_iter_->handle(), cur_handle_)) {
+    key_iter_->Next();
+  }
+  if (!key_iter_->status().ok()) {
+    status_ = key_iter_->status();
+    valid_ = false;
+    return;
+  }
+  if (!key_iter_->Valid() || before(cur_handle_, key_iter_->handle())) {
+    status_ = Status::Corruption("Blob record missing in record index");
+    valid_ = false;
+    return;
+  }
+  cur_blob_record_.key = key_iter_->key();
+}
+
+void BlobFileIterator::GetLiveRecord() {
+  if (live_record_pos_ >= live_records_.size()) {
+    valid_ = false;
+    return;
+  }
+  const BlobHandle& handle = live_records_[live_record_pos_];
+  if (handle.in_block() != blocked_) {
+    status_ = Status::Corruption("Blob handle mismatches blob file version");
+    return;
+  }
+  if (blocked_ && !block_.empty() && handle.offset == block_handle_.offset) {
+    // The block is read for the previous record already.
+    GetBlockRecord(handle.record_offset);
+    cur_handle_ = handle;
+    return;
+  }
+  if (handle.size < kRecordHeaderSize ||
+      handle.offset + handle.size > end_of_blob_record_) {
+    status_ = Status::Corruption("Blob handle out of bound");
+    return;
+  }
+  // A record is read with its header in one request.
+  Slice record_slice;
+  buffer_.resize(handle.size);
+  // With for_compaction=true, rate_limiter is enabled. Since BlobFileIterator
+  // is only used for GC, we always set for_compaction to true.
+  status_ = file_->Read(IOOptions(), handle.offset, handle.size, &record_slice,
+                        buffer_.data(), nullptr /*aligned_buf*/,
+                        true /*for_compaction*/);
+  if (!status_.ok()) return;
+  if (record_slice.size() != handle.size) {
+    status_ = Status::Corruption("Blob record truncated");
+    return;
+  }
+  Slice header_slice(record_slice.data(), kRecordHeaderSize);
+  status_ = decoder_.DecodeHeader(&header_slice);
+  if (!status_.ok()) return;
+  if (decoder_.GetRecordSize() != handle.size - kRecordHeaderSize) {
+    status_ = Status::Corruption("Blob record size mismatch");
+    return;
+  }
+  record_slice.remove_prefix(kRecordHeaderSize);
+  if (blocked_) {
+    status_ = decoder_.DecodeContents(&record_slice, &block_, &uncompressed_);
+    if (!status_.ok()) return;
+    block_handle_ = BlobHandle();
+    block_handle_.offset = handle.offset;
+    block_handle_.size = handle.size;
+    GetBlockRecord(handle.record_offset);
+    cur_handle_ = handle;
+    return;
+  }
+  status_ =
+      decoder_.DecodeRecord(&record_slice, &cur_blob_record_, &uncompressed_);
+  if (!status_.ok()) return;
+
+  cur_handle_ = handle;
+  valid_ = true;
+  if (keyless_) {
+    GetRecordKey();
+  }
 }
 
 void BlobFileIterator::PrefetchAndGet() {
+  if (blocked_ && block_pos_ < block_.size()) {
+    GetBlockRecord(block_pos_);
+    return;
+  }
   if (iterate_offset_ >= end_of_blob_record_) {
     valid_ = false;
     return;
@@ -201,14 +383,22 @@ bool BlobFileMergeIterator::Valid() const {
 }
 
 void BlobFileMergeIterator::SeekToFirst() {
+  // Only the iterators of live records may be empty, e.g. for a file all
+  // garbage. An empty whole file means its reads failed.
+  bool may_be_empty = true;
   for (auto& iter : blob_file_iterators_) {
     iter->SeekToFirst();
-    if (iter->status().ok() && iter->Valid()) min_heap_.push(iter.get());
+    if (!iter->status().ok()) {
+      status_ = iter->status();
+      return;
+    }
+    if (iter->Valid()) min_heap_.push(iter.get());
+    may_be_empty = may_be_empty && iter->live_records_only();
   }
   if (!min_heap_.empty()) {
     current_ = min_heap_.top();
     min_heap_.pop();
-  } else {
+  } else if (!may_be_empty) {
     status_ = Status::Aborted("No iterator is valid");
   }
 }
@@ -216,7 +406,12 @@ void BlobFileMergeIterator::SeekToFirst() {
 void BlobFileMergeIterator::Next() {
   assert(Valid());
   current_->Next();
-  if (current_->status().ok() && current_->Valid()) min_heap_.push(current_);
+  if (!current_->status().ok()) {
+    status_ = current_->status();
+    current_ = nullptr;
+    return;
+  }
+  if (current_->Valid()) min_heap_.push(current_);
   if (!min_heap_.empty()) {
     current_ = min_heap_.top();
     min_heap_.pop();
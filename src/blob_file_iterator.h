@@ -9,6 +9,7 @@
 #include "rocksdb/status.h"
 #include "table/internal_iterator.h"
 
+#include "blob_file_reader.h"
 #include "blob_format.h"
 #include "titan/options.h"
 #include "util.h"
@@ -16,7 +17,9 @@
 namespace rocksdb {
 namespace titandb {
 
-// Used by GC job for iterate through blob file.
+// Used by GC job for iterate through blob file. The records of a blocked
+// file are iterated one by one, uncompressing each block once. The keys of
+// keyless records are read from the record index.
 class BlobFileIterator {
  public:
   const uint64_t kMinReadaheadSize = 4 << 10;
@@ -35,14 +38,29 @@ class BlobFileIterator {
   Slice value() const;
   Status status() const { return status_; }
   uint64_t header_size() const { return header_size_; }
-
+  // Offset right after the last record, where the meta blocks start.
+  uint64_t end_of_blob_record() const { return end_of_blob_record_; }
+  // The record index of the file, or nullptr if it has none. Available
+  // after Init().
+  const BlobRecordIndex* record_index() const { return record_index_.get(); }
+
+  // Positions the iterator so that Next() reads the record containing
+  // "offset". Uses the record index if the file has one, otherwise reads
+  // the headers of the records before.
   void IterateForPrev(uint64_t);
 
+  // Makes the iterator visit only the records at "handles", rather than
+  // every record of the file. The records are visited in the order of
+  // their offsets, or in the order of "handles" if "ordered" is set. Must
+  // be called before SeekToFirst().
+  void SetLiveRecords(std::vector<BlobHandle>&& handles, bool ordered = false);
+
+  bool live_records_only() const { return live_records_only_; }
+
   BlobIndex GetBlobIndex() {
     BlobIndex blob_index;
     blob_index.file_number = file_number_;
-    blob_index.blob_handle.offset = cur_record_offset_;
-    blob_index.blob_handle.size = cur_record_size_;
+    blob_index.blob_handle = cur_handle_;
     return blob_index;
   }
 
@@ -61,22 +79,43 @@ class BlobFileIterator {
   bool valid_{false};
 
   std::unique_ptr<UncompressionDict> uncompression_dict_;
+  std::unique_ptr<BlobRecordIndex> record_index_;
   BlobDecoder decoder_;
 
+  // Whether the records are keyless, and the iterator of the record index
+  // to get their keys from.
+  bool keyless_{false};
+  std::unique_ptr<BlobRecordIndex::Iterator> key_iter_;
+
   uint64_t iterate_offset_{0};
   std::vector<char> buffer_;
   OwnedSlice uncompressed_;
   BlobRecord cur_blob_record_;
-  uint64_t cur_record_offset_;
-  uint64_t cur_record_size_;
+  BlobHandle cur_handle_;
   uint64_t header_size_;
 
+  // The uncompressed block the records are read from, if the file is
+  // blocked, along with its handle and the offset of the next record.
+  bool blocked_{false};
+  Slice block_;
+  BlobHandle block_handle_;
+  uint64_t block_pos_{0};
+
   uint64_t readahead_begin_offset_{0};
   uint64_t readahead_end_offset_{0};
   uint64_t readahead_size_{kMinReadaheadSize};
 
+  bool live_records_only_{false};
+  std::vector<BlobHandle> live_records_;
+  size_t live_record_pos_{0};
+
   void PrefetchAndGet();
   void GetBlobRecord();
+  void GetLiveRecord();
+  // Reads the record at "record_offset" of the current block.
+  void GetBlockRecord(uint64_t record_offset);
+  // Sets the key of the current keyless record from the record index.
+  void GetRecordKey();
 };
 
 class BlobFileMergeIterator {
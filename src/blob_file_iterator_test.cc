@@ -4,6 +4,7 @@
 
 #include "file/filename.h"
 #include "test_util/testharness.h"
+#include "util/coding.h"
 #include "util/random.h"
 
 #include "blob_file_builder.h"
@@ -25,14 +26,19 @@ class BlobFileIteratorTest : public testing::Test {
   std::unique_ptr<WritableFileWriter> writable_file_;
   std::unique_ptr<BlobFileIterator> blob_file_iterator_;
   std::unique_ptr<RandomAccessFileReader> readable_file_;
+  // Shared by the builders compressing on parallel threads.
+  std::unique_ptr<ThreadPool> compression_pool_;
 
-  BlobFileIteratorTest() : dirname_(test::TmpDir(env_)) {
+  BlobFileIteratorTest()
+      : dirname_(test::TmpDir(env_)), compression_pool_(NewThreadPool(4)) {
     titan_options_.dirname = dirname_;
     file_number_ = Random::GetTLSInstance()->Next();
     file_name_ = BlobFileName(dirname_, file_number_);
   }
 
   ~BlobFileIteratorTest() {
+    builder_.reset();
+    compression_pool_->JoinAllThreads();
     env_->DeleteFile(file_name_);
     env_->DeleteDir(dirname_);
   }
@@ -63,8 +69,10 @@ class BlobFileIteratorTest : public testing::Test {
       writable_file_.reset(new WritableFileWriter(std::move(f), file_name_,
                                                   FileOptions(env_options_)));
     }
-    builder_.reset(
-        new BlobFileBuilder(db_options, cf_options, writable_file_.get()));
+    builder_.reset(new BlobFileBuilder(db_options, cf_options,
+                                       writable_file_.get(),
+                                       BlobFileHeader::kVersion2,
+                                       compression_pool_.get()));
   }
 
   void AddKeyValue(const std::string& key, const std::string& value,
@@ -97,16 +105,23 @@ class BlobFileIteratorTest : public testing::Test {
     }
   }
 
-  void NewBlobFileIterator() {
+  void NewBlobFileIterator(uint64_t stream_readahead_size = 0) {
     uint64_t file_size = 0;
     ASSERT_OK(env_->GetFileSize(file_name_, &file_size));
-    NewBlobFileReader(file_number_, 0, titan_options_, env_options_, env_,
-                      &readable_file_);
+    if (stream_readahead_size > 0) {
+      ASSERT_OK(NewBlobFileStreamReader(file_name_, file_size,
+                                        stream_readahead_size,
+                                        false /*use_direct_io*/, env_options_,
+                                        env_, &readable_file_));
+    } else {
+      ASSERT_OK(NewBlobFileReader(file_number_, 0, titan_options_,
+                                  env_options_, env_, &readable_file_));
+    }
     blob_file_iterator_.reset(new BlobFileIterator{
         std::move(readable_file_), file_number_, file_size, TitanCFOptions()});
   }
 
-  void TestBlobFileIterator() {
+  void TestBlobFileIterator(uint64_t stream_readahead_size = 0) {
     NewBuilder();
 
     const int n = 1000;
@@ -117,7 +132,7 @@ class BlobFileIteratorTest : public testing::Test {
 
     FinishBuilder(contexts);
 
-    NewBlobFileIterator();
+    NewBlobFileIterator(stream_readahead_size);
 
     blob_file_iterator_->SeekToFirst();
     ASSERT_EQ(contexts.size(), n);
@@ -131,6 +146,118 @@ class BlobFileIteratorTest : public testing::Test {
                 blob_index.blob_handle);
     }
   }
+
+  void TestLiveRecords() {
+    NewBuilder();
+    const int n = 1000;
+    BlobFileBuilder::OutContexts contexts;
+    for (int i = 0; i < n; i++) {
+      AddKeyValue(GenKey(i), GenValue(i), contexts);
+    }
+    FinishBuilder(contexts);
+    ASSERT_EQ(contexts.size(), n);
+
+    // Every third record is live, given out of order.
+    std::vector<BlobHandle> handles;
+    for (int i = n - 1; i >= 0; i--) {
+      if (i % 3 == 0) {
+        handles.push_back(contexts[i]->new_blob_index.blob_handle);
+      }
+    }
+    NewBlobFileIterator();
+    blob_file_iterator_->SetLiveRecords(std::move(handles));
+    blob_file_iterator_->SeekToFirst();
+    for (int i = 0; i < n; i += 3, blob_file_iterator_->Next()) {
+      ASSERT_OK(blob_file_iterator_->status());
+      ASSERT_TRUE(blob_file_iterator_->Valid());
+      ASSERT_EQ(GenKey(i), blob_file_iterator_->key());
+      ASSERT_EQ(GenValue(i), blob_file_iterator_->value());
+      ASSERT_EQ(contexts[i]->new_blob_index.blob_handle,
+                blob_file_iterator_->GetBlobIndex().blob_handle);
+    }
+    ASSERT_OK(blob_file_iterator_->status());
+    ASSERT_FALSE(blob_file_iterator_->Valid());
+
+    // Ordered records are visited in the order given.
+    handles.clear();
+    for (int i = n - 1; i >= 0; i -= 3) {
+      handles.push_back(contexts[i]->new_blob_index.blob_handle);
+    }
+    NewBlobFileIterator();
+    blob_file_iterator_->SetLiveRecords(std::move(handles), true /*ordered*/);
+    blob_file_iterator_->SeekToFirst();
+    for (int i = n - 1; i >= 0; i -= 3, blob_file_iterator_->Next()) {
+      ASSERT_OK(blob_file_iterator_->status());
+      ASSERT_TRUE(blob_file_iterator_->Valid());
+      ASSERT_EQ(GenKey(i), blob_file_iterator_->key());
+      ASSERT_EQ(GenValue(i), blob_file_iterator_->value());
+    }
+    ASSERT_OK(blob_file_iterator_->status());
+    ASSERT_FALSE(blob_file_iterator_->Valid());
+
+    // No live records at all.
+    NewBlobFileIterator();
+    blob_file_iterator_->SetLiveRecords({});
+    blob_file_iterator_->SeekToFirst();
+    ASSERT_OK(blob_file_iterator_->status());
+    ASSERT_FALSE(blob_file_iterator_->Valid());
+  }
+
+  void TestRecordIndex() {
+    TestBlobFileIterator();
+    const BlobRecordIndex* record_index = blob_file_iterator_->record_index();
+    ASSERT_TRUE(record_index != nullptr);
+
+    const int n = 1000;
+    BlobFileBuilder::OutContexts contexts;
+    NewBuilder();
+    for (int i = 0; i < n; i++) {
+      AddKeyValue(GenKey(i), GenValue(i), contexts);
+    }
+    FinishBuilder(contexts);
+    NewBlobFileIterator();
+    blob_file_iterator_->SeekToFirst();
+    ASSERT_OK(blob_file_iterator_->status());
+    record_index = blob_file_iterator_->record_index();
+    ASSERT_TRUE(record_index != nullptr);
+
+    auto iter = record_index->NewIterator();
+    iter->SeekToFirst();
+    for (int i = 0; i < n; i++, iter->Next()) {
+      ASSERT_OK(iter->status());
+      ASSERT_TRUE(iter->Valid());
+      ASSERT_EQ(GenKey(i), iter->key());
+      ASSERT_EQ(contexts[i]->new_blob_index.blob_handle, iter->handle());
+    }
+    ASSERT_OK(iter->status());
+    ASSERT_FALSE(iter->Valid());
+
+    for (int i : {0, 1, n / 2, n - 1}) {
+      iter->Seek(GenKey(i));
+      ASSERT_TRUE(iter->Valid());
+      ASSERT_EQ(GenKey(i), iter->key());
+      ASSERT_EQ(contexts[i]->new_blob_index.blob_handle, iter->handle());
+    }
+    iter->Seek(GenKey(n));
+    ASSERT_OK(iter->status());
+    ASSERT_FALSE(iter->Valid());
+
+    // Locating a record doesn't read the records before.
+    int i = n / 2;
+    BlobHandle blob_handle = contexts[i]->new_blob_index.blob_handle;
+    blob_file_iterator_->IterateForPrev(blob_handle.offset + 1);
+    ASSERT_OK(blob_file_iterator_->status());
+    blob_file_iterator_->Next();
+    ASSERT_OK(blob_file_iterator_->status());
+    ASSERT_TRUE(blob_file_iterator_->Valid());
+    if (!blob_handle.in_block()) {
+      ASSERT_EQ(blob_handle, blob_file_iterator_->GetBlobIndex().blob_handle);
+    } else {
+      // The iterator is at the first record of the block.
+      ASSERT_EQ(blob_handle.offset,
+                blob_file_iterator_->GetBlobIndex().blob_handle.offset);
+    }
+  }
 };
 
 TEST_F(BlobFileIteratorTest, Basic) {
@@ -138,6 +265,15 @@ TEST_F(BlobFileIteratorTest, Basic) {
   TestBlobFileIterator();
 }
 
+TEST_F(BlobFileIteratorTest, StreamReader) {
+  // Records span chunks with a readahead smaller than a record.
+  for (uint64_t readahead_size : {1 << 10, 4 << 10, 64 << 10, 4 << 20}) {
+    TestBlobFileIterator(readahead_size);
+  }
+}
+
+TEST_F(BlobFileIteratorTest, LiveRecords) { TestLiveRecords(); }
+
 TEST_F(BlobFileIteratorTest, DictCompress) {
 #if ZSTD_VERSION_NUMBER >= 10103
   CompressionOptions compression_opts;
@@ -150,6 +286,79 @@ TEST_F(BlobFileIteratorTest, DictCompress) {
 #endif
 }
 
+TEST_F(BlobFileIteratorTest, BlockedFile) {
+  // A few records per block, and records larger than a block.
+  titan_options_.blob_file_block_size = 3 * titan_options_.min_blob_size;
+  TestBlobFileIterator();
+  TestBlobFileIterator(4 << 10 /*stream_readahead_size*/);
+  TestLiveRecords();
+  titan_options_.blob_file_compression = kLZ4Compression;
+  TestBlobFileIterator();
+  TestLiveRecords();
+  titan_options_.blob_file_block_size = titan_options_.min_blob_size / 2;
+  TestBlobFileIterator();
+}
+
+TEST_F(BlobFileIteratorTest, RecordIndex) {
+  titan_options_.blob_file_record_index = true;
+  TestRecordIndex();
+#if ZSTD_VERSION_NUMBER >= 10103
+  // Both the dictionary and the record index are meta blocks.
+  titan_options_.blob_file_compression = kZSTD;
+  titan_options_.blob_file_compression_options.enabled = true;
+  titan_options_.blob_file_compression_options.max_dict_bytes = 4000;
+  TestRecordIndex();
+  titan_options_.blob_file_compression_options.max_dict_bytes = 0;
+#endif
+  titan_options_.blob_file_compression = kLZ4Compression;
+  titan_options_.blob_file_compression_parallel_threads = 4;
+  TestRecordIndex();
+  titan_options_.blob_file_block_size = 3 * titan_options_.min_blob_size;
+  TestRecordIndex();
+}
+
+TEST_F(BlobFileIteratorTest, KeylessRecords) {
+  titan_options_.blob_file_keys_in_index = true;
+  TestBlobFileIterator();
+  TestLiveRecords();
+  TestRecordIndex();
+
+  // Reads get only the values.
+  NewBuilder();
+  const int n = 100;
+  BlobFileBuilder::OutContexts contexts;
+  for (int i = 0; i < n; i++) {
+    AddKeyValue(GenKey(i), GenValue(i), contexts);
+  }
+  FinishBuilder(contexts);
+  uint64_t file_size = 0;
+  ASSERT_OK(env_->GetFileSize(file_name_, &file_size));
+  ASSERT_OK(NewBlobFileReader(file_number_, 0, titan_options_, env_options_,
+                              env_, &readable_file_));
+  std::unique_ptr<BlobFileReader> reader;
+  ASSERT_OK(BlobFileReader::Open(TitanCFOptions(titan_options_),
+                                 std::move(readable_file_), file_size, &reader,
+                                 nullptr /*stats*/));
+  for (int i = 0; i < n; i++) {
+    const BlobHandle& handle = contexts[i]->new_blob_index.blob_handle;
+    std::string value = GenValue(i);
+    std::string encoded_value;
+    PutLengthPrefixedSlice(&encoded_value, value);
+    ASSERT_EQ(handle.size, kRecordHeaderSize + 1 + encoded_value.size());
+    BlobRecord record;
+    PinnableSlice buffer;
+    ASSERT_OK(reader->Get(ReadOptions(), handle, &record, &buffer));
+    ASSERT_TRUE(record.key.empty());
+    ASSERT_EQ(value, record.value);
+  }
+
+  titan_options_.blob_file_compression = kLZ4Compression;
+  titan_options_.blob_file_block_size = 3 * titan_options_.min_blob_size;
+  TestBlobFileIterator();
+  TestLiveRecords();
+  TestRecordIndex();
+}
+
 TEST_F(BlobFileIteratorTest, IterateForPrev) {
   NewBuilder();
   const int n = 1000;
@@ -5,14 +5,28 @@
 #endif
 
 #include <cinttypes>
+#include <new>
+#include <type_traits>
 
+#ifdef ROCKSDB_MALLOC_USABLE_SIZE
+#ifdef OS_FREEBSD
+#include <malloc_np.h>
+#else
+#include <malloc.h>
+#endif
+#endif
+
+#include "db/dbformat.h"
 #include "file/filename.h"
 #include "file/readahead_raf.h"
 #include "table/block_based/block.h"
+#include "table/block_based/block_based_table_reader.h"
 #include "table/internal_iterator.h"
 #include "table/meta_blocks.h"
 #include "test_util/sync_point.h"
+#include "util/aligned_buffer.h"
 #include "util/crc32c.h"
+#include "util/mutexlock.h"
 #include "util/string_util.h"
 
 #include "titan_stats.h"
@@ -40,13 +54,241 @@ Status NewBlobFileReader(uint64_t file_number, uint64_t readahead_size,
   return s;
 }
 
+namespace {
+
+// Serves the reads of a sequential scan over a whole file from two aligned
+// chunks of "readahead_size" bytes. Once the reads pass the middle of the
+// current chunk, the next chunk is read by a background thread of the
+// file, so that the I/O overlaps with the processing of the current one.
+// Reads out of the two chunks are served by reading a new chunk in place.
+//
+// The chunks are aligned to the alignment required by the underlying
+// file, so the file can be opened for direct I/O.
+class BlobFileStreamFile : public FSRandomAccessFile {
+ public:
+  BlobFileStreamFile(std::unique_ptr<FSRandomAccessFile>&& file,
+                     uint64_t file_size, size_t readahead_size)
+      : file_(std::move(file)),
+        file_size_(file_size),
+        alignment_(std::max<size_t>(file_->GetRequiredBufferAlignment(), 1)),
+        readahead_size_(Roundup(std::max(readahead_size, alignment_),
+                                alignment_)),
+        cv_(&mutex_) {
+    for (auto& chunk : chunks_) {
+      chunk.buffer.Alignment(alignment_);
+      chunk.buffer.AllocateNewBuffer(readahead_size_);
+    }
+  }
+
+  ~BlobFileStreamFile() {
+    {
+      MutexLock l(&mutex_);
+      closing_ = true;
+      cv_.SignalAll();
+    }
+    if (reader_) {
+      reader_->join();
+    }
+  }
+
+  IOStatus Read(uint64_t offset, size_t n, const IOOptions& /*options*/,
+                Slice* result, char* scratch,
+                IODebugContext* /*dbg*/) const override {
+    MutexLock l(&mutex_);
+    size_t copied = 0;
+    while (copied < n) {
+      uint64_t pos = offset + copied;
+      Chunk* chunk = GetChunk(pos);
+      if (!chunk->status.ok()) {
+        return chunk->status;
+      }
+      if (!chunk->Contains(pos)) {
+        // End of file.
+        break;
+      }
+      size_t len = static_cast<size_t>(
+          std::min<uint64_t>(chunk->offset + chunk->size - pos, n - copied));
+      memcpy(scratch + copied,
+             chunk->buffer.BufferStart() + (pos - chunk->offset), len);
+      copied += len;
+      MaybeReadAhead(pos + len);
+    }
+    *result = Slice(scratch, copied);
+    return IOStatus::OK();
+  }
+
+  // Readahead is done by this file already.
+  IOStatus Prefetch(uint64_t /*offset*/, size_t /*n*/,
+                    const IOOptions& /*options*/,
+                    IODebugContext* /*dbg*/) override {
+    return IOStatus::OK();
+  }
+
+  IOStatus InvalidateCache(size_t offset, size_t length) override {
+    return file_->InvalidateCache(offset, length);
+  }
+
+ private:
+  struct Chunk {
+    AlignedBuffer buffer;
+    uint64_t offset{0};
+    uint64_t size{0};
+    IOStatus status;
+    // Whether the chunk is being read in the background.
+    bool reading{false};
+
+    bool Contains(uint64_t pos) const {
+      return pos >= offset && pos < offset + size;
+    }
+  };
+
+  // REQUIRES: mutex_ held
+  Chunk* GetChunk(uint64_t pos) const {
+    Chunk* cur = &chunks_[cur_];
+    if (cur->Contains(pos)) {
+      return cur;
+    }
+    Chunk* next = &chunks_[1 - cur_];
+    WaitForChunk(next);
+    if (next->status.ok() && next->Contains(pos)) {
+      cur_ = 1 - cur_;
+      return next;
+    }
+    FillChunk(cur, TruncateToPageBoundary(alignment_, pos));
+    return cur;
+  }
+
+  // Reads the next chunk in the background once the reads pass the middle
+  // of the current chunk.
+  // REQUIRES: mutex_ held
+  void MaybeReadAhead(uint64_t pos) const {
+    Chunk* cur = &chunks_[cur_];
+    Chunk* next = &chunks_[1 - cur_];
+    uint64_t next_offset = cur->offset + cur->size;
+    if (cur->size < readahead_size_ || next_offset >= file_size_ ||
+        pos < cur->offset + cur->size / 2 || next->reading ||
+        (next->offset == next_offset && next->size > 0)) {
+      return;
+    }
+    next->offset = next_offset;
+    next->size = 0;
+    next->reading = true;
+    request_ = next;
+    // The thread lives as long as the file, rather than being created for
+    // every chunk.
+    if (!reader_) {
+      reader_.reset(new port::Thread([this]() { BackgroundRead(); }));
+    }
+    cv_.SignalAll();
+  }
+
+  void BackgroundRead() const {
+    MutexLock l(&mutex_);
+    while (true) {
+      while (request_ == nullptr && !closing_) {
+        cv_.Wait();
+      }
+      if (closing_) {
+        if (request_ != nullptr) {
+          request_->reading = false;
+          request_ = nullptr;
+        }
+        break;
+      }
+      Chunk* chunk = request_;
+      request_ = nullptr;
+      mutex_.Unlock();
+      ReadChunk(chunk);
+      mutex_.Lock();
+      chunk->reading = false;
+      cv_.SignalAll();
+    }
+  }
+
+  // REQUIRES: mutex_ held
+  void FillChunk(Chunk* chunk, uint64_t offset) const {
+    WaitForChunk(chunk);
+    chunk->offset = offset;
+    ReadChunk(chunk);
+  }
+
+  void ReadChunk(Chunk* chunk) const {
+    Slice result;
+    char* scratch = chunk->buffer.BufferStart();
+    chunk->status = file_->Read(chunk->offset, readahead_size_, IOOptions(),
+                                &result, scratch, nullptr /*dbg*/);
+    if (chunk->status.ok() && result.data() != scratch) {
+      memcpy(scratch, result.data(), result.size());
+    }
+    chunk->size = chunk->status.ok() ? result.size() : 0;
+  }
+
+  // REQUIRES: mutex_ held
+  void WaitForChunk(Chunk* chunk) const {
+    while (chunk->reading) {
+      cv_.Wait();
+    }
+  }
+
+  std::unique_ptr<FSRandomAccessFile> file_;
+  const uint64_t file_size_;
+  const size_t alignment_;
+  const size_t readahead_size_;
+
+  mutable port::Mutex mutex_;
+  mutable port::CondVar cv_;
+  mutable Chunk chunks_[2];
+  // Index of the chunk the reads are at.
+  mutable size_t cur_{0};
+  // The chunk to be read by "reader_".
+  mutable Chunk* request_{nullptr};
+  mutable bool closing_{false};
+  mutable std::unique_ptr<port::Thread> reader_;
+};
+
+}  // namespace
+
+Status NewBlobFileStreamReader(
+    const std::string& file_name, uint64_t file_size, uint64_t readahead_size,
+    bool use_direct_io, const EnvOptions& env_options, Env* env,
+    std::unique_ptr<RandomAccessFileReader>* result) {
+  FileOptions file_options(env_options);
+  file_options.use_direct_reads |= use_direct_io;
+  std::unique_ptr<FSRandomAccessFile> file;
+  Status s = env->GetFileSystem()->NewRandomAccessFile(
+      file_name, file_options, &file, nullptr /*dbg*/);
+  if (!s.ok()) return s;
+
+  if (readahead_size > 0) {
+    file.reset(new BlobFileStreamFile(std::move(file), file_size,
+                                      static_cast<size_t>(readahead_size)));
+  }
+  result->reset(new RandomAccessFileReader(
+      std::move(file), file_name, nullptr /*clock*/, nullptr /*io_tracer*/,
+      nullptr /*stats*/, 0 /*hist_type*/, nullptr /*file_read_hist*/,
+      env_options.rate_limiter));
+  return s;
+}
+
 const uint64_t kMaxReadaheadSize = 256 << 10;
+// Reads skipping no more than this from the last read are still
+// considered sequential by BlobFilePrefetcher.
+const uint64_t kMaxReadaheadGap = 16 << 10;
+
+// Records in MultiGet are fetched with a single read if the gap between
+// them is no more than this, since reading the gap is usually cheaper
+// than issuing another read.
+const uint64_t kMultiGetMaxMergeGap = 16 << 10;
+// The maximum size of a single coalesced read in MultiGet.
+const uint64_t kMultiGetMaxReadSize = 1 << 20;
 
 namespace {
 
+const size_t kMaxCachePrefixSize = kMaxVarint64Length * 3 + 1;
+
 void GenerateCachePrefix(std::string* dst, Cache* cc,
                          FSRandomAccessFile* file) {
-  char buffer[kMaxVarint64Length * 3 + 1];
+  char buffer[kMaxCachePrefixSize];
   auto size = file->GetUniqueId(buffer, sizeof(buffer));
   if (size == 0) {
     auto end = EncodeVarint64(buffer, cc->NewId());
@@ -55,9 +297,96 @@ void GenerateCachePrefix(std::string* dst, Cache* cc,
   dst->assign(buffer, size);
 }
 
-void EncodeBlobCache(std::string* dst, const Slice& prefix, uint64_t offset) {
-  dst->assign(prefix.data(), prefix.size());
-  PutVarint64(dst, offset);
+// Cache key of a blob record: the cache prefix of the file followed by
+// the fixed64 offset of the record. It lives on the stack so lookups
+// don't allocate.
+class BlobCacheKey {
+ public:
+  BlobCacheKey(const Slice& prefix, uint64_t offset)
+      : size_(prefix.size() + sizeof(uint64_t)) {
+    assert(prefix.size() <= kMaxCachePrefixSize);
+    memcpy(buffer_, prefix.data(), prefix.size());
+    EncodeFixed64(buffer_ + prefix.size(), offset);
+  }
+
+  Slice AsSlice() const { return Slice(buffer_, size_); }
+
+ private:
+  char buffer_[kMaxCachePrefixSize + sizeof(uint64_t)];
+  size_t size_;
+};
+
+// A blob cache entry is a single block: this header, followed by the key
+// and the value of a record, or by the whole block of a record in a
+// block. The key is left empty unless "store_key" is set.
+struct BlobCacheEntry {
+  Slice key;
+  // The value of the record, or the uncompressed block.
+  Slice value;
+};
+static_assert(std::is_trivially_destructible<BlobCacheEntry>::value,
+              "blob cache entries are freed as raw blocks");
+
+// Room left in front of the buffers records are read into, so that a
+// record decoded in place can become a blob cache entry without a copy.
+const size_t kBlobCacheEntryHeadroom = sizeof(BlobCacheEntry);
+
+// Turns the decoded record, or the block of a record in a block, in
+// "blob" into a new blob cache entry, and sets "*charge" to the memory
+// the entry takes. If the record was read uncompressed into a buffer with
+// headroom, the entry takes over the buffer, so that filling the cache
+// doesn't copy the value. Otherwise, and when the key is not stored, the
+// record is copied into a block of its own, which is charged exactly.
+BlobCacheEntry* NewBlobCacheEntry(const BlobHandle& handle,
+                                  const BlobRecord& record, OwnedSlice* blob,
+                                  bool store_key, size_t* charge) {
+  Slice key = store_key && !handle.in_block() ? record.key : Slice();
+  Slice value = handle.in_block() ? Slice(*blob) : record.value;
+  const char* start = blob->buffer();
+  char* buffer = nullptr;
+  size_t size = 0;
+  if (start != nullptr && (store_key || handle.in_block()) &&
+      blob->data() == start + kBlobCacheEntryHeadroom + kRecordHeaderSize) {
+    // The decoded data follows the record header and runs to the end of
+    // the buffer.
+    size = static_cast<size_t>(blob->data() + blob->size() - start);
+    buffer = blob->release();
+  } else {
+    size = sizeof(BlobCacheEntry) + key.size() + value.size();
+    buffer = new char[size];
+    char* data = buffer + sizeof(BlobCacheEntry);
+    memcpy(data, key.data(), key.size());
+    memcpy(data + key.size(), value.data(), value.size());
+    key = Slice(data, key.size());
+    value = Slice(data + key.size(), value.size());
+  }
+#ifdef ROCKSDB_MALLOC_USABLE_SIZE
+  *charge = malloc_usable_size(buffer);
+#else
+  *charge = size;
+#endif
+  return new (buffer) BlobCacheEntry{key, value};
+}
+
+// Decodes the record pointed by "handle" from the blob cache entry.
+Status DecodeCacheEntry(const BlobHandle& handle, const void* value,
+                        BlobRecord* record) {
+  auto entry = reinterpret_cast<const BlobCacheEntry*>(value);
+  if (handle.in_block()) {
+    return DecodeBlockRecord(entry->value, handle.record_offset, record);
+  }
+  record->key = entry->key;
+  record->value = entry->value;
+  return Status::OK();
+}
+
+void DeleteBlobCacheEntry(const Slice& /*key*/, void* value) {
+  delete[] reinterpret_cast<char*>(value);
+}
+
+// Entries of the compressed blob cache are raw records copied as they are.
+void DeleteCompressedCacheEntry(const Slice& /*key*/, void* value) {
+  delete[] reinterpret_cast<char*>(value);
 }
 
 // Seek to the specified meta block.
@@ -87,8 +416,10 @@ Status BlobFileReader::Open(const TitanCFOptions& options,
                             std::unique_ptr<RandomAccessFileReader> file,
                             uint64_t file_size,
                             std::unique_ptr<BlobFileReader>* result,
-                            TitanStats* stats) {
-  if (file_size < BlobFileFooter::kEncodedLength) {
+                            TitanStats* stats,
+                            BlobPersistentCache* persistent_cache,
+                            uint64_t file_number) {
+  if (file_size != 0 && file_size < BlobFileFooter::kEncodedLength) {
     return Status::Corruption("file is too short to be a blob file");
   }
 
@@ -98,6 +429,20 @@ Status BlobFileReader::Open(const TitanCFOptions& options,
     return s;
   }
 
+  if (file_size == 0) {
+    // Records of an active write-time blob file can be read as soon as
+    // they are appended. Such files never have a compression dictionary,
+    // so the reader is still valid after the file is sealed.
+    if (header.flags & BlobFileHeader::kHasUncompressionDictionary) {
+      return Status::Corruption("active blob file has a dictionary");
+    }
+    auto reader = new BlobFileReader(options, std::move(file), stats);
+    reader->persistent_cache_ = persistent_cache;
+    reader->file_number_ = file_number;
+    result->reset(reader);
+    return Status::OK();
+  }
+
   FixedSlice<BlobFileFooter::kEncodedLength> buffer;
   s = file->Read(IOOptions(), file_size - BlobFileFooter::kEncodedLength,
                  BlobFileFooter::kEncodedLength, &buffer, buffer.get(),
@@ -114,6 +459,8 @@ Status BlobFileReader::Open(const TitanCFOptions& options,
 
   auto reader = new BlobFileReader(options, std::move(file), stats);
   reader->footer_ = footer;
+  reader->persistent_cache_ = persistent_cache;
+  reader->file_number_ = file_number;
   if (header.flags & BlobFileHeader::kHasUncompressionDictionary) {
     s = InitUncompressionDict(footer, reader->file_.get(),
                               &reader->uncompression_dict_);
@@ -143,10 +490,17 @@ BlobFileReader::BlobFileReader(const TitanCFOptions& options,
     : options_(options),
       file_(std::move(file)),
       cache_(options.blob_cache),
+      compressed_cache_(options.blob_cache_compressed),
       stats_(stats) {
+  // Each tier takes its prefix from its own cache, so that readers sharing
+  // one of the caches never collide in it.
   if (cache_) {
     GenerateCachePrefix(&cache_prefix_, cache_.get(), file_->file());
   }
+  if (compressed_cache_) {
+    GenerateCachePrefix(&compressed_cache_prefix_, compressed_cache_.get(),
+                        file_->file());
+  }
 }
 
 Status BlobFileReader::Get(const ReadOptions& /*options*/,
@@ -154,46 +508,305 @@ Status BlobFileReader::Get(const ReadOptions& /*options*/,
                            PinnableSlice* buffer) {
   TEST_SYNC_POINT("BlobFileReader::Get");
 
-  std::string cache_key;
-  Cache::Handle* cache_handle = nullptr;
-  if (cache_) {
-    EncodeBlobCache(&cache_key, cache_prefix_, handle.offset);
-    cache_handle = cache_->Lookup(cache_key);
-    if (cache_handle) {
-      RecordTick(statistics(stats_), TITAN_BLOB_CACHE_HIT);
-      auto blob = reinterpret_cast<OwnedSlice*>(cache_->Value(cache_handle));
-      buffer->PinSlice(*blob, UnrefCacheHandle, cache_.get(), cache_handle);
-      return DecodeInto(*blob, record);
-    }
+  Status s;
+  if (LookupCache(handle, record, buffer, &s)) {
+    return s;
   }
   RecordTick(statistics(stats_), TITAN_BLOB_CACHE_MISS);
 
   OwnedSlice blob;
-  Status s = ReadRecord(handle, record, &blob);
+  if (!LookupCompressedCache(handle, record, &blob, &s) &&
+      !LookupPersistentCache(handle, record, &blob)) {
+    s = ReadRecord(handle, record, &blob);
+  }
   if (!s.ok()) {
     return s;
   }
+  PinRecord(handle, &blob, record, buffer);
+  return Status::OK();
+}
+
+void BlobFileReader::MultiGet(const ReadOptions& /*options*/,
+                              const std::vector<BlobHandle>& handles,
+                              BlobRecord* records, PinnableSlice* buffers,
+                              Status* statuses) {
+  TEST_SYNC_POINT("BlobFileReader::MultiGet");
+
+  // Serves what we can from the blob cache first.
+  std::vector<size_t> to_read;
+  for (size_t i = 0; i < handles.size(); i++) {
+    assert(i == 0 || handles[i - 1].offset <= handles[i].offset);
+    if (LookupCache(handles[i], &records[i], &buffers[i], &statuses[i])) {
+      continue;
+    }
+    RecordTick(statistics(stats_), TITAN_BLOB_CACHE_MISS);
+    OwnedSlice blob;
+    if (LookupCompressedCache(handles[i], &records[i], &blob, &statuses[i])) {
+      if (statuses[i].ok()) {
+        PinRecord(handles[i], &blob, &records[i], &buffers[i]);
+      }
+      continue;
+    }
+    if (LookupPersistentCache(handles[i], &records[i], &blob)) {
+      statuses[i] = Status::OK();
+      PinRecord(handles[i], &blob, &records[i], &buffers[i]);
+      continue;
+    }
+    to_read.push_back(i);
+  }
+
+  // Coalesces the missed records close to each other into one request.
+  // "to_read[ranges[k]...ranges[k + 1])" are served by "reqs[k]".
+  std::vector<size_t> ranges;
+  std::vector<FSReadRequest> reqs;
+  std::vector<CacheAllocationPtr> scratches;
+  size_t start = 0;
+  while (start < to_read.size()) {
+    const BlobHandle& first = handles[to_read[start]];
+    uint64_t read_end = first.offset + first.size;
+    size_t end = start + 1;
+    for (; end < to_read.size(); end++) {
+      const BlobHandle& next = handles[to_read[end]];
+      uint64_t next_end = next.offset + next.size;
+      if (next.offset > read_end + kMultiGetMaxMergeGap ||
+          std::max(read_end, next_end) - first.offset > kMultiGetMaxReadSize) {
+        break;
+      }
+      read_end = std::max(read_end, next_end);
+    }
+    FSReadRequest req;
+    req.offset = first.offset;
+    req.len = read_end - first.offset;
+    scratches.emplace_back(new char[kBlobCacheEntryHeadroom + req.len]);
+    req.scratch = scratches.back().get() + kBlobCacheEntryHeadroom;
+    reqs.push_back(req);
+    ranges.push_back(start);
+    start = end;
+  }
+  ranges.push_back(to_read.size());
+  if (reqs.empty()) {
+    return;
+  }
+
+  // Issues all requests at once, so that the file system can serve them
+  // in parallel.
+  AlignedBuf aligned_buf;
+  Status io_s = file_->MultiRead(IOOptions(), reqs.data(), reqs.size(),
+                                 &aligned_buf);
+  for (size_t k = 0; k < reqs.size(); k++) {
+    const FSReadRequest& req = reqs[k];
+    Status s = io_s.ok() ? Status(req.status) : io_s;
+    if (s.ok() && req.result.size() != req.len) {
+      s = Status::Corruption("MultiGet actual size: " +
+                             ToString(req.result.size()) +
+                             " not equal to read size " + ToString(req.len));
+    }
+    // The block pinned for the last record, which is decoded only once
+    // for all its records.
+    const BlobHandle* block_handle = nullptr;
+    Slice block;
+    for (size_t j = ranges[k]; j < ranges[k + 1]; j++) {
+      size_t i = to_read[j];
+      if (!s.ok()) {
+        statuses[i] = s;
+        continue;
+      }
+      const BlobHandle& handle = handles[i];
+      if (handle.in_block() && block_handle != nullptr &&
+          block_handle->offset == handle.offset) {
+        statuses[i] = PinBlockRecord(handle, block, &records[i], &buffers[i]);
+        continue;
+      }
+      block_handle = nullptr;
+      CacheAllocationPtr ubuf;
+      if (ranges[k + 1] - ranges[k] == 1 && req.result.data() == req.scratch) {
+        ubuf = std::move(scratches[k]);
+      } else {
+        // Each record owns a copy of its bytes so that it can be cached
+        // and released independently of the other records.
+        ubuf.reset(new char[kBlobCacheEntryHeadroom + handle.size]);
+        memcpy(ubuf.get() + kBlobCacheEntryHeadroom,
+               req.result.data() + (handle.offset - req.offset), handle.size);
+      }
+      Slice raw(ubuf.get() + kBlobCacheEntryHeadroom, handle.size);
+      MaybeInsertCompressedCache(handle.offset, raw);
+      MaybeInsertPersistentCache(handle.offset, raw);
+      OwnedSlice blob;
+      statuses[i] =
+          DecodeRecord(handle, std::move(ubuf), raw, &records[i], &blob);
+      if (statuses[i].ok()) {
+        PinRecord(handle, &blob, &records[i], &buffers[i], &block);
+        if (handle.in_block()) {
+          block_handle = &handle;
+        }
+      }
+    }
+  }
+}
+
+bool BlobFileReader::LookupCache(const BlobHandle& handle, BlobRecord* record,
+                                 PinnableSlice* buffer, Status* s) {
+  if (!cache_) {
+    return false;
+  }
+  BlobCacheKey cache_key(cache_prefix_, handle.offset);
+  auto cache_handle = cache_->Lookup(cache_key.AsSlice());
+  if (!cache_handle) {
+    return false;
+  }
+  RecordTick(statistics(stats_), TITAN_BLOB_CACHE_HIT);
+  *s = DecodeCacheEntry(handle, cache_->Value(cache_handle), record);
+  if (!s->ok()) {
+    cache_->Release(cache_handle);
+    return true;
+  }
+  buffer->PinSlice(record->value, UnrefCacheHandle, cache_.get(),
+                   cache_handle);
+  return true;
+}
+
+bool BlobFileReader::LookupCompressedCache(const BlobHandle& handle,
+                                           BlobRecord* record,
+                                           OwnedSlice* blob, Status* s) {
+  if (!compressed_cache_) {
+    return false;
+  }
+  BlobCacheKey cache_key(compressed_cache_prefix_, handle.offset);
+  auto cache_handle = compressed_cache_->Lookup(cache_key.AsSlice());
+  if (!cache_handle) {
+    RecordTick(statistics(stats_), TITAN_BLOB_CACHE_COMPRESSED_MISS);
+    return false;
+  }
+  RecordTick(statistics(stats_), TITAN_BLOB_CACHE_COMPRESSED_HIT);
+  // Only compressed records are cached here, so decoding always
+  // uncompresses into "blob" and the entry can be released right away.
+  auto entry =
+      reinterpret_cast<const char*>(compressed_cache_->Value(cache_handle));
+  Slice raw(entry, kRecordHeaderSize + DecodeFixed32(entry + 4));
+  *s = DecodeRecord(handle, CacheAllocationPtr(), raw, record, blob);
+  compressed_cache_->Release(cache_handle);
+  return true;
+}
+
+void BlobFileReader::MaybeInsertCompressedCache(uint64_t offset,
+                                                const Slice& raw) {
+  if (!compressed_cache_ || raw.size() < kRecordHeaderSize ||
+      static_cast<CompressionType>(raw[kRecordHeaderSize - 1]) ==
+          kNoCompression) {
+    return;
+  }
+  BlobCacheKey cache_key(compressed_cache_prefix_, offset);
+  char* entry = new char[raw.size()];
+  memcpy(entry, raw.data(), raw.size());
+  // The cache takes the entry even if it fails to insert it.
+  compressed_cache_->Insert(cache_key.AsSlice(), entry, raw.size(),
+                            &DeleteCompressedCacheEntry);
+}
+
+bool BlobFileReader::LookupPersistentCache(const BlobHandle& handle,
+                                           BlobRecord* record,
+                                           OwnedSlice* blob) {
+  if (!persistent_cache_) {
+    return false;
+  }
+  CacheAllocationPtr ubuf;
+  Status s = persistent_cache_->Lookup(file_number_, handle.offset,
+                                       handle.size, &ubuf);
+  if (s.ok()) {
+    Slice raw(ubuf.get(), handle.size);
+    // A record failing to decode, e.g. a torn write of the cache, is
+    // read from the blob file instead.
+    s = DecodeRecord(handle, std::move(ubuf), raw, record, blob);
+  }
+  if (!s.ok()) {
+    RecordTick(statistics(stats_), TITAN_BLOB_CACHE_PERSISTENT_MISS);
+    return false;
+  }
+  RecordTick(statistics(stats_), TITAN_BLOB_CACHE_PERSISTENT_HIT);
+  return true;
+}
 
+void BlobFileReader::MaybeInsertPersistentCache(uint64_t offset,
+                                                const Slice& raw) {
+  if (persistent_cache_) {
+    persistent_cache_->Insert(file_number_, offset, raw);
+  }
+}
+
+void BlobFileReader::PinRecord(const BlobHandle& handle, OwnedSlice* blob,
+                               BlobRecord* record, PinnableSlice* buffer,
+                               Slice* block) {
   if (cache_) {
-    auto cache_value = new OwnedSlice(std::move(blob));
-    auto cache_size = cache_value->size() + sizeof(*cache_value);
-    cache_->Insert(cache_key, cache_value, cache_size,
-                   &DeleteCacheValue<OwnedSlice>, &cache_handle);
-    buffer->PinSlice(*cache_value, UnrefCacheHandle, cache_.get(),
-                     cache_handle);
-  } else {
-    buffer->PinSlice(blob, OwnedSlice::CleanupFunc, blob.release(), nullptr);
+    BlobCacheKey cache_key(cache_prefix_, handle.offset);
+    size_t charge = 0;
+    BlobCacheEntry* entry = NewBlobCacheEntry(
+        handle, *record, blob, options_.blob_cache_store_key, &charge);
+    // The entry holds the record decoded fine already.
+    DecodeCacheEntry(handle, entry, record).PermitUncheckedError();
+    if (block != nullptr && handle.in_block()) {
+      *block = entry->value;
+    }
+    Cache::Handle* cache_handle = nullptr;
+    Status s = cache_->Insert(cache_key.AsSlice(), entry, charge,
+                              &DeleteBlobCacheEntry, &cache_handle);
+    if (s.ok()) {
+      buffer->PinSlice(record->value, UnrefCacheHandle, cache_.get(),
+                       cache_handle);
+      return;
+    }
+    // The cache is full and strict, keeps using the entry.
+    buffer->PinSlice(record->value, OwnedSlice::CleanupFunc, entry, nullptr);
+    return;
+  }
+  if (block != nullptr && handle.in_block()) {
+    *block = *blob;
   }
+  buffer->PinSlice(*blob, OwnedSlice::CleanupFunc, blob->release(), nullptr);
+}
 
-  return Status::OK();
+Status BlobFileReader::PinBlockRecord(const BlobHandle& handle,
+                                      const Slice& block, BlobRecord* record,
+                                      PinnableSlice* buffer) {
+  assert(handle.in_block());
+  if (cache_) {
+    // The block was just inserted into the blob cache, pins it again.
+    BlobCacheKey cache_key(cache_prefix_, handle.offset);
+    auto cache_handle = cache_->Lookup(cache_key.AsSlice());
+    if (cache_handle) {
+      Status s = DecodeCacheEntry(handle, cache_->Value(cache_handle), record);
+      if (!s.ok()) {
+        cache_->Release(cache_handle);
+        return s;
+      }
+      buffer->PinSlice(record->value, UnrefCacheHandle, cache_.get(),
+                       cache_handle);
+      return s;
+    }
+  }
+  // The block is only pinned by the buffer of another record, so the
+  // record gets a copy of its own.
+  Status s = DecodeBlockRecord(block, handle.record_offset, record);
+  if (!s.ok()) {
+    return s;
+  }
+  size_t size = record->key.size() + record->value.size();
+  char* data = new char[size];
+  memcpy(data, record->key.data(), record->key.size());
+  memcpy(data + record->key.size(), record->value.data(),
+         record->value.size());
+  record->key = Slice(data, record->key.size());
+  record->value = Slice(data + record->key.size(), record->value.size());
+  buffer->PinSlice(record->value, OwnedSlice::CleanupFunc, data, nullptr);
+  return s;
 }
 
 Status BlobFileReader::ReadRecord(const BlobHandle& handle, BlobRecord* record,
                                   OwnedSlice* buffer) {
   Slice blob;
-  CacheAllocationPtr ubuf(new char[handle.size]);
+  CacheAllocationPtr ubuf(new char[kBlobCacheEntryHeadroom + handle.size]);
   Status s = file_->Read(IOOptions(), handle.offset, handle.size, &blob,
-                         ubuf.get(), nullptr /*aligned_buf*/);
+                         ubuf.get() + kBlobCacheEntryHeadroom,
+                         nullptr /*aligned_buf*/);
   if (!s.ok()) {
     return s;
   }
@@ -202,49 +815,92 @@ Status BlobFileReader::ReadRecord(const BlobHandle& handle, BlobRecord* record,
         "ReadRecord actual size: " + ToString(blob.size()) +
         " not equal to blob size " + ToString(handle.size));
   }
+  MaybeInsertCompressedCache(handle.offset, blob);
+  MaybeInsertPersistentCache(handle.offset, blob);
+  return DecodeRecord(handle, std::move(ubuf), blob, record, buffer);
+}
 
+Status BlobFileReader::DecodeRecord(const BlobHandle& handle,
+                                    CacheAllocationPtr ubuf, Slice blob,
+                                    BlobRecord* record, OwnedSlice* buffer) {
   BlobDecoder decoder(uncompression_dict_ == nullptr
                           ? &UncompressionDict::GetEmptyDict()
                           : uncompression_dict_.get());
-  s = decoder.DecodeHeader(&blob);
+  Status s = decoder.DecodeHeader(&blob);
   if (!s.ok()) {
     return s;
   }
   buffer->reset(std::move(ubuf), blob);
-  s = decoder.DecodeRecord(&blob, record, buffer);
-  return s;
+  if (!handle.in_block()) {
+    return decoder.DecodeRecord(&blob, record, buffer);
+  }
+  // The whole block is left in "buffer", so that it can be cached.
+  Slice block;
+  s = decoder.DecodeContents(&blob, &block, buffer);
+  if (!s.ok()) {
+    return s;
+  }
+  if (block.size() != buffer->size()) {
+    return Status::Corruption("BlobRecord", "block size mismatch");
+  }
+  return DecodeBlockRecord(block, handle.record_offset, record);
 }
 
 Status BlobFilePrefetcher::Get(const ReadOptions& options,
                                const BlobHandle& handle, BlobRecord* record,
                                PinnableSlice* buffer) {
-  if (handle.offset == last_offset_) {
-    last_offset_ = handle.offset + handle.size;
-    if (handle.offset + handle.size > readahead_limit_) {
+  uint64_t end = handle.offset + handle.size;
+  if (handle.in_block() && end == last_offset_) {
+    // Another record of the block read last time.
+    return reader_->Get(options, handle, record, buffer);
+  }
+  if (handle.offset >= readahead_start_ && end <= readahead_limit_) {
+    RecordTick(statistics(reader_->stats_), TITAN_BLOB_PREFETCH_HIT);
+  }
+
+  bool fixed_size = options.readahead_size > 0 && !options.adaptive_readahead;
+  if (handle.offset >= last_offset_ &&
+      handle.offset - last_offset_ <= kMaxReadaheadGap) {
+    if (end > readahead_limit_) {
+      uint64_t max_size = options.readahead_size > 0 ? options.readahead_size
+                                                     : kMaxReadaheadSize;
+      if (fixed_size) {
+        readahead_size_ = max_size;
+      }
       readahead_size_ = std::max(handle.size, readahead_size_);
       reader_->file_->Prefetch(handle.offset, readahead_size_);
+      RecordTick(statistics(reader_->stats_), TITAN_BLOB_PREFETCH_BYTES,
+                 readahead_size_);
+      readahead_start_ = handle.offset;
       readahead_limit_ = handle.offset + readahead_size_;
-      readahead_size_ = std::min(kMaxReadaheadSize, readahead_size_ * 2);
+      readahead_size_ = std::min(max_size, readahead_size_ * 2);
     }
   } else {
-    last_offset_ = handle.offset + handle.size;
-    readahead_size_ = 0;
+    RecordWaste();
+    readahead_size_ = options.adaptive_readahead ? readahead_size_ / 2 : 0;
+    readahead_start_ = 0;
     readahead_limit_ = 0;
   }
+  last_offset_ = end;
 
   return reader_->Get(options, handle, record, buffer);
 }
 
-Status InitUncompressionDict(
-    const BlobFileFooter& footer, RandomAccessFileReader* file,
-    std::unique_ptr<UncompressionDict>* uncompression_dict) {
-  // TODO: Cache the compression dictionary in either block cache or blob cache.
-#if ZSTD_VERSION_NUMBER < 10103
-  return Status::NotSupported("the version of libztsd is too low");
-#endif
-  // 1. read meta index block
-  // 2. read dictionary
-  // 3. reset the dictionary
+void BlobFilePrefetcher::RecordWaste() {
+  if (readahead_limit_ > last_offset_) {
+    RecordTick(statistics(reader_->stats_), TITAN_BLOB_PREFETCH_WASTE_BYTES,
+               readahead_limit_ - last_offset_);
+  }
+}
+
+namespace {
+
+// Reads the meta index block of the file with "footer", and sets "*handle"
+// to the handle of the meta block "name" if it is found.
+Status ReadMetaBlockHandle(const BlobFileFooter& footer,
+                           RandomAccessFileReader* file,
+                           const std::string& name, bool* is_found,
+                           BlockHandle* handle) {
   assert(footer.meta_index_handle.size() > 0);
   BlockHandle meta_index_handle = footer.meta_index_handle;
   Slice blob;
@@ -263,10 +919,25 @@ Status InitUncompressionDict(
   std::unique_ptr<InternalIterator> meta_iter(meta->NewDataIterator(
       BytewiseComparator(), kDisableGlobalSequenceNumber));
 
+  return SeekToMetaBlock(meta_iter.get(), name, is_found, handle);
+}
+
+}  // namespace
+
+Status InitUncompressionDict(
+    const BlobFileFooter& footer, RandomAccessFileReader* file,
+    std::unique_ptr<UncompressionDict>* uncompression_dict) {
+  // TODO: Cache the compression dictionary in either block cache or blob cache.
+#if ZSTD_VERSION_NUMBER < 10103
+  return Status::NotSupported("the version of libztsd is too low");
+#endif
+  // 1. read meta index block
+  // 2. read dictionary
+  // 3. reset the dictionary
   bool dict_is_found = false;
   BlockHandle dict_block;
-  s = SeekToMetaBlock(meta_iter.get(), kCompressionDictBlockName,
-                      &dict_is_found, &dict_block);
+  Status s = ReadMetaBlockHandle(footer, file, kCompressionDictBlockName,
+                                 &dict_is_found, &dict_block);
   if (!s.ok()) {
     return s;
   }
@@ -289,5 +960,96 @@ Status InitUncompressionDict(
   return s;
 }
 
+Status BlobRecordIndex::Open(const BlobFileHeader& header,
+                             const BlobFileFooter& footer,
+                             RandomAccessFileReader* file,
+                             const Comparator* comparator,
+                             std::unique_ptr<BlobRecordIndex>* result) {
+  assert(header.flags & BlobFileHeader::kHasRecordIndex);
+  bool index_is_found = false;
+  BlockHandle index_block;
+  Status s = ReadMetaBlockHandle(footer, file, kRecordIndexBlockName,
+                                 &index_is_found, &index_block);
+  if (!s.ok()) {
+    return s;
+  }
+  if (!index_is_found) {
+    return Status::Corruption("record index missing");
+  }
+
+  // The index is read with its trailer, to verify the checksum.
+  size_t size = static_cast<size_t>(index_block.size());
+  size_t size_with_trailer = size + BlockBasedTable::kBlockTrailerSize;
+  CacheAllocationPtr buf(new char[size_with_trailer]);
+  Slice contents;
+  s = file->Read(IOOptions(), index_block.offset(), size_with_trailer,
+                 &contents, buf.get(), nullptr /*aligned_buf*/);
+  if (!s.ok()) {
+    return s;
+  }
+  if (contents.size() != size_with_trailer) {
+    return Status::Corruption("record index truncated");
+  }
+  if (contents.data() != buf.get()) {
+    memcpy(buf.get(), contents.data(), size_with_trailer);
+  }
+  const char* trailer = buf.get() + size;
+  uint32_t crc = crc32c::Extend(crc32c::Value(buf.get(), size), trailer, 1);
+  if (crc32c::Unmask(DecodeFixed32(trailer + 1)) != crc) {
+    return Status::Corruption("record index checksum mismatch");
+  }
+
+  BlockContents index_content(std::move(buf), size);
+  std::unique_ptr<Block> block(
+      new Block(std::move(index_content), kDisableGlobalSequenceNumber));
+  result->reset(new BlobRecordIndex(std::move(block), comparator,
+                                    header.blocked(), size_with_trailer));
+  return Status::OK();
+}
+
+std::unique_ptr<BlobRecordIndex::Iterator> BlobRecordIndex::NewIterator()
+    const {
+  return std::unique_ptr<Iterator>(new Iterator(
+      block_->NewDataIterator(comparator_, kDisableGlobalSequenceNumber),
+      blocked_));
+}
+
+void BlobRecordIndex::Iterator::SeekToFirst() {
+  iter_->SeekToFirst();
+  Decode();
+}
+
+void BlobRecordIndex::Iterator::Seek(const Slice& key) {
+  InternalKey target(key, kMaxSequenceNumber, kValueTypeForSeek);
+  iter_->Seek(target.Encode());
+  Decode();
+}
+
+void BlobRecordIndex::Iterator::Next() {
+  assert(valid_);
+  iter_->Next();
+  Decode();
+}
+
+void BlobRecordIndex::Iterator::Decode() {
+  valid_ = false;
+  if (!iter_->Valid()) {
+    status_ = iter_->status();
+    return;
+  }
+  ParsedInternalKey ikey;
+  status_ = ParseInternalKey(iter_->key(), &ikey, false /*log_err_key*/);
+  if (!status_.ok()) {
+    return;
+  }
+  key_ = ikey.user_key;
+  Slice value = iter_->value();
+  status_ = handle_.DecodeFrom(&value, blocked_);
+  if (!status_.ok()) {
+    return;
+  }
+  valid_ = true;
+}
+
 }  // namespace titandb
 }  // namespace rocksdb
@@ -1,8 +1,11 @@
 #pragma once
 
 #include "file/random_access_file_reader.h"
+#include "table/block_based/block.h"
+#include "table/internal_iterator.h"
 
 #include "blob_format.h"
+#include "blob_persistent_cache.h"
 #include "titan/options.h"
 #include "titan_stats.h"
 
@@ -14,22 +17,50 @@ Status NewBlobFileReader(uint64_t file_number, uint64_t readahead_size,
                          const EnvOptions& env_options, Env* env,
                          std::unique_ptr<RandomAccessFileReader>* result);
 
+// Opens "file_name" for a sequential scan over the whole file, e.g. by GC.
+// If "readahead_size" is non-zero, reads are served from chunks of that
+// size, and the next chunk is read in the background while the current
+// one is consumed. If "use_direct_io" is true, the file is read with
+// direct I/O, bypassing the page cache.
+Status NewBlobFileStreamReader(
+    const std::string& file_name, uint64_t file_size, uint64_t readahead_size,
+    bool use_direct_io, const EnvOptions& env_options, Env* env,
+    std::unique_ptr<RandomAccessFileReader>* result);
+
 class BlobFileReader {
  public:
   // Opens a blob file and read the necessary metadata from it.
   // If successful, sets "*result" to the newly opened file reader.
+  // If "persistent_cache" is not null, records of the file are cached
+  // in it under "file_number". A "file_size" of zero opens an active
+  // write-time blob file, which has no footer yet.
   static Status Open(const TitanCFOptions& options,
                      std::unique_ptr<RandomAccessFileReader> file,
                      uint64_t file_size,
                      std::unique_ptr<BlobFileReader>* result,
-                     TitanStats* stats);
+                     TitanStats* stats,
+                     BlobPersistentCache* persistent_cache = nullptr,
+                     uint64_t file_number = 0);
 
   // Gets the blob record pointed by the handle in this file. The data
   // of the record is stored in the provided buffer, so the buffer
-  // must be valid when the record is used.
+  // must be valid when the record is used. A record in a block of a
+  // blocked file is read by uncompressing the whole block, which is
+  // cached in the blob cache as a single entry.
   Status Get(const ReadOptions& options, const BlobHandle& handle,
              BlobRecord* record, PinnableSlice* buffer);
 
+  // Gets the blob records pointed by the handles in this file. Records
+  // close to each other are coalesced into one request, and all requests
+  // are issued together via MultiRead. "records",
+  // "buffers" and "statuses" must have the same length as "handles",
+  // and each record is valid as long as its buffer is valid.
+  //
+  // REQUIRES: "handles" are sorted by offset.
+  void MultiGet(const ReadOptions& options,
+                const std::vector<BlobHandle>& handles, BlobRecord* records,
+                PinnableSlice* buffers, Status* statuses);
+
  private:
   friend class BlobFilePrefetcher;
 
@@ -39,6 +70,43 @@ class BlobFileReader {
 
   Status ReadRecord(const BlobHandle& handle, BlobRecord* record,
                     OwnedSlice* buffer);
+  // Decodes the record pointed by "handle" from the raw record or block
+  // "blob" owned by "ubuf". The uncompressed block of a record in a block
+  // is left in "*buffer".
+  Status DecodeRecord(const BlobHandle& handle, CacheAllocationPtr ubuf,
+                      Slice blob, BlobRecord* record, OwnedSlice* buffer);
+  // Looks up the record pointed by "handle" in the blob cache. If it is
+  // found, pins it into "buffer", sets "*s" to the decoding status and
+  // returns true.
+  bool LookupCache(const BlobHandle& handle, BlobRecord* record,
+                   PinnableSlice* buffer, Status* s);
+  // Looks up the record pointed by "handle" in the compressed blob cache.
+  // If it is found, decodes it into "*record" backed by "blob", sets "*s"
+  // to the decoding status and returns true.
+  bool LookupCompressedCache(const BlobHandle& handle, BlobRecord* record,
+                             OwnedSlice* blob, Status* s);
+  // Inserts a copy of the raw record "raw" at "offset" into the
+  // compressed blob cache if the record is compressed.
+  void MaybeInsertCompressedCache(uint64_t offset, const Slice& raw);
+  // Looks up the record pointed by "handle" in the persistent blob
+  // cache. If it is found and decodes fine, sets "*record" backed by
+  // "blob" and returns true.
+  bool LookupPersistentCache(const BlobHandle& handle, BlobRecord* record,
+                             OwnedSlice* blob);
+  // Inserts the raw record "raw" at "offset" into the persistent blob
+  // cache, if there is one.
+  void MaybeInsertPersistentCache(uint64_t offset, const Slice& raw);
+  // Pins the decoded record pointed by "handle" into "buffer". If the blob
+  // cache is enabled, "blob", holding the record or the block of a record
+  // in a block, is moved into a cache entry without copying, otherwise
+  // "buffer" takes over "blob". If "block" is not null, it is set to the
+  // block pinned for a record in a block.
+  void PinRecord(const BlobHandle& handle, OwnedSlice* blob, BlobRecord* record,
+                 PinnableSlice* buffer, Slice* block = nullptr);
+  // Pins the record pointed by "handle" in "block", which was just read
+  // and pinned for another record of the block, into "buffer".
+  Status PinBlockRecord(const BlobHandle& handle, const Slice& block,
+                        BlobRecord* record, PinnableSlice* buffer);
   static Status ReadHeader(std::unique_ptr<RandomAccessFileReader>& file,
                            BlobFileHeader* header);
 
@@ -46,7 +114,11 @@ class BlobFileReader {
   std::unique_ptr<RandomAccessFileReader> file_;
 
   std::shared_ptr<Cache> cache_;
+  std::shared_ptr<Cache> compressed_cache_;
   std::string cache_prefix_;
+  std::string compressed_cache_prefix_;
+  BlobPersistentCache* persistent_cache_{nullptr};
+  uint64_t file_number_{0};
 
   // Information read from the file.
   BlobFileFooter footer_;
@@ -56,23 +128,97 @@ class BlobFileReader {
   TitanStats* stats_;
 };
 
-// Performs readahead on continuous reads.
+// Performs readahead on nearly sequential reads of a blob file. Reads
+// skipping small gaps, e.g. records overwritten by newer versions, still
+// count as sequential.
+//
+// The readahead size doubles on every prefetch, from the record size up
+// to "ReadOptions::readahead_size", or kMaxReadaheadSize if it is not
+// set. A non-zero "readahead_size" without "adaptive_readahead" fixes
+// the readahead size instead. On a random read, the readahead size is
+// reset, or halved if "adaptive_readahead" is set.
 class BlobFilePrefetcher : public Cleanable {
  public:
   // Constructs a prefetcher with the blob file reader.
   // "*reader" must be valid when the prefetcher is used.
   BlobFilePrefetcher(BlobFileReader* reader) : reader_(reader) {}
 
+  ~BlobFilePrefetcher() { RecordWaste(); }
+
   Status Get(const ReadOptions& options, const BlobHandle& handle,
              BlobRecord* record, PinnableSlice* buffer);
 
  private:
+  // Records the prefetched bytes beyond the last read as wasted.
+  void RecordWaste();
+
   BlobFileReader* reader_;
   uint64_t last_offset_{0};
   uint64_t readahead_size_{0};
+  uint64_t readahead_start_{0};
   uint64_t readahead_limit_{0};
 };
 
+// The record index of a blob file, see TitanCFOptions::blob_file_record_index.
+// It maps the keys of the records to their handles, so that records can be
+// located without reading the file.
+class BlobRecordIndex {
+ public:
+  // Iterates the records of the file, in key order, which is also the
+  // order of the records in the file.
+  class Iterator {
+   public:
+    bool Valid() const { return valid_; }
+    void SeekToFirst();
+    // Seeks to the first record with a key not less than "key".
+    void Seek(const Slice& key);
+    void Next();
+    Slice key() const { return key_; }
+    const BlobHandle& handle() const { return handle_; }
+    Status status() const { return status_; }
+
+   private:
+    friend class BlobRecordIndex;
+
+    Iterator(InternalIterator* iter, bool blocked)
+        : iter_(iter), blocked_(blocked) {}
+
+    // Decodes the entry the underlying iterator is at.
+    void Decode();
+
+    std::unique_ptr<InternalIterator> iter_;
+    const bool blocked_;
+    bool valid_{false};
+    Slice key_;
+    BlobHandle handle_;
+    Status status_;
+  };
+
+  // Reads the record index of the file with "header" and "footer". The
+  // keys of the file are ordered by "comparator".
+  static Status Open(const BlobFileHeader& header, const BlobFileFooter& footer,
+                     RandomAccessFileReader* file, const Comparator* comparator,
+                     std::unique_ptr<BlobRecordIndex>* result);
+
+  std::unique_ptr<Iterator> NewIterator() const;
+
+  // Bytes the index takes up in the file.
+  uint64_t size() const { return size_; }
+
+ private:
+  BlobRecordIndex(std::unique_ptr<Block>&& block, const Comparator* comparator,
+                  bool blocked, uint64_t size)
+      : block_(std::move(block)),
+        comparator_(comparator),
+        blocked_(blocked),
+        size_(size) {}
+
+  std::unique_ptr<Block> block_;
+  const Comparator* comparator_;
+  const bool blocked_;
+  const uint64_t size_;
+};
+
 // Init uncompression dictionary
 // called by BlobFileReader and BlobFileIterator when blob file has
 // uncompression dictionary
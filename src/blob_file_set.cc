@@ -2,6 +2,7 @@
 
 #include <cinttypes>
 
+#include "active_blob_file.h"
 #include "edit_collector.h"
 #include "titan_logging.h"
 
@@ -18,7 +19,8 @@ BlobFileSet::BlobFileSet(const TitanDBOptions& options, TitanStats* stats,
       db_options_(options),
       stats_(stats),
       mutex_(mutex),
-      initialized_(initialized) {
+      initialized_(initialized),
+      published_storages_(std::make_shared<StorageMap>()) {
   auto file_cache_size = db_options_.max_open_files;
   if (file_cache_size < 0) {
     file_cache_size = kMaxFileCacheSize;
@@ -27,7 +29,16 @@ BlobFileSet::BlobFileSet(const TitanDBOptions& options, TitanStats* stats,
 }
 
 Status BlobFileSet::Open(
-    const std::map<uint32_t, TitanCFOptions>& column_families) {
+    const std::map<uint32_t, TitanCFOptions>& column_families,
+    const std::string& db_id) {
+  if (!db_options_.blob_persistent_cache_dir.empty()) {
+    Status s = BlobPersistentCache::Open(
+        env_, db_options_.blob_persistent_cache_dir,
+        db_options_.blob_persistent_cache_size, db_id, db_options_.info_log,
+        &persistent_cache_);
+    if (!s.ok()) return s;
+  }
+
   // Sets up initial column families.
   AddColumnFamilies(column_families);
 
@@ -94,6 +105,27 @@ Status BlobFileSet::Recover() {
     TITAN_LOG_INFO(db_options_.info_log,
                    "Next blob file number is %" PRIu64 ".", next_file_number);
   }
+  // Seals the write-time blob files left active, their sizes are saved by
+  // the snapshot of the new manifest.
+  for (const auto& bs : column_families_) {
+    for (const auto& f : bs.second->files_) {
+      if (f.second->file_size() != 0 || f.second->is_obsolete()) {
+        continue;
+      }
+      uint64_t file_size = 0;
+      uint64_t file_entries = 0;
+      s = ActiveBlobFile::Recover(env_, env_options_,
+                                  BlobFileName(dirname_, f.first), &file_size,
+                                  &file_entries);
+      if (!s.ok()) return s;
+      f.second->set_file_size(file_size);
+      f.second->set_file_entries(file_entries);
+      TITAN_LOG_INFO(db_options_.info_log,
+                     "Titan recovery sealed active blob file %" PRIu64
+                     ", size %" PRIu64 ", entries %" PRIu64 ".",
+                     f.first, file_size, file_entries);
+    }
+  }
   auto new_manifest_file_number = NewFileNumber();
   s = OpenManifest(new_manifest_file_number);
   if (!s.ok()) return s;
@@ -118,8 +150,19 @@ Status BlobFileSet::Recover() {
     // delete obsoleted files at reopen
     // all the obsolete files's obsolete sequence are 0
     bs.second->GetObsoleteFiles(nullptr, kMaxSequenceNumber);
+    bool punch_hole_gc = bs.second->cf_options().punch_hole_gc;
     for (const auto& f : bs.second->files_) {
       alive_files.insert(f.second->file_number());
+      if (!punch_hole_gc) {
+        continue;
+      }
+      // Holes punched by GC are only known from the allocated size.
+      uint64_t allocated_size = 0;
+      if (GetFileAllocatedSize(BlobFileName(dirname_, f.first),
+                               &allocated_size)
+              .ok()) {
+        f.second->set_physical_size(allocated_size);
+      }
     }
   }
   std::vector<std::string> files;
@@ -183,14 +226,22 @@ Status BlobFileSet::OpenManifest(uint64_t file_number) {
 
 Status BlobFileSet::WriteSnapshot(log::Writer* log) {
   Status s;
+  std::vector<std::string> records;
+  EncodeSnapshot(&records);
+  for (const auto& record : records) {
+    s = log->AddRecord(record);
+    if (!s.ok()) return s;
+  }
+  return s;
+}
+
+void BlobFileSet::EncodeSnapshot(std::vector<std::string>* records) {
   // Saves global information
   {
     VersionEdit edit;
     edit.SetNextFileNumber(next_file_number_.load());
-    std::string record;
-    edit.EncodeTo(&record);
-    s = log->AddRecord(record);
-    if (!s.ok()) return s;
+    records->emplace_back();
+    edit.EncodeTo(&records->back());
   }
   // Saves column families information
   for (auto& it : this->column_families_) {
@@ -203,14 +254,111 @@ Status BlobFileSet::WriteSnapshot(log::Writer* log) {
       }
       edit.AddBlobFile(file.second);
     }
-    std::string record;
-    edit.EncodeTo(&record);
-    s = log->AddRecord(record);
-    if (!s.ok()) return s;
+    records->emplace_back();
+    edit.EncodeTo(&records->back());
+  }
+}
+
+Status BlobFileSet::GetCurrentManifestNumber(uint64_t* number) {
+  std::string manifest;
+  Status s = ReadFileToString(env_, CurrentFileName(dirname_), &manifest);
+  if (!s.ok()) return s;
+  FileType type;
+  if (manifest.empty() || manifest.back() != '\n' ||
+      !ParseFileName(manifest.substr(0, manifest.size() - 1), number,
+                     &type) ||
+      type != kDescriptorFile) {
+    return Status::Corruption("CURRENT file is malformed");
   }
   return s;
 }
 
+Status BlobFileSet::RollManifest() {
+  mutex_->AssertHeld();
+  uint64_t old_file_number = manifest_file_number_;
+  uint64_t file_number = NewFileNumber();
+  auto file_name = DescriptorFileName(dirname_, file_number);
+  // Only the encoding is done under lock, the writers of new edits wait
+  // for the head of manifest_writers_ anyway.
+  std::vector<std::string> records;
+  EncodeSnapshot(&records);
+
+  Status s;
+  std::unique_ptr<log::Writer> manifest;
+  // Which manifest "CURRENT" points to after the roll.
+  uint64_t current_file_number = old_file_number;
+  Status current_status;
+  {
+    mutex_->Unlock();
+    std::unique_ptr<FSWritableFile> f;
+    s = env_->GetFileSystem()->NewWritableFile(
+        file_name, FileOptions(env_options_), &f, nullptr /*dbg*/);
+    if (s.ok()) {
+      manifest.reset(new log::Writer(
+          std::unique_ptr<WritableFileWriter>(new WritableFileWriter(
+              std::move(f), file_name, FileOptions(env_options_))),
+          0, false));
+      for (const auto& record : records) {
+        s = manifest->AddRecord(record);
+        if (!s.ok()) break;
+      }
+    }
+    if (s.ok()) {
+      ImmutableDBOptions ioptions(db_options_);
+      s = SyncTitanManifest(stats_, &ioptions, manifest->file());
+    }
+    if (s.ok()) {
+      s = SetCurrentFile(env_->GetFileSystem().get(), dirname_, file_number,
+                         nullptr);
+      TEST_SYNC_POINT_CALLBACK("BlobFileSet::RollManifest::SetCurrentFile",
+                               &s);
+      if (s.ok()) {
+        current_file_number = file_number;
+      } else {
+        // CURRENT may have been renamed before syncing the directory failed.
+        current_status = GetCurrentManifestNumber(&current_file_number);
+      }
+    }
+    TEST_SYNC_POINT("BlobFileSet::RollManifest::AfterSetCurrentFile");
+    mutex_->Lock();
+  }
+
+  if (current_status.ok() && current_file_number == file_number) {
+    // The synced snapshot is what a restart recovers from, so the new
+    // manifest is used in spite of the error.
+    if (!s.ok()) {
+      TITAN_LOG_WARN(db_options_.info_log,
+                     "Titan manifest %" PRIu64 " is current despite: %s",
+                     file_number, s.ToString().c_str());
+    }
+    TITAN_LOG_INFO(db_options_.info_log,
+                   "Titan manifest rolled over from %" PRIu64 " to %" PRIu64
+                   " with %" ROCKSDB_PRIszt " records",
+                   old_file_number, file_number, records.size());
+    obsolete_manifests_.emplace_back(
+        DescriptorFileName(dirname_, old_file_number));
+    manifest_ = std::move(manifest);
+    manifest_file_number_ = file_number;
+    return Status::OK();
+  }
+
+  // Retrying is likely to fail the same way, while the manifest stays
+  // usable, so it isn't rolled over again until reopen.
+  roll_manifest_failed_ = true;
+  TITAN_LOG_WARN(db_options_.info_log,
+                 "Titan failed to roll over manifest %" PRIu64 ": %s",
+                 old_file_number, s.ToString().c_str());
+  if (current_status.ok() && current_file_number == old_file_number) {
+    obsolete_manifests_.emplace_back(file_name);
+    return Status::OK();
+  }
+  // Neither manifest can be given up without knowing which one is
+  // recovered from.
+  return current_status.ok()
+             ? Status::Corruption("CURRENT points to an unknown manifest")
+             : current_status;
+}
+
 // A helper class to collect all the information needed for manifest write.
 struct BlobFileSet::ManifestWriter {
   Status status;
@@ -261,7 +409,13 @@ Status BlobFileSet::LogAndApply(VersionEdit& edit) {
     collectors.push_back(&last_writer->collector);
   }
 
-  {
+  if (!roll_manifest_failed_ &&
+      manifest_->file()->GetFileSize() >= db_options_.max_manifest_file_size) {
+    // The batch goes to the new manifest, after the snapshot.
+    s = RollManifest();
+  }
+
+  if (s.ok()) {
     // Perform IO out of lock
     mutex_->Unlock();
     for (auto& e : batch_edits) {
@@ -312,8 +466,8 @@ Status BlobFileSet::LogAndApply(VersionEdit& edit) {
 void BlobFileSet::AddColumnFamilies(
     const std::map<uint32_t, TitanCFOptions>& column_families) {
   for (auto& cf : column_families) {
-    auto file_cache = std::make_shared<BlobFileCache>(db_options_, cf.second,
-                                                      file_cache_, stats_);
+    auto file_cache = std::make_shared<BlobFileCache>(
+        db_options_, cf.second, file_cache_, stats_, persistent_cache_);
     auto blob_storage = std::make_shared<BlobStorage>(
         db_options_, cf.second, cf.first, file_cache, stats_, initialized_);
     if (stats_ != nullptr) {
@@ -321,6 +475,16 @@ void BlobFileSet::AddColumnFamilies(
     }
     column_families_.emplace(cf.first, blob_storage);
   }
+  PublishColumnFamilies();
+}
+
+void BlobFileSet::PublishColumnFamilies() {
+  auto storages = std::make_shared<StorageMap>();
+  for (auto& cf : column_families_) {
+    storages->emplace(cf.first, cf.second);
+  }
+  std::atomic_store(&published_storages_,
+                    std::shared_ptr<const StorageMap>(std::move(storages)));
 }
 
 Status BlobFileSet::DropColumnFamilies(
@@ -363,6 +527,7 @@ Status BlobFileSet::MaybeDestroyColumnFamily(uint32_t cf_id) {
     it->second->MarkDestroyed();
     if (it->second->MaybeRemove()) {
       column_families_.erase(it);
+      PublishColumnFamilies();
     }
     return Status::OK();
   }
@@ -409,6 +574,7 @@ Status BlobFileSet::DeleteBlobFilesInRanges(uint32_t cf_id,
 
 void BlobFileSet::GetObsoleteFiles(std::vector<std::string>* obsolete_files,
                                    SequenceNumber oldest_sequence) {
+  bool removed = false;
   for (auto it = column_families_.begin(); it != column_families_.end();) {
     auto& cf_id = it->first;
     auto& blob_storage = it->second;
@@ -425,10 +591,14 @@ void BlobFileSet::GetObsoleteFiles(std::vector<std::string>* obsolete_files,
     // deleted.
     if (blob_storage->MaybeRemove()) {
       it = column_families_.erase(it);
+      removed = true;
       continue;
     }
     ++it;
   }
+  if (removed) {
+    PublishColumnFamilies();
+  }
 
   obsolete_files->insert(obsolete_files->end(), obsolete_manifests_.begin(),
                          obsolete_manifests_.end());
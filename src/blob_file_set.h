@@ -3,6 +3,7 @@
 #include <cstdint>
 
 #include <atomic>
+#include <memory>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -40,8 +41,10 @@ class BlobFileSet {
   // If the manifest doesn't exist, it will create one.
   // If the manifest exists, it will recover from the latest one.
   // It is a corruption if the persistent storage contains data
-  // outside of the provided column families.
-  Status Open(const std::map<uint32_t, TitanCFOptions>& column_families);
+  // outside of the provided column families. "db_id" is the identity of
+  // the base DB, which the persistent blob cache, if any, is bound to.
+  Status Open(const std::map<uint32_t, TitanCFOptions>& column_families,
+              const std::string& db_id = "");
 
   // Applies *edit and saved to the manifest.
   // REQUIRES: mutex is held
@@ -81,6 +84,19 @@ class BlobFileSet {
     return std::weak_ptr<BlobStorage>();
   }
 
+  // Same as GetBlobStorage() but doesn't require the mutex, so that the
+  // read path never contends with background jobs. It looks up an
+  // immutable copy of the column family map, which is republished
+  // whenever the map changes.
+  std::weak_ptr<BlobStorage> GetBlobStorageNoLock(uint32_t cf_id) const {
+    auto storages = std::atomic_load(&published_storages_);
+    auto it = storages->find(cf_id);
+    if (it != storages->end()) {
+      return it->second;
+    }
+    return std::weak_ptr<BlobStorage>();
+  }
+
   // REQUIRES: mutex is held
   void GetObsoleteFiles(std::vector<std::string>* obsolete_files,
                         SequenceNumber oldest_sequence);
@@ -98,6 +114,8 @@ class BlobFileSet {
 
  private:
   struct ManifestWriter;
+  using StorageMap =
+      std::unordered_map<uint32_t, std::weak_ptr<BlobStorage>>;
 
   friend class BlobFileSizeCollectorTest;
   friend class VersionTest;
@@ -108,11 +126,32 @@ class BlobFileSet {
 
   Status WriteSnapshot(log::Writer* log);
 
+  // Encodes the current blob files as manifest records.
+  void EncodeSnapshot(std::vector<std::string>* records);
+
+  // Reads the number of the manifest file "CURRENT" points to.
+  Status GetCurrentManifestNumber(uint64_t* number);
+
+  // Writes a snapshot to a new manifest file and switches to it, so that
+  // the manifest doesn't grow without bound. The old manifest is purged
+  // as an obsolete file. If it fails, edits keep going to the old manifest
+  // and it isn't rolled over again. Returns an error only if it's unknown
+  // which manifest "CURRENT" points to.
+  // REQUIRES: mutex is held, and the caller is the head of
+  // manifest_writers_, so that no edit is applied meanwhile.
+  Status RollManifest();
+
+  // Publishes a copy of column_families_ for GetBlobStorageNoLock().
+  // REQUIRES: mutex is held
+  void PublishColumnFamilies();
+
   std::string dirname_;
   Env* env_;
   EnvOptions env_options_;
   TitanDBOptions db_options_;
   std::shared_ptr<Cache> file_cache_;
+  // Shared by the blob files of all column families, if enabled.
+  std::shared_ptr<BlobPersistentCache> persistent_cache_;
 
   TitanStats* stats_;
   port::Mutex* mutex_;
@@ -133,9 +172,15 @@ class BlobFileSet {
   std::unordered_set<uint32_t> obsolete_columns_;
 
   std::unordered_map<uint32_t, std::shared_ptr<BlobStorage>> column_families_;
+  // Read-only copy of column_families_, swapped atomically on change.
+  // It holds weak references so that it doesn't delay the destruction
+  // of a dropped column family's storage.
+  std::shared_ptr<const StorageMap> published_storages_;
   std::unique_ptr<log::Writer> manifest_;
   std::atomic<uint64_t> next_file_number_{1};
   uint64_t manifest_file_number_;
+  // Whether rolling over the manifest failed, which isn't retried.
+  bool roll_manifest_failed_{false};
 
   std::deque<ManifestWriter*> manifest_writers_;
 };
@@ -12,11 +12,13 @@ namespace titandb {
 
 class BlobFileTest : public testing::Test {
  public:
-  BlobFileTest() : dirname_(test::TmpDir(env_)) {
+  BlobFileTest()
+      : dirname_(test::TmpDir(env_)), compression_pool_(NewThreadPool(4)) {
     file_name_ = BlobFileName(dirname_, file_number_);
   }
 
   ~BlobFileTest() {
+    compression_pool_->JoinAllThreads();
     env_->DeleteFile(file_name_);
     env_->DeleteDir(dirname_);
   }
@@ -56,7 +58,9 @@ class BlobFileTest : public testing::Test {
     options.dirname = dirname_;
     TitanDBOptions db_options(options);
     TitanCFOptions cf_options(options);
-    BlobFileCache cache(db_options, cf_options, {NewLRUCache(128)}, nullptr);
+    auto statistics = CreateDBStatistics();
+    TitanStats stats(statistics.get());
+    BlobFileCache cache(db_options, cf_options, {NewLRUCache(128)}, &stats);
 
     const int n = 100;
     BlobFileBuilder::OutContexts contexts;
@@ -123,6 +127,27 @@ class BlobFileTest : public testing::Test {
       ASSERT_OK(prefetcher->Get(ro, blob_handle, &record, &buffer));
       ASSERT_EQ(record, expect);
     }
+
+    // Reads skipping records are still nearly sequential.
+    for (bool adaptive : {false, true}) {
+      ro.readahead_size = adaptive ? 0 : 64 << 10;
+      ro.adaptive_readahead = adaptive;
+      uint64_t hits = statistics->getTickerCount(TITAN_BLOB_PREFETCH_HIT);
+      ASSERT_OK(cache.NewPrefetcher(file_number_, file_size, &prefetcher));
+      for (int i = 0; i < n; i += 2) {
+        auto key = GenKey(i);
+        auto value = GenValue(i);
+        BlobRecord expect;
+        expect.key = key;
+        expect.value = value;
+        BlobRecord record;
+        PinnableSlice buffer;
+        BlobHandle blob_handle = contexts[i]->new_blob_index.blob_handle;
+        ASSERT_OK(prefetcher->Get(ro, blob_handle, &record, &buffer));
+        ASSERT_EQ(record, expect);
+      }
+      ASSERT_GT(statistics->getTickerCount(TITAN_BLOB_PREFETCH_HIT), hits);
+    }
   }
 
   void TestBlobFileReader(TitanOptions options,
@@ -147,11 +172,14 @@ class BlobFileTest : public testing::Test {
     std::unique_ptr<BlobFileBuilder> builder;
     if (blob_file_version == 0) {
       // Default blob file version
-      builder.reset(new BlobFileBuilder(db_options, cf_options, file.get()));
+      builder.reset(new BlobFileBuilder(db_options, cf_options, file.get(),
+                                        BlobFileHeader::kVersion2,
+                                        compression_pool_.get()));
     } else {
       // Test with specific blob file version
       builder.reset(new BlobFileBuilder(db_options, cf_options, file.get(),
-                                        blob_file_version));
+                                        blob_file_version,
+                                        compression_pool_.get()));
     }
 
     for (int i = 0; i < n; i++) {
@@ -205,6 +233,105 @@ class BlobFileTest : public testing::Test {
       ASSERT_OK(blob_file_reader->Get(ro, blob_handle, &record, &buffer));
       ASSERT_EQ(record, expect);
     }
+
+    // Adjacent and sparse records mixed in one batch.
+    std::vector<int> ids;
+    std::vector<BlobHandle> handles;
+    for (int i = 0; i < n; i += (i < n / 2 ? 1 : 7)) {
+      ids.push_back(i);
+      handles.push_back(contexts[i]->new_blob_index.blob_handle);
+    }
+    std::vector<BlobRecord> records(handles.size());
+    std::vector<PinnableSlice> buffers(handles.size());
+    std::vector<Status> statuses(handles.size());
+    blob_file_reader->MultiGet(ro, handles, records.data(), buffers.data(),
+                               statuses.data());
+    for (size_t i = 0; i < handles.size(); i++) {
+      ASSERT_OK(statuses[i]);
+      auto key = GenKey(ids[i]);
+      auto value = GenValue(ids[i]);
+      BlobRecord expect;
+      expect.key = key;
+      expect.value = value;
+      ASSERT_EQ(records[i], expect);
+    }
+  }
+
+  // Builds a file of "n" records and opens a reader of it.
+  void BuildAndOpen(const TitanDBOptions& db_options,
+                    const TitanCFOptions& cf_options, int n,
+                    BlobFileBuilder::OutContexts& contexts,
+                    std::unique_ptr<BlobFileReader>* blob_file_reader,
+                    TitanStats* stats = nullptr) {
+    std::unique_ptr<WritableFileWriter> file;
+    {
+      std::unique_ptr<FSWritableFile> f;
+      ASSERT_OK(env_->GetFileSystem()->NewWritableFile(
+          file_name_, FileOptions(env_options_), &f, nullptr /*dbg*/));
+      file.reset(new WritableFileWriter(std::move(f), file_name_,
+                                        FileOptions(env_options_)));
+    }
+    std::unique_ptr<BlobFileBuilder> builder(
+        new BlobFileBuilder(db_options, cf_options, file.get()));
+    for (int i = 0; i < n; i++) {
+      auto key = GenKey(i);
+      auto value = GenValue(i);
+      BlobRecord record;
+      record.key = key;
+      record.value = value;
+      AddRecord(builder.get(), record, contexts);
+      ASSERT_OK(builder->status());
+    }
+    ASSERT_OK(Finish(builder.get(), contexts));
+    ASSERT_EQ(contexts.size(), n);
+
+    uint64_t file_size = 0;
+    ASSERT_OK(env_->GetFileSize(file_name_, &file_size));
+    std::unique_ptr<RandomAccessFileReader> random_access_file_reader;
+    ASSERT_OK(NewBlobFileReader(file_number_, 0, db_options, env_options_, env_,
+                                &random_access_file_reader));
+    ASSERT_OK(BlobFileReader::Open(cf_options,
+                                   std::move(random_access_file_reader),
+                                   file_size, blob_file_reader, stats));
+  }
+
+  // Reads every record twice through a reader with a blob cache, so that
+  // the second read is served by the entries filled by the first one.
+  void TestBlobCacheEntry(TitanOptions options) {
+    options.dirname = dirname_;
+    options.blob_cache = NewLRUCache(8 << 20);
+    TitanDBOptions db_options(options);
+    TitanCFOptions cf_options(options);
+
+    const int n = 100;
+    BlobFileBuilder::OutContexts contexts;
+    std::unique_ptr<BlobFileReader> blob_file_reader;
+    BuildAndOpen(db_options, cf_options, n, contexts, &blob_file_reader);
+
+    ReadOptions ro;
+    for (int round = 0; round < 2; round++) {
+      for (int i = 0; i < n; i++) {
+        BlobRecord record;
+        PinnableSlice buffer;
+        BlobHandle blob_handle = contexts[i]->new_blob_index.blob_handle;
+        ASSERT_OK(blob_file_reader->Get(ro, blob_handle, &record, &buffer));
+        ASSERT_TRUE(buffer.IsPinned());
+        ASSERT_EQ(record.value, GenValue(i));
+        if (options.blob_cache_store_key) {
+          ASSERT_EQ(record.key, GenKey(i));
+        } else {
+          ASSERT_TRUE(record.key.empty());
+        }
+      }
+      // Every entry is charged for the decoded record, without the key if
+      // it's not stored, and not much more than that.
+      size_t record_size = GenValue(0).size();
+      if (options.blob_cache_store_key) {
+        record_size += GenKey(0).size();
+      }
+      ASSERT_GE(options.blob_cache->GetUsage(), n * record_size);
+      ASSERT_LE(options.blob_cache->GetUsage(), n * (record_size + 128));
+    }
   }
 
   Env* env_{Env::Default()};
@@ -212,6 +339,8 @@ class BlobFileTest : public testing::Test {
   std::string dirname_;
   std::string file_name_;
   uint64_t file_number_{1};
+  // Shared by the builders compressing on parallel threads.
+  std::unique_ptr<ThreadPool> compression_pool_;
 };
 
 TEST_F(BlobFileTest, BlobFileReader) {
@@ -220,6 +349,75 @@ TEST_F(BlobFileTest, BlobFileReader) {
   TestBlobFileReader(options, BlobFileHeader::kVersion1);
   options.blob_file_compression = kLZ4Compression;
   TestBlobFileReader(options);
+  options.blob_file_compression_parallel_threads = 4;
+  TestBlobFileReader(options);
+  // Blocked files, with records of a block read together by MultiGet.
+  options.blob_file_block_size = 4 << 10;
+  TestBlobFileReader(options);
+  options.blob_file_compression_parallel_threads = 1;
+  TestBlobFileReader(options);
+  options.blob_file_compression = kNoCompression;
+  TestBlobFileReader(options);
+}
+
+TEST_F(BlobFileTest, BlobCacheEntry) {
+  TitanOptions options;
+  TestBlobCacheEntry(options);
+  options.blob_cache_store_key = false;
+  TestBlobCacheEntry(options);
+  options.blob_file_compression = kLZ4Compression;
+  TestBlobCacheEntry(options);
+  options.blob_cache_store_key = true;
+  TestBlobCacheEntry(options);
+}
+
+TEST_F(BlobFileTest, CompressedBlobCache) {
+  TitanOptions options;
+  options.dirname = dirname_;
+  options.blob_file_compression = kLZ4Compression;
+  options.blob_cache = NewLRUCache(1 << 20);
+  options.blob_cache_compressed = NewLRUCache(1 << 20);
+  TitanDBOptions db_options(options);
+  TitanCFOptions cf_options(options);
+  auto statistics = CreateDBStatistics();
+  TitanStats stats(statistics.get());
+
+  const int n = 10;
+  BlobFileBuilder::OutContexts contexts;
+  std::unique_ptr<BlobFileReader> blob_file_reader;
+  BuildAndOpen(db_options, cf_options, n, contexts, &blob_file_reader,
+               &stats);
+  auto ticker = [&](uint32_t type) { return statistics->getTickerCount(type); };
+
+  ReadOptions ro;
+  for (int i = 0; i < n; i++) {
+    BlobHandle blob_handle = contexts[i]->new_blob_index.blob_handle;
+    BlobRecord record;
+    PinnableSlice buffer;
+    // Read from the file, filling both tiers.
+    ASSERT_OK(blob_file_reader->Get(ro, blob_handle, &record, &buffer));
+    ASSERT_EQ(record.value, GenValue(i));
+    ASSERT_EQ(ticker(TITAN_BLOB_CACHE_MISS), 2 * i + 1);
+    ASSERT_EQ(ticker(TITAN_BLOB_CACHE_COMPRESSED_MISS), i + 1);
+    ASSERT_EQ(ticker(TITAN_BLOB_CACHE_COMPRESSED_HIT), i);
+    buffer.Reset();
+
+    // Served by the compressed tier once gone from the uncompressed one.
+    options.blob_cache->EraseUnRefEntries();
+    ASSERT_OK(blob_file_reader->Get(ro, blob_handle, &record, &buffer));
+    ASSERT_EQ(record.value, GenValue(i));
+    ASSERT_EQ(ticker(TITAN_BLOB_CACHE_MISS), 2 * i + 2);
+    ASSERT_EQ(ticker(TITAN_BLOB_CACHE_COMPRESSED_MISS), i + 1);
+    ASSERT_EQ(ticker(TITAN_BLOB_CACHE_COMPRESSED_HIT), i + 1);
+    buffer.Reset();
+
+    // Promoted to the uncompressed tier by the hit above.
+    ASSERT_OK(blob_file_reader->Get(ro, blob_handle, &record, &buffer));
+    ASSERT_EQ(record.value, GenValue(i));
+    ASSERT_EQ(ticker(TITAN_BLOB_CACHE_HIT), i + 1);
+    ASSERT_EQ(ticker(TITAN_BLOB_CACHE_MISS), 2 * i + 2);
+    ASSERT_EQ(ticker(TITAN_BLOB_CACHE_COMPRESSED_HIT), i + 1);
+  }
 }
 
 TEST_F(BlobFileTest, BlobFilePrefetcher) {
@@ -230,6 +428,18 @@ TEST_F(BlobFileTest, BlobFilePrefetcher) {
   TestBlobFilePrefetcher(options);
   options.blob_file_compression = kLZ4Compression;
   TestBlobFilePrefetcher(options);
+  // Compressed tier in front of, and without, the uncompressed tier.
+  options.blob_cache_compressed = NewLRUCache(1 << 20);
+  TestBlobFilePrefetcher(options);
+  options.blob_cache = nullptr;
+  TestBlobFilePrefetcher(options);
+  // Blocked files, with the blocks cached as a whole.
+  options.blob_file_block_size = 4 << 10;
+  TestBlobFilePrefetcher(options);
+  options.blob_cache = NewLRUCache(1 << 20);
+  TestBlobFilePrefetcher(options);
+  options.blob_cache_compressed = nullptr;
+  TestBlobFilePrefetcher(options);
 }
 
 }  // namespace titandb
@@ -15,8 +15,13 @@ bool GetChar(Slice* src, unsigned char* value) {
   return true;
 }
 
+// The records of the blob file were appended at write time.
+const uint32_t kBlobFileWriteTimeFlag = 1 << 0;
+
 }  // namespace
 
+const std::string kRecordIndexBlockName = "titan.record_index";
+
 void BlobRecord::EncodeTo(std::string* dst) const {
   PutLengthPrefixedSlice(dst, key);
   PutLengthPrefixedSlice(dst, value);
@@ -74,6 +79,19 @@ Status BlobDecoder::DecodeRecord(Slice* src, BlobRecord* record,
                                  OwnedSlice* buffer) {
   TEST_SYNC_POINT_CALLBACK("BlobDecoder::DecodeRecord", &crc_);
 
+  Slice contents;
+  Status s = DecodeContents(src, &contents, buffer);
+  if (!s.ok()) {
+    return s;
+  }
+  return DecodeInto(contents, record);
+}
+
+Status BlobDecoder::DecodeContents(Slice* src, Slice* contents,
+                                   OwnedSlice* buffer) {
+  if (src->size() < record_size_) {
+    return Status::Corruption("BlobRecord", "truncated");
+  }
   Slice input(src->data(), record_size_);
   src->remove_prefix(record_size_);
   uint32_t crc = crc32c::Extend(header_crc_, input.data(), input.size());
@@ -82,7 +100,8 @@ Status BlobDecoder::DecodeRecord(Slice* src, BlobRecord* record,
   }
 
   if (compression_ == kNoCompression) {
-    return DecodeInto(input, record);
+    *contents = input;
+    return Status::OK();
   }
   UncompressionContext ctx(compression_);
   UncompressionInfo info(ctx, *uncompression_dict_, compression_);
@@ -90,38 +109,60 @@ Status BlobDecoder::DecodeRecord(Slice* src, BlobRecord* record,
   if (!s.ok()) {
     return s;
   }
-  return DecodeInto(*buffer, record);
+  *contents = *buffer;
+  return Status::OK();
+}
+
+Status DecodeBlockRecord(const Slice& block, uint64_t offset,
+                         BlobRecord* record) {
+  if (offset >= block.size()) {
+    return Status::Corruption("BlobRecord", "offset out of block");
+  }
+  Slice input(block.data() + offset, block.size() - offset);
+  return record->DecodeFrom(&input);
 }
 
 void BlobHandle::EncodeTo(std::string* dst) const {
   PutVarint64(dst, offset);
   PutVarint64(dst, size);
+  if (in_block()) {
+    PutVarint64(dst, record_offset);
+    PutVarint64(dst, record_size);
+  }
 }
 
-Status BlobHandle::DecodeFrom(Slice* src) {
+Status BlobHandle::DecodeFrom(Slice* src, bool in_block) {
   if (!GetVarint64(src, &offset) || !GetVarint64(src, &size)) {
     return Status::Corruption("BlobHandle");
   }
+  record_offset = 0;
+  record_size = 0;
+  if (in_block && (!GetVarint64(src, &record_offset) ||
+                   !GetVarint64(src, &record_size) || record_size == 0)) {
+    return Status::Corruption("BlobHandle");
+  }
   return Status::OK();
 }
 
 bool operator==(const BlobHandle& lhs, const BlobHandle& rhs) {
-  return lhs.offset == rhs.offset && lhs.size == rhs.size;
+  return lhs.offset == rhs.offset && lhs.size == rhs.size &&
+         lhs.record_offset == rhs.record_offset &&
+         lhs.record_size == rhs.record_size;
 }
 
 void BlobIndex::EncodeTo(std::string* dst) const {
-  dst->push_back(kBlobRecord);
+  dst->push_back(blob_handle.in_block() ? kBlockRecord : kBlobRecord);
   PutVarint64(dst, file_number);
   blob_handle.EncodeTo(dst);
 }
 
 Status BlobIndex::DecodeFrom(Slice* src) {
   unsigned char type;
-  if (!GetChar(src, &type) || type != kBlobRecord ||
+  if (!GetChar(src, &type) || (type != kBlobRecord && type != kBlockRecord) ||
       !GetVarint64(src, &file_number)) {
     return Status::Corruption("BlobIndex");
   }
-  Status s = blob_handle.DecodeFrom(src);
+  Status s = blob_handle.DecodeFrom(src, type == kBlockRecord);
   if (!s.ok()) {
     return Status::Corruption("BlobIndex", s.ToString());
   }
@@ -135,27 +176,33 @@ bool operator==(const BlobIndex& lhs, const BlobIndex& rhs) {
 
 void BlobFileMeta::EncodeTo(std::string* dst) const {
   PutVarint64(dst, file_number_);
-  PutVarint64(dst, file_size_);
-  PutVarint64(dst, file_entries_);
+  PutVarint64(dst, file_size());
+  PutVarint64(dst, file_entries());
   PutVarint32(dst, file_level_);
   PutLengthPrefixedSlice(dst, smallest_key_);
   PutLengthPrefixedSlice(dst, largest_key_);
 }
 
 Status BlobFileMeta::DecodeFromLegacy(Slice* src) {
-  if (!GetVarint64(src, &file_number_) || !GetVarint64(src, &file_size_)) {
+  uint64_t file_size = 0;
+  if (!GetVarint64(src, &file_number_) || !GetVarint64(src, &file_size)) {
     return Status::Corruption("BlobFileMeta decode legacy failed");
   }
+  file_size_ = file_size;
   assert(smallest_key_.empty());
   assert(largest_key_.empty());
   return Status::OK();
 }
 
 Status BlobFileMeta::DecodeFrom(Slice* src) {
-  if (!GetVarint64(src, &file_number_) || !GetVarint64(src, &file_size_) ||
-      !GetVarint64(src, &file_entries_) || !GetVarint32(src, &file_level_)) {
+  uint64_t file_size = 0;
+  uint64_t file_entries = 0;
+  if (!GetVarint64(src, &file_number_) || !GetVarint64(src, &file_size) ||
+      !GetVarint64(src, &file_entries) || !GetVarint32(src, &file_level_)) {
     return Status::Corruption("BlobFileMeta decode failed");
   }
+  file_size_ = file_size;
+  file_entries_ = file_entries;
   Slice str;
   if (GetLengthPrefixedSlice(src, &str)) {
     smallest_key_.assign(str.data(), str.size());
@@ -170,11 +217,29 @@ Status BlobFileMeta::DecodeFrom(Slice* src) {
   return Status::OK();
 }
 
+void BlobFileMeta::EncodeFlagsTo(std::string* dst) const {
+  uint32_t flags = 0;
+  if (write_time_) {
+    flags |= kBlobFileWriteTimeFlag;
+  }
+  PutVarint32(dst, flags);
+}
+
+Status BlobFileMeta::DecodeFlagsFrom(Slice* src) {
+  uint32_t flags = 0;
+  if (!GetVarint32(src, &flags)) {
+    return Status::Corruption("BlobFileMeta flags decode failed");
+  }
+  write_time_ = (flags & kBlobFileWriteTimeFlag) != 0;
+  return Status::OK();
+}
+
 bool operator==(const BlobFileMeta& lhs, const BlobFileMeta& rhs) {
   return (lhs.file_number_ == rhs.file_number_ &&
-          lhs.file_size_ == rhs.file_size_ &&
-          lhs.file_entries_ == rhs.file_entries_ &&
-          lhs.file_level_ == rhs.file_level_);
+          lhs.file_size() == rhs.file_size() &&
+          lhs.file_entries() == rhs.file_entries() &&
+          lhs.file_level_ == rhs.file_level_ &&
+          lhs.write_time_ == rhs.write_time_);
 }
 
 void BlobFileMeta::FileStateTransit(const FileEvent& event) {
@@ -186,8 +251,12 @@ void BlobFileMeta::FileStateTransit(const FileEvent& event) {
       // normal state after flush completed.
       assert(state_ == FileState::kPendingLSM ||
              state_ == FileState::kPendingGC || state_ == FileState::kNormal ||
-             state_ == FileState::kBeingGC || state_ == FileState::kObsolete);
-      if (state_ == FileState::kPendingLSM) state_ = FileState::kNormal;
+             state_ == FileState::kBeingGC || state_ == FileState::kObsolete ||
+             state_ == FileState::kPendingFlush);
+      if (state_ == FileState::kPendingLSM ||
+          state_ == FileState::kPendingFlush) {
+        state_ = FileState::kNormal;
+      }
       break;
     case FileEvent::kGCCompleted:
       // file is marked obsoleted during gc
@@ -213,6 +282,20 @@ void BlobFileMeta::FileStateTransit(const FileEvent& event) {
       assert(state_ == FileState::kNone);
       state_ = FileState::kPendingLSM;
       break;
+    case FileEvent::kWriteTimeOutput:
+      assert(state_ == FileState::kNone);
+      state_ = FileState::kActive;
+      write_time_ = true;
+      break;
+    case FileEvent::kSealed:
+      // The column family may be dropped before the file is sealed.
+      if (state_ == FileState::kObsolete) {
+        break;
+      }
+      assert(state_ == FileState::kActive);
+      // Its live data is only counted once the writes to it are flushed.
+      state_ = FileState::kPendingFlush;
+      break;
     case FileEvent::kDbStart:
       assert(state_ == FileState::kNone);
       state_ = FileState::kPendingInit;
@@ -265,12 +348,15 @@ TitanInternalStats::StatsType BlobFileMeta::GetDiscardableRatioLevel() const {
 
 void BlobFileMeta::Dump(bool with_keys) const {
   fprintf(stdout, "file %" PRIu64 ", size %" PRIu64 ", level %" PRIu32,
-          file_number_, file_size_, file_level_);
+          file_number_, file_size(), file_level_);
   if (with_keys) {
     fprintf(stdout, ", smallest key: %s, largest key: %s",
             Slice(smallest_key_).ToString(true /*hex*/).c_str(),
             Slice(largest_key_).ToString(true /*hex*/).c_str());
   }
+  if (write_time_) {
+    fprintf(stdout, ", write time");
+  }
   fprintf(stdout, "\n");
 }
 
@@ -278,7 +364,7 @@ void BlobFileHeader::EncodeTo(std::string* dst) const {
   PutFixed32(dst, kHeaderMagicNumber);
   PutFixed32(dst, version);
 
-  if (version == BlobFileHeader::kVersion2) {
+  if (version != BlobFileHeader::kVersion1) {
     PutFixed32(dst, flags);
   }
 }
@@ -289,13 +375,15 @@ Status BlobFileHeader::DecodeFrom(Slice* src) {
     return Status::Corruption(
         "Blob file header magic number missing or mismatched.");
   }
-  if (!GetFixed32(src, &version) ||
-      (version != kVersion1 && version != kVersion2)) {
+  if (!GetFixed32(src, &version) || !ValidateVersion(version).ok()) {
     return Status::Corruption("Blob file header version missing or invalid.");
   }
-  if (version == BlobFileHeader::kVersion2) {
+  if (version != BlobFileHeader::kVersion1) {
     // Check that no other flags are set
-    if (!GetFixed32(src, &flags) || flags & ~kHasUncompressionDictionary) {
+    if (!GetFixed32(src, &flags) ||
+        flags & ~(kHasUncompressionDictionary | kHasRecordIndex |
+                  kHasKeylessRecords) ||
+        ((flags & kHasKeylessRecords) && !(flags & kHasRecordIndex))) {
       return Status::Corruption("Blob file header flags missing or invalid.");
     }
   }
@@ -24,8 +24,25 @@ namespace titandb {
 // [blob file meta index]
 // [blob file footer]
 //
-// For now, the only kind of meta block is an optional uncompression dictionary
-// indicated by a flag in the file header.
+// The meta blocks are an optional uncompression dictionary and an optional
+// record index, each indicated by a flag in the file header.
+//
+// The record index is a block in the format of a RocksDB data block, with
+// prefix compressed keys and restart points. It has an entry for every
+// record, in the order of the records, mapping the key of the record to
+// its encoded blob handle. The keys are stored as internal keys with
+// sequence number 0, so that the block can be searched like a data block.
+//
+// Files with keyless records store the records with empty keys, and the
+// keys only in the record index.
+//
+// Files of version 3 are blocked: each record head is followed by a block
+// of consecutive blob records, rather than a single record, compressed as
+// a unit:
+//
+// [record head + block 1: [blob record 1][blob record 2]...]
+// [record head + block 2: [blob record K]...]
+// ...
 
 // Format of blob head (9 bytes):
 //
@@ -39,6 +56,9 @@ const uint64_t kBlobMaxHeaderSize = 12;
 const uint64_t kRecordHeaderSize = 9;
 const uint64_t kBlobFooterSize = BlockHandle::kMaxEncodedLength + 8 + 4;
 
+// Name of the record index in the meta index block.
+extern const std::string kRecordIndexBlockName;
+
 // Format of blob record (not fixed size):
 //
 //    +--------------------+----------------------+
@@ -115,6 +135,10 @@ class BlobDecoder {
 
   Status DecodeHeader(Slice* src);
   Status DecodeRecord(Slice* src, BlobRecord* record, OwnedSlice* buffer);
+  // Verifies and uncompresses the contents following the header, i.e. an
+  // encoded record or block. "*contents" is either part of "*src" or the
+  // uncompressed data owned by "*buffer".
+  Status DecodeContents(Slice* src, Slice* contents, OwnedSlice* buffer);
 
   void SetUncompressionDict(const UncompressionDict* uncompression_dict) {
     uncompression_dict_ = uncompression_dict;
@@ -138,12 +162,33 @@ class BlobDecoder {
 //    | Varint64 | Varint64 |
 //    +----------+----------+
 //
+// For a record in a block, "offset" and "size" locate the block, and
+// are followed by the offset of the record in the uncompressed block and
+// the size of the record:
+//
+//    +----------+----------+---------------+-------------+
+//    |  offset  |   size   | record offset | record size |
+//    +----------+----------+---------------+-------------+
+//    | Varint64 | Varint64 |   Varint64    |  Varint64   |
+//    +----------+----------+---------------+-------------+
+//
 struct BlobHandle {
   uint64_t offset{0};
   uint64_t size{0};
+  // Offset of the record in the uncompressed block.
+  uint64_t record_offset{0};
+  // Share of the record in the block size, in proportion to its size in
+  // the uncompressed block, see BlockRecordSize(). It is never zero for a
+  // record in a block, and zero otherwise.
+  uint64_t record_size{0};
+
+  bool in_block() const { return record_size > 0; }
+  // Bytes of the file taken up by the record, which counts towards the
+  // live data size of the file.
+  uint64_t data_size() const { return in_block() ? record_size : size; }
 
   void EncodeTo(std::string* dst) const;
-  Status DecodeFrom(Slice* src);
+  Status DecodeFrom(Slice* src, bool in_block = false);
 
   friend bool operator==(const BlobHandle& lhs, const BlobHandle& rhs);
 };
@@ -156,11 +201,14 @@ struct BlobHandle {
 //    | char |  Varint64   | Varint64(offsest) + Varint64(size) |
 //    +------+-------------+------------------------------------+
 //
+// The type is kBlockRecord for a record in a block of a blocked file.
+//
 // It is stored in LSM-Tree as the value of key, then Titan can use this blob
 // index to locate actual value from blob file.
 struct BlobIndex {
   enum Type : unsigned char {
     kBlobRecord = 1,
+    kBlockRecord = 2,
   };
   uint64_t file_number{0};
   BlobHandle blob_handle;
@@ -187,6 +235,14 @@ struct BlobIndex {
 // The blob file meta is stored in Titan's manifest for quick constructing of
 // meta informations of all the blob files in memory.
 //
+// A write-time blob file meta is followed by its flags:
+//
+//    +----------+
+//    |  flags   |
+//    +----------+
+//    | Varint32 |
+//    +----------+
+//
 // Legacy format:
 //
 //    +-------------+-----------+
@@ -208,6 +264,8 @@ class BlobFileMeta {
     kFlushOrCompactionOutput,
     kDelete,
     kNeedMerge,
+    kWriteTimeOutput,
+    kSealed,
     kReset,  // reset file to normal for test
   };
 
@@ -215,11 +273,14 @@ class BlobFileMeta {
     kNone,         // just after created
     kPendingInit,  // file is not async initialized yet
     kNormal,
-    kPendingLSM,  // waiting keys adding to LSM
-    kBeingGC,     // being gced
-    kPendingGC,   // output of gc, waiting gc finish and keys adding to LSM
-    kObsolete,    // already gced, but wait to be physical deleted
-    kToMerge,     // need merge to new blob file in next compaction
+    kPendingLSM,    // waiting keys adding to LSM
+    kBeingGC,       // being gced
+    kPendingGC,     // output of gc, waiting gc finish and keys adding to LSM
+    kObsolete,      // already gced, but wait to be physical deleted
+    kToMerge,       // need merge to new blob file in next compaction
+    kActive,        // write-time blob file still being appended to
+    kPendingFlush,  // sealed write-time blob file, waiting for the writes
+                    // to it to be flushed
   };
 
   BlobFileMeta() = default;
@@ -240,9 +301,37 @@ class BlobFileMeta {
   void EncodeTo(std::string* dst) const;
   Status DecodeFrom(Slice* src);
   Status DecodeFromLegacy(Slice* src);
+  // Encodes and decodes the flags following a write-time blob file meta.
+  void EncodeFlagsTo(std::string* dst) const;
+  Status DecodeFlagsFrom(Slice* src);
 
   uint64_t file_number() const { return file_number_; }
-  uint64_t file_size() const { return file_size_; }
+  // Zero until a write-time blob file is sealed, as its footer is not
+  // written yet.
+  uint64_t file_size() const {
+    return file_size_.load(std::memory_order_acquire);
+  }
+  void set_file_size(uint64_t size) {
+    file_size_.store(size, std::memory_order_release);
+  }
+  // Bytes actually allocated for the file, which is less than the file size
+  // once holes are punched in it.
+  uint64_t physical_size() const {
+    uint64_t physical_size = physical_size_.load(std::memory_order_relaxed);
+    return physical_size == 0 ? file_size()
+                              : std::min(physical_size, file_size());
+  }
+  void set_physical_size(uint64_t size) {
+    physical_size_.store(size, std::memory_order_relaxed);
+  }
+  // Fraction of the file size that has been given back by punching holes.
+  double GetHoleRatio() const {
+    uint64_t file_size = this->file_size();
+    if (file_size == 0) {
+      return 0;
+    }
+    return 1 - static_cast<double>(physical_size()) / file_size;
+  }
   uint64_t live_data_size() const { return live_data_size_; }
   uint32_t file_level() const { return file_level_; }
   const std::string& smallest_key() const { return smallest_key_; }
@@ -250,8 +339,12 @@ class BlobFileMeta {
 
   void set_live_data_size(int64_t size) { live_data_size_ = size; }
   uint64_t file_entries() const { return file_entries_; }
+  void set_file_entries(uint64_t entries) { file_entries_ = entries; }
   FileState file_state() const { return state_; }
   bool is_obsolete() const { return state_ == FileState::kObsolete; }
+  // Whether the records were appended at write time, so that the live data
+  // size is only counted once their blob indexes are flushed.
+  bool is_write_time() const { return write_time_; }
 
   void FileStateTransit(const FileEvent& event);
   void UpdateLiveDataSize(int64_t delta) { live_data_size_ += delta; }
@@ -264,12 +357,18 @@ class BlobFileMeta {
   }
   double GetDiscardableRatio() const {
     assert(state_ != FileState::kPendingInit);
-    if (file_size_ == 0) {
+    if (file_size() == 0) {
       return 0;
     }
+    // Punched holes are no longer garbage. The physical size is only tracked
+    // with punch hole GC, and is the file size otherwise.
     // TODO: Exclude meta blocks from file size
+    uint64_t size = physical_size();
+    if (size <= kBlobMaxHeaderSize + kBlobFooterSize) {
+      return 0;
+    }
     return 1 - (static_cast<double>(live_data_size_) /
-                (file_size_ - kBlobMaxHeaderSize - kBlobFooterSize));
+                (size - kBlobMaxHeaderSize - kBlobFooterSize));
   }
   TitanInternalStats::StatsType GetDiscardableRatioLevel() const;
   void Dump(bool with_keys) const;
@@ -278,8 +377,8 @@ class BlobFileMeta {
   // Persistent field
 
   uint64_t file_number_{0};
-  uint64_t file_size_{0};
-  uint64_t file_entries_;
+  std::atomic<uint64_t> file_size_{0};
+  std::atomic<uint64_t> file_entries_{0};
   // Target level of compaction/flush which generates this blob file
   uint32_t file_level_;
   // Empty `smallest_key_` and `largest_key_` means smallest key is unknown,
@@ -301,6 +400,10 @@ class BlobFileMeta {
   // `OnCompactionCompleted()` is called.
   std::atomic<int64_t> live_data_size_{0};
   std::atomic<FileState> state_{FileState::kNone};
+  // Allocated size of the file, refreshed on recovery and after punching
+  // holes. Zero means the file is fully allocated.
+  std::atomic<uint64_t> physical_size_{0};
+  bool write_time_{false};
 };
 
 // Format of blob file header for version 1 (8 bytes):
@@ -311,7 +414,7 @@ class BlobFileMeta {
 //    |   Fixed32    | Fixed32 |
 //    +--------------+---------+
 //
-// For version 2, there are another 4 bytes for flags:
+// For version 2 and 3, there are another 4 bytes for flags:
 //
 //    +--------------+---------+---------+
 //    | magic number | version |  flags  |
@@ -319,6 +422,9 @@ class BlobFileMeta {
 //    |   Fixed32    | Fixed32 | Fixed32 |
 //    +--------------+---------+---------+
 //
+// Version 3 is the same as version 2, except that records are stored in
+// blocks.
+//
 // The header is mean to be compatible with header of BlobDB blob files, except
 // we use a different magic number.
 struct BlobFileHeader {
@@ -326,18 +432,23 @@ struct BlobFileHeader {
   static const uint32_t kHeaderMagicNumber = 0x2be0a614ul;
   static const uint32_t kVersion1 = 1;
   static const uint32_t kVersion2 = 2;
+  static const uint32_t kVersion3 = 3;
 
   static const uint64_t kMinEncodedLength = 4 + 4;
   static const uint64_t kMaxEncodedLength = 4 + 4 + 4;
 
   // Flags:
   static const uint32_t kHasUncompressionDictionary = 1 << 0;
+  static const uint32_t kHasRecordIndex = 1 << 1;
+  // Implies kHasRecordIndex.
+  static const uint32_t kHasKeylessRecords = 1 << 2;
 
   uint32_t version = kVersion2;
   uint32_t flags = 0;
 
   static Status ValidateVersion(uint32_t ver) {
-    if (ver != BlobFileHeader::kVersion1 && ver != BlobFileHeader::kVersion2) {
+    if (ver != BlobFileHeader::kVersion1 && ver != BlobFileHeader::kVersion2 &&
+        ver != BlobFileHeader::kVersion3) {
       return Status::InvalidArgument("unrecognized blob file version " +
                                      ToString(ver));
     }
@@ -350,6 +461,8 @@ struct BlobFileHeader {
                : BlobFileHeader::kMaxEncodedLength;
   }
 
+  bool blocked() const { return version == BlobFileHeader::kVersion3; }
+
   void EncodeTo(std::string* dst) const;
   Status DecodeFrom(Slice* src);
 };
@@ -377,6 +490,19 @@ struct BlobFileFooter {
   friend bool operator==(const BlobFileFooter& lhs, const BlobFileFooter& rhs);
 };
 
+// Returns the share of a record of "record_size" bytes in a block of
+// "block_size" bytes, which is "raw_size" bytes uncompressed. The shares
+// of the records in a block add up to about the block size.
+inline uint64_t BlockRecordSize(uint64_t record_size, uint64_t raw_size,
+                                uint64_t block_size) {
+  assert(raw_size > 0);
+  return std::max<uint64_t>(1, block_size * record_size / raw_size);
+}
+
+// Decodes the record at "offset" of the uncompressed block "block".
+Status DecodeBlockRecord(const Slice& block, uint64_t offset,
+                         BlobRecord* record);
+
 // A convenient template to decode a const slice.
 template <typename T>
 Status DecodeInto(const Slice& src, T* target,
@@ -40,6 +40,21 @@ TEST(BlobFormatTest, BlobFileMeta) {
   CheckCodec(input);
 }
 
+TEST(BlobFormatTest, BlobFileMetaDiscardableRatio) {
+  BlobFileMeta file(2, 100 << 10, 0, 0, "0", "9");
+  file.FileStateTransit(BlobFileMeta::FileEvent::kDbStart);
+  file.FileStateTransit(BlobFileMeta::FileEvent::kDbInit);
+  file.set_live_data_size(25 << 10);
+  ASSERT_GT(file.GetDiscardableRatio(), 0.7);
+  // Punched holes don't count as garbage.
+  file.set_physical_size(50 << 10);
+  ASSERT_LT(file.GetDiscardableRatio(), 0.6);
+  ASSERT_GT(file.GetHoleRatio(), 0.4);
+  // Nearly everything punched doesn't underflow the size.
+  file.set_physical_size(1);
+  ASSERT_EQ(file.GetDiscardableRatio(), 0);
+}
+
 TEST(BlobFormatTest, BlobFileFooter) {
   BlobFileFooter input;
   CheckCodec(input);
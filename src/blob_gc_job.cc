@@ -5,13 +5,40 @@
 
 #include <cinttypes>
 
+#include <algorithm>
 #include <memory>
 
+#include "file/filename.h"
+#include "rocksdb/rate_limiter.h"
+#include "util/aligned_buffer.h"
+#include "util/string_util.h"
+
+#include "blob_file_reader.h"
 #include "titan_logging.h"
 
 namespace rocksdb {
 namespace titandb {
 
+// RewriteValidKeyToLSM() commits up to this many keys in one write.
+const size_t kMaxKeysPerRewriteGroup = 256;
+// DiscardEntry() recreates its base iterator after this many checks, so
+// that it doesn't pin memtables and SST files for the whole GC run.
+const uint64_t kMaxChecksPerLSMIterator = 4096;
+// DiscardEntry() steps its base iterator forward at most this many times
+// to reach the next key before falling back to a seek.
+const int kMaxLSMIteratorSkips = 8;
+// Only the live records of input files with at least this ratio of
+// garbage are read, after looking them up in the LSM.
+const double kMinLiveRecordsDiscardableRatio = 0.5;
+// How often RequestGCBytes() checks the load of the base DB.
+const uint64_t kGCLoadCheckBytes = 4 << 20;
+// GC runs at this fraction of "gc_rate_limiter" while the base DB is busy.
+const double kGCBusyRateRatio = 0.25;
+// The delay owed for a busy base DB is slept in slices of up to
+// kGCBusyMaxSleepMicros, once it reaches kGCBusyMinSleepMicros.
+const uint64_t kGCBusyMinSleepMicros = 1000;
+const uint64_t kGCBusyMaxSleepMicros = 100 * 1000;
+
 // Write callback for garbage collection to check if key has been updated
 // since last read. Similar to how OptimisticTransaction works.
 class BlobGCJob::GarbageCollectionWriteCallback : public WriteCallback {
@@ -64,11 +91,11 @@ class BlobGCJob::GarbageCollectionWriteCallback : public WriteCallback {
 
   virtual bool AllowWriteBatching() override { return false; }
 
-  std::string key() { return key_; }
+  const std::string& key() const { return key_; }
 
   uint64_t read_bytes() { return read_bytes_; }
 
-  uint64_t blob_record_size() { return blob_index_.blob_handle.size; }
+  uint64_t blob_record_size() { return blob_index_.blob_handle.data_size(); }
 
   const BlobIndex& new_blob_index() { return new_blob_index_; }
 
@@ -82,12 +109,70 @@ class BlobGCJob::GarbageCollectionWriteCallback : public WriteCallback {
   uint64_t read_bytes_;
 };
 
+// Write callback for a group of rewritten keys, which are already checked
+// to be unchanged as of "sequence". It only has to make sure that none of
+// them is written after "sequence", which is cheap enough to be done in
+// the write thread for the whole group, by looking into the memtables.
+class BlobGCJob::GarbageCollectionGroupWriteCallback : public WriteCallback {
+ public:
+  GarbageCollectionGroupWriteCallback(ColumnFamilyHandle* cfh,
+                                      std::vector<Slice>&& keys,
+                                      SequenceNumber sequence)
+      : cfh_(cfh), keys_(std::move(keys)), sequence_(sequence) {}
+
+  virtual Status Callback(DB* db) override {
+    auto* db_impl = reinterpret_cast<DBImpl*>(db);
+    auto* cfd = reinterpret_cast<ColumnFamilyHandleImpl*>(cfh_)->cfd();
+    SuperVersion* sv = db_impl->GetAndRefSuperVersion(cfd);
+    Status s;
+    SequenceNumber earliest_sequence =
+        db_impl->GetEarliestMemTableSequenceNumber(sv,
+                                                   true /*include_history*/);
+    if (earliest_sequence == kMaxSequenceNumber ||
+        earliest_sequence > sequence_) {
+      // Writes after "sequence" may have been flushed already.
+      s = Status::Busy("not enough memtable history");
+    }
+    for (size_t i = 0; s.ok() && i < keys_.size(); i++) {
+      SequenceNumber latest_sequence = kMaxSequenceNumber;
+      bool found_record_for_key = false;
+      // Titan values in the memtables are blob indexes, which are reported
+      // as NotSupported without "is_blob_index".
+      bool is_blob_index = false;
+      s = db_impl->GetLatestSequenceForKey(
+          sv, keys_[i], true /*cache_only*/, 0 /*lower_bound_seq*/,
+          &latest_sequence, nullptr /*timestamp*/, &found_record_for_key,
+          &is_blob_index);
+      if (!(s.ok() || s.IsNotFound() || s.IsMergeInProgress())) {
+        break;
+      }
+      s = Status::OK();
+      if (found_record_for_key && latest_sequence > sequence_) {
+        s = Status::Busy("key overwritten");
+      }
+    }
+    db_impl->ReturnAndCleanupSuperVersion(cfd, sv);
+    return s;
+  }
+
+  // The check is cheap, so let it join the write groups of foreground
+  // writes rather than stalling them.
+  virtual bool AllowWriteBatching() override { return true; }
+
+ private:
+  ColumnFamilyHandle* cfh_;
+  std::vector<Slice> keys_;
+  SequenceNumber sequence_;
+};
+
 BlobGCJob::BlobGCJob(BlobGC* blob_gc, DB* db, port::Mutex* mutex,
                      const TitanDBOptions& titan_db_options, Env* env,
                      const EnvOptions& env_options,
                      BlobFileManager* blob_file_manager,
                      BlobFileSet* blob_file_set, LogBuffer* log_buffer,
-                     std::atomic_bool* shuting_down, TitanStats* stats)
+                     std::atomic_bool* shuting_down, TitanStats* stats,
+                     ThreadPool* subjob_pool, size_t max_subjob_threads,
+                     ThreadPool* compression_pool)
     : blob_gc_(blob_gc),
       base_db_(db),
       base_db_impl_(reinterpret_cast<DBImpl*>(base_db_)),
@@ -98,8 +183,12 @@ BlobGCJob::BlobGCJob(BlobGC* blob_gc, DB* db, port::Mutex* mutex,
       blob_file_manager_(blob_file_manager),
       blob_file_set_(blob_file_set),
       log_buffer_(log_buffer),
+      inputs_(blob_gc->inputs()),
       shuting_down_(shuting_down),
-      stats_(stats) {}
+      stats_(stats),
+      subjob_pool_(subjob_pool),
+      max_subjob_threads_(max_subjob_threads),
+      compression_pool_(compression_pool) {}
 
 BlobGCJob::~BlobGCJob() {
   if (log_buffer_) {
@@ -125,6 +214,10 @@ BlobGCJob::~BlobGCJob() {
   RecordTick(statistics(stats_), TITAN_GC_NUM_NEW_FILES,
              metrics_.gc_num_new_files);
   RecordTick(statistics(stats_), TITAN_GC_NUM_FILES, metrics_.gc_num_files);
+  RecordTick(statistics(stats_), TITAN_GC_NUM_FILES_PUNCHED,
+             metrics_.gc_num_files_punched);
+  RecordTick(statistics(stats_), TITAN_GC_BYTES_PUNCHED,
+             metrics_.gc_bytes_punched);
 }
 
 Status BlobGCJob::Prepare() {
@@ -143,9 +236,287 @@ Status BlobGCJob::Run() {
   TITAN_LOG_BUFFER(log_buffer_, "[%s] Titan GC candidates[%s]",
                    blob_gc_->column_family_handle()->GetName().c_str(),
                    tmp.c_str());
+  Status s = PunchHoles();
+  if (!s.ok() || inputs_.empty()) {
+    return s;
+  }
+  size_t num_subjobs =
+      std::min<size_t>(db_options_.max_gc_subjobs, inputs_.size());
+  if (num_subjobs > 1) {
+    return RunSubJobs(num_subjobs);
+  }
   return DoRunGC();
 }
 
+Status BlobGCJob::RunSubJobs(size_t max_subjobs) {
+  // Sub-jobs share the GC input files and the base DB, but have their own
+  // output files, rewrite batches, metrics, log buffer and LSM iterator.
+  // The state is shared with the pool threads, which may start only after
+  // every sub-job is taken, and then return without touching it.
+  struct SubJobs {
+    explicit SubJobs(size_t n) : num(n), statuses(n), cv(&mutex) {}
+    const size_t num;
+    std::vector<std::unique_ptr<LogBuffer>> log_buffers;
+    std::vector<std::unique_ptr<BlobGCJob>> jobs;
+    std::vector<Status> statuses;
+    std::atomic<size_t> next{0};
+    port::Mutex mutex;
+    port::CondVar cv;
+    size_t num_done = 0;
+  };
+  auto groups = SplitInputs(max_subjobs);
+  auto subjobs = std::make_shared<SubJobs>(groups.size());
+  for (auto& group : groups) {
+    subjobs->log_buffers.emplace_back(
+        new LogBuffer(InfoLogLevel::INFO_LEVEL, db_options_.info_log.get()));
+    subjobs->jobs.emplace_back(new BlobGCJob(
+        blob_gc_, base_db_, mutex_, db_options_, env_, env_options_,
+        blob_file_manager_, blob_file_set_, subjobs->log_buffers.back().get(),
+        shuting_down_, stats_, nullptr /*subjob_pool*/,
+        0 /*max_subjob_threads*/, compression_pool_));
+    subjobs->jobs.back()->inputs_ = std::move(group);
+  }
+  size_t num_threads = 0;
+  if (subjob_pool_ != nullptr) {
+    num_threads = std::min(max_subjob_threads_, subjobs->num - 1);
+  }
+  TITAN_LOG_BUFFER(log_buffer_,
+                   "[%s] Titan GC runs in %" ROCKSDB_PRIszt
+                   " sub-jobs on %" ROCKSDB_PRIszt " threads",
+                   blob_gc_->column_family_handle()->GetName().c_str(),
+                   subjobs->num, num_threads + 1);
+
+  auto run = [subjobs]() {
+    size_t i;
+    while ((i = subjobs->next.fetch_add(1)) < subjobs->num) {
+      // I/O stats are per thread, every sub-job accounts its own.
+      BlobGCJob* job = subjobs->jobs[i].get();
+      TEST_SYNC_POINT("BlobGCJob::RunSubJobs:BeforeSubJob");
+      SavePrevIOBytes(&job->prev_bytes_read_, &job->prev_bytes_written_);
+      Status s = job->DoRunGC();
+      UpdateIOBytes(job->prev_bytes_read_, job->prev_bytes_written_,
+                    &job->io_bytes_read_, &job->io_bytes_written_);
+      TEST_SYNC_POINT("BlobGCJob::RunSubJobs:AfterSubJob");
+      MutexLock l(&subjobs->mutex);
+      subjobs->statuses[i] = s;
+      if (++subjobs->num_done == subjobs->num) {
+        subjobs->cv.SignalAll();
+      }
+    }
+  };
+  // The I/O of the sub-jobs run by this thread is accounted by them.
+  UpdateIOBytes(prev_bytes_read_, prev_bytes_written_, &io_bytes_read_,
+                &io_bytes_written_);
+  for (size_t i = 0; i < num_threads; i++) {
+    subjob_pool_->SubmitJob(run);
+  }
+  // Sub-jobs not yet taken by the pool threads are run here, so that
+  // this never waits for a busy pool.
+  run();
+  {
+    MutexLock l(&subjobs->mutex);
+    while (subjobs->num_done < subjobs->num) {
+      subjobs->cv.Wait();
+    }
+  }
+  SavePrevIOBytes(&prev_bytes_read_, &prev_bytes_written_);
+
+  Status s;
+  for (size_t i = 0; i < subjobs->num; i++) {
+    BlobGCJob* subjob = subjobs->jobs[i].get();
+    for (auto& builder : subjob->blob_file_builders_) {
+      blob_file_builders_.emplace_back(std::move(builder));
+    }
+    for (auto& write_batch : subjob->rewrite_batches_) {
+      rewrite_batches_.emplace_back(std::move(write_batch));
+    }
+    // Metrics are recorded once by this job.
+    metrics_.Add(subjob->metrics_);
+    subjob->metrics_ = Metrics();
+    io_bytes_read_ += subjob->io_bytes_read_;
+    io_bytes_written_ += subjob->io_bytes_written_;
+    if (s.ok() && !subjobs->statuses[i].ok()) {
+      s = subjobs->statuses[i];
+    }
+  }
+  // Flushes the logs of the sub-jobs before this job's.
+  subjobs->jobs.clear();
+  return s;
+}
+
+Status BlobGCJob::PunchHoles() {
+  const auto& cf_options = blob_gc_->titan_cf_options();
+  if (!cf_options.punch_hole_gc || HasSnapshots()) {
+    return Status::OK();
+  }
+  std::vector<std::shared_ptr<BlobFileMeta>> files;
+  for (const auto& file : inputs_) {
+    // Legacy files don't know their key range. Small files are picked to
+    // be merged, and files left with too little live data are better
+    // compacted by a rewrite.
+    if (file->smallest_key().empty() || file->largest_key().empty() ||
+        file->file_size() < cf_options.merge_small_file_threshold ||
+        file->file_size() == 0 ||
+        1 - static_cast<double>(file->live_data_size()) / file->file_size() >
+            cf_options.punch_hole_max_fragmentation) {
+      continue;
+    }
+    files.push_back(file);
+  }
+  if (files.empty()) {
+    return Status::OK();
+  }
+  std::unordered_map<uint64_t, std::vector<BlobHandle>> live_records;
+  Status s = ScanLiveRecords(files, &live_records);
+  if (!s.ok()) {
+    return s;
+  }
+
+  std::vector<std::shared_ptr<BlobFileMeta>> remaining;
+  for (auto& file : inputs_) {
+    auto live = live_records.find(file->file_number());
+    // Reads started before the LSM scan hold a snapshot, and may still
+    // read the records found dead by the scan.
+    if (live == live_records.end() || live->second.empty() || HasSnapshots()) {
+      remaining.push_back(std::move(file));
+      continue;
+    }
+    uint64_t bytes_punched = 0;
+    s = PunchFileHoles(file, &live->second, &bytes_punched);
+    if (s.ok() && bytes_punched == 0) {
+      remaining.push_back(std::move(file));
+      continue;
+    }
+    if (!s.ok()) {
+      TITAN_LOG_WARN(db_options_.info_log,
+                     "[%s] Titan GC failed to punch holes in blob file %" PRIu64
+                     ", fallback to rewrite it: %s",
+                     blob_gc_->column_family_handle()->GetName().c_str(),
+                     file->file_number(), s.ToString().c_str());
+      remaining.push_back(std::move(file));
+      continue;
+    }
+    TITAN_LOG_BUFFER(log_buffer_,
+                     "[%s] Titan GC punched %" PRIu64
+                     " bytes of holes in blob file %" PRIu64,
+                     blob_gc_->column_family_handle()->GetName().c_str(),
+                     bytes_punched, file->file_number());
+    metrics_.gc_num_files_punched++;
+    metrics_.gc_bytes_punched += bytes_punched;
+    punched_files_.insert(file->file_number());
+  }
+  inputs_ = std::move(remaining);
+  return Status::OK();
+}
+
+Status BlobGCJob::PunchFileHoles(const std::shared_ptr<BlobFileMeta>& file,
+                                 std::vector<BlobHandle>* live_records,
+                                 uint64_t* bytes_punched) {
+  std::string file_name =
+      BlobFileName(db_options_.dirname, file->file_number());
+  std::unique_ptr<RandomAccessFileReader> reader;
+  Status s = NewBlobFileStreamReader(file_name, file->file_size(),
+                                     0 /*readahead_size*/,
+                                     false /*use_direct_io*/, env_options_,
+                                     env_, &reader);
+  if (!s.ok()) {
+    return s;
+  }
+  // Only the header and the footer are read, to locate the records.
+  BlobFileIterator iter(std::move(reader), file->file_number(),
+                        file->file_size(), blob_gc_->titan_cf_options());
+  if (!iter.Init()) {
+    return iter.status();
+  }
+
+  std::sort(live_records->begin(), live_records->end(),
+            [](const BlobHandle& a, const BlobHandle& b) {
+              return a.offset < b.offset;
+            });
+  std::vector<std::pair<uint64_t, uint64_t>> holes;
+  // Only whole pages are deallocated, partial pages are zeroed by the file
+  // system which gives nothing back.
+  auto add_hole = [&holes](uint64_t begin, uint64_t end) {
+    begin = Roundup(begin, kDefaultPageSize);
+    end = TruncateToPageBoundary(kDefaultPageSize, end);
+    if (end > begin) {
+      holes.emplace_back(begin, end - begin);
+    }
+  };
+  uint64_t offset = iter.header_size();
+  uint64_t garbage_size = 0;
+  for (const auto& handle : *live_records) {
+    if (handle.offset > offset) {
+      garbage_size += handle.offset - offset;
+      add_hole(offset, handle.offset);
+    }
+    offset = std::max(offset, handle.offset + handle.size);
+  }
+  if (iter.end_of_blob_record() > offset) {
+    garbage_size += iter.end_of_blob_record() - offset;
+    add_hole(offset, iter.end_of_blob_record());
+  }
+
+  // Holes punched before are punched again, but give nothing back.
+  uint64_t punched_size = file->file_size() - file->physical_size();
+  uint64_t holes_size = 0;
+  for (const auto& hole : holes) {
+    holes_size += hole.second;
+  }
+  *bytes_punched = holes_size > punched_size ? holes_size - punched_size : 0;
+  // With records much smaller than a page, most of the garbage stays in
+  // partial pages, and only a rewrite reclaims it.
+  garbage_size = garbage_size > punched_size ? garbage_size - punched_size : 0;
+  if (*bytes_punched == 0 || *bytes_punched * 2 < garbage_size) {
+    *bytes_punched = 0;
+    return Status::OK();
+  }
+  s = rocksdb::titandb::PunchHoles(file_name, holes);
+  // Even a partial failure may have punched some holes.
+  uint64_t allocated_size = 0;
+  if (GetFileAllocatedSize(file_name, &allocated_size).ok()) {
+    file->set_physical_size(allocated_size);
+  }
+  return s;
+}
+
+bool BlobGCJob::HasSnapshots() {
+  uint64_t num_snapshots = 0;
+  return !base_db_->GetIntProperty(DB::Properties::kNumSnapshots,
+                                   &num_snapshots) ||
+         num_snapshots > 0;
+}
+
+std::vector<std::vector<std::shared_ptr<BlobFileMeta>>>
+BlobGCJob::SplitInputs(size_t max_groups) {
+  assert(max_groups > 0);
+  auto inputs = inputs_;
+  const Comparator* ucmp = blob_gc_->titan_cf_options().comparator;
+  std::sort(inputs.begin(), inputs.end(),
+            [ucmp](const std::shared_ptr<BlobFileMeta>& a,
+                   const std::shared_ptr<BlobFileMeta>& b) {
+              return ucmp->Compare(a->smallest_key(), b->smallest_key()) < 0;
+            });
+  uint64_t total_size = 0;
+  for (const auto& file : inputs) {
+    total_size += file->file_size();
+  }
+  uint64_t target_size = total_size / max_groups;
+
+  std::vector<std::vector<std::shared_ptr<BlobFileMeta>>> groups;
+  uint64_t group_size = 0;
+  for (auto& file : inputs) {
+    if (groups.empty() ||
+        (group_size >= target_size && groups.size() < max_groups)) {
+      groups.emplace_back();
+      group_size = 0;
+    }
+    group_size += file->file_size();
+    groups.back().emplace_back(std::move(file));
+  }
+  return groups;
+}
+
 Status BlobGCJob::DoRunGC() {
   Status s;
 
@@ -170,7 +541,6 @@ Status BlobGCJob::DoRunGC() {
   std::string last_key;
   bool last_key_is_fresh = false;
   gc_iter->SeekToFirst();
-  assert(gc_iter->Valid());
   for (; gc_iter->Valid(); gc_iter->Next()) {
     if (IsShutingDown()) {
       s = Status::ShutdownInProgress();
@@ -178,7 +548,8 @@ Status BlobGCJob::DoRunGC() {
     }
     BlobIndex blob_index = gc_iter->GetBlobIndex();
     // count read bytes for blob record of gc candidate files
-    metrics_.gc_bytes_read += blob_index.blob_handle.size;
+    metrics_.gc_bytes_read += blob_index.blob_handle.data_size();
+    RequestGCBytes(blob_index.blob_handle.data_size());
 
     if (!last_key.empty() && (gc_iter->key().compare(last_key) == 0)) {
       if (last_key_is_fresh) {
@@ -199,7 +570,7 @@ Status BlobGCJob::DoRunGC() {
     }
     if (discardable) {
       metrics_.gc_num_keys_overwritten++;
-      metrics_.gc_bytes_overwritten += blob_index.blob_handle.size;
+      metrics_.gc_bytes_overwritten += blob_index.blob_handle.data_size();
       continue;
     }
     last_key_is_fresh = true;
@@ -241,7 +612,8 @@ Status BlobGCJob::DoRunGC() {
                      blob_file_handle->GetNumber());
       blob_file_builder = std::unique_ptr<BlobFileBuilder>(
           new BlobFileBuilder(db_options_, blob_gc_->titan_cf_options(),
-                              blob_file_handle->GetFile()));
+                              blob_file_handle->GetFile(),
+                              BlobFileHeader::kVersion2, compression_pool_));
       file_size = 0;
     }
     assert(blob_file_handle);
@@ -253,6 +625,7 @@ Status BlobGCJob::DoRunGC() {
     // count written bytes for new blob record,
     // blob index's size is counted in `RewriteValidKeyToLSM`
     metrics_.gc_bytes_written += blob_record.size();
+    RequestGCBytes(blob_record.size());
 
     // BlobRecordContext require key to be an internal key. We encode key to
     // internal key in spite we only need the user key.
@@ -273,6 +646,8 @@ Status BlobGCJob::DoRunGC() {
     }
   }
 
+  lsm_iter_.reset();
+
   if (gc_iter->status().ok() && s.ok()) {
     if (blob_file_builder && blob_file_handle) {
       assert(blob_file_builder->status().ok());
@@ -289,6 +664,87 @@ Status BlobGCJob::DoRunGC() {
   return s;
 }
 
+void BlobGCJob::RequestGCBytes(uint64_t bytes) {
+  RateLimiter* limiter = db_options_.gc_rate_limiter.get();
+  if (limiter == nullptr) {
+    return;
+  }
+  if (bytes_since_load_check_ == 0) {
+    base_db_busy_ = IsBaseDBBusy();
+  }
+  bytes_since_load_check_ += bytes;
+  if (bytes_since_load_check_ >= kGCLoadCheckBytes) {
+    bytes_since_load_check_ = 0;
+  }
+
+  // The limiter is shared, it's charged the actual bytes only.
+  auto charge = static_cast<int64_t>(bytes);
+  const int64_t burst = std::max<int64_t>(limiter->GetSingleBurstBytes(), 1);
+  while (charge > 0 && !IsShutingDown()) {
+    int64_t request = std::min(charge, burst);
+    limiter->Request(request, Env::IO_LOW, statistics(stats_));
+    charge -= request;
+  }
+
+  if (!base_db_busy_) {
+    return;
+  }
+  // Sleeps for the rest of the time the bytes take at the busy rate.
+  int64_t rate = limiter->GetBytesPerSecond();
+  if (rate > 0) {
+    busy_delay_micros_ += static_cast<double>(bytes) *
+                          (1 / kGCBusyRateRatio - 1) * 1000000 / rate;
+  }
+  if (busy_delay_micros_ < kGCBusyMinSleepMicros) {
+    return;
+  }
+  auto delay = static_cast<uint64_t>(busy_delay_micros_);
+  busy_delay_micros_ -= delay;
+  TEST_SYNC_POINT_CALLBACK("BlobGCJob::RequestGCBytes:BusyDelay", &delay);
+  while (delay > 0 && !IsShutingDown()) {
+    uint64_t micros = std::min(delay, kGCBusyMaxSleepMicros);
+    env_->SleepForMicroseconds(static_cast<int>(micros));
+    delay -= micros;
+  }
+}
+
+bool BlobGCJob::IsBaseDBBusy() {
+  bool busy = false;
+  TEST_SYNC_POINT_CALLBACK("BlobGCJob::IsBaseDBBusy", &busy);
+  if (busy) {
+    return true;
+  }
+  auto* cfh = blob_gc_->column_family_handle();
+  const auto& cf_options = blob_gc_->titan_cf_options();
+  uint64_t value = 0;
+  if (base_db_->GetIntProperty(cfh, DB::Properties::kIsWriteStopped,
+                               &value) &&
+      value > 0) {
+    return true;
+  }
+  if (base_db_->GetIntProperty(cfh, DB::Properties::kActualDelayedWriteRate,
+                               &value) &&
+      value > 0) {
+    return true;
+  }
+  if (cf_options.soft_pending_compaction_bytes_limit > 0 &&
+      base_db_->GetIntProperty(
+          cfh, DB::Properties::kEstimatePendingCompactionBytes, &value) &&
+      value >= cf_options.soft_pending_compaction_bytes_limit / 2) {
+    return true;
+  }
+  std::string l0_files;
+  if (cf_options.level0_slowdown_writes_trigger > 0 &&
+      base_db_->GetProperty(cfh, DB::Properties::kNumFilesAtLevelPrefix + "0",
+                            &l0_files) &&
+      ParseUint64(l0_files) >=
+          static_cast<uint64_t>(cf_options.level0_slowdown_writes_trigger) /
+              2) {
+    return true;
+  }
+  return false;
+}
+
 void BlobGCJob::BatchWriteNewIndices(BlobFileBuilder::OutContexts& contexts,
                                      Status* s) {
   auto* cfh = blob_gc_->column_family_handle();
@@ -321,20 +777,42 @@ void BlobGCJob::BatchWriteNewIndices(BlobFileBuilder::OutContexts& contexts,
 Status BlobGCJob::BuildIterator(
     std::unique_ptr<BlobFileMergeIterator>* result) {
   Status s;
-  const auto& inputs = blob_gc_->inputs();
+  const auto& inputs = inputs_;
   assert(!inputs.empty());
+  std::unordered_map<uint64_t, std::vector<BlobHandle>> live_records;
+  s = CollectLiveRecords(&live_records);
+  if (!s.ok()) {
+    return s;
+  }
+  for (const auto& file : inputs) {
+    if (file->is_write_time()) {
+      s = SortRecordsByKey(file, &live_records[file->file_number()]);
+      if (!s.ok()) {
+        return s;
+      }
+    }
+  }
   std::vector<std::unique_ptr<BlobFileIterator>> list;
   for (std::size_t i = 0; i < inputs.size(); ++i) {
+    auto live = live_records.find(inputs[i]->file_number());
     std::unique_ptr<RandomAccessFileReader> file;
-    // TODO(@DorianZheng) set read ahead size
-    s = NewBlobFileReader(inputs[i]->file_number(), 0, db_options_,
-                          env_options_, env_, &file);
+    // Live records are read one by one, so no readahead for them.
+    s = NewBlobFileStreamReader(
+        BlobFileName(db_options_.dirname, inputs[i]->file_number()),
+        inputs[i]->file_size(),
+        live == live_records.end() ? db_options_.gc_readahead_size : 0,
+        db_options_.use_direct_io_for_gc, env_options_, env_, &file);
     if (!s.ok()) {
       break;
     }
     list.emplace_back(std::unique_ptr<BlobFileIterator>(new BlobFileIterator(
         std::move(file), inputs[i]->file_number(), inputs[i]->file_size(),
         blob_gc_->titan_cf_options())));
+    if (live != live_records.end()) {
+      // The records of a write-time file are sorted by key already.
+      list.back()->SetLiveRecords(std::move(live->second),
+                                  inputs[i]->is_write_time());
+    }
   }
 
   if (s.ok())
@@ -344,23 +822,261 @@ Status BlobGCJob::BuildIterator(
   return s;
 }
 
+Status BlobGCJob::CollectLiveRecords(
+    std::unordered_map<uint64_t, std::vector<BlobHandle>>* live_records) {
+  const Comparator* ucmp = blob_gc_->titan_cf_options().comparator;
+  auto* cfh = blob_gc_->column_family_handle();
+  // Files with punched holes can't be read as a whole any more.
+  std::vector<std::shared_ptr<BlobFileMeta>> files;
+  std::vector<std::shared_ptr<BlobFileMeta>> sparse_files;
+  std::string smallest_key;
+  std::string largest_key;
+  uint64_t garbage_size = 0;
+  for (const auto& file : inputs_) {
+    // Legacy files don't know their key range.
+    if (file->smallest_key().empty() || file->largest_key().empty()) {
+      continue;
+    }
+    if (file->physical_size() < file->file_size()) {
+      files.push_back(file);
+      continue;
+    }
+    if (file->GetDiscardableRatio() < kMinLiveRecordsDiscardableRatio) {
+      continue;
+    }
+    if (sparse_files.empty() ||
+        ucmp->Compare(file->smallest_key(), smallest_key) < 0) {
+      smallest_key = file->smallest_key();
+    }
+    if (sparse_files.empty() ||
+        ucmp->Compare(file->largest_key(), largest_key) > 0) {
+      largest_key = file->largest_key();
+    }
+    garbage_size += static_cast<uint64_t>(file->file_size() *
+                                          file->GetDiscardableRatio());
+    sparse_files.push_back(file);
+  }
+
+  if (!sparse_files.empty()) {
+    // Scanning the key range in the LSM has to be cheaper than reading the
+    // garbage in the files.
+    Range range(smallest_key, largest_key);
+    uint64_t lsm_size = 0;
+    Status s = base_db_->GetApproximateSizes(SizeApproximationOptions(), cfh,
+                                             &range, 1, &lsm_size);
+    if (s.ok() && lsm_size < garbage_size) {
+      files.insert(files.end(), sparse_files.begin(), sparse_files.end());
+      sparse_files.clear();
+    }
+  }
+  if (!files.empty()) {
+    Status s = ScanLiveRecords(files, live_records);
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  // Otherwise the live records of the sparse files are found by checking
+  // the keys in their record indexes, if they have.
+  for (const auto& file : sparse_files) {
+    std::vector<BlobHandle> handles;
+    Status s = IndexLiveRecords(file, &handles);
+    if (s.IsNotFound()) {
+      continue;
+    }
+    if (!s.ok()) {
+      return s;
+    }
+    (*live_records)[file->file_number()] = std::move(handles);
+  }
+  return Status::OK();
+}
+
+Status BlobGCJob::SortRecordsByKey(const std::shared_ptr<BlobFileMeta>& file,
+                                   std::vector<BlobHandle>* handles) {
+  std::unique_ptr<RandomAccessFileReader> reader;
+  Status s = NewBlobFileStreamReader(
+      BlobFileName(db_options_.dirname, file->file_number()),
+      file->file_size(), db_options_.gc_readahead_size,
+      db_options_.use_direct_io_for_gc, env_options_, env_, &reader);
+  if (!s.ok()) {
+    return s;
+  }
+  BlobFileIterator iter(std::move(reader), file->file_number(),
+                        file->file_size(), blob_gc_->titan_cf_options());
+  // A file with punched holes can only be read at its live records.
+  if (!handles->empty()) {
+    iter.SetLiveRecords(std::move(*handles));
+  }
+  std::vector<std::pair<std::string, BlobHandle>> records;
+  for (iter.SeekToFirst(); iter.Valid(); iter.Next()) {
+    if (IsShutingDown()) {
+      return Status::ShutdownInProgress();
+    }
+    BlobHandle handle = iter.GetBlobIndex().blob_handle;
+    metrics_.gc_bytes_read += handle.data_size();
+    RequestGCBytes(handle.data_size());
+    records.emplace_back(iter.key().ToString(), handle);
+  }
+  if (!iter.status().ok()) {
+    return iter.status();
+  }
+  // Versions of a key keep the order they were written in.
+  const Comparator* ucmp = blob_gc_->titan_cf_options().comparator;
+  std::stable_sort(records.begin(), records.end(),
+                   [ucmp](const std::pair<std::string, BlobHandle>& a,
+                          const std::pair<std::string, BlobHandle>& b) {
+                     return ucmp->Compare(a.first, b.first) < 0;
+                   });
+  handles->clear();
+  handles->reserve(records.size());
+  for (const auto& record : records) {
+    handles->push_back(record.second);
+  }
+  return Status::OK();
+}
+
+Status BlobGCJob::IndexLiveRecords(const std::shared_ptr<BlobFileMeta>& file,
+                                   std::vector<BlobHandle>* live_records) {
+  std::unique_ptr<RandomAccessFileReader> reader;
+  Status s = NewBlobFileStreamReader(
+      BlobFileName(db_options_.dirname, file->file_number()),
+      file->file_size(), 0 /*readahead_size*/, false /*use_direct_io*/,
+      env_options_, env_, &reader);
+  if (!s.ok()) {
+    return s;
+  }
+  // Only the header, the footer and the meta blocks are read.
+  BlobFileIterator iter(std::move(reader), file->file_number(),
+                        file->file_size(), blob_gc_->titan_cf_options());
+  if (!iter.Init()) {
+    return iter.status();
+  }
+  const BlobRecordIndex* record_index = iter.record_index();
+  if (record_index == nullptr) {
+    return Status::NotFound("record index");
+  }
+  metrics_.gc_bytes_read += record_index->size();
+  BlobIndex blob_index;
+  blob_index.file_number = file->file_number();
+  auto index_iter = record_index->NewIterator();
+  for (index_iter->SeekToFirst(); index_iter->Valid(); index_iter->Next()) {
+    if (IsShutingDown()) {
+      return Status::ShutdownInProgress();
+    }
+    blob_index.blob_handle = index_iter->handle();
+    bool discardable = false;
+    s = DiscardEntry(index_iter->key(), blob_index, &discardable);
+    if (!s.ok()) {
+      return s;
+    }
+    if (!discardable) {
+      live_records->push_back(blob_index.blob_handle);
+    }
+  }
+  return index_iter->status();
+}
+
+Status BlobGCJob::ScanLiveRecords(
+    const std::vector<std::shared_ptr<BlobFileMeta>>& files,
+    std::unordered_map<uint64_t, std::vector<BlobHandle>>* live_records) {
+  const Comparator* ucmp = blob_gc_->titan_cf_options().comparator;
+  std::string smallest_key;
+  std::string largest_key;
+  for (const auto& file : files) {
+    if (live_records->empty() ||
+        ucmp->Compare(file->smallest_key(), smallest_key) < 0) {
+      smallest_key = file->smallest_key();
+    }
+    if (live_records->empty() ||
+        ucmp->Compare(file->largest_key(), largest_key) > 0) {
+      largest_key = file->largest_key();
+    }
+    (*live_records)[file->file_number()];
+  }
+  if (live_records->empty()) {
+    return Status::OK();
+  }
+
+  TitanStopWatch sw(env_, metrics_.gc_read_lsm_micros);
+  auto* cfd = reinterpret_cast<ColumnFamilyHandleImpl*>(
+                  blob_gc_->column_family_handle())
+                  ->cfd();
+  ReadOptions ro;
+  ro.total_order_seek = true;
+  ro.fill_cache = false;
+  std::unique_ptr<ArenaWrappedDBIter> iter(base_db_impl_->NewIteratorImpl(
+      ro, cfd, base_db_impl_->GetLatestSequenceNumber(),
+      nullptr /*read_callback*/, true /*expose_blob_index*/,
+      false /*allow_refresh*/));
+  for (iter->Seek(smallest_key);
+       iter->Valid() && ucmp->Compare(iter->key(), largest_key) <= 0;
+       iter->Next()) {
+    if (IsShutingDown()) {
+      return Status::ShutdownInProgress();
+    }
+    if (!iter->IsBlob()) {
+      continue;
+    }
+    BlobIndex blob_index;
+    Slice index_entry = iter->value();
+    Status s = blob_index.DecodeFrom(&index_entry);
+    if (!s.ok()) {
+      return s;
+    }
+    auto live = live_records->find(blob_index.file_number);
+    if (live != live_records->end()) {
+      live->second.push_back(blob_index.blob_handle);
+    }
+  }
+  return iter->status();
+}
+
 Status BlobGCJob::DiscardEntry(const Slice& key, const BlobIndex& blob_index,
                                bool* discardable) {
   TitanStopWatch sw(env_, metrics_.gc_read_lsm_micros);
   assert(discardable != nullptr);
-  PinnableSlice index_entry;
-  bool is_blob_index = false;
-  DBImpl::GetImplOptions gopts;
-  gopts.column_family = blob_gc_->column_family_handle();
-  gopts.value = &index_entry;
-  gopts.is_blob_index = &is_blob_index;
-  Status s = base_db_impl_->GetImpl(ReadOptions(), key, gopts);
-  if (!s.ok() && !s.IsNotFound()) {
+  const Comparator* ucmp = blob_gc_->titan_cf_options().comparator;
+  if (!lsm_iter_ || lsm_iter_checks_ >= kMaxChecksPerLSMIterator) {
+    auto cfd = reinterpret_cast<ColumnFamilyHandleImpl*>(
+                   blob_gc_->column_family_handle())
+                   ->cfd();
+    ReadOptions ro;
+    ro.total_order_seek = true;
+    lsm_iter_.reset(base_db_impl_->NewIteratorImpl(
+        ro, cfd, base_db_impl_->GetLatestSequenceNumber(),
+        nullptr /*read_callback*/, true /*expose_blob_index*/,
+        false /*allow_refresh*/));
+    lsm_iter_checks_ = 0;
+    lsm_iter_key_.clear();
+    lsm_iter_->Seek(key);
+  } else if (ucmp->Compare(key, lsm_iter_key_) < 0) {
+    lsm_iter_->Seek(key);
+  } else {
+    // The iterator is at the first key not less than the last checked
+    // key, and so not greater than "key" unless "key" doesn't exist.
+    int skips = 0;
+    while (lsm_iter_->Valid() && ucmp->Compare(lsm_iter_->key(), key) < 0) {
+      if (++skips > kMaxLSMIteratorSkips) {
+        lsm_iter_->Seek(key);
+        break;
+      }
+      lsm_iter_->Next();
+    }
+  }
+  lsm_iter_checks_++;
+  lsm_iter_key_.assign(key.data(), key.size());
+  if (!lsm_iter_->status().ok()) {
+    Status s = lsm_iter_->status();
+    lsm_iter_.reset();
     return s;
   }
+
+  bool found =
+      lsm_iter_->Valid() && ucmp->Compare(lsm_iter_->key(), key) == 0;
+  Slice index_entry = found ? lsm_iter_->value() : Slice();
   // count read bytes for checking LSM entry
   metrics_.gc_bytes_read += key.size() + index_entry.size();
-  if (s.IsNotFound() || !is_blob_index) {
+  if (!found || !lsm_iter_->IsBlob()) {
     // Either the key is deleted or updated with a newer version which is
     // inlined in LSM.
     *discardable = true;
@@ -368,7 +1084,7 @@ Status BlobGCJob::DiscardEntry(const Slice& key, const BlobIndex& blob_index,
   }
 
   BlobIndex other_blob_index;
-  s = other_blob_index.DecodeFrom(&index_entry);
+  Status s = other_blob_index.DecodeFrom(&index_entry);
   if (!s.ok()) {
     return s;
   }
@@ -495,7 +1211,7 @@ Status BlobGCJob::RewriteValidKeyToLSM() {
 
   std::unordered_map<uint64_t, uint64_t>
       dropped;  // blob_file_number -> dropped_size
-  for (auto& write_batch : rewrite_batches_) {
+  for (size_t start = 0; start < rewrite_batches_.size();) {
     if (blob_gc_->GetColumnFamilyData()->IsDropped()) {
       s = Status::Aborted("Column family drop");
       break;
@@ -504,34 +1220,32 @@ Status BlobGCJob::RewriteValidKeyToLSM() {
       s = Status::ShutdownInProgress();
       break;
     }
-    s = db_impl->WriteWithCallback(wo, &write_batch.first, &write_batch.second);
-    const auto& new_blob_index = write_batch.second.new_blob_index();
-    if (s.ok()) {
-      if (new_blob_index.blob_handle.size > 0) {
-        // Rewritten as blob record.
-        // count written bytes for new blob index.
-        metrics_.gc_bytes_written += write_batch.first.GetDataSize();
-        metrics_.gc_num_keys_relocated++;
-        metrics_.gc_bytes_relocated += write_batch.second.blob_record_size();
-      } else {
-        // Rewritten as inline value due to fallback mode.
-        metrics_.gc_num_keys_fallback++;
-        metrics_.gc_bytes_fallback += write_batch.second.blob_record_size();
+    size_t end =
+        std::min(start + kMaxKeysPerRewriteGroup, rewrite_batches_.size());
+    s = RewriteGroupToLSM(start, end, &dropped);
+    if (s.IsBusy()) {
+      // Some key is overwritten right before the group write, falls back
+      // to rewriting the keys one by one.
+      TEST_SYNC_POINT("BlobGCJob::RewriteValidKeyToLSM:GroupBusy");
+      for (size_t i = start; i < end; i++) {
+        auto& write_batch = rewrite_batches_[i];
+        if (write_batch.first.Count() == 0) {
+          // Found overwritten by the group write already.
+          continue;
+        }
+        s = db_impl->WriteWithCallback(wo, &write_batch.first,
+                                       &write_batch.second);
+        UpdateRewriteMetrics(i, s, &dropped);
+        if (!s.ok() && !s.IsBusy()) {
+          // We hit an error.
+          break;
+        }
       }
-    } else if (s.IsBusy()) {
-      metrics_.gc_num_keys_overwritten++;
-      metrics_.gc_bytes_overwritten += write_batch.second.blob_record_size();
-      // The key is overwritten in the meanwhile. Drop the blob record.
-      // Though record is dropped, the diff won't counted in discardable
-      // ratio,
-      // so we should update the live_data_size here.
-      dropped[new_blob_index.file_number] += new_blob_index.blob_handle.size;
-    } else {
-      // We hit an error.
+    }
+    if (!s.ok() && !s.IsBusy()) {
       break;
     }
-    // count read bytes in write callback
-    metrics_.gc_bytes_read += write_batch.second.read_bytes();
+    start = end;
   }
   if (s.IsBusy()) {
     s = Status::OK();
@@ -566,6 +1280,85 @@ Status BlobGCJob::RewriteValidKeyToLSM() {
   return s;
 }
 
+Status BlobGCJob::RewriteGroupToLSM(
+    size_t start, size_t end, std::unordered_map<uint64_t, uint64_t>* dropped) {
+  auto* db_impl = reinterpret_cast<DBImpl*>(base_db_);
+  WriteOptions wo;
+  wo.low_pri = true;
+  wo.ignore_missing_column_families = true;
+
+  // Checks the keys outside of the write thread first. The sequence is
+  // taken before the checks, so a write racing with them is caught by
+  // the group callback.
+  SequenceNumber sequence = db_impl->GetLatestSequenceNumber();
+  WriteBatch group;
+  std::vector<size_t> valid;
+  std::vector<Slice> keys;
+  for (size_t i = start; i < end; i++) {
+    auto& write_batch = rewrite_batches_[i];
+    Status s = write_batch.second.Callback(db_impl);
+    if (s.IsBusy()) {
+      UpdateRewriteMetrics(i, s, dropped);
+      // Marks it as done for the fallback path.
+      write_batch.first.Clear();
+      continue;
+    }
+    if (s.ok()) {
+      s = WriteBatchInternal::Append(&group, &write_batch.first);
+    }
+    if (!s.ok()) {
+      return s;
+    }
+    valid.push_back(i);
+    keys.emplace_back(write_batch.second.key());
+  }
+  if (valid.empty()) {
+    return Status::OK();
+  }
+
+  TEST_SYNC_POINT("BlobGCJob::RewriteGroupToLSM:BeforeWrite");
+  GarbageCollectionGroupWriteCallback callback(
+      blob_gc_->column_family_handle(), std::move(keys), sequence);
+  Status s = db_impl->WriteWithCallback(wo, &group, &callback);
+  if (s.ok()) {
+    for (auto i : valid) {
+      UpdateRewriteMetrics(i, s, dropped);
+    }
+  }
+  return s;
+}
+
+void BlobGCJob::UpdateRewriteMetrics(
+    size_t i, const Status& s,
+    std::unordered_map<uint64_t, uint64_t>* dropped) {
+  auto& write_batch = rewrite_batches_[i];
+  const auto& new_blob_index = write_batch.second.new_blob_index();
+  if (s.ok()) {
+    if (new_blob_index.blob_handle.size > 0) {
+      // Rewritten as blob record.
+      // count written bytes for new blob index.
+      metrics_.gc_bytes_written += write_batch.first.GetDataSize();
+      metrics_.gc_num_keys_relocated++;
+      metrics_.gc_bytes_relocated += write_batch.second.blob_record_size();
+    } else {
+      // Rewritten as inline value due to fallback mode.
+      metrics_.gc_num_keys_fallback++;
+      metrics_.gc_bytes_fallback += write_batch.second.blob_record_size();
+    }
+  } else if (s.IsBusy()) {
+    metrics_.gc_num_keys_overwritten++;
+    metrics_.gc_bytes_overwritten += write_batch.second.blob_record_size();
+    // The key is overwritten in the meanwhile. Drop the blob record.
+    // Though record is dropped, the diff won't counted in discardable
+    // ratio,
+    // so we should update the live_data_size here.
+    (*dropped)[new_blob_index.file_number] +=
+        new_blob_index.blob_handle.data_size();
+  }
+  // count read bytes in write callback
+  metrics_.gc_bytes_read += write_batch.second.read_bytes();
+}
+
 Status BlobGCJob::DeleteInputBlobFiles() {
   SequenceNumber obsolete_sequence = base_db_impl_->GetLatestSequenceNumber();
 
@@ -581,9 +1374,10 @@ Status BlobGCJob::DeleteInputBlobFiles() {
     metrics_.gc_num_files++;
     RecordInHistogram(statistics(stats_), TITAN_GC_INPUT_FILE_SIZE,
                       file->file_size());
-    if (file->is_obsolete()) {
+    if (file->is_obsolete() ||
+        punched_files_.count(file->file_number()) > 0) {
       // There may be a concurrent DeleteBlobFilesInRanges or GC,
-      // so the input file is already deleted.
+      // so the input file is already deleted. Punched files are kept.
       continue;
     }
     edit.DeleteBlobFile(file->file_number(), obsolete_sequence);
@@ -1,8 +1,10 @@
 #pragma once
 
+#include "db/arena_wrapped_db_iter.h"
 #include "db/db_impl/db_impl.h"
 #include "rocksdb/statistics.h"
 #include "rocksdb/status.h"
+#include "rocksdb/threadpool.h"
 
 #include "blob_file_builder.h"
 #include "blob_file_iterator.h"
@@ -22,7 +24,9 @@ class BlobGCJob {
             const TitanDBOptions &titan_db_options, Env *env,
             const EnvOptions &env_options, BlobFileManager *blob_file_manager,
             BlobFileSet *blob_file_set, LogBuffer *log_buffer,
-            std::atomic_bool *shuting_down, TitanStats *stats);
+            std::atomic_bool *shuting_down, TitanStats *stats,
+            ThreadPool *subjob_pool = nullptr, size_t max_subjob_threads = 0,
+            ThreadPool *compression_pool = nullptr);
 
   // No copying allowed
   BlobGCJob(const BlobGCJob &) = delete;
@@ -37,8 +41,12 @@ class BlobGCJob {
   // REQUIRE: mutex held
   Status Finish();
 
+  // Whether the base DB was busy as of the last load check of the job.
+  bool base_db_busy() const { return base_db_busy_; }
+
  private:
   class GarbageCollectionWriteCallback;
+  class GarbageCollectionGroupWriteCallback;
   friend class BlobGCJobTest;
 
   void UpdateInternalOpStats();
@@ -60,11 +68,34 @@ class BlobGCJob {
   std::vector<std::pair<WriteBatch, GarbageCollectionWriteCallback>>
       rewrite_batches_;
 
+  // The input files read by this job. A sub-job reads a part of the
+  // inputs of "blob_gc_".
+  std::vector<std::shared_ptr<BlobFileMeta>> inputs_;
+  // The input files reclaimed in place by punching holes, which are kept
+  // rather than deleted after GC.
+  std::unordered_set<uint64_t> punched_files_;
+
   std::atomic_bool *shuting_down_{nullptr};
 
+  // A base DB iterator shared by consecutive DiscardEntry() calls, which
+  // check the keys in ascending order.
+  std::unique_ptr<ArenaWrappedDBIter> lsm_iter_;
+  // The key "lsm_iter_" was last positioned for.
+  std::string lsm_iter_key_;
+  uint64_t lsm_iter_checks_ = 0;
+
   TitanStats *stats_;
 
-  struct {
+  // Sub-jobs other than the one run by the calling thread run on up to
+  // "max_subjob_threads_" threads of "subjob_pool_", which are reserved
+  // for this job by the caller.
+  ThreadPool *subjob_pool_;
+  size_t max_subjob_threads_;
+  // Compresses the records of the output files, shared with the flushes
+  // and compactions of the column family.
+  ThreadPool *compression_pool_;
+
+  struct Metrics {
     uint64_t gc_bytes_read = 0;
     uint64_t gc_bytes_written = 0;
     uint64_t gc_num_keys_overwritten = 0;
@@ -75,22 +106,106 @@ class BlobGCJob {
     uint64_t gc_bytes_fallback = 0;
     uint64_t gc_num_new_files = 0;
     uint64_t gc_num_files = 0;
+    uint64_t gc_num_files_punched = 0;
+    uint64_t gc_bytes_punched = 0;
     uint64_t gc_read_lsm_micros = 0;
     uint64_t gc_update_lsm_micros = 0;
+
+    void Add(const Metrics &m) {
+      gc_bytes_read += m.gc_bytes_read;
+      gc_bytes_written += m.gc_bytes_written;
+      gc_num_keys_overwritten += m.gc_num_keys_overwritten;
+      gc_bytes_overwritten += m.gc_bytes_overwritten;
+      gc_num_keys_relocated += m.gc_num_keys_relocated;
+      gc_bytes_relocated += m.gc_bytes_relocated;
+      gc_num_keys_fallback += m.gc_num_keys_fallback;
+      gc_bytes_fallback += m.gc_bytes_fallback;
+      gc_num_new_files += m.gc_num_new_files;
+      gc_num_files += m.gc_num_files;
+      gc_num_files_punched += m.gc_num_files_punched;
+      gc_bytes_punched += m.gc_bytes_punched;
+      gc_read_lsm_micros += m.gc_read_lsm_micros;
+      gc_update_lsm_micros += m.gc_update_lsm_micros;
+    }
   } metrics_;
 
+  // Whether the base DB was busy as of the last load check, and the time
+  // GC owes to sleep for it.
+  bool base_db_busy_ = false;
+  double busy_delay_micros_ = 0;
+  uint64_t bytes_since_load_check_ = 0;
+
   uint64_t prev_bytes_read_ = 0;
   uint64_t prev_bytes_written_ = 0;
   uint64_t io_bytes_read_ = 0;
   uint64_t io_bytes_written_ = 0;
 
   Status DoRunGC();
+  // Reclaims the garbage of the eligible inputs in place by punching holes,
+  // and removes them from "inputs_". Inputs failing to be punched are left
+  // to normal GC.
+  Status PunchHoles();
+  // Punches holes in the extents of "file" not covered by "live_records".
+  // Sets "*bytes_punched" to the bytes deallocated.
+  Status PunchFileHoles(const std::shared_ptr<BlobFileMeta> &file,
+                        std::vector<BlobHandle> *live_records,
+                        uint64_t *bytes_punched);
+  // Splits the inputs into up to "max_subjobs" sub-jobs, runs them on the
+  // calling thread and the reserved threads of "subjob_pool_", and collects
+  // their output files, rewrite batches and metrics into this job.
+  Status RunSubJobs(size_t max_subjobs);
+  // Splits the inputs into up to "max_groups" groups of similar size.
+  // Inputs are ordered by smallest key, so that the groups cover mostly
+  // disjoint key ranges.
+  std::vector<std::vector<std::shared_ptr<BlobFileMeta>>> SplitInputs(
+      size_t max_groups);
   void BatchWriteNewIndices(BlobFileBuilder::OutContexts &contexts, Status *s);
   Status BuildIterator(std::unique_ptr<BlobFileMergeIterator> *result);
+  // Collects the records still referenced by the LSM for the input files
+  // mostly made of garbage, either by scanning the LSM or by checking the
+  // keys in their record indexes, so that only those records are read.
+  // Files not in "live_records" are read as a whole.
+  Status CollectLiveRecords(
+      std::unordered_map<uint64_t, std::vector<BlobHandle>> *live_records);
+  // Scans the key range of "files" in the LSM and adds the handles of
+  // their records still referenced to "live_records".
+  Status ScanLiveRecords(
+      const std::vector<std::shared_ptr<BlobFileMeta>> &files,
+      std::unordered_map<uint64_t, std::vector<BlobHandle>> *live_records);
+  // Checks the keys in the record index of "file" against the LSM, and
+  // adds the handles of its records still referenced to "live_records".
+  // Returns NotFound if the file has no record index.
+  Status IndexLiveRecords(const std::shared_ptr<BlobFileMeta> &file,
+                          std::vector<BlobHandle> *live_records);
+  // Reads the records of the write-time blob file "file", which are in
+  // the order they were written, and sets "*handles" to them sorted by
+  // key, so that the file can be merged with the other inputs. If
+  // "*handles" isn't empty, only the records at it are read.
+  Status SortRecordsByKey(const std::shared_ptr<BlobFileMeta> &file,
+                          std::vector<BlobHandle> *handles);
+  // Whether the base DB has snapshots, which includes the implicit ones
+  // taken by ongoing reads.
+  bool HasSnapshots();
+  // Checks whether the blob record of "key" is still referenced by the
+  // LSM. Checking keys in ascending order is the cheapest, since the
+  // lookups then mostly step the shared base iterator forward.
   Status DiscardEntry(const Slice &key, const BlobIndex &blob_index,
                       bool *discardable);
+  // Charges "bytes" of GC I/O to the GC rate limiter, if any, and slows
+  // GC down while the base DB is busy.
+  void RequestGCBytes(uint64_t bytes);
+  // Whether the base DB is close to a write stall, or behind in compaction.
+  bool IsBaseDBBusy();
   Status InstallOutputBlobFiles();
   Status RewriteValidKeyToLSM();
+  // Rewrites "rewrite_batches_[start, end)" in one write. Keys found
+  // overwritten are added to "dropped". Returns Busy if a key is
+  // overwritten right before the write, in which case nothing is written.
+  Status RewriteGroupToLSM(size_t start, size_t end,
+                           std::unordered_map<uint64_t, uint64_t> *dropped);
+  // Accounts the result "s" of rewriting "rewrite_batches_[i]".
+  void UpdateRewriteMetrics(size_t i, const Status &s,
+                            std::unordered_map<uint64_t, uint64_t> *dropped);
   Status DeleteInputBlobFiles();
 
   bool IsShutingDown();
@@ -1,7 +1,9 @@
 #include "blob_gc_job.h"
 
 #include "rocksdb/convenience.h"
+#include "rocksdb/rate_limiter.h"
 #include "test_util/testharness.h"
+#include "test_util/testutil.h"
 
 #include "blob_gc_picker.h"
 #include "db_impl.h"
@@ -145,6 +147,7 @@ class BlobGCJobTest : public testing::Test {
       cf_options.merge_small_file_threshold = 0;
     }
     cf_options.blob_file_discardable_ratio = 0.4;
+    cf_options.punch_hole_gc = options_.punch_hole_gc;
 
     std::unique_ptr<BlobGC> blob_gc;
     {
@@ -188,6 +191,23 @@ class BlobGCJobTest : public testing::Test {
     mutex_->Lock();
   }
 
+  // The tests are not friends of BlobGCJob, only the fixture is.
+  Status ScanLiveRecords(
+      BlobGCJob* job, const std::vector<std::shared_ptr<BlobFileMeta>>& files,
+      std::unordered_map<uint64_t, std::vector<BlobHandle>>* live_records) {
+    return job->ScanLiveRecords(files, live_records);
+  }
+
+  Status IndexLiveRecords(BlobGCJob* job,
+                          const std::shared_ptr<BlobFileMeta>& file,
+                          std::vector<BlobHandle>* live_records) {
+    return job->IndexLiveRecords(file, live_records);
+  }
+
+  uint64_t GCBytesRead(const BlobGCJob& job) {
+    return job.metrics_.gc_bytes_read;
+  }
+
   Status NewIterator(uint64_t file_number, uint64_t file_size,
                      std::unique_ptr<BlobFileIterator>* iter) {
     std::unique_ptr<RandomAccessFileReader> file;
@@ -215,6 +235,19 @@ class BlobGCJobTest : public testing::Test {
     ASSERT_OK(WriteBatchInternal::PutBlobIndex(&wb, cfh->GetID(), key, res));
     auto rewrite_status = base_db_->Write(WriteOptions(), &wb);
 
+    BlobIndex other_index = blob_index;
+    other_index.blob_handle.offset += 0x100;
+    std::string other_res;
+    other_index.EncodeTo(&other_res);
+    WriteBatch wb2;
+    for (int i = 0; i < 20; i++) {
+      if (i % 4 == 0) continue;
+      ASSERT_OK(WriteBatchInternal::PutBlobIndex(
+          &wb2, cfh->GetID(), GenKey(i), i % 4 == 1 ? res : other_res));
+    }
+    ASSERT_OK(wb2.Put(GenKey(19), "inlined"));
+    ASSERT_OK(base_db_->Write(WriteOptions(), &wb2));
+
     std::vector<std::shared_ptr<BlobFileMeta>> tmp;
     BlobGC blob_gc(std::move(tmp), TitanCFOptions(), false /*trigger_next*/);
     blob_gc.SetColumnFamily(cfh);
@@ -224,6 +257,13 @@ class BlobGCJobTest : public testing::Test {
     bool discardable = false;
     ASSERT_OK(blob_gc_job.DiscardEntry(key, blob_index, &discardable));
     ASSERT_FALSE(discardable);
+
+    // Keys checked in ascending order share the base iterator, and the
+    // ones out of order seek it again.
+    for (int i : {0, 1, 2, 3, 5, 18, 19, 9, 13}) {
+      ASSERT_OK(blob_gc_job.DiscardEntry(GenKey(i), blob_index, &discardable));
+      ASSERT_EQ(discardable, i % 4 != 1) << i;
+    }
   }
 
   void TestRunGC() {
@@ -287,6 +327,256 @@ TEST_F(BlobGCJobTest, DiscardEntry) { TestDiscardEntry(); }
 
 TEST_F(BlobGCJobTest, RunGC) { TestRunGC(); }
 
+TEST_F(BlobGCJobTest, RunGCWithKeylessRecords) {
+  // The keys are read from the record indexes of the files.
+  options_.blob_file_keys_in_index = true;
+  TestRunGC();
+}
+
+TEST_F(BlobGCJobTest, RunGCWithDirectIO) {
+  if (!test::IsDirectIOSupported(options_.env, dbname_)) {
+    fprintf(stderr, "Direct I/O is not supported, skipped\n");
+    return;
+  }
+  options_.use_direct_io_for_gc = true;
+  // Spans the files over a few readahead chunks.
+  options_.gc_readahead_size = 4096;
+  // Live records are read one by one.
+  TestRunGC();
+
+  // Files with little garbage are read as a whole by the readahead.
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), GenKey(i), GenValue(i)));
+  }
+  Flush();
+  for (int i = 0; i < MAX_KEY_NUM; i += 4) {
+    ASSERT_OK(db_->Delete(WriteOptions(), GenKey(i)));
+  }
+  Flush();
+  CompactAll();
+  RunGC(true);
+  std::string result;
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    Status s = db_->Get(ReadOptions(), GenKey(i), &result);
+    if (i % 4 == 0) {
+      ASSERT_TRUE(s.IsNotFound());
+      continue;
+    }
+    ASSERT_OK(s);
+    ASSERT_EQ(result, GenValue(i));
+  }
+}
+
+TEST_F(BlobGCJobTest, ScanLiveRecords) {
+  NewDB();
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), GenKey(i), GenValue(i)));
+  }
+  Flush();
+  auto b = GetBlobStorage(base_db_->DefaultColumnFamily()->GetID()).lock();
+  ASSERT_EQ(b->files_.size(), 1);
+  auto file = b->files_.begin()->second;
+  // Overwrites a third of the keys into another blob file, and deletes
+  // another third.
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    if (i % 3 == 1) {
+      ASSERT_OK(db_->Put(WriteOptions(), GenKey(i), GenValue(i + MAX_KEY_NUM)));
+    } else if (i % 3 == 2) {
+      ASSERT_OK(db_->Delete(WriteOptions(), GenKey(i)));
+    }
+  }
+  Flush();
+
+  // Only the records still referenced by the LSM are found, and the LSM
+  // scan is not counted as GC reads.
+  std::unordered_map<uint64_t, std::vector<BlobHandle>> live_records;
+  {
+    std::vector<std::shared_ptr<BlobFileMeta>> files{file};
+    BlobGC blob_gc(std::move(files), TitanCFOptions(), false /*trigger_next*/);
+    blob_gc.SetColumnFamily(base_db_->DefaultColumnFamily());
+    BlobGCJob blob_gc_job(&blob_gc, base_db_, mutex_, tdb_->db_options_,
+                          tdb_->env_, EnvOptions(options_), nullptr,
+                          blob_file_set_, nullptr, nullptr, nullptr);
+    ASSERT_OK(ScanLiveRecords(&blob_gc_job, {file}, &live_records));
+    ASSERT_EQ(GCBytesRead(blob_gc_job), 0);
+    MutexLock l(mutex_);
+    blob_gc.ReleaseGcFiles();
+  }
+  ASSERT_EQ(live_records.size(), 1);
+  auto& handles = live_records[file->file_number()];
+  ASSERT_EQ(handles.size(), (MAX_KEY_NUM + 2) / 3);
+
+  std::unique_ptr<BlobFileIterator> iter;
+  ASSERT_OK(NewIterator(file->file_number(), file->file_size(), &iter));
+  iter->SetLiveRecords(std::move(handles));
+  iter->SeekToFirst();
+  for (int i = 0; i < MAX_KEY_NUM; i += 3, iter->Next()) {
+    ASSERT_OK(iter->status());
+    ASSERT_TRUE(iter->Valid());
+    ASSERT_EQ(iter->key(), GenKey(i));
+    ASSERT_EQ(iter->value(), GenValue(i));
+  }
+  ASSERT_OK(iter->status());
+  ASSERT_FALSE(iter->Valid());
+
+  // GC through the scan keeps the overwritten values.
+  CompactAll();
+  RunGC(true);
+  std::string result;
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    Status s = db_->Get(ReadOptions(), GenKey(i), &result);
+    if (i % 3 == 2) {
+      ASSERT_TRUE(s.IsNotFound());
+      continue;
+    }
+    ASSERT_OK(s);
+    ASSERT_EQ(result, GenValue(i % 3 == 1 ? i + MAX_KEY_NUM : i));
+  }
+}
+
+TEST_F(BlobGCJobTest, IndexLiveRecords) {
+  options_.blob_file_record_index = true;
+  NewDB();
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), GenKey(i), GenValue(i)));
+  }
+  Flush();
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    if (i % 3 == 0) continue;
+    ASSERT_OK(db_->Delete(WriteOptions(), GenKey(i)));
+  }
+  Flush();
+  auto b = GetBlobStorage(base_db_->DefaultColumnFamily()->GetID()).lock();
+  ASSERT_EQ(b->files_.size(), 1);
+  auto file = b->files_.begin()->second;
+
+  // Only the keys are checked, and the live records are read afterwards.
+  std::vector<BlobHandle> handles;
+  {
+    std::vector<std::shared_ptr<BlobFileMeta>> files{file};
+    BlobGC blob_gc(std::move(files), TitanCFOptions(), false /*trigger_next*/);
+    blob_gc.SetColumnFamily(base_db_->DefaultColumnFamily());
+    BlobGCJob blob_gc_job(&blob_gc, base_db_, mutex_, tdb_->db_options_,
+                          tdb_->env_, EnvOptions(options_), nullptr,
+                          blob_file_set_, nullptr, nullptr, nullptr);
+    ASSERT_OK(IndexLiveRecords(&blob_gc_job, file, &handles));
+    MutexLock l(mutex_);
+    blob_gc.ReleaseGcFiles();
+  }
+  ASSERT_EQ(handles.size(), (MAX_KEY_NUM + 2) / 3);
+
+  std::unique_ptr<BlobFileIterator> iter;
+  ASSERT_OK(NewIterator(file->file_number(), file->file_size(), &iter));
+  iter->SetLiveRecords(std::move(handles));
+  iter->SeekToFirst();
+  for (int i = 0; i < MAX_KEY_NUM; i += 3, iter->Next()) {
+    ASSERT_OK(iter->status());
+    ASSERT_TRUE(iter->Valid());
+    ASSERT_EQ(iter->key(), GenKey(i));
+    ASSERT_EQ(iter->value(), GenValue(i));
+  }
+  ASSERT_OK(iter->status());
+  ASSERT_FALSE(iter->Valid());
+
+  // GC works the same with the record index.
+  CompactAll();
+  RunGC(true);
+  std::string result;
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    Status s = db_->Get(ReadOptions(), GenKey(i), &result);
+    if (i % 3 != 0) {
+      ASSERT_TRUE(s.IsNotFound());
+      continue;
+    }
+    ASSERT_OK(s);
+    ASSERT_EQ(result, GenValue(i));
+  }
+}
+
+TEST_F(BlobGCJobTest, RunGCWithSubJobs) {
+  const int kNumFiles = 4;
+  options_.max_gc_subjobs = kNumFiles;
+  NewDB();
+  for (int f = 0; f < kNumFiles; f++) {
+    for (int i = f; i < MAX_KEY_NUM; i += kNumFiles) {
+      ASSERT_OK(db_->Put(WriteOptions(), GenKey(i), GenValue(i)));
+    }
+    Flush();
+  }
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    if (i % 3 == 0) continue;
+    ASSERT_OK(db_->Delete(WriteOptions(), GenKey(i)));
+  }
+  Flush();
+  CompactAll();
+  auto b = GetBlobStorage(base_db_->DefaultColumnFamily()->GetID()).lock();
+  ASSERT_EQ(b->files_.size(), kNumFiles);
+
+  RunGC(true);
+  // Every sub-job writes its own output file.
+  b = GetBlobStorage(base_db_->DefaultColumnFamily()->GetID()).lock();
+  ASSERT_EQ(b->files_.size(), kNumFiles);
+  std::string result;
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    Status s = db_->Get(ReadOptions(), GenKey(i), &result);
+    if (i % 3 != 0) {
+      ASSERT_TRUE(s.IsNotFound());
+      continue;
+    }
+    ASSERT_OK(s);
+    ASSERT_EQ(result, GenValue(i));
+  }
+}
+
+TEST_F(BlobGCJobTest, GroupRewriteFallback) {
+  NewDB();
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), GenKey(i), GenValue(i)));
+  }
+  Flush();
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    if (i % 3 == 0) continue;
+    ASSERT_OK(db_->Delete(WriteOptions(), GenKey(i)));
+  }
+  Flush();
+  CompactAll();
+
+  // Overwrites a key of the first group after it is checked, so that the
+  // group write is rejected and its keys are rewritten one by one.
+  const std::string overwritten_key = GenKey(3);
+  int num_busy = 0;
+  bool overwritten = false;
+  SyncPoint::GetInstance()->SetCallBack(
+      "BlobGCJob::RewriteGroupToLSM:BeforeWrite", [&](void*) {
+        if (!overwritten) {
+          overwritten = true;
+          ASSERT_OK(db_->Put(WriteOptions(), overwritten_key, "new_value"));
+        }
+      });
+  SyncPoint::GetInstance()->SetCallBack(
+      "BlobGCJob::RewriteValidKeyToLSM:GroupBusy",
+      [&](void*) { num_busy++; });
+  SyncPoint::GetInstance()->EnableProcessing();
+  RunGC(true);
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  ASSERT_EQ(num_busy, 1);
+
+  // The input file is deleted, so every key is readable only if it is
+  // either rewritten or overwritten.
+  CheckBlobNumber(1);
+  std::string result;
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    Status s = db_->Get(ReadOptions(), GenKey(i), &result);
+    if (i % 3 != 0) {
+      ASSERT_TRUE(s.IsNotFound());
+      continue;
+    }
+    ASSERT_OK(s);
+    ASSERT_EQ(result, i == 3 ? "new_value" : GenValue(i));
+  }
+}
+
 TEST_F(BlobGCJobTest, GCLimiter) {
   class TestLimiter : public RateLimiter {
    public:
@@ -380,6 +670,140 @@ TEST_F(BlobGCJobTest, GCLimiter) {
   Close();
 }
 
+TEST_F(BlobGCJobTest, GCRateLimiter) {
+  std::shared_ptr<RateLimiter> gc_rate_limiter(NewGenericRateLimiter(
+      1 << 30 /*rate_bytes_per_sec*/, 100 * 1000 /*refill_period_us*/,
+      10 /*fairness*/, RateLimiter::Mode::kAllIo, true /*auto_tuned*/));
+  options_.gc_rate_limiter = gc_rate_limiter;
+  NewDB();
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), GenKey(i), GenValue(i)));
+  }
+  Flush();
+  for (int i = 0; i < MAX_KEY_NUM; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), GenKey(i), GenValue(i)));
+  }
+  Flush();
+  ASSERT_EQ(gc_rate_limiter->GetTotalBytesThrough(Env::IO_LOW), 0);
+  RunGC(true);
+  ASSERT_GT(gc_rate_limiter->GetTotalBytesThrough(Env::IO_LOW), 0);
+  Close();
+}
+
+#ifdef ROCKSDB_FALLOCATE_PRESENT
+TEST_F(BlobGCJobTest, GCBusySlowdown) {
+  const int64_t kRate = 1 << 20;
+  std::shared_ptr<RateLimiter> gc_rate_limiter(NewGenericRateLimiter(
+      kRate, 100 * 1000 /*refill_period_us*/, 10 /*fairness*/,
+      RateLimiter::Mode::kAllIo, false /*auto_tuned*/));
+  options_.gc_rate_limiter = gc_rate_limiter;
+  NewDB();
+  auto overwrite_all = [&]() {
+    for (int i = 0; i < MAX_KEY_NUM; i++) {
+      ASSERT_OK(db_->Put(WriteOptions(), GenKey(i), GenValue(i)));
+    }
+    Flush();
+  };
+  bool busy = false;
+  uint64_t delay = 0;
+  SyncPoint::GetInstance()->SetCallBack(
+      "BlobGCJob::IsBaseDBBusy",
+      [&](void* arg) { *static_cast<bool*>(arg) = busy; });
+  SyncPoint::GetInstance()->SetCallBack(
+      "BlobGCJob::RequestGCBytes:BusyDelay",
+      [&](void* arg) { delay += *static_cast<uint64_t*>(arg); });
+  SyncPoint::GetInstance()->EnableProcessing();
+
+  overwrite_all();
+  overwrite_all();
+  RunGC(true);
+  int64_t bytes = gc_rate_limiter->GetTotalBytesThrough(Env::IO_LOW);
+  ASSERT_GT(bytes, 0);
+  ASSERT_EQ(delay, 0);
+
+  // While the base DB is busy, GC sleeps to run at a quarter of the rate,
+  // but is still charged the actual bytes only.
+  busy = true;
+  overwrite_all();
+  RunGC(true);
+  bytes = gc_rate_limiter->GetTotalBytesThrough(Env::IO_LOW) - bytes;
+  ASSERT_GT(bytes, 0);
+  uint64_t expected_delay = static_cast<uint64_t>(bytes) * 3 * 1000000 / kRate;
+  // The delay is slept once it reaches 1ms.
+  ASSERT_LE(delay, expected_delay + 1);
+  ASSERT_GE(delay + 1000, expected_delay);
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  Close();
+}
+
+TEST_F(BlobGCJobTest, PunchHoleGC) {
+  const int kNumKeys = 100;
+  options_.punch_hole_gc = true;
+  NewDB();
+  for (int i = 0; i < kNumKeys; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), GenKey(i), std::string(8 << 10, 'v')));
+  }
+  Flush();
+  // Deletes a contiguous half of the records.
+  for (int i = 0; i < kNumKeys / 2; i++) {
+    ASSERT_OK(db_->Delete(WriteOptions(), GenKey(i)));
+  }
+  Flush();
+  CompactAll();
+  auto b = GetBlobStorage(base_db_->DefaultColumnFamily()->GetID()).lock();
+  ASSERT_EQ(b->files_.size(), 1);
+  auto file = b->files_.begin()->second;
+  uint64_t file_number = file->file_number();
+  ASSERT_EQ(file->physical_size(), file->file_size());
+
+  RunGC(true, true);
+  // The file is kept with its garbage given back to the file system.
+  ASSERT_EQ(b->files_.size(), 1);
+  ASSERT_EQ(b->files_.begin()->first, file_number);
+  ASSERT_LT(file->physical_size(), file->file_size() / 2 + (64 << 10));
+  ASSERT_LT(file->GetDiscardableRatio(), 0.4);
+  auto check_values = [&]() {
+    std::string value;
+    for (int i = 0; i < kNumKeys; i++) {
+      Status s = db_->Get(ReadOptions(), GenKey(i), &value);
+      if (i < kNumKeys / 2) {
+        ASSERT_TRUE(s.IsNotFound());
+        continue;
+      }
+      ASSERT_OK(s);
+      ASSERT_EQ(value, std::string(8 << 10, 'v'));
+    }
+  };
+  check_values();
+
+  // Holes are recovered from the file system after reopen.
+  Reopen();
+  b = GetBlobStorage(base_db_->DefaultColumnFamily()->GetID()).lock();
+  ASSERT_EQ(b->files_.size(), 1);
+  file = b->files_.begin()->second;
+  ASSERT_EQ(file->file_number(), file_number);
+  ASSERT_LT(file->physical_size(), file->file_size() / 2 + (64 << 10));
+  check_values();
+
+  // A rewrite of the punched file only reads the live records.
+  for (int i = kNumKeys / 2; i < kNumKeys * 3 / 4; i++) {
+    ASSERT_OK(db_->Delete(WriteOptions(), GenKey(i)));
+  }
+  Flush();
+  CompactAll();
+  options_.punch_hole_gc = false;
+  RunGC(true, true);
+  ASSERT_EQ(b->files_.size(), 1);
+  ASSERT_NE(b->files_.begin()->first, file_number);
+  std::string value;
+  for (int i = kNumKeys * 3 / 4; i < kNumKeys; i++) {
+    ASSERT_OK(db_->Get(ReadOptions(), GenKey(i), &value));
+    ASSERT_EQ(value, std::string(8 << 10, 'v'));
+  }
+}
+#endif
+
 TEST_F(BlobGCJobTest, Reopen) {
   DisableMergeSmall();
   NewDB();
@@ -6,6 +6,8 @@
 
 #include <cinttypes>
 
+#include <algorithm>
+
 #include "titan_logging.h"
 
 namespace rocksdb {
@@ -28,18 +30,7 @@ std::unique_ptr<BlobGC> BasicBlobGCPicker::PickBlobGC(
   bool stop_picking = false;
   bool maybe_continue_next_time = false;
   uint64_t next_gc_size = 0;
-  for (auto& gc_score : blob_storage->gc_score()) {
-    if (gc_score.score < cf_options_.blob_file_discardable_ratio) {
-      break;
-    }
-    auto blob_file = blob_storage->FindFile(gc_score.file_number).lock();
-    if (!CheckBlobFile(blob_file.get())) {
-      // Skip this file id this file is being GCed
-      // or this file had been GCed
-      TITAN_LOG_INFO(db_options_.info_log, "Blob file %" PRIu64 " no need gc",
-                     blob_file->file_number());
-      continue;
-    }
+  VisitCandidates(blob_storage, [&](std::shared_ptr<BlobFileMeta> blob_file) {
     if (!stop_picking) {
       blob_files.emplace_back(blob_file);
       if (blob_file->file_size() <= cf_options_.merge_small_file_threshold) {
@@ -64,10 +55,11 @@ std::unique_ptr<BlobGC> BasicBlobGCPicker::PickBlobGC(
                        "remain more than %" PRIu64
                        " bytes to be gc and trigger after this gc",
                        next_gc_size);
-        break;
+        return false;
       }
     }
-  }
+    return true;
+  });
   TITAN_LOG_DEBUG(db_options_.info_log,
                   "got batch size %" PRIu64 ", estimate output %" PRIu64
                   " bytes",
@@ -89,6 +81,30 @@ std::unique_ptr<BlobGC> BasicBlobGCPicker::PickBlobGC(
       std::move(blob_files), std::move(cf_options_), maybe_continue_next_time));
 }
 
+void BasicBlobGCPicker::VisitCandidates(
+    BlobStorage* blob_storage,
+    const std::function<bool(std::shared_ptr<BlobFileMeta>)>& visit) {
+  auto gc_scores = blob_storage->gc_score();
+  for (auto& gc_score : *gc_scores) {
+    if (gc_score.score < cf_options_.blob_file_discardable_ratio) {
+      break;
+    }
+    auto blob_file = blob_storage->FindFile(gc_score.file_number).lock();
+    if (!CheckBlobFile(blob_file.get())) {
+      // Skip this file id this file is being GCed
+      // or this file had been GCed
+      TITAN_LOG_INFO(db_options_.info_log, "Blob file %" PRIu64 " no need gc",
+                     gc_score.file_number);
+      continue;
+    }
+    // Files are looked up only until the picking is done, rather than for
+    // every file with enough garbage.
+    if (!visit(std::move(blob_file))) {
+      break;
+    }
+  }
+}
+
 bool BasicBlobGCPicker::CheckBlobFile(BlobFileMeta* blob_file) const {
   assert(blob_file == nullptr ||
          blob_file->file_state() != BlobFileMeta::FileState::kNone);
@@ -99,5 +115,71 @@ bool BasicBlobGCPicker::CheckBlobFile(BlobFileMeta* blob_file) const {
   return true;
 }
 
+void CostBenefitBlobGCPicker::VisitCandidates(
+    BlobStorage* blob_storage,
+    const std::function<bool(std::shared_ptr<BlobFileMeta>)>& visit) {
+  std::vector<std::shared_ptr<BlobFileMeta>> candidates;
+  BasicBlobGCPicker::VisitCandidates(
+      blob_storage, [&](std::shared_ptr<BlobFileMeta> blob_file) {
+        candidates.emplace_back(std::move(blob_file));
+        return true;
+      });
+  uint64_t newest_file_number = 0;
+  for (auto& gc_score : *blob_storage->gc_score()) {
+    newest_file_number = std::max(newest_file_number, gc_score.file_number);
+  }
+  for (auto& blob_file : candidates) {
+    newest_file_number =
+        std::max(newest_file_number, blob_file->file_number());
+  }
+  std::vector<std::pair<double, std::shared_ptr<BlobFileMeta>>> scored;
+  scored.reserve(candidates.size());
+  for (auto& blob_file : candidates) {
+    double score = GetScore(*blob_file, newest_file_number);
+    scored.emplace_back(score, std::move(blob_file));
+  }
+  // Stable, so that files of the same score are still picked by
+  // discardable ratio.
+  std::stable_sort(
+      scored.begin(), scored.end(),
+      [](const std::pair<double, std::shared_ptr<BlobFileMeta>>& a,
+         const std::pair<double, std::shared_ptr<BlobFileMeta>>& b) {
+        return a.first > b.first;
+      });
+  for (auto& file : scored) {
+    if (!visit(std::move(file.second))) {
+      break;
+    }
+  }
+}
+
+double CostBenefitBlobGCPicker::GetScore(const BlobFileMeta& blob_file,
+                                         uint64_t newest_file_number) const {
+  double garbage = blob_file.GetDiscardableRatio();
+  if (blob_file.file_size() < cf_options_.merge_small_file_threshold) {
+    // Small files are worth merging even without much garbage, the same
+    // as BlobStorage::ComputeGCScore() does.
+    garbage = std::max(garbage, cf_options_.blob_file_discardable_ratio);
+  }
+  garbage = std::min(std::max(garbage, 0.0), 1.0);
+  double age =
+      static_cast<double>(newest_file_number - blob_file.file_number() + 1);
+  return garbage * age / (1 + (1 - garbage));
+}
+
+std::unique_ptr<BlobGCPicker> NewBlobGCPicker(const TitanDBOptions& db_options,
+                                              const TitanCFOptions& cf_options,
+                                              TitanStats* stats) {
+  switch (cf_options.gc_policy) {
+    case TitanGCPolicy::kCostBenefit:
+      return std::unique_ptr<BlobGCPicker>(
+          new CostBenefitBlobGCPicker(db_options, cf_options, stats));
+    case TitanGCPolicy::kDiscardableRatio:
+    default:
+      return std::unique_ptr<BlobGCPicker>(
+          new BasicBlobGCPicker(db_options, cf_options, stats));
+  }
+}
+
 }  // namespace titandb
 }  // namespace rocksdb
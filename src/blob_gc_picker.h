@@ -1,6 +1,8 @@
 #pragma once
 
+#include <functional>
 #include <memory>
+#include <vector>
 
 #include "db/column_family.h"
 #include "db/write_callback.h"
@@ -27,22 +29,53 @@ class BlobGCPicker {
   virtual std::unique_ptr<BlobGC> PickBlobGC(BlobStorage* blob_storage) = 0;
 };
 
-class BasicBlobGCPicker final : public BlobGCPicker {
+class BasicBlobGCPicker : public BlobGCPicker {
  public:
   BasicBlobGCPicker(TitanDBOptions, TitanCFOptions, TitanStats*);
   ~BasicBlobGCPicker();
 
   std::unique_ptr<BlobGC> PickBlobGC(BlobStorage* blob_storage) override;
 
- private:
+ protected:
+  // Calls "visit" on the blob files eligible for GC, in the order to pick
+  // them, until it returns false.
+  virtual void VisitCandidates(
+      BlobStorage* blob_storage,
+      const std::function<bool(std::shared_ptr<BlobFileMeta>)>& visit);
+
   TitanDBOptions db_options_;
   TitanCFOptions cf_options_;
   TitanStats* stats_;
 
+ private:
   // Check if blob_file needs to gc, return true means we need pick this
   // file for gc
   bool CheckBlobFile(BlobFileMeta* blob_file) const;
 };
 
+// Picks the eligible blob files by the cost-benefit policy of LFS, i.e.
+// by garbage * age / (1 + live), where garbage and live are fractions of
+// the file. The age of a file is the number of blob files created after
+// it, as file numbers grow monotonically.
+class CostBenefitBlobGCPicker final : public BasicBlobGCPicker {
+ public:
+  using BasicBlobGCPicker::BasicBlobGCPicker;
+
+ protected:
+  // Scores every eligible file, the order can't be known otherwise.
+  void VisitCandidates(BlobStorage* blob_storage,
+                       const std::function<bool(std::shared_ptr<BlobFileMeta>)>&
+                           visit) override;
+
+ private:
+  double GetScore(const BlobFileMeta& blob_file,
+                  uint64_t newest_file_number) const;
+};
+
+// Creates the picker for "cf_options.gc_policy".
+std::unique_ptr<BlobGCPicker> NewBlobGCPicker(const TitanDBOptions& db_options,
+                                              const TitanCFOptions& cf_options,
+                                              TitanStats* stats);
+
 }  // namespace titandb
 }  // namespace rocksdb
@@ -161,6 +161,35 @@ TEST_F(BlobGCPickerTest, ParallelPickGC) {
   UpdateBlobStorage();
 }
 
+TEST_F(BlobGCPickerTest, CostBenefit) {
+  TitanDBOptions titan_db_options;
+  TitanCFOptions titan_cf_options;
+  titan_cf_options.min_gc_batch_size = 0;
+  titan_cf_options.max_gc_batch_size = 1;
+  titan_cf_options.merge_small_file_threshold = 0;
+  NewBlobStorageAndPicker(titan_db_options, titan_cf_options);
+  AddBlobFile(1U, 1U << 20, 600U << 10);
+  AddBlobFile(10U, 1U << 20, 700U << 10);
+  AddBlobFile(11U, 1U << 20, 100U << 10);
+  UpdateBlobStorage();
+  // The young file with more garbage goes first by discardable ratio.
+  auto blob_gc = basic_blob_gc_picker_->PickBlobGC(blob_storage_.get());
+  ASSERT_TRUE(blob_gc != nullptr);
+  ASSERT_EQ(blob_gc->inputs().size(), 1);
+  ASSERT_EQ(blob_gc->inputs()[0]->file_number(), 10U);
+  ASSERT_TRUE(blob_gc->trigger_next());
+  blob_gc->ReleaseGcFiles();
+
+  // The old file goes first by cost-benefit.
+  titan_cf_options.gc_policy = TitanGCPolicy::kCostBenefit;
+  auto picker = NewBlobGCPicker(titan_db_options, titan_cf_options, nullptr);
+  blob_gc = picker->PickBlobGC(blob_storage_.get());
+  ASSERT_TRUE(blob_gc != nullptr);
+  ASSERT_EQ(blob_gc->inputs().size(), 1);
+  ASSERT_EQ(blob_gc->inputs()[0]->file_number(), 1U);
+  ASSERT_TRUE(blob_gc->trigger_next());
+}
+
 }  // namespace titandb
 }  // namespace rocksdb
 
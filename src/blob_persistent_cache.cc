@@ -0,0 +1,534 @@
+#include "blob_persistent_cache.h"
+
+#ifndef __STDC_FORMAT_MACROS
+#define __STDC_FORMAT_MACROS
+#endif
+
+#include <cinttypes>
+
+#include <algorithm>
+
+#include "util/coding.h"
+#include "util/mutexlock.h"
+#include "util/string_util.h"
+
+#include "titan_logging.h"
+
+namespace rocksdb {
+namespace titandb {
+
+namespace {
+
+const char* kSegmentFileSuffix = ".bcdata";
+const char* kIndexFileSuffix = ".bcindex";
+const char* kIdentityFileName = "/IDENTITY";
+
+// Segments are sized so that evicting one drops a small fraction of the
+// cache, within reasonable bounds.
+const uint64_t kMinSegmentSize = 1 << 20;
+const uint64_t kMaxSegmentSize = 64 << 20;
+const uint64_t kMinNumSegments = 16;
+
+// The number of erased blob files remembered.
+const size_t kMaxErasedFiles = 4096;
+
+std::string MakeFileName(const std::string& dirname, uint64_t number,
+                         const char* suffix) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), "/%06" PRIu64 "%s", number, suffix);
+  return dirname + buf;
+}
+
+bool ParseFileName(const std::string& name, const char* suffix,
+                   uint64_t* number) {
+  Slice rest(name);
+  return ConsumeDecimalNumber(&rest, number) && rest == Slice(suffix);
+}
+
+}  // namespace
+
+Status BlobPersistentCache::Open(Env* env, const std::string& dirname,
+                                 uint64_t capacity, const std::string& db_id,
+                                 std::shared_ptr<Logger> info_log,
+                                 std::shared_ptr<BlobPersistentCache>* result) {
+  if (capacity == 0) {
+    return Status::InvalidArgument("persistent blob cache capacity is zero");
+  }
+  std::shared_ptr<BlobPersistentCache> cache(
+      new BlobPersistentCache(env, dirname, capacity, info_log));
+  Status s = cache->Recover(db_id);
+  if (!s.ok()) {
+    return s;
+  }
+  BlobPersistentCache* c = cache.get();
+  cache->writer_thread_.reset(
+      new port::Thread([c]() { c->BackgroundWrite(); }));
+  *result = std::move(cache);
+  return s;
+}
+
+BlobPersistentCache::BlobPersistentCache(Env* env, const std::string& dirname,
+                                         uint64_t capacity,
+                                         std::shared_ptr<Logger> info_log)
+    : env_(env),
+      fs_(env->GetFileSystem()),
+      dirname_(dirname),
+      capacity_(capacity),
+      segment_size_(std::min(
+          kMaxSegmentSize,
+          std::max(kMinSegmentSize, capacity / kMinNumSegments))),
+      info_log_(info_log),
+      work_cv_(&mutex_),
+      done_cv_(&mutex_) {}
+
+BlobPersistentCache::~BlobPersistentCache() {
+  {
+    MutexLock l(&mutex_);
+    closing_ = true;
+    work_cv_.Signal();
+  }
+  if (writer_thread_) {
+    writer_thread_->join();
+  }
+  if (segment_writer_) {
+    segment_writer_->Close(IOOptions(), nullptr /*dbg*/);
+    index_writer_->Close(IOOptions(), nullptr /*dbg*/);
+  }
+}
+
+Status BlobPersistentCache::Recover(const std::string& db_id) {
+  Status s = env_->CreateDirIfMissing(dirname_);
+  if (!s.ok()) return s;
+  s = CheckIdentity(db_id);
+  if (!s.ok()) return s;
+  std::vector<std::string> children;
+  s = env_->GetChildren(dirname_, &children);
+  if (!s.ok()) return s;
+
+  std::vector<uint64_t> numbers;
+  for (auto& name : children) {
+    uint64_t number = 0;
+    if (ParseFileName(name, kSegmentFileSuffix, &number)) {
+      numbers.push_back(number);
+    }
+  }
+  std::sort(numbers.begin(), numbers.end());
+
+  std::vector<uint64_t> evicted;
+  {
+    MutexLock l(&mutex_);
+    for (auto number : numbers) {
+      s = ReplaySegment(number);
+      if (!s.ok()) {
+        // Losing a segment only loses the records in it.
+        TITAN_LOG_WARN(info_log_.get(),
+                       "Drop persistent blob cache segment %" PRIu64 ": %s",
+                       number, s.ToString().c_str());
+        evicted.push_back(number);
+      }
+    }
+    if (!numbers.empty()) {
+      next_segment_number_ = numbers.back() + 1;
+    }
+    // The capacity may be smaller than last time.
+    EvictSegments(&evicted);
+    TITAN_LOG_INFO(info_log_.get(),
+                   "Persistent blob cache %s recovered %" ROCKSDB_PRIszt
+                   " segments, usage %" PRIu64,
+                   dirname_.c_str(), segments_.size(), usage_);
+  }
+  for (auto number : evicted) {
+    DeleteSegmentFiles(number);
+  }
+  return Status::OK();
+}
+
+Status BlobPersistentCache::CheckIdentity(const std::string& db_id) {
+  std::string id;
+  Status s = ReadFileToString(env_, IdentityFileName(), &id);
+  if (s.ok() && id == db_id) {
+    return s;
+  }
+  if (!s.ok() && !s.IsNotFound()) {
+    return s;
+  }
+  // The cache is of another DB, or of no known DB, wipes it before
+  // taking it over.
+  std::vector<std::string> children;
+  s = env_->GetChildren(dirname_, &children);
+  if (!s.ok()) return s;
+  size_t num_deleted = 0;
+  for (auto& name : children) {
+    uint64_t number = 0;
+    if (ParseFileName(name, kSegmentFileSuffix, &number) ||
+        ParseFileName(name, kIndexFileSuffix, &number)) {
+      s = env_->DeleteFile(dirname_ + "/" + name);
+      if (!s.ok()) return s;
+      num_deleted++;
+    }
+  }
+  if (num_deleted > 0) {
+    TITAN_LOG_INFO(info_log_.get(),
+                   "Persistent blob cache %s is not of this DB, deleted "
+                   "%" ROCKSDB_PRIszt " files",
+                   dirname_.c_str(), num_deleted);
+  }
+  return WriteStringToFile(env_, db_id, IdentityFileName(),
+                           true /*should_sync*/);
+}
+
+Status BlobPersistentCache::ReplaySegment(uint64_t number) {
+  mutex_.AssertHeld();
+
+  Segment segment;
+  segment.number = number;
+  Status s = env_->GetFileSize(SegmentFileName(number), &segment.size);
+  if (!s.ok()) return s;
+  std::string index;
+  s = ReadFileToString(env_, IndexFileName(number), &index);
+  if (!s.ok()) return s;
+  std::unique_ptr<FSRandomAccessFile> file;
+  s = fs_->NewRandomAccessFile(SegmentFileName(number), FileOptions(), &file,
+                               nullptr /*dbg*/);
+  if (!s.ok()) return s;
+  segment.file = std::move(file);
+
+  // Entries are appended after their records, so a torn tail entry or an
+  // entry beyond the end of the segment is simply ignored.
+  Slice input(index);
+  while (input.size() >= kIndexEntrySize) {
+    const char* p = input.data();
+    uint64_t file_number = DecodeFixed64(p);
+    uint64_t offset = DecodeFixed64(p + sizeof(uint64_t));
+    uint64_t position = DecodeFixed64(p + 2 * sizeof(uint64_t));
+    uint32_t size = DecodeFixed32(p + 3 * sizeof(uint64_t));
+    input.remove_prefix(kIndexEntrySize);
+    if (size == 0) {
+      index_.erase(file_number);
+      AddErasedFile(file_number);
+      continue;
+    }
+    if (position + size > segment.size) {
+      continue;
+    }
+    index_[file_number][offset] = Location{number, position, size};
+    segment.records.emplace_back(file_number, offset);
+  }
+  usage_ += segment.size;
+  segments_.push_back(std::move(segment));
+  return s;
+}
+
+Status BlobPersistentCache::Lookup(uint64_t file_number, uint64_t offset,
+                                   uint64_t size, CacheAllocationPtr* buffer) {
+  Location location;
+  std::shared_ptr<FSRandomAccessFile> file;
+  {
+    MutexLock l(&mutex_);
+    auto records = index_.find(file_number);
+    if (records == index_.end()) {
+      return Status::NotFound();
+    }
+    auto record = records->second.find(offset);
+    if (record == records->second.end()) {
+      return Status::NotFound();
+    }
+    location = record->second;
+    if (location.size != size) {
+      return Status::Corruption("persistent blob cache record size " +
+                                ToString(location.size) +
+                                " not equal to blob size " + ToString(size));
+    }
+    auto segment = std::lower_bound(
+        segments_.begin(), segments_.end(), location.segment,
+        [](const Segment& a, uint64_t number) { return a.number < number; });
+    assert(segment != segments_.end() && segment->number == location.segment);
+    // Holds the file, so that reading is safe even if the segment is
+    // evicted concurrently.
+    file = segment->file;
+  }
+
+  CacheAllocationPtr scratch(new char[size]);
+  Slice result;
+  Status s = file->Read(location.position, size, IOOptions(), &result,
+                        scratch.get(), nullptr /*dbg*/);
+  if (!s.ok()) {
+    return s;
+  }
+  if (result.size() != size) {
+    return Status::Corruption("persistent blob cache read size " +
+                              ToString(result.size()) +
+                              " not equal to blob size " + ToString(size));
+  }
+  if (result.data() != scratch.get()) {
+    memcpy(scratch.get(), result.data(), size);
+  }
+  *buffer = std::move(scratch);
+  return s;
+}
+
+void BlobPersistentCache::Insert(uint64_t file_number, uint64_t offset,
+                                 const Slice& record) {
+  if (record.empty() || record.size() > segment_size_) {
+    return;
+  }
+  MutexLock l(&mutex_);
+  // Up to a segment worth of records are queued, so that a slow cache
+  // device doesn't pile up memory.
+  if (closing_ || pending_bytes_ + record.size() > segment_size_ ||
+      erased_files_.count(file_number) > 0) {
+    return;
+  }
+  auto records = index_.find(file_number);
+  if ((records != index_.end() && records->second.count(offset) > 0) ||
+      !pending_records_.emplace(file_number, offset).second) {
+    return;
+  }
+  pending_.push_back(PendingWrite{file_number, offset, record.ToString()});
+  pending_bytes_ += record.size();
+  work_cv_.Signal();
+}
+
+void BlobPersistentCache::EraseFile(uint64_t file_number) {
+  MutexLock l(&mutex_);
+  if (!AddErasedFile(file_number)) {
+    return;
+  }
+  // The erase entry is written after the records of the file queued
+  // before, so that it covers them on replay. Records of the file never
+  // cached need no entry: they are never looked up, since the file number
+  // is not reused.
+  bool has_pending = false;
+  for (auto& write : pending_) {
+    if (write.file_number == file_number) {
+      has_pending = true;
+      break;
+    }
+  }
+  if (index_.erase(file_number) == 0 && !has_pending) {
+    return;
+  }
+  pending_.push_back(PendingWrite{file_number, 0, std::string()});
+  work_cv_.Signal();
+}
+
+uint64_t BlobPersistentCache::GetUsage() const {
+  MutexLock l(&mutex_);
+  return usage_;
+}
+
+void BlobPersistentCache::TEST_WaitForWrites() {
+  MutexLock l(&mutex_);
+  while (!pending_.empty() || writing_) {
+    done_cv_.Wait();
+  }
+}
+
+void BlobPersistentCache::BackgroundWrite() {
+  MutexLock l(&mutex_);
+  while (true) {
+    while (pending_.empty() && !closing_) {
+      work_cv_.Wait();
+    }
+    // Queued records are written out even when closing, so that they
+    // survive the restart.
+    if (pending_.empty()) {
+      break;
+    }
+    PendingWrite write = std::move(pending_.front());
+    pending_.pop_front();
+    writing_ = true;
+    mutex_.Unlock();
+    Write(write);
+    mutex_.Lock();
+    writing_ = false;
+    if (!write.record.empty()) {
+      pending_bytes_ -= write.record.size();
+      pending_records_.erase({write.file_number, write.offset});
+    }
+    done_cv_.SignalAll();
+  }
+}
+
+void BlobPersistentCache::Write(const PendingWrite& write) {
+  Status s;
+  if (write.record.empty()) {
+    if (!index_writer_) {
+      s = NewSegment();
+    }
+    if (s.ok()) {
+      s = AppendIndexEntry(write.file_number, 0, 0, 0);
+    }
+    if (!s.ok()) {
+      TITAN_LOG_WARN(info_log_.get(),
+                     "Persistent blob cache erase blob file %" PRIu64
+                     " failed: %s",
+                     write.file_number, s.ToString().c_str());
+    }
+    return;
+  }
+
+  const Slice record(write.record);
+  if (!segment_writer_ || segment_written_ + record.size() > segment_size_) {
+    s = NewSegment();
+    if (!s.ok()) {
+      TITAN_LOG_WARN(info_log_.get(),
+                     "Persistent blob cache new segment failed: %s",
+                     s.ToString().c_str());
+      return;
+    }
+  }
+  uint64_t position = segment_written_;
+  s = segment_writer_->Append(record, IOOptions(), nullptr /*dbg*/);
+  if (s.ok()) {
+    s = segment_writer_->Flush(IOOptions(), nullptr /*dbg*/);
+  }
+  if (s.ok()) {
+    s = AppendIndexEntry(write.file_number, write.offset, position,
+                         static_cast<uint32_t>(record.size()));
+  }
+  if (!s.ok()) {
+    TITAN_LOG_WARN(info_log_.get(),
+                   "Persistent blob cache insert failed: %s, rolls over to "
+                   "a new segment on next insert",
+                   s.ToString().c_str());
+    // The segment may hold a partial record now, stops appending to it.
+    segment_writer_.reset();
+    index_writer_.reset();
+    return;
+  }
+  segment_written_ += record.size();
+
+  std::vector<uint64_t> evicted;
+  {
+    MutexLock l(&mutex_);
+    Segment& segment = segments_.back();
+    segment.size += record.size();
+    usage_ += record.size();
+    // A file erased while the record was queued has its erase entry
+    // written after the record, which covers it on replay.
+    if (erased_files_.count(write.file_number) == 0) {
+      index_[write.file_number][write.offset] = Location{
+          segment.number, position, static_cast<uint32_t>(record.size())};
+      segment.records.emplace_back(write.file_number, write.offset);
+    }
+    EvictSegments(&evicted);
+  }
+  for (auto number : evicted) {
+    DeleteSegmentFiles(number);
+  }
+}
+
+Status BlobPersistentCache::NewSegment() {
+  if (segment_writer_) {
+    segment_writer_->Close(IOOptions(), nullptr /*dbg*/);
+    index_writer_->Close(IOOptions(), nullptr /*dbg*/);
+    segment_writer_.reset();
+    index_writer_.reset();
+  }
+  uint64_t number = next_segment_number_++;
+  std::unique_ptr<FSWritableFile> segment_writer;
+  std::unique_ptr<FSWritableFile> index_writer;
+  std::unique_ptr<FSRandomAccessFile> file;
+  Status s = fs_->NewWritableFile(SegmentFileName(number), FileOptions(),
+                                  &segment_writer, nullptr /*dbg*/);
+  if (s.ok()) {
+    s = fs_->NewWritableFile(IndexFileName(number), FileOptions(),
+                             &index_writer, nullptr /*dbg*/);
+  }
+  if (s.ok()) {
+    s = fs_->NewRandomAccessFile(SegmentFileName(number), FileOptions(),
+                                 &file, nullptr /*dbg*/);
+  }
+  if (!s.ok()) {
+    DeleteSegmentFiles(number);
+    return s;
+  }
+  segment_writer_ = std::move(segment_writer);
+  index_writer_ = std::move(index_writer);
+  segment_written_ = 0;
+  Segment segment;
+  segment.number = number;
+  segment.size = 0;
+  segment.file = std::move(file);
+  MutexLock l(&mutex_);
+  segments_.push_back(std::move(segment));
+  return s;
+}
+
+void BlobPersistentCache::EvictSegments(std::vector<uint64_t>* evicted) {
+  mutex_.AssertHeld();
+
+  // Never evicts the segment being written.
+  while (usage_ > capacity_ && segments_.size() > 1) {
+    Segment& segment = segments_.front();
+    for (auto& key : segment.records) {
+      auto records = index_.find(key.first);
+      if (records == index_.end()) {
+        continue;
+      }
+      auto record = records->second.find(key.second);
+      if (record != records->second.end() &&
+          record->second.segment == segment.number) {
+        records->second.erase(record);
+        if (records->second.empty()) {
+          index_.erase(records);
+        }
+      }
+    }
+    usage_ -= segment.size;
+    evicted->push_back(segment.number);
+    segments_.pop_front();
+  }
+}
+
+void BlobPersistentCache::DeleteSegmentFiles(uint64_t number) {
+  env_->DeleteFile(SegmentFileName(number)).PermitUncheckedError();
+  env_->DeleteFile(IndexFileName(number)).PermitUncheckedError();
+}
+
+bool BlobPersistentCache::AddErasedFile(uint64_t file_number) {
+  mutex_.AssertHeld();
+
+  if (!erased_files_.insert(file_number).second) {
+    return false;
+  }
+  erased_order_.push_back(file_number);
+  if (erased_order_.size() > kMaxErasedFiles) {
+    erased_files_.erase(erased_order_.front());
+    erased_order_.pop_front();
+  }
+  return true;
+}
+
+Status BlobPersistentCache::AppendIndexEntry(uint64_t file_number,
+                                             uint64_t offset,
+                                             uint64_t position,
+                                             uint32_t size) {
+  char buf[kIndexEntrySize];
+  EncodeFixed64(buf, file_number);
+  EncodeFixed64(buf + sizeof(uint64_t), offset);
+  EncodeFixed64(buf + 2 * sizeof(uint64_t), position);
+  EncodeFixed32(buf + 3 * sizeof(uint64_t), size);
+  Status s = index_writer_->Append(Slice(buf, sizeof(buf)), IOOptions(),
+                                   nullptr /*dbg*/);
+  if (s.ok()) {
+    s = index_writer_->Flush(IOOptions(), nullptr /*dbg*/);
+  }
+  return s;
+}
+
+std::string BlobPersistentCache::SegmentFileName(uint64_t number) const {
+  return MakeFileName(dirname_, number, kSegmentFileSuffix);
+}
+
+std::string BlobPersistentCache::IndexFileName(uint64_t number) const {
+  return MakeFileName(dirname_, number, kIndexFileSuffix);
+}
+
+std::string BlobPersistentCache::IdentityFileName() const {
+  return dirname_ + kIdentityFileName;
+}
+
+}  // namespace titandb
+}  // namespace rocksdb
@@ -0,0 +1,178 @@
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "port/port.h"
+#include "rocksdb/env.h"
+#include "rocksdb/file_system.h"
+#include "rocksdb/status.h"
+
+#include "util.h"
+
+namespace rocksdb {
+namespace titandb {
+
+// A file-backed cache of raw blob records, meant to live on a local device
+// that is faster than the one holding the blob files. Records are appended
+// to segment files of a fixed size, and whole segments are evicted in FIFO
+// order once the capacity is exceeded.
+//
+// Every segment "<number>.bcdata" comes with an index file
+// "<number>.bcindex" of fixed size entries:
+//
+//    +-------------+---------+-----------+---------+
+//    | file number | offset  | position  |  size   |
+//    +-------------+---------+-----------+---------+
+//    |   Fixed64   | Fixed64 |  Fixed64  | Fixed32 |
+//    +-------------+---------+-----------+---------+
+//
+// which maps (blob file number, offset) of a record to its position in the
+// segment. The index files are replayed on open so that the cache survives
+// restarts. An entry of size zero erases all the records of a blob file.
+//
+// Blob file numbers are only unique within a DB, so the cache directory
+// also holds an "IDENTITY" file naming the DB it caches. A cache opened
+// for another DB, e.g. one destroyed and recreated, or restored, with the
+// same cache directory, is wiped.
+//
+// Records are written by a background thread, so that filling the cache
+// never blocks reads on I/O. Cached records keep their on-disk format, so
+// the record checksum still guards against a torn or corrupted cache.
+class BlobPersistentCache {
+ public:
+  // Opens the cache of the DB "db_id" in "dirname", which is created if
+  // missing, and replays the existing segments. "capacity" is the maximum
+  // number of bytes taken by the cached records.
+  static Status Open(Env* env, const std::string& dirname, uint64_t capacity,
+                     const std::string& db_id,
+                     std::shared_ptr<Logger> info_log,
+                     std::shared_ptr<BlobPersistentCache>* result);
+
+  // Writes out the queued records, then stops the writer thread.
+  ~BlobPersistentCache();
+
+  // Looks up the raw record at "offset" of the blob file. If found, reads
+  // the record of exactly "size" bytes into "*buffer" and returns OK.
+  // Returns NotFound if the record is not cached.
+  Status Lookup(uint64_t file_number, uint64_t offset, uint64_t size,
+                CacheAllocationPtr* buffer);
+
+  // Queues the raw record at "offset" of the blob file to be cached. The
+  // cache is best effort: records are dropped when too many bytes are
+  // queued already, and write errors are only logged.
+  void Insert(uint64_t file_number, uint64_t offset, const Slice& record);
+
+  // Drops all the records of the blob file. Records of the file are not
+  // cached again afterwards.
+  void EraseFile(uint64_t file_number);
+
+  // Returns the number of bytes taken by the cached records.
+  uint64_t GetUsage() const;
+
+  // Waits till the queued records are written.
+  void TEST_WaitForWrites();
+
+ private:
+  static const size_t kIndexEntrySize =
+      3 * sizeof(uint64_t) + sizeof(uint32_t);
+
+  struct Location {
+    uint64_t segment;
+    uint64_t position;
+    uint32_t size;
+  };
+
+  struct Segment {
+    uint64_t number;
+    uint64_t size;
+    std::shared_ptr<FSRandomAccessFile> file;
+    // (file number, offset) of the records written to this segment, used
+    // to drop them from the index when the segment is evicted.
+    std::vector<std::pair<uint64_t, uint64_t>> records;
+  };
+
+  // A record queued for the writer thread. An empty record is the erase
+  // entry of the blob file.
+  struct PendingWrite {
+    uint64_t file_number;
+    uint64_t offset;
+    std::string record;
+  };
+
+  BlobPersistentCache(Env* env, const std::string& dirname, uint64_t capacity,
+                      std::shared_ptr<Logger> info_log);
+
+  Status Recover(const std::string& db_id);
+  // Deletes every segment, if the cache in "dirname_" is not of "db_id".
+  Status CheckIdentity(const std::string& db_id);
+  Status ReplaySegment(uint64_t number);
+
+  // Writes the queued records till the cache is closed.
+  void BackgroundWrite();
+  // The following are only called by the writer thread, without holding
+  // mutex_, so that lookups never wait for the I/O.
+  void Write(const PendingWrite& write);
+  // Closes the current segment, if any, and starts a new one.
+  Status NewSegment();
+  Status AppendIndexEntry(uint64_t file_number, uint64_t offset,
+                          uint64_t position, uint32_t size);
+
+  // Evicts the oldest segments until the usage is within the capacity,
+  // and adds the numbers of the evicted segments to "*evicted" for the
+  // caller to delete their files.
+  // REQUIRES: mutex_ is held
+  void EvictSegments(std::vector<uint64_t>* evicted);
+  void DeleteSegmentFiles(uint64_t number);
+  // Records that the blob file is erased. Only the most recently erased
+  // files are remembered, which is enough to stop the readers still
+  // holding an erased file from caching its records again. Returns false
+  // if the file is erased already.
+  // REQUIRES: mutex_ is held
+  bool AddErasedFile(uint64_t file_number);
+
+  std::string SegmentFileName(uint64_t number) const;
+  std::string IndexFileName(uint64_t number) const;
+  std::string IdentityFileName() const;
+
+  Env* env_;
+  std::shared_ptr<FileSystem> fs_;
+  const std::string dirname_;
+  const uint64_t capacity_;
+  const uint64_t segment_size_;
+  std::shared_ptr<Logger> info_log_;
+
+  mutable port::Mutex mutex_;
+  // Signaled when a write is queued or the cache is closing.
+  port::CondVar work_cv_;
+  // Signaled when a queued write is done.
+  port::CondVar done_cv_;
+  // blob file number -> offset -> location
+  std::unordered_map<uint64_t, std::unordered_map<uint64_t, Location>> index_;
+  std::unordered_set<uint64_t> erased_files_;
+  // The files in "erased_files_", oldest erased first.
+  std::deque<uint64_t> erased_order_;
+  // Oldest segment first, the last one is being written.
+  std::deque<Segment> segments_;
+  uint64_t usage_{0};
+  std::deque<PendingWrite> pending_;
+  // (file number, offset) of the records in "pending_".
+  std::set<std::pair<uint64_t, uint64_t>> pending_records_;
+  uint64_t pending_bytes_{0};
+  bool writing_{false};
+  bool closing_{false};
+  std::unique_ptr<port::Thread> writer_thread_;
+
+  // Only used by the writer thread.
+  std::unique_ptr<FSWritableFile> segment_writer_;
+  std::unique_ptr<FSWritableFile> index_writer_;
+  uint64_t next_segment_number_{1};
+  // Bytes written to the current segment.
+  uint64_t segment_written_{0};
+};
+
+}  // namespace titandb
+}  // namespace rocksdb
@@ -0,0 +1,160 @@
+#include "blob_persistent_cache.h"
+
+#include "test_util/testharness.h"
+
+namespace rocksdb {
+namespace titandb {
+
+class BlobPersistentCacheTest : public testing::Test {
+ public:
+  BlobPersistentCacheTest()
+      : dirname_(test::TmpDir(env_) + "/blob_persistent_cache") {
+    DestroyDir();
+  }
+
+  ~BlobPersistentCacheTest() {
+    cache_.reset();
+    DestroyDir();
+  }
+
+  void DestroyDir() {
+    std::vector<std::string> children;
+    if (env_->GetChildren(dirname_, &children).ok()) {
+      for (auto& name : children) {
+        env_->DeleteFile(dirname_ + "/" + name);
+      }
+    }
+    env_->DeleteDir(dirname_);
+  }
+
+  void Reopen(uint64_t capacity, const std::string& db_id = "db") {
+    cache_.reset();
+    ASSERT_OK(BlobPersistentCache::Open(env_, dirname_, capacity, db_id,
+                                        nullptr /*info_log*/, &cache_));
+  }
+
+  void CheckFound(uint64_t file_number, uint64_t offset,
+                  const std::string& expect) {
+    CacheAllocationPtr buffer;
+    ASSERT_OK(cache_->Lookup(file_number, offset, expect.size(), &buffer));
+    ASSERT_EQ(Slice(buffer.get(), expect.size()), Slice(expect));
+  }
+
+  void CheckNotFound(uint64_t file_number, uint64_t offset, uint64_t size) {
+    CacheAllocationPtr buffer;
+    ASSERT_TRUE(
+        cache_->Lookup(file_number, offset, size, &buffer).IsNotFound());
+  }
+
+  Env* env_{Env::Default()};
+  std::string dirname_;
+  std::shared_ptr<BlobPersistentCache> cache_;
+};
+
+TEST_F(BlobPersistentCacheTest, Basic) {
+  Reopen(16 << 20);
+  std::string a(100, 'a');
+  std::string b(200, 'b');
+  cache_->Insert(1, 0, a);
+  cache_->Insert(1, 100, b);
+  cache_->Insert(2, 0, b);
+  cache_->TEST_WaitForWrites();
+  CheckFound(1, 0, a);
+  CheckFound(1, 100, b);
+  CheckFound(2, 0, b);
+  CheckNotFound(1, 300, 100);
+  CheckNotFound(3, 0, 100);
+  CacheAllocationPtr buffer;
+  ASSERT_TRUE(cache_->Lookup(1, 0, 99, &buffer).IsCorruption());
+  ASSERT_EQ(cache_->GetUsage(), a.size() + 2 * b.size());
+
+  cache_->EraseFile(1);
+  CheckNotFound(1, 0, a.size());
+  CheckNotFound(1, 100, b.size());
+  CheckFound(2, 0, b);
+  // Records of an erased file are not cached again.
+  cache_->Insert(1, 0, a);
+  cache_->TEST_WaitForWrites();
+  CheckNotFound(1, 0, a.size());
+}
+
+TEST_F(BlobPersistentCacheTest, Recover) {
+  Reopen(16 << 20);
+  std::string a(100, 'a');
+  std::string b(200, 'b');
+  cache_->Insert(1, 0, a);
+  cache_->Insert(2, 0, b);
+  cache_->Insert(2, 200, a);
+  cache_->EraseFile(2);
+
+  Reopen(16 << 20);
+  CheckFound(1, 0, a);
+  CheckNotFound(2, 0, b.size());
+  CheckNotFound(2, 200, a.size());
+  cache_->Insert(3, 0, b);
+
+  Reopen(16 << 20);
+  CheckFound(1, 0, a);
+  CheckFound(3, 0, b);
+}
+
+TEST_F(BlobPersistentCacheTest, Evict) {
+  const uint64_t kCapacity = 4 << 20;
+  const uint64_t kRecordSize = 64 << 10;
+  const uint64_t kNumRecords = 256;
+  Reopen(kCapacity);
+  for (uint64_t i = 0; i < kNumRecords; i++) {
+    cache_->Insert(1, i * kRecordSize,
+                   std::string(kRecordSize, static_cast<char>('a' + i % 26)));
+    cache_->TEST_WaitForWrites();
+    ASSERT_LE(cache_->GetUsage(), kCapacity + (1 << 20));
+  }
+  // The oldest records are evicted first.
+  CheckNotFound(1, 0, kRecordSize);
+  uint64_t last = kNumRecords - 1;
+  CheckFound(1, last * kRecordSize,
+             std::string(kRecordSize, static_cast<char>('a' + last % 26)));
+
+  Reopen(kCapacity);
+  ASSERT_LE(cache_->GetUsage(), kCapacity + (1 << 20));
+  CheckNotFound(1, 0, kRecordSize);
+  CheckFound(1, last * kRecordSize,
+             std::string(kRecordSize, static_cast<char>('a' + last % 26)));
+}
+
+TEST_F(BlobPersistentCacheTest, EraseQueuedRecords) {
+  Reopen(16 << 20);
+  std::string a(100, 'a');
+  // Erased before the records are written, the erase entry still covers
+  // them after a restart.
+  cache_->Insert(1, 0, a);
+  cache_->Insert(1, 100, a);
+  cache_->EraseFile(1);
+  cache_->TEST_WaitForWrites();
+  CheckNotFound(1, 0, a.size());
+  Reopen(16 << 20);
+  CheckNotFound(1, 0, a.size());
+  CheckNotFound(1, 100, a.size());
+}
+
+TEST_F(BlobPersistentCacheTest, Identity) {
+  Reopen(16 << 20, "db1");
+  std::string a(100, 'a');
+  cache_->Insert(1, 0, a);
+  Reopen(16 << 20, "db1");
+  CheckFound(1, 0, a);
+  // The same blob file number of another DB is a different file.
+  Reopen(16 << 20, "db2");
+  CheckNotFound(1, 0, a.size());
+  ASSERT_EQ(cache_->GetUsage(), 0);
+  Reopen(16 << 20, "db1");
+  CheckNotFound(1, 0, a.size());
+}
+
+}  // namespace titandb
+}  // namespace rocksdb
+
+int main(int argc, char** argv) {
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -16,6 +16,34 @@ Status BlobStorage::Get(const ReadOptions& options, const BlobIndex& index,
                           index.blob_handle, record, buffer);
 }
 
+void BlobStorage::MultiGet(const ReadOptions& options,
+                           const std::vector<BlobIndex>& indexes,
+                           BlobRecord* records, PinnableSlice* buffers,
+                           Status* statuses) {
+  size_t start = 0;
+  while (start < indexes.size()) {
+    uint64_t file_number = indexes[start].file_number;
+    std::vector<BlobHandle> handles;
+    size_t end = start;
+    for (; end < indexes.size() && indexes[end].file_number == file_number;
+         end++) {
+      handles.push_back(indexes[end].blob_handle);
+    }
+    auto sfile = FindFile(file_number).lock();
+    if (!sfile) {
+      for (size_t i = start; i < end; i++) {
+        statuses[i] = Status::Corruption("Missing blob file: " +
+                                         std::to_string(file_number));
+      }
+    } else {
+      file_cache_->MultiGet(options, sfile->file_number(), sfile->file_size(),
+                            handles, records + start, buffers + start,
+                            statuses + start);
+    }
+    start = end;
+  }
+}
+
 Status BlobStorage::NewPrefetcher(uint64_t file_number,
                                   std::unique_ptr<BlobFilePrefetcher>* result) {
   auto sfile = FindFile(file_number).lock();
@@ -29,7 +57,7 @@ Status BlobStorage::NewPrefetcher(uint64_t file_number,
 Status BlobStorage::GetBlobFilesInRanges(
     const RangePtr* ranges, size_t n, bool include_end,
     std::vector<std::shared_ptr<BlobFileMeta>>* files) {
-  MutexLock l(&mutex_);
+  ReadLock l(&mutex_);
   for (size_t i = 0; i < n; i++) {
     const Slice* begin = ranges[i].start;
     const Slice* end = ranges[i].limit;
@@ -75,7 +103,7 @@ Status BlobStorage::GetBlobFilesInRanges(
 }
 
 std::weak_ptr<BlobFileMeta> BlobStorage::FindFile(uint64_t file_number) const {
-  MutexLock l(&mutex_);
+  ReadLock l(&mutex_);
   auto it = files_.find(file_number);
   if (it != files_.end()) {
     assert(file_number == it->second->file_number());
@@ -87,21 +115,31 @@ std::weak_ptr<BlobFileMeta> BlobStorage::FindFile(uint64_t file_number) const {
 void BlobStorage::ExportBlobFiles(
     std::map<uint64_t, std::weak_ptr<BlobFileMeta>>& ret) const {
   ret.clear();
-  MutexLock l(&mutex_);
+  ReadLock l(&mutex_);
   for (auto& kv : files_) {
     ret.emplace(kv.first, std::weak_ptr<BlobFileMeta>(kv.second));
   }
 }
 
 void BlobStorage::AddBlobFile(std::shared_ptr<BlobFileMeta>& file) {
-  MutexLock l(&mutex_);
+  WriteLock l(&mutex_);
+  auto it = files_.find(file->file_number());
+  if (it != files_.end()) {
+    // Seals the active write-time blob file, whose meta is already shared
+    // with the readers.
+    assert(it->second->file_state() == BlobFileMeta::FileState::kActive);
+    it->second->set_file_entries(file->file_entries());
+    it->second->set_file_size(file->file_size());
+    it->second->FileStateTransit(BlobFileMeta::FileEvent::kSealed);
+    return;
+  }
   files_.emplace(std::make_pair(file->file_number(), file));
   blob_ranges_.emplace(std::make_pair(Slice(file->smallest_key()), file));
 }
 
 bool BlobStorage::MarkFileObsolete(uint64_t file_number,
                                    SequenceNumber obsolete_sequence) {
-  MutexLock l(&mutex_);
+  WriteLock l(&mutex_);
   auto file = files_.find(file_number);
   if (file == files_.end()) {
     return false;
@@ -117,6 +155,7 @@ void BlobStorage::MarkFileObsoleteLocked(std::shared_ptr<BlobFileMeta> file,
   obsolete_files_.push_back(
       std::make_pair(file->file_number(), obsolete_sequence));
   file->FileStateTransit(BlobFileMeta::FileEvent::kDelete);
+  file_cache_->EvictPersistentCache(file->file_number());
 }
 
 bool BlobStorage::RemoveFile(uint64_t file_number) {
@@ -144,7 +183,7 @@ bool BlobStorage::RemoveFile(uint64_t file_number) {
 
 void BlobStorage::GetObsoleteFiles(std::vector<std::string>* obsolete_files,
                                    SequenceNumber oldest_sequence) {
-  MutexLock l(&mutex_);
+  WriteLock l(&mutex_);
 
   for (auto it = obsolete_files_.begin(); it != obsolete_files_.end();) {
     auto& file_number = it->first;
@@ -173,7 +212,7 @@ void BlobStorage::GetObsoleteFiles(std::vector<std::string>* obsolete_files,
 }
 
 void BlobStorage::GetAllFiles(std::vector<std::string>* files) {
-  MutexLock l(&mutex_);
+  ReadLock l(&mutex_);
 
   for (auto& file : files_) {
     uint64_t file_number = file.first;
@@ -183,13 +222,13 @@ void BlobStorage::GetAllFiles(std::vector<std::string>* files) {
 }
 
 void BlobStorage::UpdateStats() {
-  MutexLock l(&mutex_);
+  ReadLock l(&mutex_);
 
-  levels_file_count_.clear();
-  levels_file_count_.assign(cf_options_.num_levels, 0);
+  std::vector<uint64_t> levels_file_count(levels_file_count_.size(), 0);
   uint64_t live_blob_file_size = 0, num_live_blob_file = 0;
   uint64_t obsolete_blob_file_size = 0, num_obsolete_blob_file = 0;
   std::unordered_map<int, uint64_t> ratio_levels;
+  uint64_t reclaimable_size = 0;
 
   // collect metrics
   for (auto& file : files_) {
@@ -199,17 +238,30 @@ void BlobStorage::UpdateStats() {
       continue;
     }
     num_live_blob_file += 1;
-    levels_file_count_[file.second->file_level()]++;
+    levels_file_count[file.second->file_level()]++;
 
     // If the file is initialized yet, skip it
     if (file.second->file_state() != BlobFileMeta::FileState::kPendingInit) {
       live_blob_file_size += file.second->live_data_size();
       ratio_levels[static_cast<int>(file.second->GetDiscardableRatioLevel())] +=
           1;
+      double ratio = file.second->GetDiscardableRatio();
+      if (ratio > 0) {
+        reclaimable_size += static_cast<uint64_t>(
+            std::min(ratio, 1.0) * file.second->physical_size());
+      }
     }
   }
 
   // update metrics
+  for (size_t i = 0; i < levels_file_count.size(); i++) {
+    levels_file_count_[i].store(levels_file_count[i],
+                                std::memory_order_relaxed);
+  }
+  reclaimable_size_.store(reclaimable_size, std::memory_order_relaxed);
+  num_garbage_files_.store(
+      ratio_levels[TitanInternalStats::NUM_DISCARDABLE_RATIO_LE100],
+      std::memory_order_relaxed);
   SetStats(stats_, cf_id_, TitanInternalStats::LIVE_BLOB_FILE_SIZE,
            live_blob_file_size);
   SetStats(stats_, cf_id_, TitanInternalStats::NUM_LIVE_BLOB_FILE,
@@ -230,11 +282,14 @@ void BlobStorage::ComputeGCScore() {
     return;
   }
 
-  MutexLock l(&mutex_);
-  gc_score_.clear();
+  auto gc_score = std::make_shared<std::vector<GCScore>>();
+  ReadLock l(&mutex_);
+  gc_score->reserve(files_.size());
 
   for (auto& file : files_) {
-    if (file.second->is_obsolete()) {
+    if (file.second->is_obsolete() ||
+        file.second->file_state() == BlobFileMeta::FileState::kActive ||
+        file.second->file_state() == BlobFileMeta::FileState::kPendingFlush) {
       continue;
     }
 
@@ -247,16 +302,26 @@ void BlobStorage::ComputeGCScore() {
     } else {
       score = file.second->GetDiscardableRatio();
     }
-    gc_score_.emplace_back(GCScore{
+    // Too many holes make the file worth rewriting, even if there is little
+    // garbage left in it.
+    if (cf_options_.punch_hole_gc) {
+      double hole_ratio = file.second->GetHoleRatio();
+      if (hole_ratio > cf_options_.punch_hole_max_fragmentation) {
+        score = std::max(score, hole_ratio);
+      }
+    }
+    gc_score->emplace_back(GCScore{
         .file_number = file.first,
         .score = score,
     });
   }
 
-  std::sort(gc_score_.begin(), gc_score_.end(),
+  std::sort(gc_score->begin(), gc_score->end(),
             [](const GCScore& first, const GCScore& second) {
               return first.score > second.score;
             });
+  std::atomic_store(&gc_score_,
+                    std::shared_ptr<const std::vector<GCScore>>(gc_score));
 }
 
 }  // namespace titandb
@@ -5,6 +5,7 @@
 #include <cinttypes>
 
 #include "rocksdb/options.h"
+#include "util/mutexlock.h"
 
 #include "blob_file_cache.h"
 #include "blob_format.h"
@@ -36,7 +37,7 @@ class BlobStorage {
         cf_options_(_cf_options),
         blob_run_mode_(_cf_options.blob_run_mode),
         cf_id_(cf_id),
-        levels_file_count_(_cf_options.num_levels, 0),
+        levels_file_count_(_cf_options.num_levels),
         blob_ranges_(InternalComparator(_cf_options.comparator)),
         file_cache_(_file_cache),
         destroyed_(false),
@@ -57,9 +58,10 @@ class BlobStorage {
     return _cf_options;
   }
 
-  const std::vector<GCScore> gc_score() {
-    MutexLock l(&mutex_);
-    return gc_score_;
+  // Returns the GC score computed by the last ComputeGCScore(). It is
+  // published atomically, so callers don't block file changes.
+  std::shared_ptr<const std::vector<GCScore>> gc_score() const {
+    return std::atomic_load(&gc_score_);
   }
 
   // Gets the blob record pointed by the blob index. The provided
@@ -68,6 +70,15 @@ class BlobStorage {
   Status Get(const ReadOptions& options, const BlobIndex& index,
              BlobRecord* record, PinnableSlice* buffer);
 
+  // Gets the blob records pointed by the blob indexes, reading the
+  // records of the same file in one batch. "records", "buffers" and
+  // "statuses" must have the same length as "indexes".
+  //
+  // REQUIRES: "indexes" are sorted by file number and offset.
+  void MultiGet(const ReadOptions& options,
+                const std::vector<BlobIndex>& indexes, BlobRecord* records,
+                PinnableSlice* buffers, Status* statuses);
+
   // Creates a prefetcher for the specified file number.
   Status NewPrefetcher(uint64_t file_number,
                        std::unique_ptr<BlobFilePrefetcher>* result);
@@ -82,7 +93,7 @@ class BlobStorage {
   std::weak_ptr<BlobFileMeta> FindFile(uint64_t file_number) const;
 
   void StartInitializeAllFiles() {
-    MutexLock l(&mutex_);
+    ReadLock l(&mutex_);
     for (auto& file : files_) {
       file.second->FileStateTransit(BlobFileMeta::FileEvent::kDbStart);
     }
@@ -90,7 +101,7 @@ class BlobStorage {
 
   // Must call before TitanDBImpl initialized.
   void InitializeAllFiles() {
-    MutexLock l(&mutex_);
+    ReadLock l(&mutex_);
     for (auto& file : files_) {
       file.second->FileStateTransit(BlobFileMeta::FileEvent::kDbInit);
     }
@@ -99,13 +110,13 @@ class BlobStorage {
   // The corresponding column family is dropped, so mark destroyed and we can
   // remove this blob storage later.
   void MarkDestroyed() {
-    MutexLock l(&mutex_);
+    WriteLock l(&mutex_);
     destroyed_ = true;
   }
 
   // Returns whether this blob storage can be deleted now.
   bool MaybeRemove() const {
-    MutexLock l(&mutex_);
+    ReadLock l(&mutex_);
     return destroyed_ && obsolete_files_.empty();
   }
 
@@ -115,7 +126,8 @@ class BlobStorage {
   // Collects and updates statistics.
   void UpdateStats();
 
-  // Add a new blob file to this blob storage.
+  // Add a new blob file to this blob storage. Adding an active write-time
+  // blob file again seals it with the size of "file".
   void AddBlobFile(std::shared_ptr<BlobFileMeta>& file);
 
   // Gets all obsolete blob files whose obsolete_sequence is smaller than the
@@ -134,22 +146,33 @@ class BlobStorage {
 
   // Returns the number of blob files, including obsolete files.
   std::size_t NumBlobFiles() const {
-    MutexLock l(&mutex_);
+    ReadLock l(&mutex_);
     return files_.size();
   }
 
   uint64_t NumBlobFilesAtLevel(int level) const {
-    MutexLock l(&mutex_);
     if (level >= static_cast<int>(levels_file_count_.size())) {
       return 0;
     }
-    return levels_file_count_[level];
+    return levels_file_count_[level].load(std::memory_order_relaxed);
+  }
+
+  // Returns the bytes of garbage in the live blob files, as of the last
+  // UpdateStats().
+  uint64_t ReclaimableSize() const {
+    return reclaimable_size_.load(std::memory_order_relaxed);
+  }
+
+  // Returns the number of live blob files with over 80% garbage, as of the
+  // last UpdateStats().
+  uint64_t NumGarbageBlobFiles() const {
+    return num_garbage_files_.load(std::memory_order_relaxed);
   }
 
   // Returns the number of obsolete blob files.
   // TODO: use this method to calculate `kNumObsoleteBlobFile` DB property.
   std::size_t NumObsoleteBlobFiles() const {
-    MutexLock l(&mutex_);
+    ReadLock l(&mutex_);
     return obsolete_files_.size();
   }
 
@@ -175,12 +198,18 @@ class BlobStorage {
   std::atomic<TitanBlobRunMode> blob_run_mode_;
   uint32_t cf_id_;
 
-  mutable port::Mutex mutex_;
+  // Lookups, stats and GC score computation only read the file index,
+  // so they share the lock and only wait for the short sections that
+  // add or remove files.
+  mutable port::RWMutex mutex_;
 
   // Only BlobStorage OWNS BlobFileMeta
   // file_number -> file_meta
   std::unordered_map<uint64_t, std::shared_ptr<BlobFileMeta>> files_;
-  std::vector<uint64_t> levels_file_count_;
+  // Updated by UpdateStats(), read without lock.
+  std::vector<std::atomic<uint64_t>> levels_file_count_;
+  std::atomic<uint64_t> reclaimable_size_{0};
+  std::atomic<uint64_t> num_garbage_files_{0};
 
   class InternalComparator {
    public:
@@ -203,7 +232,9 @@ class BlobStorage {
 
   std::shared_ptr<BlobFileCache> file_cache_;
 
-  std::vector<GCScore> gc_score_;
+  // Sorted by score in descending order, swapped atomically.
+  std::shared_ptr<const std::vector<GCScore>> gc_score_{
+      std::make_shared<const std::vector<GCScore>>()};
 
   std::list<std::pair<uint64_t, SequenceNumber>> obsolete_files_;
   // It is marked when the column family handle is destroyed, indicating the
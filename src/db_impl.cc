@@ -148,7 +148,8 @@ TitanDBImpl::TitanDBImpl(const TitanDBOptions& options,
       dbname_(dbname),
       env_(options.env),
       env_options_(options),
-      db_options_(options) {
+      db_options_(options),
+      active_blob_files_cv_(&active_blob_files_mutex_) {
   if (db_options_.dirname.empty()) {
     db_options_.dirname = dbname_ + "/titandb";
   }
@@ -182,6 +183,14 @@ void TitanDBImpl::StartBackgroundTasks() {
         env_->GetSystemClock().get(),
         db_options_.titan_stats_dump_period_sec * 1000 * 1000));
   }
+  if (thread_check_gc_ == nullptr && !db_options_.disable_background_gc &&
+      db_options_.gc_check_period_sec > 0) {
+    thread_check_gc_.reset(new rocksdb::RepeatableThread(
+        [this]() { TitanDBImpl::CheckGC(); }, "titangc",
+        env_->GetSystemClock().get(),
+        db_options_.gc_check_period_sec * 1000 * 1000,
+        db_options_.gc_check_period_sec * 1000 * 1000 /*initial_delay_us*/));
+  }
 }
 
 Status TitanDBImpl::ValidateOptions(
@@ -194,6 +203,21 @@ Status TitanDBImpl::ValidateOptions(
           "Require enabling level_compaction_dynamic_level_bytes for "
           "level_merge");
     }
+    if (cf.options.write_time_separation &&
+        (cf.options.level_merge || options.allow_mmap_reads)) {
+      return Status::InvalidArgument(
+          "write_time_separation is incompatible with level_merge and "
+          "allow_mmap_reads");
+    }
+    if (cf.options.blob_cache_compressed != nullptr &&
+        cf.options.blob_cache_compressed == cf.options.blob_cache) {
+      return Status::InvalidArgument(
+          "blob_cache_compressed must be a different cache from blob_cache");
+    }
+  }
+  if (options.use_direct_io_for_gc && options.allow_mmap_reads) {
+    return Status::InvalidArgument(
+        "use_direct_io_for_gc is incompatible with allow_mmap_reads");
   }
   return Status::OK();
 }
@@ -331,10 +355,16 @@ Status TitanDBImpl::OpenImpl(const std::vector<TitanCFDescriptor>& descs,
     }
   }
   TEST_SYNC_POINT_CALLBACK("TitanDBImpl::OpenImpl:BeforeOpenBlobFileSet", this);
-  s = blob_file_set_->Open(column_families);
+  std::string db_id;
+  s = db_->GetDbIdentity(db_id);
+  if (!s.ok()) {
+    return s;
+  }
+  s = blob_file_set_->Open(column_families, db_id);
   if (!s.ok()) {
     return s;
   }
+  AddWriteTimeSeparation(column_families);
   s = AsyncInitializeGC(*handles);
   if (!s.ok()) {
     return s;
@@ -396,6 +426,11 @@ Status TitanDBImpl::CloseImpl() {
     }
   }
 
+  {
+    MutexLock l(&active_blob_files_mutex_);
+    SealActiveBlobFiles();
+  }
+
   if (thread_purge_obsolete_ != nullptr) {
     thread_purge_obsolete_->cancel();
     mutex_.Lock();
@@ -410,6 +445,13 @@ Status TitanDBImpl::CloseImpl() {
     mutex_.Unlock();
   }
 
+  if (thread_check_gc_ != nullptr) {
+    thread_check_gc_->cancel();
+    mutex_.Lock();
+    thread_check_gc_.reset();
+    mutex_.Unlock();
+  }
+
   if (thread_initialize_gc_ != nullptr) {
     if (thread_initialize_gc_->joinable()) {
       thread_initialize_gc_->join();
@@ -425,6 +467,10 @@ Status TitanDBImpl::CloseImpl() {
 Status TitanDBImpl::CreateColumnFamilies(
     const std::vector<TitanCFDescriptor>& descs,
     std::vector<ColumnFamilyHandle*>* handles) {
+  Status s = ValidateOptions(db_options_, descs);
+  if (!s.ok()) {
+    return s;
+  }
   std::vector<ColumnFamilyDescriptor> base_descs;
   std::vector<std::shared_ptr<TableFactory>> base_table_factory;
   std::vector<std::shared_ptr<TitanTableFactory>> titan_table_factory;
@@ -451,7 +497,7 @@ Status TitanDBImpl::CreateColumnFamilies(
     base_descs.emplace_back(desc.name, options);
   }
 
-  Status s = db_impl_->CreateColumnFamilies(base_descs, handles);
+  s = db_impl_->CreateColumnFamilies(base_descs, handles);
   assert(handles->size() == descs.size());
 
   if (s.ok()) {
@@ -471,6 +517,7 @@ Status TitanDBImpl::CreateColumnFamilies(
       }
       blob_file_set_->AddColumnFamilies(column_families);
     }
+    AddWriteTimeSeparation(column_families);
   }
   if (s.ok()) {
     for (auto& desc : descs) {
@@ -494,9 +541,11 @@ Status TitanDBImpl::DropColumnFamilies(
     const std::vector<ColumnFamilyHandle*>& handles) {
   TEST_SYNC_POINT("TitanDBImpl::DropColumnFamilies:Begin");
   std::vector<uint32_t> column_families;
+  std::vector<std::string> column_family_names;
   std::string column_families_str;
   for (auto& handle : handles) {
     column_families.emplace_back(handle->GetID());
+    column_family_names.emplace_back(handle->GetName());
     column_families_str += "[" + handle->GetName() + "]";
   }
   {
@@ -513,10 +562,35 @@ Status TitanDBImpl::DropColumnFamilies(
   TEST_SYNC_POINT_CALLBACK("TitanDBImpl::DropColumnFamilies:BeforeBaseDBDropCF",
                            nullptr);
   Status s = db_impl_->DropColumnFamilies(handles);
+  if (s.ok() && write_time_separation_.load()) {
+    // The active blob files are dropped along with the column families
+    // without being sealed.
+    MutexLock l(&active_blob_files_mutex_);
+    for (uint32_t cf_id : column_families) {
+      active_blob_files_.erase(cf_id);
+    }
+  }
   if (s.ok()) {
     MutexLock l(&mutex_);
     SequenceNumber obsolete_sequence = db_impl_->GetLatestSequenceNumber();
     s = blob_file_set_->DropColumnFamilies(column_families, obsolete_sequence);
+    for (uint32_t cf_id : column_families) {
+      unflushed_blob_files_.erase(cf_id);
+      flushed_sequences_.erase(cf_id);
+    }
+    // A dropped column family never reports the end of its stall.
+    for (auto& name : column_family_names) {
+      stalled_cfs_.erase(name);
+    }
+    // Requests queued for the dropped column families are discarded. Jobs
+    // already scheduled skip them.
+    for (uint32_t cf_id : column_families) {
+      auto state = gc_states_.find(cf_id);
+      if (state != gc_states_.end()) {
+        unscheduled_gc_ -= state->second.queued;
+        gc_states_.erase(state);
+      }
+    }
     drop_cf_requests_--;
     if (drop_cf_requests_ == 0) {
       bg_cv_.SignalAll();
@@ -588,6 +662,11 @@ Status TitanDBImpl::Put(const rocksdb::WriteOptions& options,
                         rocksdb::ColumnFamilyHandle* column_family,
                         const rocksdb::Slice& key,
                         const rocksdb::Slice& value) {
+  if (write_time_separation_.load(std::memory_order_relaxed)) {
+    WriteBatch batch;
+    Status s = batch.Put(column_family, key, value);
+    return s.ok() ? Write(options, &batch, nullptr /*callback*/) : s;
+  }
   return HasBGError() ? GetBGError()
                       : db_->Put(options, column_family, key, value);
 }
@@ -595,15 +674,43 @@ Status TitanDBImpl::Put(const rocksdb::WriteOptions& options,
 Status TitanDBImpl::Write(const rocksdb::WriteOptions& options,
                           rocksdb::WriteBatch* updates,
                           PostWriteCallback* callback) {
-  return HasBGError() ? GetBGError() : db_->Write(options, updates, callback);
+  if (HasBGError()) {
+    return GetBGError();
+  }
+  if (write_time_separation_.load(std::memory_order_relaxed)) {
+    std::vector<WriteBatch*> batches{updates};
+    std::vector<WriteBatch> rewritten;
+    std::vector<BlobFileWrite> blob_writes;
+    Status s = SeparateBlobsOnWrite(options, &batches, &rewritten,
+                                    &blob_writes);
+    TEST_SYNC_POINT("TitanDBImpl::Write:BeforeBaseDBWrite");
+    if (s.ok()) {
+      s = db_->Write(options, batches.front(), callback);
+    }
+    EndBlobFileWrites(blob_writes, s);
+    return s;
+  }
+  return db_->Write(options, updates, callback);
 }
 
 Status TitanDBImpl::MultiBatchWrite(const WriteOptions& options,
                                     std::vector<WriteBatch*>&& updates,
                                     PostWriteCallback* callback) {
-  return HasBGError()
-             ? GetBGError()
-             : db_->MultiBatchWrite(options, std::move(updates), callback);
+  if (HasBGError()) {
+    return GetBGError();
+  }
+  if (write_time_separation_.load(std::memory_order_relaxed)) {
+    std::vector<WriteBatch> rewritten;
+    std::vector<BlobFileWrite> blob_writes;
+    Status s =
+        SeparateBlobsOnWrite(options, &updates, &rewritten, &blob_writes);
+    if (s.ok()) {
+      s = db_->MultiBatchWrite(options, std::move(updates), callback);
+    }
+    EndBlobFileWrites(blob_writes, s);
+    return s;
+  }
+  return db_->MultiBatchWrite(options, std::move(updates), callback);
 }
 
 Status TitanDBImpl::Delete(const rocksdb::WriteOptions& options,
@@ -645,6 +752,17 @@ Status TitanDBImpl::Get(const ReadOptions& options, ColumnFamilyHandle* handle,
   return GetImpl(ro, handle, key, value);
 }
 
+void TitanDBImpl::PinBlobValue(const BlobRecord& record, PinnableSlice* buffer,
+                               PinnableSlice* value) {
+  if (buffer->IsPinned()) {
+    // The record lives in the blob cache entry or the read buffer owned by
+    // "buffer", so hands it over to "value" instead of copying.
+    value->PinSlice(record.value, buffer);
+  } else {
+    value->PinSelf(record.value);
+  }
+}
+
 Status TitanDBImpl::GetImpl(const ReadOptions& options,
                             ColumnFamilyHandle* handle, const Slice& key,
                             PinnableSlice* value) {
@@ -669,9 +787,7 @@ Status TitanDBImpl::GetImpl(const ReadOptions& options,
   BlobRecord record;
   PinnableSlice buffer;
 
-  mutex_.Lock();
-  auto storage = blob_file_set_->GetBlobStorage(handle->GetID()).lock();
-  mutex_.Unlock();
+  auto storage = blob_file_set_->GetBlobStorageNoLock(handle->GetID()).lock();
 
   if (storage) {
     StopWatch read_sw(env_->GetSystemClock().get(), statistics(stats_.get()),
@@ -695,7 +811,7 @@ Status TitanDBImpl::GetImpl(const ReadOptions& options,
   }
   if (s.ok()) {
     value->Reset();
-    value->PinSelf(record.value);
+    PinBlobValue(record, &buffer, value);
   }
   return s;
 }
@@ -703,32 +819,144 @@ Status TitanDBImpl::GetImpl(const ReadOptions& options,
 std::vector<Status> TitanDBImpl::MultiGet(
     const ReadOptions& options, const std::vector<ColumnFamilyHandle*>& handles,
     const std::vector<Slice>& keys, std::vector<std::string>* values) {
+  assert(handles.size() == keys.size());
+  size_t num_keys = keys.size();
+  std::vector<ColumnFamilyHandle*> cf_handles(handles);
+  std::vector<Status> res(num_keys);
+  std::unique_ptr<PinnableSlice[]> pinnable_values(new PinnableSlice[num_keys]);
+  MultiGet(options, num_keys, cf_handles.data(), keys.data(),
+           pinnable_values.get(), res.data());
+  values->resize(num_keys);
+  for (size_t i = 0; i < num_keys; i++) {
+    if (res[i].ok()) {
+      (*values)[i].assign(pinnable_values[i].data(), pinnable_values[i].size());
+    }
+  }
+  return res;
+}
+
+void TitanDBImpl::MultiGet(const ReadOptions& options, size_t num_keys,
+                           ColumnFamilyHandle** handles, const Slice* keys,
+                           PinnableSlice* values, Status* statuses,
+                           const bool /*sorted_input*/) {
   auto options_copy = options;
   options_copy.total_order_seek = true;
   if (options_copy.snapshot) {
-    return MultiGetImpl(options_copy, handles, keys, values);
+    return MultiGetImpl(options_copy, num_keys, handles, keys, values,
+                        statuses);
   }
   ReadOptions ro(options_copy);
   ManagedSnapshot snapshot(this);
   ro.snapshot = snapshot.snapshot();
-  return MultiGetImpl(ro, handles, keys, values);
+  MultiGetImpl(ro, num_keys, handles, keys, values, statuses);
 }
 
-std::vector<Status> TitanDBImpl::MultiGetImpl(
-    const ReadOptions& options, const std::vector<ColumnFamilyHandle*>& handles,
-    const std::vector<Slice>& keys, std::vector<std::string>* values) {
-  std::vector<Status> res;
-  res.resize(keys.size());
-  values->resize(keys.size());
-  for (size_t i = 0; i < keys.size(); i++) {
-    auto value = &(*values)[i];
-    PinnableSlice pinnable_value(value);
-    res[i] = GetImpl(options, handles[i], keys[i], &pinnable_value);
-    if (res[i].ok() && pinnable_value.IsPinned()) {
-      value->assign(pinnable_value.data(), pinnable_value.size());
+void TitanDBImpl::MultiGet(const ReadOptions& options,
+                           ColumnFamilyHandle* handle, size_t num_keys,
+                           const Slice* keys, PinnableSlice* values,
+                           Status* statuses, const bool sorted_input) {
+  std::vector<ColumnFamilyHandle*> handles(num_keys, handle);
+  MultiGet(options, num_keys, handles.data(), keys, values, statuses,
+           sorted_input);
+}
+
+void TitanDBImpl::MultiGetImpl(const ReadOptions& options, size_t num_keys,
+                               ColumnFamilyHandle** handles, const Slice* keys,
+                               PinnableSlice* values, Status* statuses) {
+  struct BlobKey {
+    size_t pos;
+    uint32_t cf_id;
+    BlobIndex index;
+  };
+  std::vector<BlobKey> blob_keys;
+
+  // The base DB's batched MultiGet can't return blob indexes, so the
+  // indexes are looked up one by one under the same snapshot.
+  for (size_t i = 0; i < num_keys; i++) {
+    bool is_blob_index = false;
+    DBImpl::GetImplOptions gopts;
+    gopts.column_family = handles[i];
+    gopts.value = &values[i];
+    gopts.is_blob_index = &is_blob_index;
+    values[i].Reset();
+    statuses[i] = db_impl_->GetImpl(options, keys[i], gopts);
+    if (!statuses[i].ok() || !is_blob_index) continue;
+
+    BlobKey blob_key{i, handles[i]->GetID(), BlobIndex()};
+    Slice index_slice(values[i]);
+    statuses[i] = blob_key.index.DecodeFrom(&index_slice);
+    assert(statuses[i].ok());
+    if (!statuses[i].ok()) continue;
+    blob_keys.push_back(blob_key);
+  }
+  if (blob_keys.empty()) return;
+
+  StopWatch get_sw(env_->GetSystemClock().get(), statistics(stats_.get()),
+                   TITAN_GET_MICROS);
+  RecordTick(statistics(stats_.get()), TITAN_NUM_GET, blob_keys.size());
+
+  std::sort(blob_keys.begin(), blob_keys.end(),
+            [](const BlobKey& a, const BlobKey& b) {
+              if (a.cf_id != b.cf_id) return a.cf_id < b.cf_id;
+              if (a.index.file_number != b.index.file_number) {
+                return a.index.file_number < b.index.file_number;
+              }
+              return a.index.blob_handle.offset < b.index.blob_handle.offset;
+            });
+
+  size_t num_blobs = blob_keys.size();
+  std::vector<BlobRecord> records(num_blobs);
+  std::unique_ptr<PinnableSlice[]> buffers(new PinnableSlice[num_blobs]);
+  std::vector<Status> blob_statuses(num_blobs);
+  size_t start = 0;
+  while (start < num_blobs) {
+    uint32_t cf_id = blob_keys[start].cf_id;
+    std::vector<BlobIndex> indexes;
+    uint64_t bytes_read = 0;
+    size_t end = start;
+    for (; end < num_blobs && blob_keys[end].cf_id == cf_id; end++) {
+      indexes.push_back(blob_keys[end].index);
+      bytes_read += blob_keys[end].index.blob_handle.size;
+    }
+
+    auto storage = blob_file_set_->GetBlobStorageNoLock(cf_id).lock();
+
+    if (storage) {
+      StopWatch read_sw(env_->GetSystemClock().get(), statistics(stats_.get()),
+                        TITAN_BLOB_FILE_READ_MICROS);
+      storage->MultiGet(options, indexes, &records[start], &buffers[start],
+                        &blob_statuses[start]);
+      RecordTick(statistics(stats_.get()), TITAN_BLOB_FILE_NUM_KEYS_READ,
+                 indexes.size());
+      RecordTick(statistics(stats_.get()), TITAN_BLOB_FILE_BYTES_READ,
+                 bytes_read);
+    } else {
+      TITAN_LOG_ERROR(db_options_.info_log,
+                      "Column family id:%" PRIu32 " not Found.", cf_id);
+      for (size_t i = start; i < end; i++) {
+        blob_statuses[i] = Status::NotFound(
+            "Column family id: " + std::to_string(cf_id) + " not Found.");
+      }
+    }
+    start = end;
+  }
+
+  for (size_t i = 0; i < num_blobs; i++) {
+    size_t pos = blob_keys[i].pos;
+    Status& s = statuses[pos];
+    s = blob_statuses[i];
+    if (s.IsCorruption()) {
+      TITAN_LOG_ERROR(db_options_.info_log,
+                      "Key:%s Snapshot:%" PRIu64 " GetBlobFile err:%s\n",
+                      keys[pos].ToString(true).c_str(),
+                      options.snapshot->GetSequenceNumber(),
+                      s.ToString().c_str());
+    }
+    if (s.ok()) {
+      values[pos].Reset();
+      PinBlobValue(records[i], &buffers[i], &values[pos]);
     }
   }
-  return res;
 }
 
 Iterator* TitanDBImpl::NewIterator(const TitanReadOptions& options,
@@ -750,9 +978,7 @@ Iterator* TitanDBImpl::NewIteratorImpl(
     std::shared_ptr<ManagedSnapshot> snapshot) {
   auto cfd = reinterpret_cast<ColumnFamilyHandleImpl*>(handle)->cfd();
 
-  mutex_.Lock();
-  auto storage = blob_file_set_->GetBlobStorage(handle->GetID()).lock();
-  mutex_.Unlock();
+  auto storage = blob_file_set_->GetBlobStorageNoLock(handle->GetID()).lock();
 
   if (!storage) {
     TITAN_LOG_ERROR(db_options_.info_log,
@@ -848,6 +1074,10 @@ Status TitanDBImpl::GetAllTitanFiles(std::vector<std::string>& files,
   }
 
   {
+    // Active blob files are sealed first, so that none of the files listed
+    // is appended to afterwards.
+    MutexLock active_l(&active_blob_files_mutex_);
+    SealActiveBlobFiles();
     MutexLock l(&mutex_);
     blob_file_set_->GetAllFiles(&files, edits);
   }
@@ -1106,6 +1336,17 @@ Status TitanDBImpl::SetOptions(
   // Make sure base db's SetOptions success before setting blob_run_mode.
   if (set_blob_run_mode) {
     uint32_t cf_id = column_family->GetID();
+    if (write_time_separation_.load()) {
+      // Values are only separated at write time in normal mode.
+      MutexLock l(&active_blob_files_mutex_);
+      auto it = active_blob_files_.find(cf_id);
+      if (it != active_blob_files_.end()) {
+        it->second.cf_options.blob_run_mode = blob_run_mode;
+        if (blob_run_mode != TitanBlobRunMode::kNormal && it->second.file) {
+          SealActiveBlobFile(cf_id, std::move(it->second.file));
+        }
+      }
+    }
     {
       MutexLock l(&mutex_);
       assert(cf_info_.count(cf_id) > 0);
@@ -1232,6 +1473,13 @@ void TitanDBImpl::OnFlushCompleted(const FlushJobInfo& flush_job_info) {
         continue;
       }
 
+      if (file->is_write_time()) {
+        // Values of write-time blob files become live when flushed, so the
+        // ones overwritten in the memtable are never counted.
+        file->UpdateLiveDataSize(delta);
+        continue;
+      }
+
       if (file->file_state() != BlobFileMeta::FileState::kPendingLSM) {
         // This file may be output of a GC job.
         TITAN_LOG_INFO(db_options_.info_log,
@@ -1250,6 +1498,24 @@ void TitanDBImpl::OnFlushCompleted(const FlushJobInfo& flush_job_info) {
                        file->live_data_size());
       }
     }
+    if (write_time_separation_.load()) {
+      // Sealed write-time blob files are left to GC once the writes to them
+      // are flushed, with their live data counted.
+      SequenceNumber& flushed = flushed_sequences_[flush_job_info.cf_id];
+      flushed = std::max(flushed, flush_job_info.largest_seqno);
+      auto& unflushed = unflushed_blob_files_[flush_job_info.cf_id];
+      for (auto it = unflushed.begin(); it != unflushed.end();) {
+        if (it->first > flushed) {
+          ++it;
+          continue;
+        }
+        const auto& file = it->second;
+        if (file->file_state() == BlobFileMeta::FileState::kPendingFlush) {
+          file->FileStateTransit(BlobFileMeta::FileEvent::kFlushCompleted);
+        }
+        it = unflushed.erase(it);
+      }
+    }
   }
   TEST_SYNC_POINT("TitanDBImpl::OnFlushCompleted:Finished");
 }
@@ -1319,8 +1585,11 @@ void TitanDBImpl::OnCompactionCompleted(
         continue;
       }
 
-      if (file->file_state() == BlobFileMeta::FileState::kPendingInit) {
-        // When uninitialized, only update the live data size.
+      if (file->file_state() == BlobFileMeta::FileState::kPendingInit ||
+          file->file_state() == BlobFileMeta::FileState::kActive ||
+          file->file_state() == BlobFileMeta::FileState::kPendingFlush) {
+        // When uninitialized or still being written to, only update the
+        // live data size.
         file->UpdateLiveDataSize(delta);
         continue;
       }
@@ -1,10 +1,14 @@
 #pragma once
 
+#include <set>
+#include <unordered_set>
+
 #include "db/db_impl/db_impl.h"
 #include "rocksdb/statistics.h"
 #include "rocksdb/threadpool.h"
 #include "util/repeatable_thread.h"
 
+#include "active_blob_file.h"
 #include "blob_file_manager.h"
 #include "blob_file_set.h"
 #include "table_factory.h"
@@ -98,6 +102,15 @@ class TitanDBImpl : public TitanDB {
                                const std::vector<Slice>& keys,
                                std::vector<std::string>* values) override;
 
+  void MultiGet(const ReadOptions& options, size_t num_keys,
+                ColumnFamilyHandle** handles, const Slice* keys,
+                PinnableSlice* values, Status* statuses,
+                const bool sorted_input = false) override;
+
+  void MultiGet(const ReadOptions& options, ColumnFamilyHandle* handle,
+                size_t num_keys, const Slice* keys, PinnableSlice* values,
+                Status* statuses, const bool sorted_input = false) override;
+
   using TitanDB::NewIterator;
   Iterator* NewIterator(const TitanReadOptions& options,
                         ColumnFamilyHandle* handle) override;
@@ -111,6 +124,10 @@ class TitanDBImpl : public TitanDB {
 
   void ReleaseSnapshot(const Snapshot* snapshot) override;
 
+  Status FlushWAL(bool sync) override;
+
+  Status SyncWAL() override;
+
   using TitanDB::DisableFileDeletions;
   Status DisableFileDeletions() override;
 
@@ -156,10 +173,14 @@ class TitanDBImpl : public TitanDB {
     return initialized_.load(std::memory_order_acquire);
   }
 
+  void OnFlushBegin();
+
   void OnFlushCompleted(const FlushJobInfo& flush_job_info);
 
   void OnCompactionCompleted(const CompactionJobInfo& compaction_job_info);
 
+  void OnStallConditionsChanged(const WriteStallInfo& info);
+
   void StartBackgroundTasks();
 
   void TEST_set_initialized(bool _initialized) { initialized_ = _initialized; }
@@ -183,6 +204,8 @@ class TitanDBImpl : public TitanDB {
  private:
   class FileManager;
   friend class FileManager;
+  class BlobSeparator;
+  friend class BlobSeparator;
   friend class BlobGCJobTest;
   friend class BaseDbListener;
   friend class TitanDBTest;
@@ -203,10 +226,22 @@ class TitanDBImpl : public TitanDB {
   Status GetImpl(const ReadOptions& options, ColumnFamilyHandle* handle,
                  const Slice& key, PinnableSlice* value);
 
-  std::vector<Status> MultiGetImpl(
-      const ReadOptions& options,
-      const std::vector<ColumnFamilyHandle*>& handles,
-      const std::vector<Slice>& keys, std::vector<std::string>* values);
+  // Pins "record.value" into "value", moving the pin of "buffer"
+  // which holds the record's data.
+  static void PinBlobValue(const BlobRecord& record, PinnableSlice* buffer,
+                           PinnableSlice* value);
+
+  // Looks up the blob indexes of all keys first, then reads the blob
+  // records grouped by blob file and sorted by offset, so that records
+  // close to each other are fetched with a single read.
+  //
+  // Only the blob reads are batched. The base DB's batched MultiGet
+  // resolves blob indexes through the integrated BlobDB, and fails or
+  // hands back raw index bytes without telling them apart, so the
+  // indexes are looked up key by key with DBImpl::GetImpl.
+  void MultiGetImpl(const ReadOptions& options, size_t num_keys,
+                    ColumnFamilyHandle** handles, const Slice* keys,
+                    PinnableSlice* values, Status* statuses);
 
   Iterator* NewIteratorImpl(const TitanReadOptions& options,
                             ColumnFamilyHandle* handle,
@@ -226,23 +261,26 @@ class TitanDBImpl : public TitanDB {
   void AddToGCQueue(uint32_t column_family_id) {
     mutex_.AssertHeld();
     unscheduled_gc_++;
-    gc_queue_.push_back(column_family_id);
+    gc_states_[column_family_id].queued++;
   }
 
-  // REQUIRE: gc_queue_ not empty
+  // Picks the queued column family with the most garbage in its blob
+  // files, among the ones under their "max_concurrent_gc" limit. A column
+  // family passed over too many times is picked first, so that none of
+  // them starves. Returns false if no column family can be picked.
+  //
   // REQUIRE: mutex_ held
-  uint32_t PopFirstFromGCQueue() {
-    assert(!gc_queue_.empty());
-    auto column_family_id = *gc_queue_.begin();
-    gc_queue_.pop_front();
-    return column_family_id;
-  }
+  bool PickFromGCQueue(uint32_t* column_family_id);
+
+  // Queues the column families with blob files to GC, and forces GC on
+  // the idle ones piling up garbage. Runs every "gc_check_period_sec".
+  void CheckGC();
 
   // REQUIRE: mutex_ held
   void MaybeScheduleGC();
 
-  static void BGWorkGC(void* db);
-  void BackgroundCallGC();
+  static void BGWorkGC(void* db, uint32_t column_family_id);
+  void BackgroundCallGC(uint32_t column_family_id);
   Status BackgroundGC(LogBuffer* log_buffer, uint32_t column_family_id);
 
   void PurgeObsoleteFiles();
@@ -278,6 +316,90 @@ class TitanDBImpl : public TitanDB {
 
   bool HasBGError() { return has_bg_error_.load(); }
 
+  // Blob indexes put by a write for the records it appended to an active
+  // blob file.
+  struct BlobFileWrite {
+    uint32_t cf_id;
+    std::shared_ptr<ActiveBlobFile> file;
+    // The rewritten batch holding the blob indexes, and the position of
+    // the last one in it.
+    const WriteBatch* batch;
+    uint32_t last_index;
+  };
+
+  // Moves the large values of column families with "write_time_separation"
+  // to their active blob files. Each batch of "*updates" with a value moved
+  // is replaced by a rewritten one, holding blob indexes instead, which is
+  // kept in "*rewritten". The files appended to are noted in "*writes",
+  // which must be passed to EndBlobFileWrites() once the batches are
+  // written, even if this fails.
+  Status SeparateBlobsOnWrite(const WriteOptions& options,
+                              std::vector<WriteBatch*>* updates,
+                              std::vector<WriteBatch>* rewritten,
+                              std::vector<BlobFileWrite>* writes);
+
+  // Ends the writes noted by SeparateBlobsOnWrite(), "s" being the status
+  // of writing the batches.
+  void EndBlobFileWrites(const std::vector<BlobFileWrite>& writes,
+                         const Status& s);
+
+  // Keeps the sealed active blob file "file", which no write is putting
+  // blob indexes for any more, from GC until the blob indexes are flushed.
+  void AddUnflushedBlobFile(uint32_t cf_id, const ActiveBlobFile& file);
+
+  // Makes sure the column families in "cf_ids" that separate values
+  // have an active blob file, creating the missing ones. The files are
+  // created with active_blob_files_mutex_ released.
+  // REQUIRE: active_blob_files_mutex_ held
+  Status EnsureActiveBlobFiles(const std::set<uint32_t>& cf_ids);
+
+  // Replaces the full active blob files of the column families in
+  // "cf_ids" with new ones, and seals them. The files are created and
+  // sealed with active_blob_files_mutex_ released.
+  // REQUIRE: active_blob_files_mutex_ held
+  void RotateActiveBlobFiles(const std::set<uint32_t>& cf_ids);
+
+  // Creates an active blob file for the column family and adds it to the
+  // blob file set.
+  Status NewActiveBlobFile(uint32_t cf_id, const TitanCFOptions& cf_options,
+                           std::shared_ptr<ActiveBlobFile>* result);
+
+  // Seals the active blob file and logs its final size. If it fails, the
+  // file stays readable and is sealed again on the next recovery.
+  void SealActiveBlobFile(uint32_t cf_id, std::shared_ptr<ActiveBlobFile> file);
+
+  // Logs the final size of an active blob file, which seals it.
+  Status LogActiveBlobFileSealed(uint32_t cf_id, uint64_t file_number,
+                                 uint64_t file_size, uint64_t file_entries);
+
+  // Stops appending to the active blob file "file" after a failed write,
+  // leaving it to SealAbandonedBlobFiles(). The records before stay
+  // readable.
+  // REQUIRE: active_blob_files_mutex_ held
+  void AbandonActiveBlobFile(std::shared_ptr<ActiveBlobFile> file,
+                             const Status& s);
+
+  // Seals the abandoned active blob files, truncating the torn records
+  // they may end with, so that GC can pick them. A file that fails to be
+  // sealed stays readable and is sealed on the next recovery. The files
+  // are sealed with active_blob_files_mutex_ released.
+  // REQUIRE: active_blob_files_mutex_ held
+  void SealAbandonedBlobFiles();
+
+  // Makes the records appended to the active blob files durable.
+  Status SyncActiveBlobFiles();
+
+  // Seals the active blob files of all column families, after waiting for
+  // the ones being created or sealed by writers. No file is created while
+  // the mutex stays held afterwards.
+  // REQUIRE: active_blob_files_mutex_ held
+  void SealActiveBlobFiles();
+
+  // Starts separating values at write time for the column families with
+  // "write_time_separation" enabled.
+  void AddWriteTimeSeparation(
+      const std::map<uint32_t, TitanCFOptions>& column_families);
+
   void DumpStats();
 
   FileLock* lock_{nullptr};
@@ -322,24 +444,52 @@ class TitanDBImpl : public TitanDB {
   // handle for dump internal stats at fixed intervals.
   std::unique_ptr<RepeatableThread> thread_dump_stats_;
 
+  // handle for checking column families for GC at fixed intervals.
+  std::unique_ptr<RepeatableThread> thread_check_gc_;
+
   std::unique_ptr<port::Thread> thread_initialize_gc_;
 
   std::unique_ptr<BlobFileSet> blob_file_set_;
   std::set<uint64_t> pending_outputs_;
   std::shared_ptr<BlobFileManager> blob_manager_;
 
-  // gc_queue_ hold column families that we need to gc.
-  // pending_gc_ hold column families that already on gc_queue_.
-  std::deque<uint32_t> gc_queue_;
+  // GC scheduling state of a column family.
+  struct GCState {
+    // GC requests not scheduled yet.
+    int queued = 0;
+    // Times passed over for another column family since last picked.
+    int skipped = 0;
+    // GC jobs scheduled or running.
+    int running = 0;
+    // Whether a GC job finished since the last CheckGC().
+    bool gc_done = false;
+    // Blob files with over 80% garbage as of the last CheckGC(), and the
+    // number of checks in a row it has grown with no GC done.
+    uint64_t num_garbage_files = 0;
+    int idle_checks = 0;
+    // Whether the next GC ignores "min_gc_batch_size".
+    bool force = false;
+    // GC jobs in a row that left more to GC while the garbage of the
+    // column family kept growing, and the garbage after the last of them.
+    int backlog_jobs = 0;
+    uint64_t backlog_size = 0;
+  };
+  // REQUIRE: mutex_ held.
+  std::unordered_map<uint32_t, GCState> gc_states_;
 
   // REQUIRE: mutex_ held.
   int bg_gc_scheduled_ = 0;
   // REQUIRE: mutex_ held.
   int bg_gc_running_ = 0;
+  // The number of queued GC requests of all column families.
   // REQUIRE: mutex_ held.
   int unscheduled_gc_ = 0;
   // REQUIRE: mutex_ held.
   int drop_cf_requests_ = 0;
+  // Column families of the base DB with writes delayed or stopped. GC jobs
+  // are not scheduled while it's not empty.
+  // REQUIRE: mutex_ held.
+  std::unordered_set<std::string> stalled_cfs_;
 
   // PurgeObsoleteFiles, DisableFileDeletions and EnableFileDeletions block
   // on the mutex to avoid contention.
@@ -349,6 +499,48 @@ class TitanDBImpl : public TitanDB {
   int disable_titandb_file_deletions_ = 0;
 
   std::atomic_bool shuting_down_{false};
+
+  // Whether any column family has "write_time_separation" enabled.
+  std::atomic<bool> write_time_separation_{false};
+
+  // Serializes the appends to active blob files. It is never acquired while
+  // holding mutex_, and is released for syncing, creating and sealing the
+  // files.
+  port::Mutex active_blob_files_mutex_;
+  // Signaled when a writer is done creating or sealing an active blob file.
+  port::CondVar active_blob_files_cv_;
+
+  // Write-time separation state of a column family.
+  struct ActiveBlobFileState {
+    TitanCFOptions cf_options;
+    // Created on the first value to separate. Writers syncing it out of
+    // the lock hold references to it.
+    std::shared_ptr<ActiveBlobFile> file;
+    // Whether a writer is creating a new file for the column family.
+    bool creating = false;
+  };
+  // Column families with "write_time_separation" enabled.
+  // REQUIRE: access with active_blob_files_mutex_ held.
+  std::unordered_map<uint32_t, ActiveBlobFileState> active_blob_files_;
+  // Active blob files abandoned after a failed write, with their column
+  // families, waiting to be sealed.
+  // REQUIRE: access with active_blob_files_mutex_ held.
+  std::vector<std::pair<uint32_t, std::shared_ptr<ActiveBlobFile>>>
+      abandoned_blob_files_;
+  // Active blob files being created or sealed by writers.
+  // REQUIRE: access with active_blob_files_mutex_ held.
+  int active_blob_file_jobs_ = 0;
+  // Sealed write-time blob files of each column family, waiting for a
+  // flush up to the sequence number of the last blob index referring to
+  // them.
+  // REQUIRE: access with mutex_ held.
+  std::unordered_map<
+      uint32_t,
+      std::vector<std::pair<SequenceNumber, std::shared_ptr<BlobFileMeta>>>>
+      unflushed_blob_files_;
+  // The largest sequence number flushed of each column family.
+  // REQUIRE: access with mutex_ held.
+  std::unordered_map<uint32_t, SequenceNumber> flushed_sequences_;
 };
 
 }  // namespace titandb
@@ -1,3 +1,6 @@
+#include <algorithm>
+#include <limits>
+
 #include "test_util/sync_point.h"
 
 #include "blob_file_iterator.h"
@@ -12,6 +15,16 @@
 namespace rocksdb {
 namespace titandb {
 
+// A queued column family passed over this many times for the ones with
+// more garbage is picked next.
+const int kMaxGCSkips = 8;
+// A column family is forced to GC after this many GC checks in a row
+// find its garbage growing with no GC done.
+const int kMaxIdleGCChecks = 3;
+// A column family gets another GC job running alongside once this many
+// jobs in a row leave more to GC while its garbage keeps growing.
+const int kMinGCBacklogJobs = 3;
+
 Status TitanDBImpl::ExtractGCStatsFromTableProperty(
     const std::shared_ptr<const TableProperties>& table_properties, bool to_add,
     std::map<uint64_t, int64_t>* blob_file_size_diff) {
@@ -172,20 +185,133 @@ void TitanDBImpl::MaybeScheduleGC() {
 
   if (shuting_down_.load(std::memory_order_acquire)) return;
 
+  // GC competes with flushes and compactions for I/O, the queued requests
+  // are scheduled once the stall is over.
+  if (!stalled_cfs_.empty()) return;
+
+  uint32_t column_family_id;
   while (unscheduled_gc_ > 0 &&
-         bg_gc_scheduled_ < db_options_.max_background_gc) {
+         bg_gc_scheduled_ < db_options_.max_background_gc &&
+         PickFromGCQueue(&column_family_id)) {
     unscheduled_gc_--;
     bg_gc_scheduled_++;
-    thread_pool_->SubmitJob(std::bind(&TitanDBImpl::BGWorkGC, this));
+    thread_pool_->SubmitJob(
+        std::bind(&TitanDBImpl::BGWorkGC, this, column_family_id));
+  }
+}
+
+void TitanDBImpl::OnStallConditionsChanged(const WriteStallInfo& info) {
+  MutexLock l(&mutex_);
+  if (info.condition.cur == WriteStallCondition::kNormal) {
+    stalled_cfs_.erase(info.cf_name);
+    MaybeScheduleGC();
+  } else {
+    stalled_cfs_.insert(info.cf_name);
+  }
+}
+
+bool TitanDBImpl::PickFromGCQueue(uint32_t* column_family_id) {
+  mutex_.AssertHeld();
+  auto picked = gc_states_.end();
+  uint64_t picked_size = 0;
+  for (auto it = gc_states_.begin(); it != gc_states_.end(); ++it) {
+    const GCState& state = it->second;
+    if (state.queued == 0) {
+      continue;
+    }
+    // Requests of unknown column families are picked to be skipped.
+    uint64_t size = 0;
+    auto cf_info = cf_info_.find(it->first);
+    if (cf_info != cf_info_.end()) {
+      int max_concurrent_gc =
+          cf_info->second.immutable_cf_options.max_concurrent_gc;
+      if (max_concurrent_gc > 0 && state.running >= max_concurrent_gc) {
+        continue;
+      }
+      auto blob_storage = blob_file_set_->GetBlobStorage(it->first).lock();
+      if (blob_storage != nullptr) {
+        size = blob_storage->ReclaimableSize();
+      }
+    }
+    if (state.skipped >= kMaxGCSkips) {
+      size = std::numeric_limits<uint64_t>::max();
+    }
+    if (picked == gc_states_.end() || size > picked_size) {
+      picked = it;
+      picked_size = size;
+    }
+  }
+  if (picked == gc_states_.end()) {
+    return false;
+  }
+  for (auto& state : gc_states_) {
+    if (state.second.queued > 0) {
+      state.second.skipped++;
+    }
+  }
+  *column_family_id = picked->first;
+  picked->second.queued--;
+  picked->second.skipped = 0;
+  picked->second.running++;
+  return true;
+}
+
+void TitanDBImpl::CheckGC() {
+  MutexLock l(&mutex_);
+  if (!initialized_.load(std::memory_order_acquire) ||
+      shuting_down_.load(std::memory_order_acquire)) {
+    return;
+  }
+  for (auto& cf : cf_info_) {
+    uint32_t cf_id = cf.first;
+    // Blob files of level merge CFs are deleted by compactions.
+    if (cf.second.immutable_cf_options.level_merge ||
+        blob_file_set_->IsColumnFamilyObsolete(cf_id)) {
+      continue;
+    }
+    auto blob_storage = blob_file_set_->GetBlobStorage(cf_id).lock();
+    if (blob_storage == nullptr) {
+      continue;
+    }
+    blob_storage->ComputeGCScore();
+    GCState& state = gc_states_[cf_id];
+    uint64_t num_garbage_files = blob_storage->NumGarbageBlobFiles();
+    if (!state.gc_done && num_garbage_files > state.num_garbage_files) {
+      state.idle_checks++;
+    } else {
+      state.idle_checks = 0;
+    }
+    state.num_garbage_files = num_garbage_files;
+    state.gc_done = false;
+    if (state.idle_checks >= kMaxIdleGCChecks) {
+      TITAN_LOG_INFO(db_options_.info_log,
+                     "Titan force GC on idle cf [%s] with %" PRIu64
+                     " blob files mostly garbage",
+                     cf.second.name.c_str(), num_garbage_files);
+      state.idle_checks = 0;
+      state.force = true;
+    }
+    if (state.queued > 0 || (state.running > 0 && !state.force)) {
+      continue;
+    }
+    auto gc_score = blob_storage->gc_score();
+    if (state.force ||
+        (gc_score && !gc_score->empty() &&
+         gc_score->front().score >=
+             cf.second.immutable_cf_options.blob_file_discardable_ratio)) {
+      AddToGCQueue(cf_id);
+    }
   }
+  MaybeScheduleGC();
 }
 
-void TitanDBImpl::BGWorkGC(void* db) {
-  reinterpret_cast<TitanDBImpl*>(db)->BackgroundCallGC();
+void TitanDBImpl::BGWorkGC(void* db, uint32_t column_family_id) {
+  reinterpret_cast<TitanDBImpl*>(db)->BackgroundCallGC(column_family_id);
 }
 
-void TitanDBImpl::BackgroundCallGC() {
-  TEST_SYNC_POINT("TitanDBImpl::BackgroundCallGC:BeforeGCRunning");
+void TitanDBImpl::BackgroundCallGC(uint32_t column_family_id) {
+  TEST_SYNC_POINT_CALLBACK("TitanDBImpl::BackgroundCallGC:BeforeGCRunning",
+                           &column_family_id);
   {
     MutexLock l(&mutex_);
     assert(bg_gc_scheduled_ > 0);
@@ -195,8 +321,7 @@ void TitanDBImpl::BackgroundCallGC() {
     bg_gc_running_++;
 
     TEST_SYNC_POINT("TitanDBImpl::BackgroundCallGC:BeforeBackgroundGC");
-    if (!gc_queue_.empty()) {
-      uint32_t column_family_id = PopFirstFromGCQueue();
+    {
       LogBuffer log_buffer(InfoLogLevel::INFO_LEVEL,
                            db_options_.info_log.get());
       BackgroundGC(&log_buffer, column_family_id);
@@ -207,6 +332,13 @@ void TitanDBImpl::BackgroundCallGC() {
         mutex_.Lock();
       }
     }
+    // The state is gone if the column family was dropped meanwhile.
+    auto state = gc_states_.find(column_family_id);
+    if (state != gc_states_.end()) {
+      assert(state->second.running > 0);
+      state->second.running--;
+      state->second.gc_done = true;
+    }
 
     bg_gc_running_--;
     bg_gc_scheduled_--;
@@ -231,6 +363,8 @@ Status TitanDBImpl::BackgroundGC(LogBuffer* log_buffer,
 
   std::unique_ptr<BlobGC> blob_gc;
   std::unique_ptr<ColumnFamilyHandle> cfh;
+  // Holds the compression pool of the column family during the job.
+  std::shared_ptr<TitanTableFactory> table_factory;
 
   std::shared_ptr<BlobStorage> blob_storage;
   // Skip CFs that have been dropped.
@@ -242,16 +376,26 @@ Status TitanDBImpl::BackgroundGC(LogBuffer* log_buffer,
                      cf_info_[column_family_id].name.c_str());
   }
   if (blob_storage != nullptr) {
-    const auto& cf_options = blob_storage->cf_options();
-    std::shared_ptr<BlobGCPicker> blob_gc_picker =
-        std::make_shared<BasicBlobGCPicker>(db_options_, cf_options,
-                                            stats_.get());
+    auto cf_options = blob_storage->cf_options();
+    bool& force = gc_states_[column_family_id].force;
+    if (force) {
+      // The CF is idle with garbage piling up, which won't reach the min
+      // batch size soon.
+      cf_options.min_gc_batch_size = 0;
+      force = false;
+    }
+    std::unique_ptr<BlobGCPicker> blob_gc_picker =
+        NewBlobGCPicker(db_options_, cf_options, stats_.get());
     blob_gc = blob_gc_picker->PickBlobGC(blob_storage.get());
 
     if (blob_gc) {
       cfh = db_impl_->GetColumnFamilyHandleUnlocked(column_family_id);
       assert(column_family_id == cfh->GetID());
       blob_gc->SetColumnFamily(cfh.get());
+      auto cf_info = cf_info_.find(column_family_id);
+      if (cf_info != cf_info_.end()) {
+        table_factory = cf_info->second.titan_table_factory;
+      }
     }
   }
 
@@ -264,10 +408,23 @@ Status TitanDBImpl::BackgroundGC(LogBuffer* log_buffer,
   } else {
     StopWatch gc_sw(env_->GetSystemClock().get(), statistics(stats_.get()),
                     TITAN_GC_MICROS);
+    // Sub-jobs run on the idle GC threads, which are reserved for the run
+    // so that GC never takes more than "max_background_gc" threads.
+    int num_subjob_threads = 0;
+    if (thread_pool_ != nullptr && db_options_.max_gc_subjobs > 1) {
+      num_subjob_threads =
+          std::min(static_cast<int>(db_options_.max_gc_subjobs) - 1,
+                   db_options_.max_background_gc - bg_gc_scheduled_);
+      num_subjob_threads = std::max(num_subjob_threads, 0);
+      bg_gc_scheduled_ += num_subjob_threads;
+    }
     BlobGCJob blob_gc_job(blob_gc.get(), db_, &mutex_, db_options_, env_,
                           env_options_, blob_manager_.get(),
                           blob_file_set_.get(), log_buffer, &shuting_down_,
-                          stats_.get());
+                          stats_.get(), thread_pool_.get(),
+                          static_cast<size_t>(num_subjob_threads),
+                          table_factory ? table_factory->compression_pool()
+                                        : nullptr);
     s = blob_gc_job.Prepare();
     if (s.ok()) {
       mutex_.Unlock();
@@ -276,19 +433,42 @@ Status TitanDBImpl::BackgroundGC(LogBuffer* log_buffer,
       TEST_SYNC_POINT("TitanDBImpl::BackgroundGC::AfterRunGCJob");
       mutex_.Lock();
     }
+    bg_gc_scheduled_ -= num_subjob_threads;
     if (s.ok()) {
       s = blob_gc_job.Finish();
     }
     blob_gc->ReleaseGcFiles();
 
-    if (blob_gc->trigger_next() &&
-        (bg_gc_scheduled_ - 1 + gc_queue_.size() <
-         2 * static_cast<uint32_t>(db_options_.max_background_gc))) {
+    GCState& state = gc_states_[column_family_id];
+    if (blob_gc->trigger_next()) {
+      // GC falls behind if the garbage keeps growing, unless the base DB
+      // is busy and GC is meant to slow down.
+      uint64_t reclaimable_size = blob_storage->ReclaimableSize();
+      bool backlog = reclaimable_size >= state.backlog_size &&
+                     !blob_gc_job.base_db_busy();
+      TEST_SYNC_POINT_CALLBACK("TitanDBImpl::BackgroundGC:Backlog", &backlog);
+      state.backlog_jobs = backlog ? state.backlog_jobs + 1 : 0;
+      state.backlog_size = reclaimable_size;
+    } else {
+      state.backlog_jobs = 0;
+      state.backlog_size = 0;
+    }
+    if (blob_gc->trigger_next() && state.queued == 0) {
       RecordTick(statistics(stats_.get()), TITAN_GC_TRIGGER_NEXT, 1);
-      // There is still data remained to be GCed
-      // and the queue is not overwhelmed
-      // then put this cf to GC queue for next GC
-      AddToGCQueue(blob_gc->column_family_handle()->GetID());
+      // There is still data remained to be GCed and the cf is not queued
+      // yet, then put this cf to GC queue for next GC. Other cfs are
+      // still picked first if they have more garbage.
+      AddToGCQueue(column_family_id);
+      if (state.backlog_jobs >= kMinGCBacklogJobs) {
+        // Speeds GC up with another job on an idle GC thread, still
+        // subject to "max_concurrent_gc" and the rate limiter.
+        TITAN_LOG_BUFFER(log_buffer,
+                         "Titan GC falls behind on cf [%s], %" PRIu64
+                         " bytes of garbage left",
+                         cf_info_[column_family_id].name.c_str(),
+                         state.backlog_size);
+        AddToGCQueue(column_family_id);
+      }
     }
 
     if (s.ok()) {
@@ -302,7 +482,8 @@ Status TitanDBImpl::BackgroundGC(LogBuffer* log_buffer,
     }
   }
 
-  TEST_SYNC_POINT("TitanDBImpl::BackgroundGC:Finish");
+  TEST_SYNC_POINT_CALLBACK("TitanDBImpl::BackgroundGC:Finish",
+                           &column_family_id);
   return s;
 }
 
@@ -0,0 +1,623 @@
+#include <cinttypes>
+
+#include "db/write_batch_internal.h"
+#include "monitoring/statistics_impl.h"
+#include "test_util/sync_point.h"
+#include "util/mutexlock.h"
+
+#include "db_impl.h"
+#include "titan_logging.h"
+
+namespace rocksdb {
+namespace titandb {
+
+// Rewrites write batches, appending the values to separate to the active
+// blob files of their column families and putting blob indexes in their
+// place. Other records are copied as they are.
+class TitanDBImpl::BlobSeparator : public WriteBatch::Handler {
+ public:
+  // The records appended to active blob files are noted in "*writes".
+  BlobSeparator(TitanDBImpl* db, std::vector<BlobFileWrite>* writes)
+      : db_(db), writes_(writes) {}
+
+  // Rewrites the records iterated from now on into "*output".
+  void Reset(WriteBatch* output) {
+    output_ = output;
+    separated_ = false;
+  }
+
+  // Adds the column families that values iterated from now on are to be
+  // separated for to "*cf_ids", instead of rewriting the records.
+  void Collect(std::set<uint32_t>* cf_ids) {
+    output_ = nullptr;
+    cf_ids_ = cf_ids;
+  }
+
+  // Whether any value has been separated since the last Reset().
+  bool separated() const { return separated_; }
+
+  // Makes the records appended so far readable. The files to make them
+  // durable if "sync" are added to "*to_sync", unless they can't be synced
+  // concurrently with appends, in which case they are synced here. The
+  // column families with active blob files that have reached their target
+  // size are added to "*full".
+  Status Finish(bool sync, std::vector<std::shared_ptr<ActiveBlobFile>>* to_sync,
+                std::set<uint32_t>* full) {
+    Status s;
+    for (uint32_t cf_id : touched_) {
+      auto it = db_->active_blob_files_.find(cf_id);
+      if (it == db_->active_blob_files_.end() || !it->second.file) {
+        continue;
+      }
+      auto& state = it->second;
+      bool sync_now = sync && !state.file->IsSyncThreadSafe();
+      Status flush_status = state.file->Flush(sync_now);
+      if (!flush_status.ok()) {
+        db_->AbandonActiveBlobFile(state.file, flush_status);
+        if (s.ok()) {
+          s = flush_status;
+        }
+        continue;
+      }
+      if (sync && !sync_now) {
+        to_sync->push_back(state.file);
+      }
+      if (state.file->file_size() >= state.cf_options.blob_file_target_size) {
+        full->insert(cf_id);
+      }
+    }
+    return s;
+  }
+
+  Status PutCF(uint32_t column_family_id, const Slice& key,
+               const Slice& value) override {
+    auto* state = GetState(column_family_id, value.size());
+    if (output_ == nullptr) {
+      if (state != nullptr) {
+        cf_ids_->insert(column_family_id);
+      }
+      return Status::OK();
+    }
+    // The value stays in the LSM-tree if the file couldn't be created.
+    if (state == nullptr || !state->file) {
+      return WriteBatchInternal::Put(output_, column_family_id, key, value);
+    }
+    ActiveBlobFile* file = state->file.get();
+
+    BlobRecord record;
+    record.key = key;
+    record.value = value;
+    BlobIndex index;
+    index.file_number = file->file_number();
+    touched_.insert(column_family_id);
+    Status s = file->Add(record, &index.blob_handle);
+    if (!s.ok()) {
+      db_->AbandonActiveBlobFile(state->file, s);
+      return s;
+    }
+    separated_ = true;
+    RecordTick(statistics(db_->stats_.get()), TITAN_BLOB_FILE_NUM_KEYS_WRITTEN);
+    RecordTick(statistics(db_->stats_.get()), TITAN_BLOB_FILE_BYTES_WRITTEN,
+               index.blob_handle.size);
+
+    index_buffer_.clear();
+    index.EncodeTo(&index_buffer_);
+    s = WriteBatchInternal::PutBlobIndex(output_, column_family_id, key,
+                                         index_buffer_);
+    if (s.ok()) {
+      NoteWrite(column_family_id, state->file);
+    }
+    return s;
+  }
+
+  Status DeleteCF(uint32_t column_family_id, const Slice& key) override {
+    if (output_ == nullptr) {
+      return Status::OK();
+    }
+    return WriteBatchInternal::Delete(output_, column_family_id, key);
+  }
+
+  Status SingleDeleteCF(uint32_t column_family_id, const Slice& key) override {
+    if (output_ == nullptr) {
+      return Status::OK();
+    }
+    return WriteBatchInternal::SingleDelete(output_, column_family_id, key);
+  }
+
+  Status DeleteRangeCF(uint32_t column_family_id, const Slice& begin_key,
+                       const Slice& end_key) override {
+    if (output_ == nullptr) {
+      return Status::OK();
+    }
+    return WriteBatchInternal::DeleteRange(output_, column_family_id,
+                                           begin_key, end_key);
+  }
+
+  Status MergeCF(uint32_t column_family_id, const Slice& key,
+                 const Slice& value) override {
+    if (output_ == nullptr) {
+      return Status::OK();
+    }
+    return WriteBatchInternal::Merge(output_, column_family_id, key, value);
+  }
+
+  Status PutBlobIndexCF(uint32_t column_family_id, const Slice& key,
+                        const Slice& value) override {
+    if (output_ == nullptr) {
+      return Status::OK();
+    }
+    return WriteBatchInternal::PutBlobIndex(output_, column_family_id, key,
+                                            value);
+  }
+
+  void LogData(const Slice& blob) override {
+    if (output_ != nullptr) {
+      output_->PutLogData(blob).PermitUncheckedError();
+    }
+  }
+
+ private:
+  // Returns the write-time separation state of the column family if a
+  // value of "value_size" is to be separated, or nullptr if the value
+  // stays in the LSM-tree.
+  ActiveBlobFileState* GetState(uint32_t cf_id, size_t value_size) {
+    auto it = db_->active_blob_files_.find(cf_id);
+    if (it == db_->active_blob_files_.end()) {
+      return nullptr;
+    }
+    auto& state = it->second;
+    if (state.cf_options.blob_run_mode != TitanBlobRunMode::kNormal ||
+        value_size < state.cf_options.min_blob_size) {
+      return nullptr;
+    }
+    return &state;
+  }
+
+  // Notes that the blob index just put into the output batch refers to
+  // "file".
+  void NoteWrite(uint32_t cf_id, const std::shared_ptr<ActiveBlobFile>& file) {
+    uint32_t index = WriteBatchInternal::Count(output_) - 1;
+    if (!writes_->empty() && writes_->back().file == file &&
+        writes_->back().batch == output_) {
+      writes_->back().last_index = index;
+      return;
+    }
+    file->BeginWrite();
+    writes_->push_back(BlobFileWrite{cf_id, file, output_, index});
+  }
+
+  TitanDBImpl* db_;
+  std::vector<BlobFileWrite>* writes_;
+  WriteBatch* output_{nullptr};
+  std::set<uint32_t>* cf_ids_{nullptr};
+  bool separated_{false};
+  // Column families with values appended to their active blob files.
+  std::set<uint32_t> touched_;
+  std::string index_buffer_;
+};
+
+Status TitanDBImpl::SeparateBlobsOnWrite(const WriteOptions& options,
+                                         std::vector<WriteBatch*>* updates,
+                                         std::vector<WriteBatch>* rewritten,
+                                         std::vector<BlobFileWrite>* writes) {
+  std::vector<std::shared_ptr<ActiveBlobFile>> to_sync;
+  Status s;
+  {
+    MutexLock l(&active_blob_files_mutex_);
+    BlobSeparator separator(this, writes);
+    // The missing active blob files are created before any value is
+    // appended, since the mutex is released meanwhile.
+    std::set<uint32_t> cf_ids;
+    separator.Collect(&cf_ids);
+    for (auto* batch : *updates) {
+      s = batch->Iterate(&separator);
+      if (!s.ok()) {
+        return s;
+      }
+    }
+    s = EnsureActiveBlobFiles(cf_ids);
+    if (!s.ok()) {
+      return s;
+    }
+
+    // The rewritten batches are referred to by pointers, so they must not
+    // be moved by reallocation.
+    rewritten->reserve(updates->size());
+    for (auto& batch : *updates) {
+      rewritten->emplace_back();
+      separator.Reset(&rewritten->back());
+      s = batch->Iterate(&separator);
+      if (!s.ok()) {
+        break;
+      }
+      if (separator.separated()) {
+        batch = &rewritten->back();
+      } else {
+        rewritten->pop_back();
+      }
+    }
+    std::set<uint32_t> full;
+    Status finish_status = separator.Finish(options.sync, &to_sync, &full);
+    if (s.ok()) {
+      s = finish_status;
+    }
+    RotateActiveBlobFiles(full);
+    SealAbandonedBlobFiles();
+  }
+  // Other writers keep appending to the files while they are synced. The
+  // records are synced before the WAL, which refers to them, is.
+  for (auto& file : to_sync) {
+    Status sync_status = file->Sync();
+    if (!sync_status.ok()) {
+      MutexLock l(&active_blob_files_mutex_);
+      AbandonActiveBlobFile(file, sync_status);
+      SealAbandonedBlobFiles();
+      if (s.ok()) {
+        s = sync_status;
+      }
+    }
+  }
+  return s;
+}
+
+void TitanDBImpl::EndBlobFileWrites(const std::vector<BlobFileWrite>& writes,
+                                    const Status& s) {
+  for (const auto& write : writes) {
+    SequenceNumber sequence = 0;
+    if (s.ok()) {
+      sequence = WriteBatchInternal::Sequence(write.batch) + write.last_index;
+    }
+    if (write.file->EndWrite(sequence)) {
+      AddUnflushedBlobFile(write.cf_id, *write.file);
+    }
+  }
+}
+
+void TitanDBImpl::AddUnflushedBlobFile(uint32_t cf_id,
+                                       const ActiveBlobFile& file) {
+  MutexLock l(&mutex_);
+  const auto& meta = file.file();
+  // The column family may be dropped meanwhile.
+  if (meta->file_state() != BlobFileMeta::FileState::kPendingFlush) {
+    return;
+  }
+  SequenceNumber sequence = file.last_sequence();
+  auto flushed = flushed_sequences_.find(cf_id);
+  if (sequence == 0 || (flushed != flushed_sequences_.end() &&
+                        flushed->second >= sequence)) {
+    meta->FileStateTransit(BlobFileMeta::FileEvent::kFlushCompleted);
+    return;
+  }
+  unflushed_blob_files_[cf_id].emplace_back(sequence, meta);
+}
+
+Status TitanDBImpl::SyncActiveBlobFiles() {
+  std::vector<std::shared_ptr<ActiveBlobFile>> to_sync;
+  Status s;
+  {
+    MutexLock l(&active_blob_files_mutex_);
+    // The files being replaced are synced by sealing them.
+    while (active_blob_file_jobs_ > 0) {
+      active_blob_files_cv_.Wait();
+    }
+    for (auto& cf : active_blob_files_) {
+      std::shared_ptr<ActiveBlobFile> file = cf.second.file;
+      if (!file) {
+        continue;
+      }
+      if (file->IsSyncThreadSafe()) {
+        to_sync.push_back(std::move(file));
+        continue;
+      }
+      Status sync_status = file->Flush(true /*sync*/);
+      if (!sync_status.ok()) {
+        AbandonActiveBlobFile(file, sync_status);
+        if (s.ok()) {
+          s = sync_status;
+        }
+      }
+    }
+    SealAbandonedBlobFiles();
+  }
+  for (auto& file : to_sync) {
+    Status sync_status = file->Sync();
+    if (!sync_status.ok()) {
+      MutexLock l(&active_blob_files_mutex_);
+      AbandonActiveBlobFile(file, sync_status);
+      SealAbandonedBlobFiles();
+      if (s.ok()) {
+        s = sync_status;
+      }
+    }
+  }
+  return s;
+}
+
+Status TitanDBImpl::FlushWAL(bool sync) {
+  if (sync && write_time_separation_.load()) {
+    Status s = SyncActiveBlobFiles();
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  return db_->FlushWAL(sync);
+}
+
+Status TitanDBImpl::SyncWAL() {
+  if (write_time_separation_.load()) {
+    Status s = SyncActiveBlobFiles();
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  return db_->SyncWAL();
+}
+
+void TitanDBImpl::OnFlushBegin() {
+  if (!write_time_separation_.load()) {
+    return;
+  }
+  // The flushed blob indexes refer to records which may not be synced yet.
+  // Writes stop on failure, as the flush goes on regardless.
+  Status s = SyncActiveBlobFiles();
+  if (!s.ok()) {
+    TITAN_LOG_ERROR(db_options_.info_log,
+                    "Titan failed to sync active blob files before flush: %s",
+                    s.ToString().c_str());
+    MutexLock l(&mutex_);
+    SetBGError(s);
+  }
+}
+
+Status TitanDBImpl::EnsureActiveBlobFiles(const std::set<uint32_t>& cf_ids) {
+  active_blob_files_mutex_.AssertHeld();
+  for (uint32_t cf_id : cf_ids) {
+    while (true) {
+      auto it = active_blob_files_.find(cf_id);
+      if (it == active_blob_files_.end() || it->second.file) {
+        break;
+      }
+      if (it->second.creating) {
+        active_blob_files_cv_.Wait();
+        continue;
+      }
+      it->second.creating = true;
+      active_blob_file_jobs_++;
+      TitanCFOptions cf_options = it->second.cf_options;
+      std::shared_ptr<ActiveBlobFile> file;
+      active_blob_files_mutex_.Unlock();
+      Status s = NewActiveBlobFile(cf_id, cf_options, &file);
+      active_blob_files_mutex_.Lock();
+      active_blob_file_jobs_--;
+      active_blob_files_cv_.SignalAll();
+      // The file goes with the column family if it was dropped meanwhile.
+      it = active_blob_files_.find(cf_id);
+      if (it != active_blob_files_.end()) {
+        it->second.creating = false;
+        if (s.ok()) {
+          it->second.file = std::move(file);
+        }
+      }
+      if (!s.ok()) {
+        return s;
+      }
+    }
+  }
+  return Status::OK();
+}
+
+void TitanDBImpl::RotateActiveBlobFiles(const std::set<uint32_t>& cf_ids) {
+  active_blob_files_mutex_.AssertHeld();
+  for (uint32_t cf_id : cf_ids) {
+    auto it = active_blob_files_.find(cf_id);
+    // Another writer is replacing the file already.
+    if (it == active_blob_files_.end() || it->second.creating) {
+      continue;
+    }
+    it->second.creating = true;
+    active_blob_file_jobs_++;
+    TitanCFOptions cf_options = it->second.cf_options;
+    std::shared_ptr<ActiveBlobFile> file;
+    active_blob_files_mutex_.Unlock();
+    Status s = NewActiveBlobFile(cf_id, cf_options, &file);
+    active_blob_files_mutex_.Lock();
+    std::shared_ptr<ActiveBlobFile> full;
+    it = active_blob_files_.find(cf_id);
+    if (it != active_blob_files_.end()) {
+      it->second.creating = false;
+      if (s.ok()) {
+        full = std::move(it->second.file);
+        it->second.file = std::move(file);
+      }
+    }
+    if (!s.ok()) {
+      // Values keep going to the full file.
+      TITAN_LOG_WARN(db_options_.info_log,
+                     "Titan failed to replace full active blob file: %s",
+                     s.ToString().c_str());
+    }
+    if (full) {
+      // No writer appends to the file any more.
+      active_blob_files_mutex_.Unlock();
+      SealActiveBlobFile(cf_id, std::move(full));
+      active_blob_files_mutex_.Lock();
+    }
+    active_blob_file_jobs_--;
+    active_blob_files_cv_.SignalAll();
+  }
+}
+
+Status TitanDBImpl::NewActiveBlobFile(uint32_t cf_id,
+                                      const TitanCFOptions& cf_options,
+                                      std::shared_ptr<ActiveBlobFile>* result) {
+  TEST_SYNC_POINT("TitanDBImpl::NewActiveBlobFile:Begin");
+  std::unique_ptr<BlobFileHandle> handle;
+  Status s = blob_manager_->NewFile(&handle, Env::IOPriority::IO_HIGH);
+  if (!s.ok()) {
+    return s;
+  }
+  // The file is referred to by the manifest before any record is appended,
+  // so that recovery can find and seal it.
+  s = ActiveBlobFile::WriteHeader(handle->GetFile());
+  if (s.ok()) {
+    s = handle->GetFile()->Sync(false /*use_fsync*/);
+  }
+  if (s.ok()) {
+    s = directory_->Fsync();
+  }
+  auto file = std::make_shared<BlobFileMeta>(
+      handle->GetNumber(), 0 /*file_size*/, 0 /*file_entries*/,
+      0 /*file_level*/, "" /*smallest_key*/, "" /*largest_key*/);
+  file->FileStateTransit(BlobFileMeta::FileEvent::kWriteTimeOutput);
+  if (s.ok()) {
+    VersionEdit edit;
+    edit.SetColumnFamilyID(cf_id);
+    edit.AddBlobFile(file);
+    MutexLock l(&mutex_);
+    s = blob_file_set_->LogAndApply(edit);
+    if (!s.ok()) {
+      SetBGError(s);
+    }
+  }
+  if (!s.ok()) {
+    blob_manager_->DeleteFile(std::move(handle)).PermitUncheckedError();
+    return s;
+  }
+  {
+    MutexLock l(&mutex_);
+    pending_outputs_.erase(file->file_number());
+  }
+  TITAN_LOG_INFO(db_options_.info_log,
+                 "Titan adding active blob file [%" PRIu64 "]",
+                 file->file_number());
+  result->reset(new ActiveBlobFile(cf_options, file, std::move(handle)));
+  return s;
+}
+
+void TitanDBImpl::SealActiveBlobFile(uint32_t cf_id,
+                                     std::shared_ptr<ActiveBlobFile> file) {
+  Status s = file->Finish();
+  if (s.ok()) {
+    s = LogActiveBlobFileSealed(cf_id, file->file_number(), file->file_size(),
+                                file->file_entries());
+  }
+  // Writers may still be putting blob indexes referring to the file.
+  if (s.ok() && file->MarkSealed()) {
+    AddUnflushedBlobFile(cf_id, *file);
+  }
+  if (s.ok()) {
+    TITAN_LOG_INFO(db_options_.info_log,
+                   "Titan sealed active blob file [%" PRIu64 "], size %" PRIu64
+                   ", entries %" PRIu64,
+                   file->file_number(), file->file_size(),
+                   file->file_entries());
+  } else {
+    TITAN_LOG_WARN(db_options_.info_log,
+                   "Titan failed to seal active blob file [%" PRIu64 "]: %s",
+                   file->file_number(), s.ToString().c_str());
+  }
+}
+
+Status TitanDBImpl::LogActiveBlobFileSealed(uint32_t cf_id,
+                                            uint64_t file_number,
+                                            uint64_t file_size,
+                                            uint64_t file_entries) {
+  // The final size completes the meta already in the blob storage.
+  auto file = std::make_shared<BlobFileMeta>(
+      file_number, file_size, file_entries, 0 /*file_level*/,
+      "" /*smallest_key*/, "" /*largest_key*/);
+  // Keeps the file write-time once the manifest is replayed.
+  file->FileStateTransit(BlobFileMeta::FileEvent::kWriteTimeOutput);
+  VersionEdit edit;
+  edit.SetColumnFamilyID(cf_id);
+  edit.AddBlobFile(file);
+  MutexLock l(&mutex_);
+  return blob_file_set_->LogAndApply(edit);
+}
+
+void TitanDBImpl::SealActiveBlobFiles() {
+  active_blob_files_mutex_.AssertHeld();
+  SealAbandonedBlobFiles();
+  while (active_blob_file_jobs_ > 0) {
+    active_blob_files_cv_.Wait();
+  }
+  for (auto& cf : active_blob_files_) {
+    if (cf.second.file) {
+      SealActiveBlobFile(cf.first, std::move(cf.second.file));
+    }
+  }
+}
+
+void TitanDBImpl::AbandonActiveBlobFile(std::shared_ptr<ActiveBlobFile> file,
+                                        const Status& s) {
+  active_blob_files_mutex_.AssertHeld();
+  for (auto& cf : active_blob_files_) {
+    if (file && cf.second.file == file) {
+      TITAN_LOG_WARN(db_options_.info_log,
+                     "Titan abandoning active blob file [%" PRIu64
+                     "], size %" PRIu64 ": %s",
+                     file->file_number(), file->file_size(),
+                     s.ToString().c_str());
+      cf.second.file.reset();
+      abandoned_blob_files_.emplace_back(cf.first, std::move(file));
+      return;
+    }
+  }
+}
+
+void TitanDBImpl::SealAbandonedBlobFiles() {
+  active_blob_files_mutex_.AssertHeld();
+  if (abandoned_blob_files_.empty()) {
+    return;
+  }
+  auto abandoned = std::move(abandoned_blob_files_);
+  abandoned_blob_files_.clear();
+  active_blob_file_jobs_++;
+  active_blob_files_mutex_.Unlock();
+  for (auto& cf : abandoned) {
+    auto& file = cf.second;
+    // The file is closed first, so that nothing is appended after the
+    // footer.
+    file->Abandon();
+    uint64_t file_size = 0;
+    uint64_t file_entries = 0;
+    Status s = ActiveBlobFile::Recover(
+        env_, env_options_, BlobFileName(dirname_, file->file_number()),
+        &file_size, &file_entries);
+    if (s.ok()) {
+      s = LogActiveBlobFileSealed(cf.first, file->file_number(), file_size,
+                                  file_entries);
+    }
+    if (s.ok() && file->MarkSealed()) {
+      AddUnflushedBlobFile(cf.first, *file);
+    }
+    if (s.ok()) {
+      TITAN_LOG_INFO(db_options_.info_log,
+                     "Titan sealed abandoned active blob file [%" PRIu64
+                     "], size %" PRIu64 ", entries %" PRIu64,
+                     file->file_number(), file_size, file_entries);
+    } else {
+      TITAN_LOG_WARN(db_options_.info_log,
+                     "Titan failed to seal abandoned active blob file [%" PRIu64
+                     "], left to recovery: %s",
+                     file->file_number(), s.ToString().c_str());
+    }
+  }
+  active_blob_files_mutex_.Lock();
+  active_blob_file_jobs_--;
+  active_blob_files_cv_.SignalAll();
+}
+
+void TitanDBImpl::AddWriteTimeSeparation(
+    const std::map<uint32_t, TitanCFOptions>& column_families) {
+  MutexLock l(&active_blob_files_mutex_);
+  for (auto& cf : column_families) {
+    if (cf.second.write_time_separation) {
+      active_blob_files_[cf.first].cf_options = cf.second;
+      write_time_separation_.store(true);
+    }
+  }
+}
+
+}  // namespace titandb
+}  // namespace rocksdb
@@ -6,8 +6,10 @@
 
 #include <cinttypes>
 
+#include <algorithm>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 #include "db/arena_wrapped_db_iter.h"
 #include "db/db_iter.h"
@@ -41,7 +43,12 @@ class TitanDBIterator : public Iterator {
                       files_.size());
   }
 
-  bool Valid() const override { return iter_->Valid() && status_.ok(); }
+  bool Valid() const override {
+    if (prefetching_) {
+      return window_pos_ < window_.size() && status_.ok();
+    }
+    return iter_->Valid() && status_.ok();
+  }
 
   Status status() const override {
     // assume volatile inner iter
@@ -53,7 +60,14 @@ class TitanDBIterator : public Iterator {
   }
 
   void SeekToFirst() override {
+    ResetWindow();
     iter_->SeekToFirst();
+    if (options_.blob_prefetch_depth > 0) {
+      StopWatch seek_sw(clock_, statistics(stats_), TITAN_SEEK_MICROS);
+      FillWindow();
+      RecordTick(statistics(stats_), TITAN_NUM_SEEK);
+      return;
+    }
     if (ShouldGetBlobValue()) {
       StopWatch seek_sw(clock_, statistics(stats_), TITAN_SEEK_MICROS);
       GetBlobValue();
@@ -62,6 +76,7 @@ class TitanDBIterator : public Iterator {
   }
 
   void SeekToLast() override {
+    ResetWindow();
     iter_->SeekToLast();
     if (ShouldGetBlobValue()) {
       StopWatch seek_sw(clock_, statistics(stats_), TITAN_SEEK_MICROS);
@@ -71,7 +86,14 @@ class TitanDBIterator : public Iterator {
   }
 
   void Seek(const Slice &target) override {
+    ResetWindow();
     iter_->Seek(target);
+    if (options_.blob_prefetch_depth > 0) {
+      StopWatch seek_sw(clock_, statistics(stats_), TITAN_SEEK_MICROS);
+      FillWindow();
+      RecordTick(statistics(stats_), TITAN_NUM_SEEK);
+      return;
+    }
     if (ShouldGetBlobValue()) {
       StopWatch seek_sw(clock_, statistics(stats_), TITAN_SEEK_MICROS);
       GetBlobValue();
@@ -80,6 +102,7 @@ class TitanDBIterator : public Iterator {
   }
 
   void SeekForPrev(const Slice &target) override {
+    ResetWindow();
     iter_->SeekForPrev(target);
     if (ShouldGetBlobValue()) {
       StopWatch seek_sw(clock_, statistics(stats_), TITAN_SEEK_MICROS);
@@ -90,6 +113,20 @@ class TitanDBIterator : public Iterator {
 
   void Next() override {
     assert(Valid());
+    if (prefetching_ && ++window_pos_ < window_.size()) {
+      RecordTick(statistics(stats_), TITAN_NUM_NEXT);
+      return;
+    }
+    if (options_.blob_prefetch_depth > 0) {
+      // The base iterator is already past the window, if there is one.
+      if (!prefetching_) {
+        iter_->Next();
+      }
+      StopWatch next_sw(clock_, statistics(stats_), TITAN_NEXT_MICROS);
+      FillWindow();
+      RecordTick(statistics(stats_), TITAN_NUM_NEXT);
+      return;
+    }
     iter_->Next();
     if (ShouldGetBlobValue()) {
       StopWatch next_sw(clock_, statistics(stats_), TITAN_NEXT_MICROS);
@@ -100,6 +137,14 @@ class TitanDBIterator : public Iterator {
 
   void Prev() override {
     assert(Valid());
+    if (prefetching_) {
+      // Moves the base iterator back from the end of the window to the
+      // current entry.
+      std::string current = window_[window_pos_].key;
+      ResetWindow();
+      iter_->Seek(current);
+      assert(iter_->Valid() && iter_->key() == Slice(current));
+    }
     iter_->Prev();
     if (ShouldGetBlobValue()) {
       StopWatch prev_sw(clock_, statistics(stats_), TITAN_PREV_MICROS);
@@ -110,17 +155,27 @@ class TitanDBIterator : public Iterator {
 
   Slice key() const override {
     assert(Valid());
+    if (prefetching_) return window_[window_pos_].key;
     return iter_->key();
   }
 
   Slice value() const override {
     assert(Valid() && !options_.key_only);
     if (options_.key_only) return Slice();
+    if (prefetching_) {
+      const auto &entry = window_[window_pos_];
+      if (entry.blob == kNoBlob) return entry.value;
+      return window_records_[entry.blob].value;
+    }
     if (!iter_->IsBlob()) return iter_->value();
     return record_.value;
   }
 
   bool seqno(SequenceNumber *number) const override {
+    if (prefetching_) {
+      *number = window_[window_pos_].seqno;
+      return window_[window_pos_].has_seqno;
+    }
     return iter_->seqno(number);
   }
 
@@ -174,10 +229,124 @@ class TitanDBIterator : public Iterator {
     return;
   }
 
+  // Drops the window and goes back to reading entries from the base
+  // iterator one by one.
+  void ResetWindow() {
+    prefetching_ = false;
+    window_.clear();
+    window_pos_ = 0;
+    window_records_.clear();
+    window_buffers_.clear();
+  }
+
+  // Buffers up to "blob_prefetch_depth" entries starting from the current
+  // entry of the base iterator, which is left past them, and reads the
+  // blob values of the entries in one batch.
+  void FillWindow() {
+    ResetWindow();
+    prefetching_ = true;
+    status_ = Status::OK();
+
+    std::vector<BlobIndex> indexes;
+    while (window_.size() < options_.blob_prefetch_depth && iter_->Valid()) {
+      window_.emplace_back();
+      auto &entry = window_.back();
+      entry.key = iter_->key().ToString();
+      entry.has_seqno = iter_->seqno(&entry.seqno);
+      if (options_.key_only) {
+        // No value is needed.
+      } else if (iter_->IsBlob()) {
+        BlobIndex index;
+        status_ = DecodeInto(iter_->value(), &index);
+        if (!status_.ok()) {
+          TITAN_LOG_ERROR(info_log_,
+                          "Titan iterator: failed to decode blob index %s: %s",
+                          iter_->value().ToString(true /*hex*/).c_str(),
+                          status_.ToString().c_str());
+          return;
+        }
+        entry.blob = indexes.size();
+        indexes.push_back(index);
+      } else {
+        entry.value = iter_->value().ToString();
+      }
+      iter_->Next();
+    }
+    if (!iter_->status().ok()) {
+      status_ = iter_->status();
+      return;
+    }
+    if (indexes.empty()) {
+      return;
+    }
+
+    // BlobStorage::MultiGet wants the indexes in file order.
+    std::vector<size_t> order(indexes.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      order[i] = i;
+    }
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      const auto &x = indexes[a];
+      const auto &y = indexes[b];
+      return x.file_number != y.file_number
+                 ? x.file_number < y.file_number
+                 : x.blob_handle.offset < y.blob_handle.offset;
+    });
+    std::vector<BlobIndex> sorted_indexes;
+    sorted_indexes.reserve(indexes.size());
+    std::vector<size_t> position(indexes.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      sorted_indexes.push_back(indexes[order[i]]);
+      position[order[i]] = i;
+    }
+    window_records_.resize(indexes.size());
+    window_buffers_ = std::vector<PinnableSlice>(indexes.size());
+    std::vector<Status> statuses(indexes.size());
+    storage_->MultiGet(options_, sorted_indexes, window_records_.data(),
+                       window_buffers_.data(), statuses.data());
+    for (auto &entry : window_) {
+      if (entry.blob == kNoBlob) {
+        continue;
+      }
+      size_t i = position[entry.blob];
+      entry.blob = i;
+      if (!statuses[i].ok()) {
+        status_ = statuses[i];
+        TITAN_LOG_ERROR(
+            info_log_,
+            "Titan iterator: failed to read blob value from file %" PRIu64
+            ", offset %" PRIu64 ", size %" PRIu64 ": %s\n",
+            sorted_indexes[i].file_number, sorted_indexes[i].blob_handle.offset,
+            sorted_indexes[i].blob_handle.size, status_.ToString().c_str());
+        return;
+      }
+    }
+  }
+
+  static const size_t kNoBlob = port::kMaxSizet;
+
+  struct WindowEntry {
+    std::string key;
+    // The value of an inlined entry.
+    std::string value;
+    bool has_seqno{false};
+    SequenceNumber seqno{0};
+    // The position of the blob value in "window_records_", or kNoBlob.
+    size_t blob{kNoBlob};
+  };
+
   Status status_;
   BlobRecord record_;
   PinnableSlice buffer_;
 
+  // Entries read ahead from the base iterator when "blob_prefetch_depth"
+  // is set, and the iterator is scanning forward.
+  bool prefetching_{false};
+  std::vector<WindowEntry> window_;
+  size_t window_pos_{0};
+  std::vector<BlobRecord> window_records_;
+  std::vector<PinnableSlice> window_buffers_;
+
   TitanReadOptions options_;
   BlobStorage *storage_;
   std::shared_ptr<ManagedSnapshot> snap_;
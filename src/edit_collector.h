@@ -133,7 +133,14 @@ class EditCollector {
 
     Status AddFile(const std::shared_ptr<BlobFileMeta>& file) {
       auto number = file->file_number();
-      if (added_files_.count(number) > 0) {
+      auto it = added_files_.find(number);
+      if (it != added_files_.end() && it->second->file_size() == 0) {
+        // A write-time blob file is added again with its size once it is
+        // sealed.
+        it->second = file;
+        return Status::OK();
+      }
+      if (it != added_files_.end()) {
         TITAN_LOG_ERROR(info_log_,
                         "blob file %" PRIu64 " has been deleted twice\n",
                         number);
@@ -168,7 +175,7 @@ class EditCollector {
       for (auto& file : added_files_) {
         auto number = file.first;
         auto blob = storage->FindFile(number).lock();
-        if (blob) {
+        if (blob && blob->file_state() != BlobFileMeta::FileState::kActive) {
           if (blob->is_obsolete()) {
             TITAN_LOG_ERROR(storage->db_options().info_log,
                             "blob file %" PRIu64 " has been deleted before\n",
@@ -22,12 +22,30 @@ void TitanDBOptions::Dump(Logger* logger) const {
   TITAN_LOG_HEADER(logger,
                    "TitanDBOptions.max_background_gc          : %" PRIi32,
                    max_background_gc);
+  TITAN_LOG_HEADER(logger,
+                   "TitanDBOptions.max_gc_subjobs             : %" PRIu32,
+                   max_gc_subjobs);
+  TITAN_LOG_HEADER(logger, "TitanDBOptions.gc_rate_limiter            : %p",
+                   gc_rate_limiter.get());
+  TITAN_LOG_HEADER(logger,
+                   "TitanDBOptions.gc_readahead_size          : %" PRIu64,
+                   gc_readahead_size);
+  TITAN_LOG_HEADER(logger, "TitanDBOptions.use_direct_io_for_gc       : %d",
+                   static_cast<int>(use_direct_io_for_gc));
   TITAN_LOG_HEADER(logger,
                    "TitanDBOptions.purge_obsolete_files_period_sec: %" PRIu32,
                    purge_obsolete_files_period_sec);
   TITAN_LOG_HEADER(logger,
                    "TitanDBOptions.titan_stats_dump_period_sec: %" PRIu32,
                    titan_stats_dump_period_sec);
+  TITAN_LOG_HEADER(logger,
+                   "TitanDBOptions.gc_check_period_sec        : %" PRIu32,
+                   gc_check_period_sec);
+  TITAN_LOG_HEADER(logger, "TitanDBOptions.blob_persistent_cache_dir  : %s",
+                   blob_persistent_cache_dir.c_str());
+  TITAN_LOG_HEADER(logger,
+                   "TitanDBOptions.blob_persistent_cache_size : %" PRIu64,
+                   blob_persistent_cache_size);
 }
 
 TitanCFOptions::TitanCFOptions(const ColumnFamilyOptions& cf_opts,
@@ -36,12 +54,24 @@ TitanCFOptions::TitanCFOptions(const ColumnFamilyOptions& cf_opts,
     : ColumnFamilyOptions(cf_opts),
       min_blob_size(immutable_opts.min_blob_size),
       blob_file_compression(immutable_opts.blob_file_compression),
+      blob_file_compression_parallel_threads(
+          immutable_opts.blob_file_compression_parallel_threads),
+      blob_file_block_size(immutable_opts.blob_file_block_size),
+      blob_file_record_index(immutable_opts.blob_file_record_index),
+      blob_file_keys_in_index(immutable_opts.blob_file_keys_in_index),
       blob_file_target_size(immutable_opts.blob_file_target_size),
       blob_cache(immutable_opts.blob_cache),
+      blob_cache_store_key(immutable_opts.blob_cache_store_key),
+      blob_cache_compressed(immutable_opts.blob_cache_compressed),
       max_gc_batch_size(immutable_opts.max_gc_batch_size),
       min_gc_batch_size(immutable_opts.min_gc_batch_size),
       blob_file_discardable_ratio(immutable_opts.blob_file_discardable_ratio),
       merge_small_file_threshold(immutable_opts.merge_small_file_threshold),
+      gc_policy(immutable_opts.gc_policy),
+      max_concurrent_gc(immutable_opts.max_concurrent_gc),
+      punch_hole_gc(immutable_opts.punch_hole_gc),
+      punch_hole_max_fragmentation(immutable_opts.punch_hole_max_fragmentation),
+      write_time_separation(immutable_opts.write_time_separation),
       blob_run_mode(mutable_opts.blob_run_mode),
       skip_value_in_compaction_filter(
           immutable_opts.skip_value_in_compaction_filter) {}
@@ -70,6 +100,16 @@ void TitanCFOptions::Dump(Logger* logger) const {
                    blob_file_compression_options.max_dict_bytes);
   TITAN_LOG_HEADER(logger, "    zstd_max_train_bytes : %" PRIu32,
                    blob_file_compression_options.zstd_max_train_bytes);
+  TITAN_LOG_HEADER(
+      logger, "TitanCFOptions.blob_file_compression_parallel_threads: %" PRIu32,
+      blob_file_compression_parallel_threads);
+  TITAN_LOG_HEADER(logger,
+                   "TitanCFOptions.blob_file_block_size         : %" PRIu64,
+                   blob_file_block_size);
+  TITAN_LOG_HEADER(logger, "TitanCFOptions.blob_file_record_index       : %d",
+                   blob_file_record_index);
+  TITAN_LOG_HEADER(logger, "TitanCFOptions.blob_file_keys_in_index      : %d",
+                   blob_file_keys_in_index);
   TITAN_LOG_HEADER(logger,
                    "TitanCFOptions.blob_file_target_size        : %" PRIu64,
                    blob_file_target_size);
@@ -78,6 +118,14 @@ void TitanCFOptions::Dump(Logger* logger) const {
   if (blob_cache != nullptr) {
     TITAN_LOG_HEADER(logger, "%s", blob_cache->GetPrintableOptions().c_str());
   }
+  TITAN_LOG_HEADER(logger, "TitanCFOptions.blob_cache_store_key         : %d",
+                   static_cast<int>(blob_cache_store_key));
+  TITAN_LOG_HEADER(logger, "TitanCFOptions.blob_cache_compressed        : %p",
+                   blob_cache_compressed.get());
+  if (blob_cache_compressed != nullptr) {
+    TITAN_LOG_HEADER(logger, "%s",
+                     blob_cache_compressed->GetPrintableOptions().c_str());
+  }
   TITAN_LOG_HEADER(logger,
                    "TitanCFOptions.max_gc_batch_size            : %" PRIu64,
                    max_gc_batch_size);
@@ -89,6 +137,18 @@ void TitanCFOptions::Dump(Logger* logger) const {
   TITAN_LOG_HEADER(logger,
                    "TitanCFOptions.merge_small_file_threshold   : %" PRIu64,
                    merge_small_file_threshold);
+  TITAN_LOG_HEADER(logger, "TitanCFOptions.gc_policy                    : %s",
+                   gc_policy == TitanGCPolicy::kCostBenefit
+                       ? "kCostBenefit"
+                       : "kDiscardableRatio");
+  TITAN_LOG_HEADER(logger, "TitanCFOptions.max_concurrent_gc            : %d",
+                   max_concurrent_gc);
+  TITAN_LOG_HEADER(logger, "TitanCFOptions.punch_hole_gc                : %d",
+                   punch_hole_gc);
+  TITAN_LOG_HEADER(logger, "TitanCFOptions.punch_hole_max_fragmentation : %lf",
+                   punch_hole_max_fragmentation);
+  TITAN_LOG_HEADER(logger, "TitanCFOptions.write_time_separation        : %d",
+                   write_time_separation);
   std::string blob_run_mode_str = "unknown";
   if (blob_run_mode_to_string.count(blob_run_mode) > 0) {
     blob_run_mode_str = blob_run_mode_to_string.at(blob_run_mode);
@@ -161,8 +161,9 @@ void TitanTableBuilder::AddBlob(const ParsedInternalKey& ikey,
     TITAN_LOG_INFO(db_options_.info_log,
                    "Titan table builder created new blob file %" PRIu64 ".",
                    blob_handle_->GetNumber());
-    blob_builder_.reset(
-        new BlobFileBuilder(db_options_, cf_options_, blob_handle_->GetFile()));
+    blob_builder_.reset(new BlobFileBuilder(
+        db_options_, cf_options_, blob_handle_->GetFile(),
+        BlobFileHeader::kVersion2, compression_pool_));
   }
 
   RecordTick(statistics(stats_), TITAN_BLOB_FILE_NUM_KEYS_WRITTEN);
@@ -179,16 +180,15 @@ void TitanTableBuilder::AddBlob(const ParsedInternalKey& ikey,
   UpdateIOBytes(prev_bytes_read, prev_bytes_written, &io_bytes_read_,
                 &io_bytes_written_);
 
+  // The contexts returned by `Add` go before the ones still held by the blob
+  // builder, which `FinishBlobFile` returns.
+  AddBlobResultsToBase(contexts);
+
   if (blob_handle_->GetFile()->GetFileSize() >=
       cf_options_.blob_file_target_size) {
     // if blob file hit the size limit, we have to finish it
-    // in this case, when calling `BlobFileBuilder::Finish`, builder will be in
-    // unbuffered state, so it will not trigger another `AddBlobResultsToBase`
-    // call
     FinishBlobFile();
   }
-
-  AddBlobResultsToBase(contexts);
 }
 
 void TitanTableBuilder::AddBlobResultsToBase(
@@ -206,8 +206,8 @@ void TitanTableBuilder::AddBlobResultsToBase(
       base_builder_->Add(ctx->key, ctx->value);
     } else {
       RecordTick(statistics(stats_), TITAN_BLOB_FILE_BYTES_WRITTEN,
-                 ctx->new_blob_index.blob_handle.size);
-      bytes_written_ += ctx->new_blob_index.blob_handle.size;
+                 ctx->new_blob_index.blob_handle.data_size());
+      bytes_written_ += ctx->new_blob_index.blob_handle.data_size();
       std::string index_value;
       ctx->new_blob_index.EncodeTo(&index_value);
 
@@ -310,8 +310,11 @@ void TitanTableBuilder::Abandon() {
 uint64_t TitanTableBuilder::NumEntries() const {
   if (builder_unbuffered()) {
     return base_builder_->NumEntries();
-  } else {
+  } else if (blob_builder_->GetBuilderState() ==
+             BlobFileBuilder::BuilderState::kBuffered) {
     return blob_builder_->NumEntries() + blob_builder_->NumSampleEntries();
+  } else {
+    return base_builder_->NumEntries() + blob_builder_->NumPendingEntries();
   }
 }
 
@@ -19,7 +19,8 @@ class TitanTableBuilder : public TableBuilder {
                     std::unique_ptr<TableBuilder> base_builder,
                     std::shared_ptr<BlobFileManager> blob_manager,
                     std::weak_ptr<BlobStorage> blob_storage, TitanStats* stats,
-                    int merge_level, int target_level)
+                    int merge_level, int target_level,
+                    ThreadPool* compression_pool = nullptr)
       : cf_id_(cf_id),
         db_options_(db_options),
         cf_options_(cf_options),
@@ -28,7 +29,8 @@ class TitanTableBuilder : public TableBuilder {
         blob_storage_(blob_storage),
         stats_(stats),
         target_level_(target_level),
-        merge_level_(merge_level) {}
+        merge_level_(merge_level),
+        compression_pool_(compression_pool) {}
 
   void Add(const Slice& key, const Slice& value) override;
 
@@ -58,8 +60,7 @@ class TitanTableBuilder : public TableBuilder {
   bool ok() const { return status().ok(); }
 
   bool builder_unbuffered() const {
-    return !blob_builder_ || blob_builder_->GetBuilderState() ==
-                                 BlobFileBuilder::BuilderState::kUnbuffered;
+    return !blob_builder_ || !blob_builder_->HoldsContexts();
   }
 
   std::unique_ptr<BlobFileBuilder::BlobRecordContext> NewCachedRecordContext(
@@ -103,6 +104,8 @@ class TitanTableBuilder : public TableBuilder {
   // equals to merge_level_, values belong to blob files which have lower level
   // than target_level_ will be merged to new blob file
   int merge_level_;
+  // Shared with the other builders of the column family.
+  ThreadPool* compression_pool_;
 
   // counters
   uint64_t bytes_read_ = 0;
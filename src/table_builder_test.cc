@@ -265,6 +265,86 @@ class TableBuilderTest : public testing::Test {
     result->reset(table_factory_->NewTableBuilder(options, file));
   }
 
+  // Builds a table with small values and blob indexes interleaved with the
+  // records, while the blob file builder holds back their contexts.
+  void TestHeldContextsDisorder() {
+    table_factory_.reset(new TitanTableFactory(db_options_, cf_options_,
+                                               blob_manager_, &mutex_,
+                                               blob_file_set_.get(), nullptr));
+
+    std::unique_ptr<WritableFileWriter> base_file;
+    NewBaseFileWriter(&base_file);
+    std::unique_ptr<TableBuilder> table_builder;
+    NewTableBuilder(base_file_number_, base_file.get(), &table_builder);
+
+    // Small values and blob indexes are interleaved with the records being
+    // compressed.
+    const int n = 100;
+    for (char i = 0; i < n; i++) {
+      std::string key(1, i);
+      InternalKey ikey(key, 1, kTypeValue);
+      std::string value;
+      if (i % 3 == 0) {
+        value = std::string(1, i);
+      } else if (i % 3 == 1) {
+        value = std::string(kMinBlobSize, i);
+      } else if (i % 3 == 2) {
+        ikey.Set(key, 1, kTypeBlobIndex);
+        BlobIndex blob_index;
+        blob_index.file_number = i;
+        blob_index.blob_handle.size = i * 2 + 1;
+        blob_index.blob_handle.offset = i * 3 + 2;
+        blob_index.EncodeTo(&value);
+      }
+      table_builder->Add(ikey.Encode(), value);
+    }
+    ASSERT_OK(table_builder->Finish());
+    ASSERT_EQ(n, table_builder->NumEntries());
+    ASSERT_OK(base_file->Sync(true));
+    ASSERT_OK(base_file->Close());
+    std::unique_ptr<TableReader> base_reader;
+    NewTableReader(base_file_number_, &base_reader);
+    std::unique_ptr<BlobFileReader> blob_reader;
+    NewBlobFileReader(&blob_reader);
+
+    ReadOptions ro;
+    std::unique_ptr<InternalIterator> iter;
+    iter.reset(base_reader->NewIterator(
+        ro, nullptr /*prefix_extractor*/, nullptr /*arena*/,
+        false /*skip_filters*/, TableReaderCaller::kUncategorized));
+    iter->SeekToFirst();
+    for (char i = 0; i < n; i++) {
+      ASSERT_TRUE(iter->Valid());
+      std::string key(1, i);
+      ParsedInternalKey ikey;
+      ASSERT_OK(ParseInternalKey(iter->key(), &ikey, false));
+      ASSERT_EQ(ikey.user_key, key);
+      if (i % 3 == 0) {
+        ASSERT_EQ(ikey.type, kTypeValue);
+        ASSERT_EQ(iter->value(), std::string(1, i));
+      } else if (i % 3 == 1) {
+        ASSERT_EQ(ikey.type, kTypeBlobIndex);
+        BlobIndex index;
+        ASSERT_OK(DecodeInto(iter->value(), &index));
+        ASSERT_EQ(index.file_number, kTestFileNumber);
+        BlobRecord record;
+        PinnableSlice buffer;
+        ASSERT_OK(blob_reader->Get(ro, index.blob_handle, &record, &buffer));
+        ASSERT_EQ(record.key, key);
+        ASSERT_EQ(record.value, std::string(kMinBlobSize, i));
+      } else if (i % 3 == 2) {
+        ASSERT_EQ(ikey.type, kTypeBlobIndex);
+        BlobIndex index;
+        ASSERT_OK(DecodeInto(iter->value(), &index));
+        ASSERT_EQ(index.file_number, i);
+        ASSERT_EQ(index.blob_handle.size, i * 2 + 1);
+        ASSERT_EQ(index.blob_handle.offset, i * 3 + 2);
+      }
+      iter->Next();
+    }
+    ASSERT_TRUE(!iter->Valid());
+  }
+
   port::Mutex mutex_;
 
   Env* env_{Env::Default()};
@@ -538,6 +618,17 @@ TEST_F(TableBuilderTest, DictCompressDisorder) {
 #endif
 }
 
+TEST_F(TableBuilderTest, ParallelCompressDisorder) {
+  cf_options_.blob_file_compression = kLZ4Compression;
+  cf_options_.blob_file_compression_parallel_threads = 4;
+  TestHeldContextsDisorder();
+}
+
+TEST_F(TableBuilderTest, BlockedFileDisorder) {
+  cf_options_.blob_file_block_size = 4 * kMinBlobSize;
+  TestHeldContextsDisorder();
+}
+
 TEST_F(TableBuilderTest, NoBlob) {
   std::unique_ptr<WritableFileWriter> base_file;
   NewBaseFileWriter(&base_file);
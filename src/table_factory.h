@@ -3,6 +3,7 @@
 #include <atomic>
 
 #include "rocksdb/table.h"
+#include "rocksdb/threadpool.h"
 
 #include "blob_file_manager.h"
 #include "blob_file_set.h"
@@ -28,7 +29,19 @@ class TitanTableFactory : public TableFactory {
         blob_manager_(blob_manager),
         db_mutex_(db_mutex),
         blob_file_set_(blob_file_set),
-        stats_(stats) {}
+        stats_(stats) {
+    if (cf_options.blob_file_compression != kNoCompression &&
+        cf_options.blob_file_compression_parallel_threads > 1) {
+      compression_pool_.reset(NewThreadPool(
+          static_cast<int>(cf_options.blob_file_compression_parallel_threads)));
+    }
+  }
+
+  ~TitanTableFactory() {
+    if (compression_pool_ != nullptr) {
+      compression_pool_->JoinAllThreads();
+    }
+  }
 
   const char* Name() const override { return "TitanTable"; }
 
@@ -45,6 +58,11 @@ class TitanTableFactory : public TableFactory {
 
   void SetBlobRunMode(TitanBlobRunMode mode) { blob_run_mode_.store(mode); }
 
+  // Pool compressing the blob records of the column family on parallel
+  // threads, shared by the blob file builders of flushes, compactions and
+  // GC. Null if "blob_file_compression_parallel_threads" is at most 1.
+  ThreadPool* compression_pool() const { return compression_pool_.get(); }
+
   bool IsDeleteRangeSupported() const override {
     return base_factory_->IsDeleteRangeSupported();
   }
@@ -58,6 +76,7 @@ class TitanTableFactory : public TableFactory {
   port::Mutex* db_mutex_;
   BlobFileSet* blob_file_set_;
   TitanStats* stats_;
+  std::unique_ptr<ThreadPool> compression_pool_;
 };
 
 }  // namespace titandb
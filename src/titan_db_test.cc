@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <cinttypes>
+#include <random>
 
 #include <unordered_map>
 
@@ -308,11 +310,13 @@ class TitanDBTest : public testing::Test {
   }
 
   void CallGC() {
+    uint32_t cf_id = db_->DefaultColumnFamily()->GetID();
     {
       MutexLock l(&db_impl_->mutex_);
       db_impl_->bg_gc_scheduled_++;
+      db_impl_->gc_states_[cf_id].running++;
     }
-    db_impl_->BackgroundCallGC();
+    db_impl_->BackgroundCallGC(cf_id);
     {
       MutexLock l(&db_impl_->mutex_);
       while (db_impl_->bg_gc_scheduled_) {
@@ -506,6 +510,55 @@ TEST_F(TitanDBTest, DBIterSeek) {
   }
 }
 
+TEST_F(TitanDBTest, DBIterPrefetch) {
+  Open();
+  std::map<std::string, std::string> data;
+  const int kNumEntries = 100;
+  for (uint64_t i = 1; i <= kNumEntries; i++) {
+    Put(i, &data);
+  }
+  Flush();
+  ASSERT_EQ(kNumEntries, data.size());
+  TitanReadOptions ropts;
+  ropts.blob_prefetch_depth = 8;
+  std::unique_ptr<Iterator> iter(db_->NewIterator(ropts));
+  iter->SeekToFirst();
+  for (const auto& it : data) {
+    ASSERT_TRUE(iter->Valid());
+    ASSERT_EQ(it.first, iter->key());
+    ASSERT_EQ(it.second, iter->value());
+    iter->Next();
+  }
+  ASSERT_FALSE(iter->Valid());
+  ASSERT_OK(iter->status());
+
+  // Changes direction in the middle of a window.
+  auto it = data.begin();
+  std::advance(it, 10);
+  iter->Seek(it->first);
+  for (int i = 0; i < 5; i++) {
+    ASSERT_TRUE(iter->Valid());
+    ASSERT_EQ(it->first, iter->key());
+    ASSERT_EQ(it->second, iter->value());
+    iter->Next();
+    it++;
+  }
+  for (int i = 0; i < 10; i++) {
+    iter->Prev();
+    it--;
+    ASSERT_TRUE(iter->Valid());
+    ASSERT_EQ(it->first, iter->key());
+    ASSERT_EQ(it->second, iter->value());
+  }
+  for (; it != data.end(); it++) {
+    ASSERT_TRUE(iter->Valid());
+    ASSERT_EQ(it->first, iter->key());
+    ASSERT_EQ(it->second, iter->value());
+    iter->Next();
+  }
+  ASSERT_FALSE(iter->Valid());
+}
+
 TEST_F(TitanDBTest, GetProperty) {
   options_.disable_background_gc = false;
   Open();
@@ -1350,6 +1403,215 @@ TEST_F(TitanDBTest, GCAfterDropCF) {
   Close();
 }
 
+TEST_F(TitanDBTest, GCQueue) {
+  options_.min_blob_size = 0;
+  Open();
+  AddCF("cf");
+  ColumnFamilyHandle* cfh = cf_handles_[0];
+  uint32_t cf_id = cfh->GetID();
+  uint32_t default_cf_id = db_->DefaultColumnFamily()->GetID();
+  // Only "cf" has garbage.
+  for (uint64_t i = 0; i < 100; i++) {
+    ASSERT_OK(db_->Put(WriteOptions(), cfh, GenKey(i), std::string(100, 'v')));
+    ASSERT_OK(db_->Put(WriteOptions(), GenKey(i), std::string(100, 'v')));
+  }
+  Flush();
+  for (uint64_t i = 0; i < 50; i++) {
+    ASSERT_OK(db_->Delete(WriteOptions(), cfh, GenKey(i)));
+  }
+  Flush();
+  ASSERT_OK(db_->CompactRange(CompactRangeOptions(), cfh, nullptr, nullptr));
+  Close();
+
+  port::Mutex mu;
+  port::CondVar cv(&mu);
+  std::vector<uint32_t> picked;
+  int running = 0;
+  int max_running = 0;
+  bool hold = false;
+  SyncPoint::GetInstance()->SetCallBack(
+      "TitanDBImpl::BackgroundCallGC:BeforeGCRunning", [&](void* arg) {
+        uint32_t id = *static_cast<uint32_t*>(arg);
+        MutexLock l(&mu);
+        picked.push_back(id);
+        if (id == cf_id) {
+          max_running = std::max(max_running, ++running);
+        }
+        while (hold && id == cf_id) {
+          cv.Wait();
+        }
+      });
+  SyncPoint::GetInstance()->SetCallBack(
+      "TitanDBImpl::BackgroundGC:Finish", [&](void* arg) {
+        MutexLock l(&mu);
+        if (*static_cast<uint32_t*>(arg) == cf_id) {
+          running--;
+        }
+      });
+  SyncPoint::GetInstance()->EnableProcessing();
+
+  // Both CFs are queued on start, the one with the most garbage runs first.
+  options_.disable_background_gc = false;
+  options_.max_background_gc = 1;
+  Reopen();
+  db_impl_->TEST_WaitForBackgroundGC();
+  {
+    MutexLock l(&mu);
+    ASSERT_GE(picked.size(), 2);
+    ASSERT_EQ(picked[0], cf_id);
+    ASSERT_NE(std::find(picked.begin(), picked.end(), default_cf_id),
+              picked.end());
+  }
+  Close();
+
+  // A request queued while "cf" is at its concurrency limit waits for the
+  // running job, even with a GC thread to spare.
+  options_.max_background_gc = 2;
+  options_.max_concurrent_gc = 1;
+  {
+    MutexLock l(&mu);
+    picked.clear();
+    hold = true;
+  }
+  Open();
+  WaitGCInitialization();
+  cfh = cf_handles_[1];
+  ASSERT_EQ(cfh->GetID(), cf_id);
+  for (uint64_t i = 50; i < 75; i++) {
+    ASSERT_OK(db_->Delete(WriteOptions(), cfh, GenKey(i)));
+  }
+  ASSERT_OK(db_->Flush(FlushOptions(), cfh));
+  ASSERT_OK(db_->CompactRange(CompactRangeOptions(), cfh, nullptr, nullptr));
+  env_->SleepForMicroseconds(100 * 1000);
+  {
+    MutexLock l(&mu);
+    hold = false;
+    cv.SignalAll();
+  }
+  db_impl_->TEST_WaitForBackgroundGC();
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  MutexLock l(&mu);
+  ASSERT_GE(std::count(picked.begin(), picked.end(), cf_id), 2);
+  ASSERT_EQ(max_running, 1);
+}
+
+TEST_F(TitanDBTest, GCBacklog) {
+  const int kNumFiles = 8;
+  options_.min_blob_size = 0;
+  options_.min_gc_batch_size = 0;
+  options_.max_gc_batch_size = 1;
+  Open();
+  for (int f = 0; f < kNumFiles; f++) {
+    for (uint64_t i = 0; i < 100; i++) {
+      ASSERT_OK(db_->Put(WriteOptions(), GenKey(f * 100 + i),
+                         std::string(100, 'v')));
+    }
+    Flush();
+  }
+  for (int f = 0; f < kNumFiles; f++) {
+    for (uint64_t i = 0; i < 60; i++) {
+      ASSERT_OK(db_->Delete(WriteOptions(), GenKey(f * 100 + i)));
+    }
+  }
+  Flush();
+  ASSERT_OK(db_->CompactRange(CompactRangeOptions(), nullptr, nullptr));
+  Close();
+
+  port::Mutex mu;
+  int num_jobs = 0;
+  int running = 0;
+  int max_running = 0;
+  SyncPoint::GetInstance()->SetCallBack(
+      "TitanDBImpl::BackgroundCallGC:BeforeGCRunning", [&](void*) {
+        {
+          MutexLock l(&mu);
+          num_jobs++;
+          max_running = std::max(max_running, ++running);
+        }
+        // Gives a job scheduled alongside the time to start.
+        env_->SleepForMicroseconds(50 * 1000);
+      });
+  SyncPoint::GetInstance()->SetCallBack(
+      "TitanDBImpl::BackgroundGC:Finish", [&](void*) {
+        MutexLock l(&mu);
+        running--;
+      });
+  // The garbage of the test doesn't grow on its own.
+  SyncPoint::GetInstance()->SetCallBack(
+      "TitanDBImpl::BackgroundGC:Backlog",
+      [&](void* arg) { *static_cast<bool*>(arg) = true; });
+  SyncPoint::GetInstance()->EnableProcessing();
+
+  // Each job GCs one file and leaves the rest for the next one, so the
+  // column family gets another job once it falls behind.
+  options_.disable_background_gc = false;
+  options_.max_background_gc = 2;
+  Open();
+  WaitGCInitialization();
+  db_impl_->TEST_WaitForBackgroundGC();
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  MutexLock l(&mu);
+  ASSERT_GE(num_jobs, 4);
+  ASSERT_EQ(max_running, 2);
+}
+
+TEST_F(TitanDBTest, GCSubJobs) {
+  const int kNumFiles = 4;
+  options_.min_blob_size = 0;
+  options_.disable_background_gc = false;
+  options_.max_background_gc = 2;
+  options_.max_gc_subjobs = kNumFiles;
+  options_.disable_auto_compactions = true;
+  Open();
+  WaitGCInitialization();
+  // Sub-jobs only run on the GC threads, either of the background GC or
+  // of TEST_StartGC().
+  std::atomic<int> num_subjobs{0};
+  std::atomic<int> num_running{0};
+  std::atomic<int> max_running{0};
+  SyncPoint::GetInstance()->SetCallBack(
+      "BlobGCJob::RunSubJobs:BeforeSubJob", [&](void*) {
+        num_subjobs++;
+        int running = ++num_running;
+        int max = max_running.load();
+        while (running > max &&
+               !max_running.compare_exchange_weak(max, running)) {
+        }
+      });
+  SyncPoint::GetInstance()->SetCallBack(
+      "BlobGCJob::RunSubJobs:AfterSubJob", [&](void*) { num_running--; });
+  SyncPoint::GetInstance()->EnableProcessing();
+  std::map<std::string, std::string> data;
+  for (int f = 0; f < kNumFiles; f++) {
+    for (uint64_t i = f; i < 400; i += kNumFiles) {
+      std::string key = GenKey(i);
+      std::string value(100, static_cast<char>('a' + f));
+      ASSERT_OK(db_->Put(WriteOptions(), key, value));
+      if (i % 3 == 0) {
+        data[key] = value;
+      }
+    }
+    Flush();
+  }
+  for (uint64_t i = 0; i < 400; i++) {
+    if (i % 3 != 0) {
+      ASSERT_OK(db_->Delete(WriteOptions(), GenKey(i)));
+    }
+  }
+  Flush();
+  CompactAll();
+
+  ASSERT_OK(db_impl_->TEST_StartGC(db_->DefaultColumnFamily()->GetID()));
+  db_impl_->TEST_WaitForBackgroundGC();
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  ASSERT_GE(num_subjobs.load(), kNumFiles);
+  ASSERT_LE(max_running.load(), options_.max_background_gc);
+  VerifyDB(data);
+}
+
 TEST_F(TitanDBTest, GCBeforeFlushCommit) {
   port::Mutex mu;
   port::CondVar cv(&mu);
@@ -1542,6 +1804,266 @@ TEST_F(TitanDBTest, UpdateValue) {
   Close();
 }
 
+TEST_F(TitanDBTest, PersistentBlobCache) {
+  const std::string cache_dir = dbname_ + "/persistent_cache";
+  DeleteDir(env_, cache_dir);
+  options_.blob_persistent_cache_dir = cache_dir;
+  Statistics* stats = options_.statistics.get();
+  Open();
+  std::map<std::string, std::string> data;
+  for (uint64_t i = 0; i < 10; i++) {
+    std::string key = GenKey(i);
+    std::string value(1024, 'a' + i);
+    ASSERT_OK(db_->Put(WriteOptions(), key, value));
+    data.emplace(key, value);
+  }
+  Flush();
+  VerifyDB(data);
+  ASSERT_EQ(stats->getTickerCount(TITAN_BLOB_CACHE_PERSISTENT_HIT), 0);
+
+  // Records cached before closing are served from the cache after reopen.
+  Reopen();
+  VerifyDB(data);
+  ASSERT_GT(stats->getTickerCount(TITAN_BLOB_CACHE_PERSISTENT_HIT), 0);
+
+  // A recreated DB reuses file numbers and offsets, it must not read the
+  // records cached for the old one.
+  Close();
+  DeleteDir(env_, options_.dirname);
+  DeleteDir(env_, dbname_);
+  ASSERT_OK(stats->Reset());
+  Open();
+  data.clear();
+  for (uint64_t i = 0; i < 10; i++) {
+    std::string key = GenKey(i);
+    std::string value(1024, 'z' - i);
+    ASSERT_OK(db_->Put(WriteOptions(), key, value));
+    data.emplace(key, value);
+  }
+  Flush();
+  VerifyDB(data);
+  ASSERT_EQ(stats->getTickerCount(TITAN_BLOB_CACHE_PERSISTENT_HIT), 0);
+
+  Close();
+  DeleteDir(env_, cache_dir);
+}
+
+TEST_F(TitanDBTest, WriteTimeSeparation) {
+  options_.write_time_separation = true;
+  options_.blob_file_target_size = 1024;
+  Open();
+  std::map<std::string, std::string> data;
+  for (uint64_t i = 0; i < 100; i++) {
+    Put(i, &data);
+  }
+  // Values are read from the active blob files before being flushed.
+  VerifyDB(data);
+  std::map<uint64_t, std::weak_ptr<BlobFileMeta>> blob_files;
+  GetBlobStorage().lock()->ExportBlobFiles(blob_files);
+  ASSERT_GT(blob_files.size(), 1);
+  Flush();
+  VerifyDB(data);
+  Reopen();
+  VerifyDB(data);
+
+  // Crashes with the active blob file unsealed, recovery seals it. The
+  // values of synced writes survive along with their WAL.
+  std::unique_ptr<TitanFaultInjectionTestEnv> mock_env(
+      new TitanFaultInjectionTestEnv(env_));
+  options_.env = mock_env.get();
+  Reopen();
+  WriteOptions sync_opts;
+  sync_opts.sync = true;
+  for (uint64_t i = 100; i < 200; i++) {
+    ASSERT_OK(db_->Put(sync_opts, GenKey(i), GenValue(i)));
+    data.emplace(GenKey(i), GenValue(i));
+  }
+  ASSERT_OK(db_->Put(WriteOptions(), GenKey(200), GenValue(200)));
+  mock_env->SetFilesystemActive(false, Status::IOError("Injected crash"));
+  db_->Close().PermitUncheckedError();
+  delete db_;
+  db_ = nullptr;
+  ASSERT_OK(mock_env->DropUnsyncedFileData());
+  mock_env->ResetState();
+  Open();
+  WaitGCInitialization();
+  VerifyDB(data);
+  blob_files.clear();
+  GetBlobStorage().lock()->ExportBlobFiles(blob_files);
+  for (auto& file : blob_files) {
+    auto meta = file.second.lock();
+    ASSERT_TRUE(meta != nullptr);
+    ASSERT_GT(meta->file_size(), 0);
+    ASSERT_EQ(meta->file_state(), BlobFileMeta::FileState::kNormal);
+    ASSERT_TRUE(meta->is_write_time());
+  }
+  options_.env = env_;
+
+  // Records of write-time files are in the order they were written, GC
+  // sorts them for the files it outputs.
+  options_.blob_file_target_size = 4096;
+  options_.blob_file_discardable_ratio = 0.1;
+  Reopen();
+  std::vector<uint64_t> keys;
+  for (uint64_t i = 1000; i < 1400; i++) {
+    keys.push_back(i);
+  }
+  std::shuffle(keys.begin(), keys.end(), std::mt19937(301));
+  for (uint64_t k : keys) {
+    std::string value(100, static_cast<char>('a' + k % 26));
+    ASSERT_OK(db_->Put(WriteOptions(), GenKey(k), value));
+    data[GenKey(k)] = value;
+  }
+  for (uint64_t i = 1000; i < 1400; i += 2) {
+    ASSERT_OK(db_->Delete(WriteOptions(), GenKey(i)));
+    data.erase(GenKey(i));
+  }
+  Flush();
+  CompactAll();
+  ASSERT_OK(db_impl_->TEST_StartGC(db_->DefaultColumnFamily()->GetID()));
+  VerifyDB(data);
+  blob_files.clear();
+  GetBlobStorage().lock()->ExportBlobFiles(blob_files);
+  int num_gc_outputs = 0;
+  for (auto& file : blob_files) {
+    auto meta = file.second.lock();
+    if (meta == nullptr || meta->is_obsolete() ||
+        meta->smallest_key().empty()) {
+      continue;
+    }
+    num_gc_outputs++;
+    uint64_t file_size = 0;
+    std::unique_ptr<RandomAccessFileReader> readable_file;
+    ASSERT_OK(env_->GetFileSize(BlobFileName(options_.dirname, file.first),
+                                &file_size));
+    ASSERT_OK(NewBlobFileReader(file.first, 0, options_, EnvOptions(), env_,
+                                &readable_file));
+    BlobFileIterator iter(std::move(readable_file), file.first, file_size,
+                          options_);
+    std::string last_key;
+    for (iter.SeekToFirst(); iter.Valid(); iter.Next()) {
+      if (last_key.empty()) {
+        ASSERT_EQ(iter.key(), meta->smallest_key());
+      } else {
+        ASSERT_LT(last_key, iter.key().ToString());
+      }
+      last_key = iter.key().ToString();
+    }
+    ASSERT_OK(iter.status());
+    ASSERT_EQ(last_key, meta->largest_key());
+  }
+  ASSERT_GT(num_gc_outputs, 0);
+  Close();
+}
+
+TEST_F(TitanDBTest, WriteTimeSeparationNewFileUnlocked) {
+  options_.write_time_separation = true;
+  Open();
+  std::string value(options_.min_blob_size + 1, 'v');
+  // The default column family gets its active blob file here.
+  ASSERT_OK(db_->Put(WriteOptions(), "k0", value));
+  AddCF("cf");
+
+  // Creating the file of "cf" doesn't block writers to the default column
+  // family.
+  std::atomic<bool> creating{false};
+  std::atomic<bool> written{false};
+  SyncPoint::GetInstance()->SetCallBack(
+      "TitanDBImpl::NewActiveBlobFile:Begin", [&](void*) {
+        creating = true;
+        while (!written) {
+          env_->SleepForMicroseconds(1000);
+        }
+      });
+  SyncPoint::GetInstance()->EnableProcessing();
+  port::Thread writer([&]() {
+    ASSERT_OK(db_->Put(WriteOptions(), cf_handles_.back(), "k1", value));
+  });
+  while (!creating) {
+    env_->SleepForMicroseconds(1000);
+  }
+  ASSERT_OK(db_->Put(WriteOptions(), "k2", value));
+  written = true;
+  writer.join();
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+
+  std::string result;
+  ASSERT_OK(db_->Get(ReadOptions(), "k2", &result));
+  ASSERT_EQ(result, value);
+  ASSERT_OK(db_->Get(ReadOptions(), cf_handles_.back(), "k1", &result));
+  ASSERT_EQ(result, value);
+  Close();
+}
+
+TEST_F(TitanDBTest, WriteTimeSeparationSealedFileUnflushed) {
+  options_.write_time_separation = true;
+  options_.min_blob_size = 1024;
+  options_.blob_file_target_size = 1024;
+  options_.disable_auto_compactions = true;
+  options_.disable_background_gc = true;
+  Open();
+  std::string value(2048, 'v');
+  ASSERT_OK(db_->Put(WriteOptions(), "k0", value));
+
+  // The writer fills and seals the file its value is appended to, then
+  // stops before putting the blob index into the memtable.
+  std::atomic<bool> sealed{false};
+  std::atomic<bool> resume{false};
+  SyncPoint::GetInstance()->SetCallBack(
+      "TitanDBImpl::Write:BeforeBaseDBWrite", [&](void*) {
+        sealed = true;
+        while (!resume) {
+          env_->SleepForMicroseconds(1000);
+        }
+      });
+  SyncPoint::GetInstance()->EnableProcessing();
+  port::Thread writer(
+      [&]() { ASSERT_OK(db_->Put(WriteOptions(), "k1", value)); });
+  while (!sealed) {
+    env_->SleepForMicroseconds(1000);
+  }
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+  std::vector<std::shared_ptr<BlobFileMeta>> pending;
+  auto get_pending_files = [&]() {
+    std::map<uint64_t, std::weak_ptr<BlobFileMeta>> blob_files;
+    GetBlobStorage().lock()->ExportBlobFiles(blob_files);
+    pending.clear();
+    for (auto& file : blob_files) {
+      auto meta = file.second.lock();
+      if (meta != nullptr &&
+          meta->file_state() == BlobFileMeta::FileState::kPendingFlush) {
+        pending.push_back(meta);
+      }
+    }
+  };
+  // Both the sealed files wait for a flush.
+  get_pending_files();
+  ASSERT_EQ(pending.size(), 2);
+  // The flush only covers the write of "k0".
+  Flush();
+  get_pending_files();
+  ASSERT_EQ(pending.size(), 1);
+  auto file = pending.front();
+  ASSERT_OK(db_impl_->TEST_StartGC(db_->DefaultColumnFamily()->GetID()));
+  ASSERT_EQ(file->file_state(), BlobFileMeta::FileState::kPendingFlush);
+  resume = true;
+  writer.join();
+
+  // GC leaves the file until the blob index of "k1" is flushed.
+  ASSERT_OK(db_impl_->TEST_StartGC(db_->DefaultColumnFamily()->GetID()));
+  ASSERT_EQ(file->file_state(), BlobFileMeta::FileState::kPendingFlush);
+  std::string result;
+  ASSERT_OK(db_->Get(ReadOptions(), "k1", &result));
+  ASSERT_EQ(result, value);
+  Flush();
+  ASSERT_EQ(file->file_state(), BlobFileMeta::FileState::kNormal);
+  ASSERT_OK(db_->Get(ReadOptions(), "k1", &result));
+  ASSERT_EQ(result, value);
+  Close();
+}
+
 TEST_F(TitanDBTest, MultiGet) {
   options_.min_blob_size = 1024;
   std::vector<int> blob_cache_sizes = {0, 15 * 1024};
@@ -1575,6 +2097,62 @@ TEST_F(TitanDBTest, MultiGet) {
   }
 }
 
+TEST_F(TitanDBTest, BatchedMultiGet) {
+  options_.min_blob_size = 1024;
+  std::vector<int> blob_cache_sizes = {0, 1024 * 1024};
+  std::vector<bool> blob_cache_store_keys = {true, false};
+
+  for (auto blob_cache_size : blob_cache_sizes) {
+    for (auto store_key : blob_cache_store_keys) {
+      options_.blob_cache = NewLRUCache(blob_cache_size);
+      options_.blob_cache_store_key = store_key;
+      Open();
+      // Two blob files, and some small values stored inline.
+      std::map<std::string, std::string> data;
+      for (int i = 0; i < 40; i++) {
+        std::string key = GenKey(i);
+        data[key] = std::string(i % 4 == 0 ? 100 : 2 * 1024 + i, 'a' + i % 26);
+        ASSERT_OK(db_->Put(WriteOptions(), key, data[key]));
+        if (i == 20) {
+          Flush();
+        }
+      }
+      Flush();
+
+      // Ask for the keys out of order, with a missing key and a duplicate.
+      std::vector<std::string> key_strs;
+      for (int i = 39; i >= 0; i -= 3) {
+        key_strs.push_back(GenKey(i));
+      }
+      key_strs.push_back("missing");
+      key_strs.push_back(GenKey(0));
+      std::vector<Slice> keys(key_strs.begin(), key_strs.end());
+      std::vector<PinnableSlice> values(keys.size());
+      std::vector<Status> statuses(keys.size());
+      // Run twice so that the second round is served by the blob cache.
+      for (int round = 0; round < 2; round++) {
+        db_->MultiGet(ReadOptions(), db_->DefaultColumnFamily(), keys.size(),
+                      keys.data(), values.data(), statuses.data());
+        for (size_t i = 0; i < keys.size(); i++) {
+          if (key_strs[i] == "missing") {
+            ASSERT_TRUE(statuses[i].IsNotFound());
+            continue;
+          }
+          ASSERT_OK(statuses[i]);
+          ASSERT_EQ(data[key_strs[i]], values[i].ToString());
+          if (values[i].size() >= options_.min_blob_size) {
+            // Blob values are pinned rather than copied.
+            ASSERT_TRUE(values[i].IsPinned());
+          }
+        }
+      }
+      Close();
+      DeleteDir(env_, options_.dirname);
+      DeleteDir(env_, dbname_);
+    }
+  }
+}
+
 TEST_F(TitanDBTest, PrefixScan) {
   options_.min_blob_size = 1024;
   options_.prefix_extractor.reset(NewFixedPrefixTransform(3));
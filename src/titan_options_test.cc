@@ -1,3 +1,4 @@
+#include "rocksdb/cache.h"
 #include "test_util/testharness.h"
 
 #include "titan/db.h"
@@ -68,6 +69,20 @@ TEST_F(TitanOptionsTest, LevelMerge) {
   ASSERT_TRUE(s.IsInvalidArgument());
 }
 
+TEST_F(TitanOptionsTest, SharedBlobCacheTiers) {
+  titan_options_.blob_cache = NewLRUCache(1 << 20);
+  titan_options_.blob_cache_compressed = titan_options_.blob_cache;
+  Status s = Open();
+  ASSERT_TRUE(s.IsInvalidArgument());
+}
+
+TEST_F(TitanOptionsTest, DirectIOForGCWithMmapReads) {
+  titan_options_.use_direct_io_for_gc = true;
+  titan_options_.allow_mmap_reads = true;
+  Status s = Open();
+  ASSERT_TRUE(s.IsInvalidArgument());
+}
+
 }  // namespace titandb
 }  // namespace rocksdb
 
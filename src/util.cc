@@ -1,5 +1,15 @@
 #include "util.h"
 
+#include <cerrno>
+#include <cstring>
+
+#ifdef OS_LINUX
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 #include "util/compression.h"
 #include "util/stop_watch.h"
 
@@ -56,5 +66,54 @@ Status SyncTitanManifest(TitanStats* stats,
   return file->Sync(db_options->use_fsync);
 }
 
+Status PunchHoles(const std::string& fname,
+                  const std::vector<std::pair<uint64_t, uint64_t>>& extents) {
+#if defined(ROCKSDB_FALLOCATE_PRESENT) && defined(FALLOC_FL_PUNCH_HOLE)
+  int fd = open(fname.c_str(), O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return Status::IOError("While open a file for punching holes " + fname,
+                           strerror(errno));
+  }
+  Status s;
+  for (const auto& extent : extents) {
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  static_cast<off_t>(extent.first),
+                  static_cast<off_t>(extent.second)) != 0) {
+      if (errno == EOPNOTSUPP) {
+        s = Status::NotSupported("Punching holes", fname);
+      } else {
+        s = Status::IOError("While punching holes in " + fname,
+                            strerror(errno));
+      }
+      break;
+    }
+  }
+  if (s.ok() && fdatasync(fd) != 0) {
+    s = Status::IOError("While fdatasync " + fname, strerror(errno));
+  }
+  close(fd);
+  return s;
+#else
+  (void)extents;
+  return Status::NotSupported("Punching holes", fname);
+#endif
+}
+
+Status GetFileAllocatedSize(const std::string& fname, uint64_t* size) {
+#ifdef OS_LINUX
+  struct stat sbuf;
+  if (stat(fname.c_str(), &sbuf) != 0) {
+    return Status::IOError("While stat a file for allocated size " + fname,
+                           strerror(errno));
+  }
+  // st_blocks is always in units of 512 bytes.
+  *size = static_cast<uint64_t>(sbuf.st_blocks) * 512;
+  return Status::OK();
+#else
+  (void)size;
+  return Status::NotSupported("Getting allocated size", fname);
+#endif
+}
+
 }  // namespace titandb
 }  // namespace rocksdb
@@ -25,6 +25,9 @@ class OwnedSlice : public Slice {
     buffer_ = std::move(buffer);
   }
 
+  // The start of the owned buffer, which the slice may point into.
+  const char* buffer() const { return buffer_.get(); }
+
   char* release() {
     data_ = nullptr;
     size_ = 0;
@@ -79,5 +82,14 @@ Status SyncTitanManifest(TitanStats* stats,
                          const ImmutableDBOptions* db_options,
                          WritableFileWriter* file);
 
+// Deallocates the given (offset, length) extents of the file in place,
+// keeping the file size and the offsets of the remaining data unchanged.
+// Returns NotSupported if the platform or file system can't punch holes.
+Status PunchHoles(const std::string& fname,
+                  const std::vector<std::pair<uint64_t, uint64_t>>& extents);
+
+// Sets "*size" to the number of bytes allocated on disk for the file.
+Status GetFileAllocatedSize(const std::string& fname, uint64_t* size);
+
 }  // namespace titandb
 }  // namespace rocksdb
@@ -13,8 +13,14 @@ void VersionEdit::EncodeTo(std::string* dst) const {
   PutVarint32Varint32(dst, kColumnFamilyID, column_family_id_);
 
   for (auto& file : added_files_) {
-    PutVarint32(dst, kAddedBlobFileV2);
-    file->EncodeTo(dst);
+    if (file->is_write_time()) {
+      PutVarint32(dst, kAddedBlobFileV3);
+      file->EncodeTo(dst);
+      file->EncodeFlagsTo(dst);
+    } else {
+      PutVarint32(dst, kAddedBlobFileV2);
+      file->EncodeTo(dst);
+    }
   }
   for (auto& file : deleted_files_) {
     // obsolete sequence is a inpersistent field, so no need to encode it.
@@ -67,6 +73,18 @@ Status VersionEdit::DecodeFrom(Slice* src) {
           error = s.ToString().c_str();
         }
         break;
+      case kAddedBlobFileV3:
+        blob_file = std::make_shared<BlobFileMeta>();
+        s = blob_file->DecodeFrom(src);
+        if (s.ok()) {
+          s = blob_file->DecodeFlagsFrom(src);
+        }
+        if (s.ok()) {
+          AddBlobFile(blob_file);
+        } else {
+          error = s.ToString().c_str();
+        }
+        break;
       case kDeletedBlobFile:
         if (GetVarint64(src, &file_number)) {
           DeleteBlobFile(file_number, 0);
@@ -18,6 +18,9 @@ enum Tag {
   kDeletedBlobFile = 12,  // Deprecated, leave here for backward compatibility
   kAddedBlobFileV2 = 13,  // Comparing to kAddedBlobFile, it newly includes
                           // smallest_key and largest_key of blob file
+  kAddedBlobFileV3 = 14,  // Comparing to kAddedBlobFileV2, it newly includes
+                          // the flags of blob file, only used for write-time
+                          // blob files to stay readable by older versions
 };
 
 class VersionEdit {
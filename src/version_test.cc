@@ -1,4 +1,5 @@
 #include "file/filename.h"
+#include "test_util/sync_point.h"
 #include "test_util/testharness.h"
 
 #include "blob_file_set.h"
@@ -64,6 +65,11 @@ class VersionTest : public testing::Test {
                                     nullptr, nullptr));
       blob_file_set_->column_families_.emplace(id, storage);
     }
+    blob_file_set_->PublishColumnFamilies();
+  }
+
+  uint64_t ManifestFileNumber() {
+    return blob_file_set_->manifest_file_number_;
   }
 
   void AddBlobFiles(uint32_t cf_id, uint64_t start, uint64_t end) {
@@ -108,6 +114,10 @@ class VersionTest : public testing::Test {
 
   void CheckColumnFamiliesSize(uint64_t size) {
     ASSERT_EQ(blob_file_set_->column_families_.size(), size);
+    for (uint32_t id = 0; id < 10; id++) {
+      ASSERT_EQ(blob_file_set_->GetBlobStorage(id).lock(),
+                blob_file_set_->GetBlobStorageNoLock(id).lock());
+    }
   }
 
   void LegacyEncode(const VersionEdit& edit, std::string* dst) {
@@ -138,6 +148,10 @@ TEST_F(VersionTest, VersionEdit) {
   input.DeleteBlobFile(7, 0);
   input.DeleteBlobFile(8, 0);
   CheckCodec(input);
+  auto file3 = std::make_shared<BlobFileMeta>(9, 0, 0, 0, "", "");
+  file3->FileStateTransit(BlobFileMeta::FileEvent::kWriteTimeOutput);
+  input.AddBlobFile(file3);
+  CheckCodec(input);
 }
 
 VersionEdit AddBlobFilesEdit(uint32_t cf_id, uint64_t start, uint64_t end) {
@@ -290,6 +304,126 @@ TEST_F(VersionTest, ObsoleteFiles) {
   CheckColumnFamiliesSize(8);
 }
 
+TEST_F(VersionTest, RollManifest) {
+  // Every LogAndApply() rolls over the manifest.
+  db_options_.max_manifest_file_size = 1;
+  Reset();
+  {
+    MutexLock l(&mutex_);
+    for (uint64_t i = 1; i <= 3; i++) {
+      auto add = AddBlobFilesEdit(1, i * 100, i * 100 + 5);
+      ASSERT_OK(blob_file_set_->LogAndApply(add));
+    }
+    auto del = DeleteBlobFilesEdit(1, 100, 102);
+    ASSERT_OK(blob_file_set_->LogAndApply(del));
+  }
+  std::vector<std::string> obsolete_files;
+  blob_file_set_->GetObsoleteFiles(&obsolete_files, kMaxSequenceNumber);
+  int num_manifests = 0;
+  for (const auto& f : obsolete_files) {
+    uint64_t number;
+    FileType type;
+    if (ParseFileName(f.substr(f.rfind('/') + 1), &number, &type) &&
+        type == kDescriptorFile) {
+      num_manifests++;
+      ASSERT_OK(env_->DeleteFile(f));
+    }
+  }
+  ASSERT_EQ(num_manifests, 4);
+
+  // Recovers from the last manifest alone.
+  blob_file_set_.reset(new BlobFileSet(db_options_, nullptr, nullptr, &mutex_));
+  std::map<uint32_t, TitanCFOptions> column_families;
+  for (uint32_t id = 0; id < 10; id++) {
+    column_families.emplace(id, cf_options_);
+  }
+  ASSERT_OK(blob_file_set_->Open(column_families));
+  auto storage = blob_file_set_->GetBlobStorage(1).lock();
+  ASSERT_TRUE(storage != nullptr);
+  for (uint64_t i = 1; i <= 3; i++) {
+    for (uint64_t n = i * 100; n < i * 100 + 5; n++) {
+      auto file = storage->FindFile(n).lock();
+      if (n < 102) {
+        ASSERT_TRUE(file == nullptr || file->is_obsolete());
+      } else {
+        ASSERT_TRUE(file != nullptr);
+        ASSERT_FALSE(file->is_obsolete());
+      }
+    }
+  }
+}
+
+TEST_F(VersionTest, RollManifestFailure) {
+  db_options_.max_manifest_file_size = 1;
+  Reset();
+  int num_rolls = 0;
+  bool restore_current = false;
+  uint64_t old_manifest = 0;
+  SyncPoint::GetInstance()->SetCallBack(
+      "BlobFileSet::RollManifest::SetCurrentFile", [&](void* arg) {
+        num_rolls++;
+        *static_cast<Status*>(arg) = Status::IOError("Injected error");
+        if (restore_current) {
+          ASSERT_OK(SetCurrentFile(env_->GetFileSystem().get(),
+                                   db_options_.dirname, old_manifest,
+                                   nullptr));
+        }
+      });
+  SyncPoint::GetInstance()->EnableProcessing();
+  {
+    MutexLock l(&mutex_);
+    // CURRENT is switched in spite of the error, so the new manifest is
+    // used.
+    old_manifest = ManifestFileNumber();
+    auto add = AddBlobFilesEdit(1, 100, 105);
+    ASSERT_OK(blob_file_set_->LogAndApply(add));
+    ASSERT_EQ(num_rolls, 1);
+    ASSERT_NE(ManifestFileNumber(), old_manifest);
+
+    // Otherwise the old manifest is kept, and not rolled over again.
+    old_manifest = ManifestFileNumber();
+    restore_current = true;
+    add = AddBlobFilesEdit(1, 200, 205);
+    ASSERT_OK(blob_file_set_->LogAndApply(add));
+    ASSERT_EQ(ManifestFileNumber(), old_manifest);
+    add = AddBlobFilesEdit(1, 300, 305);
+    ASSERT_OK(blob_file_set_->LogAndApply(add));
+    ASSERT_EQ(num_rolls, 2);
+  }
+  SyncPoint::GetInstance()->DisableProcessing();
+  SyncPoint::GetInstance()->ClearAllCallBacks();
+
+  // The first manifest and the one that failed to become current.
+  std::vector<std::string> obsolete_files;
+  blob_file_set_->GetObsoleteFiles(&obsolete_files, kMaxSequenceNumber);
+  int num_manifests = 0;
+  for (const auto& f : obsolete_files) {
+    uint64_t number;
+    FileType type;
+    if (ParseFileName(f.substr(f.rfind('/') + 1), &number, &type) &&
+        type == kDescriptorFile) {
+      num_manifests++;
+      ASSERT_NE(number, old_manifest);
+      ASSERT_OK(env_->DeleteFile(f));
+    }
+  }
+  ASSERT_EQ(num_manifests, 2);
+
+  blob_file_set_.reset(new BlobFileSet(db_options_, nullptr, nullptr, &mutex_));
+  std::map<uint32_t, TitanCFOptions> column_families;
+  for (uint32_t id = 0; id < 10; id++) {
+    column_families.emplace(id, cf_options_);
+  }
+  ASSERT_OK(blob_file_set_->Open(column_families));
+  auto storage = blob_file_set_->GetBlobStorage(1).lock();
+  ASSERT_TRUE(storage != nullptr);
+  for (uint64_t i = 1; i <= 3; i++) {
+    for (uint64_t n = i * 100; n < i * 100 + 5; n++) {
+      ASSERT_TRUE(storage->FindFile(n).lock() != nullptr);
+    }
+  }
+}
+
 TEST_F(VersionTest, DeleteBlobsInRange) {
   // The blob files' range are:
   // 1:[00--------------------------------------------------------99]
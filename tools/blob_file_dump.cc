@@ -1,15 +1,24 @@
 // Copyright 2021-present TiKV Project Authors. Licensed under Apache-2.0.
 
+#include <cinttypes>
+
 #include "file/filename.h"
 #include "util/gflags_compat.h"
 
 #include "blob_file_iterator.h"
+#include "blob_file_reader.h"
 
 using GFLAGS_NAMESPACE::ParseCommandLineFlags;
 using GFLAGS_NAMESPACE::SetUsageMessage;
 
 DEFINE_string(path, "", "Path of blob file.");
 DEFINE_bool(dump, false, "");
+DEFINE_uint64(readahead_size, 2 << 20,
+              "Readahead size of reading the blob file sequentially.");
+DEFINE_bool(use_direct_io, false, "Read the blob file with direct I/O.");
+DEFINE_bool(index, false,
+            "Dump the record index of the blob file instead of the records, "
+            "without reading the records.");
 
 #define handle_error(s, location)                                           \
   if (!s.ok()) {                                                            \
@@ -20,6 +29,31 @@ DEFINE_bool(dump, false, "");
 namespace rocksdb {
 namespace titandb {
 
+int blob_file_dump_index(BlobFileIterator* iter) {
+  if (!iter->Init()) {
+    handle_error(iter->status(), "reading blob file");
+  }
+  const BlobRecordIndex* record_index = iter->record_index();
+  if (record_index == nullptr) {
+    fprintf(stderr, "blob file has no record index\n");
+    return 1;
+  }
+  auto index_iter = record_index->NewIterator();
+  for (index_iter->SeekToFirst(); index_iter->Valid(); index_iter->Next()) {
+    std::string key = index_iter->key().ToString(true);
+    const BlobHandle& handle = index_iter->handle();
+    fprintf(stdout, "%s: offset %" PRIu64 ", size %" PRIu64, key.c_str(),
+            handle.offset, handle.size);
+    if (handle.in_block()) {
+      fprintf(stdout, ", record offset %" PRIu64 ", record size %" PRIu64,
+              handle.record_offset, handle.record_size);
+    }
+    fprintf(stdout, "\n");
+  }
+  handle_error(index_iter->status(), "reading record index");
+  return 0;
+}
+
 int blob_file_dump() {
   Env* env = Env::Default();
   Status s;
@@ -30,14 +64,15 @@ int blob_file_dump() {
   handle_error(s, "getting file size");
 
   std::unique_ptr<RandomAccessFileReader> file;
-  std::unique_ptr<FSRandomAccessFile> f;
-  s = env->GetFileSystem()->NewRandomAccessFile(file_name, FileOptions(), &f,
-                                                nullptr /*dbg*/);
+  s = NewBlobFileStreamReader(file_name, file_size, FLAGS_readahead_size,
+                              FLAGS_use_direct_io, EnvOptions(), env, &file);
   handle_error(s, "open file");
-  file.reset(new RandomAccessFileReader(std::move(f), file_name));
 
   std::unique_ptr<BlobFileIterator> iter(new BlobFileIterator(
       std::move(file), 1 /*fake file number*/, file_size, TitanCFOptions()));
+  if (FLAGS_index) {
+    return blob_file_dump_index(iter.get());
+  }
 
   iter->SeekToFirst();
   while (iter->Valid()) {
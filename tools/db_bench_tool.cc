@@ -776,6 +776,39 @@ DEFINE_int32(titan_max_background_gc,
              rocksdb::titandb::TitanOptions().max_background_gc,
              "Titan max background GC threads.");
 
+DEFINE_int32(titan_gc_policy,
+             static_cast<int32_t>(rocksdb::titandb::TitanOptions().gc_policy),
+             "Titan GC picking policy. 0: discardable ratio, 1: cost-benefit.");
+
+DEFINE_bool(titan_punch_hole_gc, false,
+            "Reclaim Titan blob file garbage in place by punching holes.");
+
+DEFINE_int32(titan_blob_file_compression_parallel_threads, 1,
+             "Number of threads compressing the records of a Titan blob "
+             "file being built.");
+
+DEFINE_int64(titan_blob_file_block_size, 0,
+             "Size of the blocks small Titan blob records are packed into. "
+             "0 stores every record on its own.");
+
+DEFINE_bool(titan_blob_file_record_index, false,
+            "Write a record index at the end of Titan blob files.");
+
+DEFINE_bool(titan_blob_file_keys_in_index, false,
+            "Store Titan blob records without their keys, which are kept "
+            "in the record index only.");
+
+DEFINE_bool(titan_write_time_separation, false,
+            "Move Titan blob values to blob files when they are written "
+            "instead of on flush.");
+
+DEFINE_int64(titan_gc_bytes_per_sec, 0,
+             "Rate limit of Titan GC I/O in bytes per second. Disabled by "
+             "default.");
+
+DEFINE_bool(titan_gc_rate_limiter_auto_tuned, false,
+            "Enable auto-tuning of the Titan GC rate limiter.");
+
 DEFINE_int64(titan_blob_cache_size, 0,
              "Size of Titan blob cache. Disabled by default.");
 
@@ -3794,8 +3827,24 @@ class Benchmark {
     opts->range_merge = FLAGS_titan_range_merge;
     opts->disable_background_gc = FLAGS_titan_disable_background_gc;
     opts->max_background_gc = FLAGS_titan_max_background_gc;
+    opts->gc_policy =
+        static_cast<titandb::TitanGCPolicy>(FLAGS_titan_gc_policy);
+    opts->punch_hole_gc = FLAGS_titan_punch_hole_gc;
+    opts->write_time_separation = FLAGS_titan_write_time_separation;
+    if (FLAGS_titan_gc_bytes_per_sec > 0) {
+      opts->gc_rate_limiter.reset(NewGenericRateLimiter(
+          FLAGS_titan_gc_bytes_per_sec, 100 * 1000 /* refill_period_us */,
+          10 /* fairness */, RateLimiter::Mode::kAllIo,
+          FLAGS_titan_gc_rate_limiter_auto_tuned));
+    }
     opts->min_gc_batch_size = 128 << 20;
     opts->blob_file_compression = FLAGS_compression_type_e;
+    opts->blob_file_compression_parallel_threads = static_cast<uint32_t>(
+        FLAGS_titan_blob_file_compression_parallel_threads);
+    opts->blob_file_block_size =
+        static_cast<uint64_t>(FLAGS_titan_blob_file_block_size);
+    opts->blob_file_record_index = FLAGS_titan_blob_file_record_index;
+    opts->blob_file_keys_in_index = FLAGS_titan_blob_file_keys_in_index;
     if (FLAGS_titan_blob_cache_size > 0) {
       opts->blob_cache = NewLRUCache(FLAGS_titan_blob_cache_size);
     }